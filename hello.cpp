@@ -28,4 +28,9 @@ int main(void) {
   h.resolve(true);
   h.dump();
   h.save("HELLO2.COM");
+
+  // CP/M の環境が無くてもその場で実行できる
+  Xz80::Emu::Cpm cpm;
+  cpm.load(h);
+  return cpm.run() ? 0 : 1;
 }
\ No newline at end of file
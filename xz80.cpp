@@ -504,9 +504,16 @@ class Gen : public Xz80::Generator {
   }
 };
 
-int main(void) {
+int main(int argc, char* argv[]) {
   Gen g;
   g.testcase();
+
+  // --diff file: 生成結果と file のイメージの差分を命令単位で表示する
+  if (argc == 3 && std::strcmp(argv[1], "--diff") == 0) {
+    g.resolve();
+    return g.diff(std::cout, argv[2]) ? 1 : 0;
+  }
+
   g.resolve(true);
   g.dump();
 
@@ -1,16 +1,36 @@
+#ifndef XZ80_HPP
+#define XZ80_HPP
+
 #if not +0
 #error "use -fno-operator-names"
 #endif
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+#if __cplusplus >= 202002L && __has_include(<source_location>)
+#include <source_location>
+#define XZ80_HAS_STD_SOURCE_LOCATION 1
+#endif
+
+// XZ80_SEPARATE_COMPILATION を定義すると、テンプレートでない関数の実装
+// (xz80_impl.hpp) を取り込まず、静的ライブラリ libxz80.a とリンクして使う。
+#ifdef XZ80_SEPARATE_COMPILATION
+#define XZ80_DECL
+#else
+#define XZ80_DECL inline
+#endif
+
 namespace Xz80 {
 // =======================================================================
 // 条件記号の定義
@@ -18,17 +38,17 @@ namespace Xz80 {
 struct CondBase {
   const int id;
   const char* str;
-  CondBase(const char* str, int id) : id(id), str(str) {}
+  constexpr CondBase(const char* str, int id) : id(id), str(str) {}
 };
 
 /// JR および JP 命令で使用できる分岐条件
 struct AllCond : public CondBase {
-  AllCond(const char* str, int id) : CondBase(str, id) {}
+  constexpr AllCond(const char* str, int id) : CondBase(str, id) {}
 };
 
 /// JP 命令でのみ使用できる分岐条件
 struct JpCond : public CondBase {
-  JpCond(const char* str, int id) : CondBase(str, id) {}
+  constexpr JpCond(const char* str, int id) : CondBase(str, id) {}
 };
 
 // =======================================================================
@@ -44,28 +64,28 @@ struct RegCAddr {
 struct Reg8 {
   const int id;
   const char* str;
-  Reg8(const char* str, int id = -1) : id(id), str(str) {}
+  constexpr Reg8(const char* str, int id = -1) : id(id), str(str) {}
 };
 
 struct BasicReg8 : public Reg8 {
-  BasicReg8(const char* str, int id) : Reg8(str, id) {}
+  constexpr BasicReg8(const char* str, int id) : Reg8(str, id) {}
 };
 
 struct RegA : public BasicReg8 {
-  RegA(const char* str, int id) : BasicReg8(str, id) {}
+  constexpr RegA(const char* str, int id) : BasicReg8(str, id) {}
 };
 
 struct RegC : public BasicReg8 {
-  RegC(const char* str, int id) : BasicReg8(str, id) {}
+  constexpr RegC(const char* str, int id) : BasicReg8(str, id) {}
   RegCAddr operator()(void) const { return RegCAddr(*this); }
 };
 
 struct RegI : public BasicReg8 {
-  RegI(const char* str) : BasicReg8(str, -1) {}
+  constexpr RegI(const char* str) : BasicReg8(str, -1) {}
 };
 
 struct RegR : public BasicReg8 {
-  RegR(const char* str) : BasicReg8(str, -1) {}
+  constexpr RegR(const char* str) : BasicReg8(str, -1) {}
 };
 
 struct Reg16;
@@ -112,40 +132,40 @@ struct IndenexReg16Addr {
 struct Reg16 {
   const int id;
   const char* str;
-  Reg16(const char* str, int id = -1) : id(id), str(str) {}
+  constexpr Reg16(const char* str, int id = -1) : id(id), str(str) {}
   Reg16Addr operator()(void) const { return Reg16Addr(*this); }
 };
 
 struct BasicReg16 : public Reg16 {
-  BasicReg16(const char* str, int id) : Reg16(str, id) {}
+  constexpr BasicReg16(const char* str, int id) : Reg16(str, id) {}
   BasicReg16Addr operator()(void) const { return BasicReg16Addr(*this); }
 };
 
 struct RegHL : public Reg16 {
-  RegHL(const char* str, int id) : Reg16(str, id) {}
+  constexpr RegHL(const char* str, int id) : Reg16(str, id) {}
   RegHLAddr operator()(void) const { return RegHLAddr(*this); }
 };
 
 struct RegAF : public Reg16 {
-  RegAF(const char* str, int id) : Reg16(str, id) {}
+  constexpr RegAF(const char* str, int id) : Reg16(str, id) {}
 };
 
 struct RegBC : public BasicReg16 {
-  RegBC(const char* str, int id) : BasicReg16(str, id) {}
+  constexpr RegBC(const char* str, int id) : BasicReg16(str, id) {}
 };
 
 struct RegDE : public BasicReg16 {
-  RegDE(const char* str, int id) : BasicReg16(str, id) {}
+  constexpr RegDE(const char* str, int id) : BasicReg16(str, id) {}
 };
 
 struct RegSP : public BasicReg16 {
-  RegSP(const char* str, int id) : BasicReg16(str, id) {}
+  constexpr RegSP(const char* str, int id) : BasicReg16(str, id) {}
   RegSPAddr operator()(void) const { return RegSPAddr(*this); }
 };
 
 struct IndexReg16 : public Reg16 {
   const uint8_t m_prefix;
-  IndexReg16(const char* str, int id, uint8_t prefix)
+  constexpr IndexReg16(const char* str, int id, uint8_t prefix)
       : Reg16(str, id), m_prefix(prefix) {}
   IndenexReg16AddrOffset operator()(int8_t offset) const {
     return IndenexReg16AddrOffset(*this, offset);
@@ -205,75 +225,12 @@ class Formatter {
   const char* m_p;
   std::string m_buffer;
 
-  Type nextType(void) const {
-    // return static_cast<Type>(*m_p);
-    switch (*m_p) {
-      case '\0':
-        return T_End;
-      case 'i':
-        return T_Insn;
-      case 'l':
-        return T_Label;
-      case 's':
-        return T_Symbol;
-      case 'I':
-        return T_Indirect;
-      case 'r':
-        return T_Reg;
-      case 'c':
-        return T_Condition;
-      case ',':
-        return T_Comma;
-      case '\'':
-        return T_Dash;
-      case 'd':
-        return T_Dec;
-      case 'x':
-        return T_Hex;
-      case 'o':
-        return T_AddrOffset;
-      case 'b':
-        return T_Bytes;
-      case 'w':
-        return T_Words;
-      case 't':
-        return T_Text;
-      default:
-        break;
-    }
-    return T_Unknown;
-  }
-
-  void reduceNoArg(void) {
-    while (true) {
-      switch (nextType()) {
-        case T_Comma:
-          ++m_p;
-          m_buffer.append(", ");
-          break;
-
-        case T_Dash:
-          ++m_p;
-          m_buffer.append("'");
-          break;
-
-        case T_Unknown:
-          ++m_p;
-          break;
-
-        default:
-          return;
-      }  // switch
-    }    // while
-  }
+  Type nextType(void) const;
+  void reduceNoArg(void);
+  Formatter bytes(const uint8_t* p, size_t n);
 
  public:
-  Formatter(const char* format)
-      : m_format(format),
-        m_p(&m_format[0]),
-        m_buffer() {
-    reduceNoArg();
-  }
+  Formatter(const char* format);
 
   const std::string& str(void) const { return m_buffer; }
 
@@ -281,297 +238,351 @@ class Formatter {
     return *this % str.c_str();
   }
 
+  Formatter operator%(const char* str);
+  Formatter operator%(const Reg8& r);
+  Formatter operator%(const RegCAddr& c);
+  Formatter operator%(const Reg16& r);
+  Formatter operator%(const BasicReg16Addr& rp);
+  Formatter operator%(const RegHLAddr& hl);
+  Formatter operator%(const RegSPAddr& sp);
+  Formatter operator%(const IndenexReg16AddrOffset& idx_offset);
+  Formatter operator%(const IndenexReg16Addr& idx);
+  Formatter operator%(const IoAddr& io);
+  Formatter operator%(const CondBase& cc);
+  Formatter operator%(int n);
+  Formatter operator%(const std::initializer_list<uint8_t>& bytes);
+  Formatter operator%(const std::vector<uint8_t>& bytes);
+  Formatter operator%(const std::initializer_list<uint16_t>& words);
+  Formatter operator%(const MemAddr& nn);
+
+#if 0
+  //テンプレ
   Formatter operator%(const char* str) {
     switch (nextType()) {
+      case T_End:
       case T_Insn:
-        ++m_p;
-        m_buffer.append("    ").append(str).append(" ");
-        break;
-
-      case T_Label:
-        ++m_p;
-        m_buffer.append(str).append(":");
-        break;
-
-      case T_Symbol:
-        ++m_p;
-        m_buffer.append(str);
-        break;
-
-      case T_Text: {
-        ++m_p;
-        std::string s;
-        bool outside = true;
-        for (const char* p = str; *p != '\0'; ++p) {
-          if (std::isprint(*p) && *p != '\'') {
-            if (outside) {
-              s.append(", '");
-              outside = false;
-            }
-            const char b[2] = {*p, 0};
-            s.append(b);
-          } else {
-            if (!outside) {
-              s.append("'");
-              outside = true;
-            }
-            char buf[8];
-            std::sprintf(buf, ", 0%xh", (0xff & *p));
-            s.append(buf);
-          }
-        }  // for
-        if (!outside) {
-          s.append("'");
-        }
-        if (s.empty()) {
-          s = ", ''";
-        }
-        m_buffer.append(s.begin() + 2, s.end());
-
-        break;
-      }
-
-      default:
-        throw std::invalid_argument("const char*不正な組み合わせ");
-        break;
-    }
-    reduceNoArg();
-    return *this;
-  }
-
-  Formatter operator%(const Reg8& r) {
-    switch (nextType()) {
       case T_Reg:
-        ++m_p;
-        m_buffer.append(r.str);
-        break;
+      case T_Comma:
+      case T_Dec:
+      case T_Hex:
+      case T_Bytes:
+      case T_Words:
+      case T_Text:
       default:
-        throw std::invalid_argument("Reg8不正な組み合わせ");
+        throw std::invalid_argument("");
         break;
     }
     reduceNoArg();
     return *this;
   }
+#endif
+};
 
-  Formatter operator%(const RegCAddr& c) {
-    switch (nextType()) {
-      case T_Reg:
-        ++m_p;
-        m_buffer.append("(").append(c.m_reg.str).append(")");
-        break;
-      default:
-        throw std::invalid_argument("Reg8不正な組み合わせ");
-        break;
-    }
-    reduceNoArg();
-    return *this;
-  }
+}  // namespace Formatter
 
-  Formatter operator%(const Reg16& r) {
-    switch (nextType()) {
-      case T_Reg:
-        ++m_p;
-        m_buffer.append(r.str);
-        break;
+// =======================================================================
+// ソース位置
+
+/// 命令を生成した C++ ソースの位置
+///
+/// 命令メソッドのデフォルト引数として呼び出し元の位置を捕捉する。
+/// C++20 以降では std::source_location を、それ以前は
+/// __builtin_FILE / __builtin_LINE を使用する。
+struct SourceLoc {
+  const char* file;
+  uint_least32_t line;
+
+#ifdef XZ80_HAS_STD_SOURCE_LOCATION
+  explicit SourceLoc(const std::source_location& sl = std::source_location::current())
+      : file(sl.file_name()), line(sl.line()) {}
+#else
+  explicit SourceLoc(const char* file = __builtin_FILE(),
+                     uint_least32_t line = __builtin_LINE())
+      : file(file), line(line) {}
+#endif
+};
 
-      default:
-        throw std::invalid_argument("Reg16不正な組み合わせ");
-        break;
-    }
-    reduceNoArg();
-    return *this;
-  }
+// =======================================================================
+// 出力フォーマット
+
+namespace Output {
+/// Intel HEX のアドレス形式
+enum HexMode {
+  H_Auto,     ///< 64KB を超える場合のみタイプ04を使用する
+  H_Addr16,   ///< タイプ00/01のみ(16ビットアドレス)
+  H_Segment,  ///< タイプ02 拡張セグメントアドレス(最大1MB)
+  H_Linear,   ///< タイプ04 拡張リニアアドレス(最大4GB)
+};
 
-  Formatter operator%(const BasicReg16Addr& rp) {
-    if (nextType() == T_Reg) {
-      ++m_p;
-      m_buffer.append("(").append(rp.m_reg.str).append(")");
-    } else {
-      throw std::invalid_argument("BasicReg16Addr不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// Motorola S-record のアドレス形式
+enum SrecMode {
+  S_Auto,  ///< 最大アドレスに合わせて選択する
+  S_S1,    ///< S1/S9 (16ビットアドレス)
+  S_S2,    ///< S2/S8 (24ビットアドレス)
+  S_S3,    ///< S3/S7 (32ビットアドレス)
+};
 
-  Formatter operator%(const RegHLAddr& hl) {
-    if (nextType() == T_Reg) {
-      ++m_p;
-      m_buffer.append("(").append(hl.m_reg.str).append(")");
-    } else {
-      throw std::invalid_argument("RegHLAddr不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// Intel HEX 形式の文字列を out の末尾に追加する
+/// @param addr 先頭バイトのアドレス
+/// @param bpr 1行当たりの最大出力バイト数(Bytes Par Row)
+/// @param mode アドレス形式
+/// @param threads 整形に使うスレッド数(0はハードウェアの並列数)
+void intelHex(std::string& out, const uint8_t* bytes, size_t size,
+              uint32_t addr, uint8_t bpr, HexMode mode = H_Auto,
+              unsigned threads = 1);
+
+/// Motorola S-record 形式の文字列を out の末尾に追加する
+/// @param name S0 レコードに埋め込む名前
+/// @param addr 先頭バイトのアドレス
+/// @param start_addr 実行開始アドレス
+/// @param bpr 1行当たりの最大出力バイト数(Bytes Par Row)
+/// @param mode アドレス形式
+/// @param threads 整形に使うスレッド数(0はハードウェアの並列数)
+void motorola(std::string& out, const char* name, const uint8_t* bytes,
+              size_t size, uint32_t addr, uint32_t start_addr, uint8_t bpr,
+              SrecMode mode = S_Auto, unsigned threads = 1);
+
+/// 差分パッチの形式
+enum PatchFormat {
+  P_IPS,  ///< IPS (同じ位置の差分のみ、最大16MB)
+  P_BPS,  ///< BPS (移動したブロックも参照できる)
+};
 
-  Formatter operator%(const RegSPAddr& sp) {
-    if (nextType() == T_Reg) {
-      ++m_p;
-      m_buffer.append("(").append(sp.m_reg.str).append(")");
-    } else {
-      throw std::invalid_argument("RegSPAddr不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// CRC-32 (IEEE 802.3) を計算する
+/// @param crc 前のブロックまでの CRC(分割して計算する場合)
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+/// base を target に変換する IPS パッチを out の末尾に追加する
+void ipsPatch(std::vector<uint8_t>& out, const uint8_t* base, size_t baseSize,
+              const uint8_t* target, size_t targetSize);
+
+/// base を target に変換する BPS パッチを out の末尾に追加する
+///
+/// base のブロックをローリングハッシュで索引化し、移動したデータも
+/// SourceCopy として参照する。
+/// @param metadata パッチに埋め込むメタデータ
+void bpsPatch(std::vector<uint8_t>& out, const uint8_t* base, size_t baseSize,
+              const uint8_t* target, size_t targetSize,
+              const std::string& metadata = std::string());
+
+/// 2つのバイト列で内容の異なる区間
+struct DiffRange {
+  uint32_t offset;  ///< 先頭からのバイト数
+  uint32_t size;    ///< 区間のバイト数
+};
 
-  Formatter operator%(const IndenexReg16AddrOffset& idx_offset) {
-    if (nextType() == T_Reg) {
-      ++m_p;
-      const int ofs = idx_offset.m_offset;
-      char buf[16];
-      if (ofs < 0) {
-        std::sprintf(buf, "-0%xh)", -ofs);
-      } else {
-        std::sprintf(buf, "+0%xh)", ofs);
-      }
-      m_buffer.append("(").append(idx_offset.m_reg.str).append(buf);
-    } else {
-      throw std::invalid_argument("IndenexReg16AddrOffset不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// a と b を比較し、内容の異なる区間を out の末尾に追加する
+///
+/// 長さが異なる場合は、短い方の末尾以降を1つの異なる区間とする。
+/// SSE2 が使える場合は16バイトずつ比較する。
+void diffRanges(std::vector<DiffRange>& out, const uint8_t* a, size_t aSize,
+                const uint8_t* b, size_t bSize);
+
+/// LZ 圧縮の結果
+struct LzStats {
+  size_t original;    ///< 圧縮前のバイト数
+  size_t compressed;  ///< 圧縮後のバイト数(終端を含む)
+  uint64_t tstates;   ///< 展開ルーチンの推定T-states(CALL/RET を除く)
+
+  /// 圧縮率(圧縮後 / 圧縮前)
+  double ratio(void) const { return original ? double(compressed) / original : 0.0; }
+  /// 展開後の1バイト当たりの推定T-states
+  double tstatesPerByte(void) const { return original ? double(tstates) / original : 0.0; }
+};
 
-  Formatter operator%(const IndenexReg16Addr& idx) {
-    if (nextType() == T_Reg) {
-      ++m_p;
-      m_buffer.append("(").append(idx.m_reg.str).append(")");
-    } else {
-      throw std::invalid_argument("IndenexReg16Addr不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// バイト列を LZ 圧縮して out の末尾に追加する
+///
+/// 形式はトークンの並びで、Z80 側では Generator::lzUnpack() で展開する。
+/// - 00h: 終端
+/// - 01h..7Fh: 続く n バイトのリテラル
+/// - 80h..BFh: (n & 3Fh) + 2 バイトの一致。続く1バイトが -距離(1..256)
+/// - C0h..FFh: (n & 3Fh) + 3 バイトの一致。続く2バイトが -距離(1..65535)
+///
+/// 一致の探索は threads 個のスレッドで行い(0 は全コア)、
+/// 圧縮後のサイズが最小になる分割を動的計画法で選ぶ。
+LzStats lzCompress(std::vector<uint8_t>& out, const uint8_t* data, size_t size,
+                   unsigned threads = 0);
+
+/// 命令リストの出力形式
+enum ListingFormat {
+  L_Json,    ///< JSON
+  L_Binary,  ///< バイナリ(リトルエンディアン)
+};
 
-  Formatter operator%(const IoAddr& io) {
-    if (nextType() == T_Indirect) {
-      ++m_p;
-      char buf[8];
-      std::sprintf(buf, "(0%xh)", (0xff & io.addr));
-      m_buffer.append(buf);
-    } else {
-      throw std::invalid_argument("IoAddr不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// ファイル書き出しの結果
+struct WriteStats {
+  size_t written;  ///< 実際に書き込んだバイト数
+  size_t skipped;  ///< 既存の内容と一致したため書き込まなかったバイト数
+};
 
-  Formatter operator%(const CondBase& cc) {
-    if (nextType() == T_Condition) {
-      ++m_p;
-      m_buffer.append(cc.str);
-    } else {
-      throw std::invalid_argument("CondBase不正な組み合わせ");
-    }
-    reduceNoArg();
-    return *this;
-  }
+/// ファイルを開く。開けなかった場合は std::runtime_error を送出する
+FILE* openFile(const char* fn, const char* mode);
 
-  Formatter operator%(int n) {
-    char buf[16];
-    switch (nextType()) {
-      case T_Dec:
-        ++m_p;
-        std::sprintf(buf, "%d", n);
-        m_buffer.append(buf);
-        break;
+/// バイト列をファイルに書き出す。失敗した場合は std::runtime_error を送出する
+/// @param update true の場合は既存のファイルと比較し、異なるブロックだけを
+///               書き換える。内容が同じならファイルに触れない(mtime も変わらない)
+WriteStats writeFile(const char* fn, const void* data, size_t size,
+                     bool update = false);
+}  // namespace Output
 
-      case T_Hex:
-        ++m_p;
-        std::sprintf(buf, "0%xh", n);
-        m_buffer.append(buf);
-        break;
+// =======================================================================
+// メモリイメージ
 
-      case T_AddrOffset:
-        ++m_p;
-        std::sprintf(buf, "%+d", n);
-        m_buffer.append("$").append(buf);
-        break;
+/// アドレスの連続した区間の集合で表した疎なメモリイメージ
+class Image {
+ public:
+  /// 連続した区間
+  struct Segment {
+    uint32_t addr;
+    std::vector<uint8_t> bytes;
+    uint64_t end(void) const { return static_cast<uint64_t>(addr) + bytes.size(); }
+  };
 
-      default:
-        throw std::invalid_argument("");
-        break;
-    }
-    reduceNoArg();
-    return *this;
-  }
+ private:
+  std::vector<Segment> m_segments;  ///< アドレス順に並んだ、互いに接しない区間
+  uint32_t m_start;                 ///< 実行開始アドレス
+  bool m_hasStart;
+  std::string m_name;  ///< S-record の S0 レコードなどから得た名前
 
-  Formatter operator%(const std::initializer_list<uint8_t>& bytes) {
-    if (nextType() == T_Bytes) {
-      ++m_p;
-      std::string s;
-      for (uint8_t b : bytes) {
-        char buf[8];
-        std::sprintf(buf, ", 0%xh", 0xff & b);
-        s.append(buf);
-      }
-      m_buffer.append(s.begin() + 2, s.end());
-    } else {
-      throw std::invalid_argument("");
-    }
-    reduceNoArg();
-    return *this;
-  }
+ public:
+  Image() : m_segments(), m_start(0), m_hasStart(false), m_name() {}
 
-  Formatter operator%(const std::initializer_list<uint16_t>& words) {
-    if (nextType() == T_Words) {
-      ++m_p;
-      std::string s;
-      for (uint16_t w : words) {
-        char buf[12];
-        std::sprintf(buf, ", 0%xh", 0xffff & w);
-        s.append(buf);
-      }
-      m_buffer.append(s.begin() + 2, s.end());
-    } else {
-      throw std::invalid_argument("");
-    }
-    reduceNoArg();
-    return *this;
-  }
+  /// バイト列を書き込む。既存の内容と重なる部分は上書きする
+  void write(uint32_t addr, const uint8_t* data, size_t size);
 
-  Formatter operator%(const MemAddr& nn) {
-    if (nextType() == T_Indirect) {
-      ++m_p;
-      if (nn.isLabel()) {
-        m_buffer.append("(").append(nn.label).append(")");
-      } else {
-        char buf[16];
-        std::sprintf(buf, "(0%xh)", nn.addr);
-        m_buffer.append(buf);
-      }
-    } else {
-      throw std::invalid_argument("");
-    }
-    reduceNoArg();
-    return *this;
+  /// 1バイト読み出す
+  /// @return 書き込まれていないアドレスの場合は false
+  bool read(uint32_t addr, uint8_t& byte) const;
+
+  /// 最小アドレスから最大アドレスまでを連続したバイト列として取得する
+  /// @param base 先頭アドレスを受け取る
+  /// @param fill 書き込まれていないアドレスを埋める値
+  std::vector<uint8_t> flatten(uint32_t& base, uint8_t fill = 0xff) const;
+
+  /// 書き込まれたバイト数の合計
+  size_t size(void) const;
+
+  const std::vector<Segment>& segments(void) const { return m_segments; }
+  bool empty(void) const { return m_segments.empty(); }
+
+  bool hasStart(void) const { return m_hasStart; }
+  uint32_t getStart(void) const { return m_start; }
+  void setStart(uint32_t addr) {
+    m_start = addr;
+    m_hasStart = true;
   }
 
-#if 0
-  //テンプレ
-  Formatter operator%(const char* str) {
-    switch (nextType()) {
-      case T_End:
-      case T_Insn:
-      case T_Reg:
-      case T_Comma:
-      case T_Dec:
-      case T_Hex:
-      case T_Bytes:
-      case T_Words:
-      case T_Text:
-      default:
-        throw std::invalid_argument("");
-        break;
-    }
-    reduceNoArg();
-    return *this;
+  const std::string& getName(void) const { return m_name; }
+  void setName(const std::string& name) { m_name = name; }
+
+  void clear(void) {
+    m_segments.clear();
+    m_start = 0;
+    m_hasStart = false;
+    m_name.clear();
   }
-#endif
 };
 
-}  // namespace Formatter
+// =======================================================================
+// 入力フォーマット
+
+namespace Input {
+/// 読み込み専用でメモリにマップしたファイル
+///
+/// mmap が使えない環境ではファイル全体をメモリに読み込む。
+class MappedFile {
+  const uint8_t* m_data;
+  size_t m_size;
+  std::vector<uint8_t> m_buffer;  ///< mmap を使わない場合の読み込み先
+
+ public:
+  /// 開けなかった場合は std::runtime_error を送出する
+  explicit MappedFile(const char* fn);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data(void) const { return m_data; }
+  size_t size(void) const { return m_size; }
+};
+
+/// 16進数文字列をバイト列に変換する
+/// @param src 16進数文字列(2*num 文字、大文字小文字を問わない)
+/// @param dst num バイトの出力先
+/// @return 16進数以外の文字を含む場合は false
+bool decodeHex(const char* src, size_t num, uint8_t* dst);
+
+/// Output::lzCompress() で圧縮したデータを展開する
+/// 形式の誤りは std::runtime_error を送出する
+std::vector<uint8_t> lzDecompress(const uint8_t* data, size_t size);
+
+/// Intel HEX 形式の文字列を解析して image に書き込む
+/// 書式やチェックサムの誤りは std::runtime_error を送出する
+void parseHex(const char* text, size_t len, Image& image);
+
+/// Motorola S-record 形式の文字列を解析して image に書き込む
+/// 書式やチェックサムの誤りは std::runtime_error を送出する
+void parseMot(const char* text, size_t len, Image& image);
+
+/// MSX の BSAVE 形式のバイト列を解析して image に書き込む
+void parseBsave(const uint8_t* data, size_t len, Image& image);
+
+/// Intel HEX 形式のファイルを読み込む
+Image loadHex(const char* fn);
+
+/// Motorola S-record 形式のファイルを読み込む
+Image loadMot(const char* fn);
+
+/// MSX の BSAVE 形式のファイルを読み込む
+Image loadBsave(const char* fn);
+}  // namespace Input
+
+// =======================================================================
+// 逆アセンブラ
+
+namespace Disasm {
+/// デコードした1命令
+struct Insn {
+  uint32_t addr;     ///< 先頭のアドレス
+  uint16_t entry;    ///< 命令テーブルの番号(テーブル * 256 + オペコード)
+  uint8_t length;    ///< バイト数(1..4)
+  uint8_t bytes[4];  ///< 命令のバイト列
+};
+
+/// 先頭の1命令をデコードする
+///
+/// CB/ED/DD/FD/DDCB/FDCB のプレフィックスを含む全命令をテーブルで引く。
+/// 未定義の ED 命令は2バイトの DB、効果の無い DD/FD は1バイトの DB、
+/// 途中で途切れた命令は先頭1バイトの DB としてデコードする。
+/// @return バイト数(size が 0 なら 0)
+size_t decode(const uint8_t* data, size_t size, uint32_t addr, Insn& insn);
+
+/// data 全体を先頭から順にデコードして out の末尾に追加する
+///
+/// 大きなデータは threads 個(0 は全コア)の区間に分けて並列にデコードし、
+/// 前の区間の終わりと命令境界が揃うところでつなぎ合わせる。
+/// 結果は先頭から1スレッドでデコードした場合と同じになる。
+/// @return デコードした命令数
+size_t decodeAll(std::vector<Insn>& out, const uint8_t* data, size_t size,
+                 uint32_t addr, unsigned threads = 1);
+
+/// 命令のニーモニックを out の末尾に追加する
+///
+/// Formatter と同じ書式(Mnemonic::getMnemonic() と同じ文字列)になる。
+/// 相対ジャンプの飛び先は $ からのオフセットで表す。
+void format(std::string& out, const Insn& insn);
+
+/// 命令のニーモニックを取得する
+std::string text(const Insn& insn);
+
+/// data 全体を逆アセンブルしたリストを out の末尾に追加する
+///
+/// 1行1命令で、comment が true の場合は dump() と同様に
+/// 「ニーモニック\t;アドレス: バイト列」の形式で出力する。
+/// @param threads デコードと文字列化に使うスレッド数(0 は全コア)
+void disassemble(std::string& out, const uint8_t* data, size_t size,
+                 uint32_t addr, bool comment = true, unsigned threads = 1);
+}  // namespace Disasm
 
 // =======================================================================
 // コードジェネレータ
@@ -582,7 +593,8 @@ class Mnemonic {
   std::vector<uint8_t> m_bytes;
   std::string m_label;
   size_t m_offset;
-  bool m_rel;  ///< 「ラベル解決時に相対アドレスとして解決する」フラグ
+  bool m_rel;         ///< 「ラベル解決時に相対アドレスとして解決する」フラグ
+  uint32_t m_srcId;  ///< ソース位置ID(0は記録なし)
 
  public:
   Mnemonic(uint16_t addr, const std::string& mnemonic,
@@ -593,13 +605,21 @@ class Mnemonic {
         m_bytes(bytes),
         m_label(label),
         m_offset(offset),
-        m_rel(false) {}
+        m_rel(false),
+        m_srcId(0) {}
 
   uint16_t getAddr(void) const { return m_addr; }
   const std::string& getMnemonic(void) const { return m_mnemonic; }
   const std::vector<uint8_t>& getBytes(void) const { return m_bytes; }
   const std::string& getLabel(void) const { return m_label; }
   size_t getOffset(void) const { return m_offset; }
+  uint32_t getSourceId(void) const { return m_srcId; }
+
+  /// 確保済みの領域を再利用して内容を置き換える
+  void assign(uint16_t addr, const std::string& mnemonic,
+              const std::vector<uint8_t>& bytes);
+
+  void setSourceId(uint32_t id) { m_srcId = id; }
 
   void setLabel(const char* label, size_t offset, bool rel) {
     m_label = label;
@@ -612,66 +632,83 @@ class Mnemonic {
     m_rel = rel;
   }
 
-  void resolveAddr(uint16_t addr) {
-    if (m_rel) {
-      const int e = static_cast<int>(addr) - static_cast<int>(m_addr);
-      if (e < -126 || 129 < e) {
-        char buf[64];
-        std::sprintf(buf, "Label resolve e=%d:out of range", e);
-        throw std::out_of_range(buf);
-      }
-      m_bytes[m_offset] = static_cast<uint8_t>((e - 2) & 0xff);
-    } else {
-      MemAddr ma(addr);
-      m_bytes[m_offset] = ma.l;
-      m_bytes[m_offset + 1] = ma.h;
-    }
-    m_label.clear();
-    m_offset = 0;
-  }
+  void resolveAddr(uint16_t addr);
 };
 
 class Generator {
   typedef Formatter::Formatter Fmt;
-  const uint16_t m_org;
+  uint16_t m_org;
   uint16_t m_curr;
   std::vector<Mnemonic> m_mnemonics;
 
   /// ラベルの定義マップ
   std::map<std::string, uint16_t> m_labelMap;
 
+  /// reset() で回収したニーモニック(文字列・バイト列の領域を再利用する)
+  std::vector<Mnemonic> m_mnemonicPool;
+  /// reset() で回収したラベルマップのノード
+  std::vector<std::map<std::string, uint16_t>::node_type> m_labelPool;
+
+  /// ファイル出力を差分更新で行うか
+  bool m_updateFiles;
+
+  /// ソース位置の記録を行うか
+  bool m_srcTrack;
+  /// ソースファイル名テーブル
+  std::vector<std::string> m_srcFiles;
+  /// ソース位置テーブル(ファイル番号, 行番号)。ID-1 がインデックス
+  std::vector<std::pair<uint32_t, uint_least32_t> > m_srcLocs;
+  /// (ファイル名ポインタ, 行番号) → ソース位置ID
+  std::map<std::pair<const char*, uint_least32_t>, uint32_t> m_srcIdMap;
+
+  /// セクションの開始位置(セクション名, 先頭のニーモニック番号)
+  std::vector<std::pair<std::string, size_t> > m_sections;
+
+  /// lzUnpack() で展開ルーチンを生成済みか
+  bool m_lzUnpack;
+
+  /// dbp() で登録したデータ → 登録番号
+  std::map<std::vector<uint8_t>, size_t> m_poolIndex;
+  /// 登録順のデータ(m_poolIndex のキーを指す)
+  std::vector<const std::vector<uint8_t>*> m_poolEntries;
+  /// dbp() の呼び出し回数と延べバイト数
+  size_t m_poolRequests;
+  size_t m_poolRequested;
+  /// 次の pool() で使うラベル番号の基数
+  size_t m_poolBase;
+
  protected:
-  const RegA A;
-  const BasicReg8 B;
-  const RegC C;
-  const BasicReg8 D;
-  const BasicReg8 E;
-  const Reg8 F;
-  const BasicReg8 H;
-  const BasicReg8 L;
-  const RegI I;
-  const RegR R;
-  const Reg8 IXH;
-  const Reg8 IXL;
-  const Reg8 IYH;
-  const Reg8 IYL;
-
-  const RegAF AF;
-  const RegBC BC;
-  const RegDE DE;
-  const RegHL HL;
-  const IndexReg16 IX;
-  const IndexReg16 IY;
-  const RegSP SP;
-
-  AllCond NZ;  ///< Not Zero
-  AllCond Z;   ///< Zero
-  AllCond NC;  ///< Not Carry
-  AllCond Cy;  ///< Carry *Cレジスタと名前が被るのでCyとした};
-  JpCond PO;   ///< Parity Odd
-  JpCond PE;   ///< Parity Even
-  JpCond P;    ///< Plus
-  JpCond M;    ///< Minus
+  static constexpr RegA A{"A", 7};
+  static constexpr BasicReg8 B{"B", 0};
+  static constexpr RegC C{"C", 1};
+  static constexpr BasicReg8 D{"D", 2};
+  static constexpr BasicReg8 E{"E", 3};
+  static constexpr Reg8 F{"F", 6};
+  static constexpr BasicReg8 H{"H", 4};
+  static constexpr BasicReg8 L{"L", 5};
+  static constexpr RegI I{"I"};
+  static constexpr RegR R{"R"};
+  static constexpr Reg8 IXH{"IXH"};
+  static constexpr Reg8 IXL{"IXL"};
+  static constexpr Reg8 IYH{"IYH"};
+  static constexpr Reg8 IYL{"IYL"};
+
+  static constexpr RegAF AF{"AF", -1};
+  static constexpr RegBC BC{"BC", 0};
+  static constexpr RegDE DE{"DE", 1};
+  static constexpr RegHL HL{"HL", 2};
+  static constexpr IndexReg16 IX{"IX", 2, 0b1101'1101};
+  static constexpr IndexReg16 IY{"IY", 2, 0b1111'1101};
+  static constexpr RegSP SP{"SP", 3};
+
+  static constexpr AllCond NZ{"NZ", 0};  ///< Not Zero
+  static constexpr AllCond Z{"Z", 1};    ///< Zero
+  static constexpr AllCond NC{"NC", 2};  ///< Not Carry
+  static constexpr AllCond Cy{"C", 3};   ///< Carry *Cレジスタと名前が被るのでCyとした};
+  static constexpr JpCond PO{"PO", 4};   ///< Parity Odd
+  static constexpr JpCond PE{"PE", 5};   ///< Parity Even
+  static constexpr JpCond P{"P", 6};     ///< Plus
+  static constexpr JpCond M{"M", 7};     ///< Minus
 
  private:
   static uint8_t build(uint8_t a, const Reg8& d, const Reg8& s) {
@@ -695,30 +732,38 @@ class Generator {
     return ret;
   }
 
-  void append(const std::string& mnemonic, const std::vector<uint8_t>& bytes) {
-    Mnemonic m(m_curr, mnemonic, bytes);
-    m_curr += bytes.size();
-    m_mnemonics.push_back(m);
-  }
+  /// ソース位置IDを取得する(未登録なら登録する)
+  uint32_t sourceId(const SourceLoc& loc);
 
-  void append(const std::string& mnemonic) {
-    Mnemonic m(m_curr, mnemonic, std::vector<uint8_t>());
-    m_mnemonics.push_back(m);
-  }
+  void append(const std::string& mnemonic, const std::vector<uint8_t>& bytes,
+              const SourceLoc& loc);
 
-  void append(const Fmt& mnemonic) {
-    Mnemonic m(m_curr, mnemonic.str(), std::vector<uint8_t>());
-    m_mnemonics.push_back(m);
+  void append(const Fmt& mnemonic, const SourceLoc& loc) {
+    append(mnemonic.str(), std::vector<uint8_t>(), loc);
   }
 
   void append(const Fmt& mnemonic,
-              const std::vector<uint8_t>& bytes) {
-    append(mnemonic.str(), bytes);
+              const std::vector<uint8_t>& bytes, const SourceLoc& loc) {
+    append(mnemonic.str(), bytes, loc);
   }
-  void append(const Fmt& mnemonic, uint8_t byte) {
-    append(mnemonic.str(), std::vector<uint8_t>{byte});
+  void append(const Fmt& mnemonic, uint8_t byte, const SourceLoc& loc) {
+    append(mnemonic.str(), std::vector<uint8_t>{byte}, loc);
   }
 
+  /// symbolMap(), sectionMap(), listing() の本体
+  ///
+  /// 出力を out に追加し、os が指定されていれば一定量毎に書き出す。
+  void renderSymbols(std::string& out, std::ostream* os) const;
+  void renderSections(std::string& out, std::ostream* os) const;
+  void renderListing(std::string& out, std::ostream* os,
+                     Output::ListingFormat format) const;
+
+  /// バイト列を16バイト毎の DB として出力する
+  void dbLines(const uint8_t* data, size_t size, const SourceLoc& loc);
+
+  /// dbp() の登録番号に対応するラベル
+  std::string poolLabel(size_t index) const;
+
   /// アドレス解決用の情報を登録する
   void resolve(const char* label, size_t offset, bool rel = false) {
     m_mnemonics.rbegin()->setLabel(label, offset, rel);
@@ -729,252 +774,154 @@ class Generator {
   }
 
  public:
+  /// pool() の結果
+  struct PoolStats {
+    size_t requests;        ///< dbp() の呼び出し回数
+    size_t entries;         ///< 重複を除いたデータの数
+    size_t requestedBytes;  ///< dbp() に渡された延べバイト数
+    size_t emittedBytes;    ///< 実際に出力したバイト数
+
+    /// 重複の除去と末尾の共有で節約できたバイト数
+    size_t saved(void) const { return requestedBytes - emittedBytes; }
+  };
+
   Generator(uint16_t org = 0x100)
       : m_org(org),
         m_curr(org),
         m_mnemonics(),  //
-        A("A", 7),
-        B("B", 0),
-        C("C", 1),
-        D("D", 2),
-        E("E", 3),
-        F("F", 6),
-        H("H", 4),
-        L("L", 5),
-        I("I"),
-        R("R"),
-        IXH("IXH"),
-        IXL("IXL"),
-        IYH("IYH"),
-        IYL("IYL"),
-        AF("AF", -1),
-        BC("BC", 0),
-        DE("DE", 1),
-        HL("HL", 2),
-        IX("IX", 2, 0b1101'1101),
-        IY("IY", 2, 0b1111'1101),
-        SP("SP", 3),
-        NZ("NZ", 0),
-        Z("Z", 1),
-        NC("NC", 2),
-        Cy("C", 3),
-        PO("PO", 4),
-        PE("PE", 5),
-        P("P", 6),
-        M("M", 7) {}
-
-  void dump() const {
-    std::printf("ORG 0100h\n");
-    for (const auto& m : m_mnemonics) {
-      std::string s;
-      char buf[8];
-      for (const auto b : m.getBytes()) {
-        std::sprintf(buf, "%02x ", b);
-        s += buf;
-      }
-      std::printf("%-20s\t;%04Xh(%+d): %s\n",  //
-                  m.getMnemonic().c_str(), m.getAddr(), m.getAddr() - m_org,
-                  s.c_str());
-    }
-  }
+        m_updateFiles(false),
+        m_srcTrack(false),
+        m_lzUnpack(false),
+        m_poolRequests(0),
+        m_poolRequested(0),
+        m_poolBase(0) {}
+
+  /// 生成済みのコードとラベルを破棄して初期状態に戻す
+  ///
+  /// 確保済みの領域は解放せずに以降の生成で再利用する。
+  /// ソース位置テーブルは呼び出し位置のキャッシュとして保持する。
+  /// @param org 新しい開始アドレス
+  void reset(uint16_t org = 0x100);
+
+  void dump() const;
+
+  /// ソース位置の記録を有効/無効にする
+  ///
+  /// 有効にした以降に生成された命令に、呼び出し元のソース位置IDが記録される。
+  void trackSource(bool enable = true) { m_srcTrack = enable; }
+
+  /// ソース位置IDからファイル名と行番号を取得する
+  /// @return IDが無効な場合は false
+  bool getSourceLoc(uint32_t id, std::string& file, uint_least32_t& line) const;
+
+  /// アドレスとソース位置の対応表をファイルに保存する
+  ///
+  /// [files] にファイル番号とファイル名、[lines] にソース位置IDと
+  /// (ファイル番号, 行番号)、[addrs] に命令毎の(アドレス, バイト数, ソース位置ID)
+  /// を出力する。ソース位置が記録されていない命令は出力しない。
+  void srcmap(const char* fn) const;
+
+  /// シンボルマップを出力する
+  ///
+  /// ラベル毎に「アドレス サイズ ラベル名」を1行ずつアドレス順に出力する。
+  /// サイズは次のラベル(最後のラベルはコードの末尾)までのバイト数。
+  void symbolMap(std::ostream& os) const;
+  Output::WriteStats symbolMap(const char* fn) const;
+
+  /// セクション毎のサイズ集計を出力する
+  ///
+  /// section() 毎に「開始アドレス バイト数 命令数 セクション名」を1行ずつ
+  /// 出力する。最初の section() より前の命令は CODE セクションとして集計する。
+  void sectionMap(std::ostream& os) const;
+  Output::WriteStats sectionMap(const char* fn) const;
+
+  /// 命令毎のアドレス・バイト列・ニーモニックのリストを出力する
+  ///
+  /// L_Json の場合は {"org":…,"size":…,"lines":[{"addr":…,"bytes":"…",
+  /// "text":"…","src":"file:line"},…]} の形式で出力する("src" はソース位置が
+  /// 記録されている命令のみ)。
+  ///
+  /// L_Binary の場合は "XZL2", org(16), 命令数(32) に続けて、命令毎に
+  /// アドレス(16), バイト数(32), バイト列, 文字数(32), 文字列, ソース位置ID(32)
+  /// を出力し、最後に srcmap() と同じファイル名テーブル(件数(32), 文字数(16),
+  /// 文字列…)とソース位置テーブル(件数(32), ファイル番号(32), 行番号(32)…)
+  /// を出力する。
+  void listing(std::ostream& os, Output::ListingFormat format = Output::L_Json) const;
+  Output::WriteStats listing(const char* fn,
+                             Output::ListingFormat format = Output::L_Json) const;
 
   /// 生成されたコードを std::vector として取得する
-  std::vector<uint8_t> getBytes(void) const {
-    const size_t size = m_curr - m_org;
-    std::vector<uint8_t> bytes;
-    bytes.reserve(size);
-    for (const auto& m : m_mnemonics) {
-      const auto& bs = m.getBytes();
-      bytes.insert(bytes.end(), bs.begin(), bs.end());
-    }
-    return bytes;
-  }
+  std::vector<uint8_t> getBytes(void) const;
+
+  /// 開始アドレスを取得する
+  uint16_t getOrg(void) const { return m_org; }
+
+  /// 生成された命令・ラベルの並びを取得する
+  const std::vector<Mnemonic>& getMnemonics(void) const { return m_mnemonics; }
+
+  /// 定義されたラベルとアドレスの対応を取得する
+  const std::map<std::string, uint16_t>& getLabels(void) const { return m_labelMap; }
+
+  /// ファイル出力を差分更新モードにする
+  ///
+  /// 有効な場合、save(), bsave(), hex(), mot() は既存のファイルと比較して
+  /// 異なるブロックだけを書き換え、内容が同じならファイルに触れない。
+  void updateFiles(bool enable = true) { m_updateFiles = enable; }
+
+  /// 生成されたコードと基準のイメージとの差分を命令単位で出力する
+  ///
+  /// 異なるバイトを含む命令のまとまり毎に「アドレス ラベル+オフセット」の行と、
+  /// 基準側(-)と生成側(+)のニーモニックとバイト列の行を出力する。
+  /// 基準側のニーモニックは base_gen があればその命令、なければ基準の
+  /// イメージを逆アセンブルして得る。
+  /// @param base 基準のイメージ(開始アドレスはこの Generator と同じとみなす)
+  /// @return 差分のあったまとまりの数(0 なら一致)
+  size_t diff(std::ostream& os, const uint8_t* base, size_t size,
+              const Generator* base_gen = nullptr) const;
+  size_t diff(std::ostream& os, const char* base_fn) const;
 
   /// 生成されたコードをベタ形式でファイルに保存する
-  void save(const char* fn) const {
-    FILE* fp = fopen(fn, "wb");
-    for (const auto& m : m_mnemonics) {
-      const auto& bs = m.getBytes();
-      std::fwrite(bs.data(), 1, bs.size(), fp);
-    }
-    fclose(fp);
-  }
+  Output::WriteStats save(const char* fn) const;
 
   /// 生成されたコードをMSXのBSAVE形式でファイルに保存する
-  void bsave(const char* fn, uint16_t start_addr = 0x0000) const {
-    FILE* fp = fopen(fn, "wb");
-    const auto wb = [&](uint8_t val)  // WriteByte
-    { std::fwrite(&val, 1, 1, fp); };
-    const auto ww = [&](uint16_t val)  // WriteWord
-    {
-      wb(val & 0xff);
-      wb((val >> 8) & 0xff);
-    };
-
-    // ヘッダの出力
-    wb(0xfe);
-    ww(this->m_org);
-    ww(this->m_curr - 1);
-    ww(start_addr);
+  Output::WriteStats bsave(const char* fn, uint16_t start_addr = 0x0000) const;
 
-    // バイナリデータ本体の出力
-    for (const auto& m : m_mnemonics) {
-      const auto& bs = m.getBytes();
-      std::fwrite(bs.data(), 1, bs.size(), fp);
-    }
-
-    fclose(fp);
-  }
+  /// 生成されたコード(ベタ形式)と基準ファイルとの差分パッチを保存する
+  /// @param fn パッチのファイル名
+  /// @param base_fn 基準となる前回のイメージのファイル名
+  /// @param format パッチの形式
+  Output::WriteStats patch(const char* fn, const char* base_fn,
+                           Output::PatchFormat format = Output::P_BPS) const;
 
   /// Intel HEX 形式でファイルに保存する
   /// @param fn ファイル名
   /// @param bpr 1行当たりの最大出力バイト数(Bytes Par Row)
-  void hex(const char* fn, const uint8_t bpr = 16) const {
-    FILE* fp = fopen(fn, "wb");
-    const size_t size = m_curr - m_org;
-
-    // バイト列の取得
-    std::vector<uint8_t> bytes = getBytes();
-
-    /// bpr バイト毎に出力
-    for (size_t i = 0; i < size; i += bpr) {
-      const size_t end = std::min(size, i + bpr);
-      const size_t num = end - i;
-      const auto addr = MemAddr(m_org + i);
-
-      std::vector<uint8_t> buf;
-      buf.push_back(num);
-      buf.push_back(addr.h);
-      buf.push_back(addr.l);
-      buf.push_back(0);
-      buf.insert(buf.end(), bytes.begin() + i, bytes.begin() + end);
-
-      // チェックサム
-      uint8_t cs = 0;
-      for (const uint8_t e : buf) {
-        cs += e;
-      }
-      buf.push_back(static_cast<uint8_t>(256 - cs));
+  Output::WriteStats hex(const char* fn, const uint8_t bpr = 16) const;
 
-      std::fputc(':', fp);
-      for (const uint8_t e : buf) {
-        std::fprintf(fp, "%02X", e);
-      }
-      std::fprintf(fp, "\r\n");
-    }
-    fprintf(fp, ":00000001FF\r\n");
-    fclose(fp);
-  }
+  /// Intel HEX 形式でストリームに出力する
+  void hex(std::ostream& os, const uint8_t bpr = 16) const;
+
+  /// Intel HEX 形式の文字列を取得する
+  std::string toHex(const uint8_t bpr = 16) const;
 
   /// Motorola S-record 形式でファイルに保存する
   /// @param fn ファイル名
   /// @param start_addr 実行開始アドレス
   /// @param bpr 1行当たりの最大出力バイト数(Bytes Par Row)
-  void mot(const char* fn, uint16_t start_addr = 0, const uint8_t bpr = 16) const {
-    FILE* fp = fopen(fn, "wb");
-    const size_t size = m_curr - m_org;
-
-    // バイト列にチェックサムを追加して出力するラムダ式
-    const auto write_row = [&](const char* type, const std::vector<uint8_t>& bs) {
-      std::fprintf(fp, "%s", type);
-      uint8_t cs = 0;
-      for (const uint8_t e : bs) {
-        cs += e;
-        std::fprintf(fp, "%02X", e);
-      }
-      std::fprintf(fp, "%02X\r\n", 0xff & (~cs));
-    };
-
-    {  // S0レコードの出力
-      std::vector<uint8_t> s0;
-      std::string msg(fn);
-      msg += "|XZ80";
-      s0.push_back(msg.size() + 4);
-      s0.push_back(0);
-      s0.push_back(0);
-      const uint8_t* p = reinterpret_cast<const uint8_t*>(msg.c_str());
-      s0.insert(s0.end(), p, p + msg.size());
-      s0.push_back(0);
-      write_row("S0", s0);
-    }
-
-    // バイト列の取得
-    std::vector<uint8_t> bytes = getBytes();
-
-    /// bpr バイト毎に出力
-    size_t numRow = 0;
-    for (size_t i = 0; i < size; i += bpr) {
-      const size_t end = std::min(size, i + bpr);
-      const size_t num = end - i;
-      const auto addr = MemAddr(m_org + i);
-
-      std::vector<uint8_t> buf;
-      buf.push_back(num + 3);
-      buf.push_back(addr.h);
-      buf.push_back(addr.l);
-      buf.insert(buf.end(), bytes.begin() + i, bytes.begin() + end);
-      write_row("S1", buf);
-      ++numRow;
-    }
-
-    {  // S5レコードの出力
-      MemAddr nr(numRow);
-      std::vector<uint8_t> s5{3, nr.h, nr.l};
-      write_row("S5", s5);
-    }
+  Output::WriteStats mot(const char* fn, uint16_t start_addr = 0, const uint8_t bpr = 16) const;
 
-    {  // S9レコードの出力
-      MemAddr ad(start_addr);
-      std::vector<uint8_t> s9{3, ad.h, ad.l};
-      write_row("S9", s9);
-    }
+  /// Motorola S-record 形式でストリームに出力する
+  /// @param name S0 レコードに埋め込む名前
+  void mot(std::ostream& os, const char* name, uint16_t start_addr = 0,
+           const uint8_t bpr = 16) const;
 
-    fclose(fp);
-  }
+  /// Motorola S-record 形式の文字列を取得する
+  /// @param name S0 レコードに埋め込む名前
+  std::string toMot(const char* name, uint16_t start_addr = 0,
+                    const uint8_t bpr = 16) const;
 
   /// ラベルのアドレス解決
-  bool resolve(bool verbose = false) {
-    int numError = 0;
-    if (verbose) {
-      std::printf(";\x1b[1;36mLabel address resolve..\x1b[0m\n");
-    }
-    for (auto& m : m_mnemonics) {
-      if (m.getLabel().empty()) {
-        continue;
-      }
-
-      const auto itr = this->m_labelMap.find(m.getLabel());
-      if (itr == m_labelMap.end()) {
-        // 解決不能なラベルだった
-        if (verbose) {
-          std::printf(
-              ";0%04xh: %-20s\t;\x1b[1;31mLabel '%s' is not resolved.\x1b[0m\n",  //
-              m.getAddr(), m.getMnemonic().c_str(), m.getLabel().c_str());
-        }
-        ++numError;
-        continue;
-      }
-
-      // アドレスを埋め込む
-      if (verbose) {
-        std::printf(
-            ";0%04xh: %-20s\t;\x1b[1;32mLabel '%s' = 0%04xh\x1b[0m\n",  //
-            m.getAddr(), m.getMnemonic().c_str(), m.getLabel().c_str(),
-            itr->second);
-      }
-      m.resolveAddr(itr->second);
-    }  // for
-
-    if (verbose) {
-      if (numError != 0) {
-        std::printf(";\x1b[1;36m%d unresolved mnemonic(s) found.\x1b[0m\n",
-                    numError);
-      } else {
-        std::printf(";\x1b[1;36mAll mnemonic labels resolved.\x1b[0m\n");
-      }
-    }
-    return numError == 0;
-  }
+  bool resolve(bool verbose = false);
 
   // -------------------------------------------------------------------
   // ニーモニック・疑似命令の実装
@@ -990,33 +937,33 @@ class Generator {
   // 疑似命令
 
   /// DB byte | constant8
-  void db(uint8_t byte) {
+  void db(uint8_t byte, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i b") % "DB" % std::initializer_list<uint8_t>{byte},  //
-           byte);
+           byte, loc);
   }
 
   /// DB byte | constant8 ...
-  void db(std::initializer_list<uint8_t> bytes) {
+  void db(std::initializer_list<uint8_t> bytes, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i b") % "DB" % bytes,  //
-           bytes);
+           bytes, loc);
   }
 
   /// DB byte | constant8 ...
-  void db(const char* str) {
+  void db(const char* str, const SourceLoc& loc = SourceLoc()) {
     const std::vector<uint8_t> bs(str, str + std::strlen(str));
     append(Fmt("i t") % "DB" % str,  //
-           bs);
+           bs, loc);
   }
 
   /// DW word | constant16
-  void dw(uint16_t word) {
+  void dw(uint16_t word, const SourceLoc& loc = SourceLoc()) {
     const MemAddr m(word);
     append(Fmt("ix") % "DW" % word,  //
-           {m.l, m.h});
+           {m.l, m.h}, loc);
   }
 
   /// DB word | constant16 ...
-  void dw(std::initializer_list<uint16_t> words) {
+  void dw(std::initializer_list<uint16_t> words, const SourceLoc& loc = SourceLoc()) {
     std::vector<uint8_t> bs;
     for (const uint16_t w : words) {
       const MemAddr m(w);
@@ -1024,30 +971,89 @@ class Generator {
       bs.push_back(m.h);
     }
     append(Fmt("i w") % "DW" % words,  //
-           bs);
+           bs, loc);
   }
 
   /// DB label | label ...
-  void dw(std::string label) {
-    append(Fmt("i s") % "DW" % label, {0x00, 0x00});
+  void dw(std::string label, const SourceLoc& loc = SourceLoc()) {
+    append(Fmt("i s") % "DW" % label, {0x00, 0x00}, loc);
     resolve(label.c_str(), 0);
   }
 
   /// DB label | label ...
-  void dw(std::initializer_list<const std::string> labels) {
+  void dw(std::initializer_list<const std::string> labels, const SourceLoc& loc = SourceLoc()) {
     for (const std::string& l : labels) {
-      append(Fmt("i s") % "DW" % l, {0x00, 0x00});
+      append(Fmt("i s") % "DW" % l, {0x00, 0x00}, loc);
       resolve(l.c_str(), 0);
     }
   }
 
+  /// SECTION name | 以降の命令を name セクションとして集計する
+  void section(const char* name) { m_sections.emplace_back(name, m_mnemonics.size()); }
+
+  /// DB byte ...
+  void db(const std::vector<uint8_t>& bytes, const SourceLoc& loc = SourceLoc()) {
+    append(Fmt("i b") % "DB" % bytes,  //
+           bytes, loc);
+  }
+
+  /// 圧縮データ | data を LZ 圧縮して DB として埋め込む
+  ///
+  /// 展開は HL に圧縮データ、DE に展開先のアドレスを設定して lzUnpack() で
+  /// 生成したルーチンを CALL する。
+  /// @param threads 圧縮に使うスレッド数(0 は全コア)
+  /// @return 圧縮率と展開時間の見積もり
+  Output::LzStats dbz(const uint8_t* data, size_t size, unsigned threads = 0,
+                      const SourceLoc& loc = SourceLoc());
+  Output::LzStats dbz(const std::vector<uint8_t>& data, unsigned threads = 0,
+                      const SourceLoc& loc = SourceLoc()) {
+    return dbz(data.data(), data.size(), threads, loc);
+  }
+
+  /// 共有データ | バイト列をデータプールに登録し、その先頭のラベルを返す
+  ///
+  /// データは pool() を呼んだ位置にまとめて出力される。同じ内容のデータは
+  /// 同じラベルを返し、他のデータの末尾と一致するデータはその途中を指す。
+  std::string dbp(const uint8_t* data, size_t size);
+  std::string dbp(const std::vector<uint8_t>& data) { return dbp(data.data(), data.size()); }
+  std::string dbp(std::initializer_list<uint8_t> bytes) { return dbp(bytes.begin(), bytes.size()); }
+  /// 文字列(終端の NUL は含まない)を登録する
+  std::string dbp(const char* str) {
+    return dbp(reinterpret_cast<const uint8_t*>(str), std::strlen(str));
+  }
+
+  /// dbp() で登録したデータを出力してプールを空にする
+  ///
+  /// 登録データを逆順の辞書順に整列し、隣り合うデータが末尾で一致すれば
+  /// 長い方に併合する。併合されたデータのラベルは長い方の途中に置かれる。
+  /// @return 出力したバイト数と節約したバイト数
+  PoolStats pool(const SourceLoc& loc = SourceLoc());
+
+  /// dbz() のデータを展開するルーチンを label として生成する
+  ///
+  /// 入力: HL = 圧縮データ, DE = 展開先。出力: HL = 圧縮データの次,
+  /// DE = 展開したデータの次。A, BC, F を破壊する。
+  /// 生成は1プログラムにつき1回で、2回目以降の呼び出しでは何もしない。
+  void lzUnpack(const char* label = "LZ_UNPACK", const SourceLoc& loc = SourceLoc());
+
   /// $ | Get current address.
   uint16_t curr(void) const { return this->m_curr; }
 
   /// Label
-  uint16_t l(const char* label) {
-    m_labelMap.insert(std::make_pair(std::string(label), m_curr));
-    append(Fmt("l") % label);
+  uint16_t l(const char* label, const SourceLoc& loc = SourceLoc()) {
+    if (m_labelPool.empty()) {
+      m_labelMap.insert(std::make_pair(std::string(label), m_curr));
+    } else {
+      auto node = std::move(m_labelPool.back());
+      m_labelPool.pop_back();
+      node.key() = label;
+      node.mapped() = m_curr;
+      auto ret = m_labelMap.insert(std::move(node));
+      if (!ret.inserted) {
+        m_labelPool.push_back(std::move(ret.node));
+      }
+    }
+    append(Fmt("l") % label, loc);
     return m_curr;
   }
 
@@ -1055,311 +1061,311 @@ class Generator {
   // 8ビット転送命令
 
   /// LD r1, r2 | reg8 <- reg8
-  void ld(const BasicReg8& r1, const BasicReg8& r2) {
+  void ld(const BasicReg8& r1, const BasicReg8& r2, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % r1 % r2,  //
-           build(0b01, r1, r2));
+           build(0b01, r1, r2), loc);
   }
 
   /// LD r, n | reg8 <- constant8
-  void ld(const BasicReg8& r, uint8_t n) {
+  void ld(const BasicReg8& r, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "LD" % r % n,  //
-           {build(0b00, r, F), n});
+           {build(0b00, r, F), n}, loc);
   }
 
   /// LD r, (HL) | reg8 <- mem[HL]
-  void ld(const BasicReg8& r, const RegHLAddr& hl_addr) {
+  void ld(const BasicReg8& r, const RegHLAddr& hl_addr, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % r % hl_addr,  //
-           build(0b01, r, F));
+           build(0b01, r, F), loc);
   }
 
   /// LD r,(indexreg16+offset) | reg8 <- mem[(IX or IY)+offset8]
-  void ld(const BasicReg8& r, const IndenexReg16AddrOffset& ireg16_offset) {
+  void ld(const BasicReg8& r, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % r % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b01, r, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// LD (HL), r | mem[HL] <- reg8
-  void ld(const RegHLAddr& hl_addr, const BasicReg8& r) {
+  void ld(const RegHLAddr& hl_addr, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % hl_addr % r,  //
-           build(0b01, F, r));
+           build(0b01, F, r), loc);
   }
 
   /// LD (indexreg16+offset), r |  mem[(IX or IY)+offset8] <- reg8
-  void ld(const IndenexReg16AddrOffset& ireg16_offset, const BasicReg8& r) {
+  void ld(const IndenexReg16AddrOffset& ireg16_offset, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % ireg16_offset % r,  //
            {ireg16_offset.m_reg.m_prefix, build(0b01, F, r),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// LD (HL), r | mem[HL] <- constant8
-  void ld(const RegHLAddr& hl_addr, uint8_t n) {
+  void ld(const RegHLAddr& hl_addr, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "LD" % hl_addr % n,  //
-           {build(0b00, F, F), n});
+           {build(0b00, F, F), n}, loc);
   }
 
   /// LD (indexreg16+offset), n |  mem[(IX or IY)+offset8] <- constant8
-  void ld(const IndenexReg16AddrOffset& ireg16_offset, uint8_t n) {
+  void ld(const IndenexReg16AddrOffset& ireg16_offset, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "LD" % ireg16_offset % n,  //
            {ireg16_offset.m_reg.m_prefix, build(0b00, F, F),
-            ireg16_offset.getOffset(), n});
+            ireg16_offset.getOffset(), n}, loc);
   }
 
   /// LD A, (BC or DE) | A <- mem[BC or DE]
-  void ld(const RegA& a, const BasicReg16Addr& rr) {
+  void ld(const RegA& a, const BasicReg16Addr& rr, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % a % rr,  //
-           build(0b00, rr.m_reg, 0b1010));
+           build(0b00, rr.m_reg, 0b1010), loc);
   }
 
   /// LD A, (nn) | A <- mem[constant16]
-  void ld(const RegA& a, const MemAddr& nn) {
+  void ld(const RegA& a, const MemAddr& nn, const SourceLoc& loc = SourceLoc()) {
     if (nn.isLabel()) {
       append(Fmt("i r,I") % "LD" % a % nn,  //
-             {build(0b00, A, D), nn.l, nn.h});
+             {build(0b00, A, D), nn.l, nn.h}, loc);
       resolve(nn.label, 1);
     } else {
       append(Fmt("i r,I") % "LD" % a % nn,  //
-             {build(0b00, A, D), nn.l, nn.h});
+             {build(0b00, A, D), nn.l, nn.h}, loc);
     }
   }
 
   /// LD (BC or DE), A | mem[BC or DE] <- A
-  void ld(const BasicReg16Addr& rr, const RegA& a) {
+  void ld(const BasicReg16Addr& rr, const RegA& a, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % rr % a,  //
-           {build(0b00, rr.m_reg, 0b0010)});
+           {build(0b00, rr.m_reg, 0b0010)}, loc);
   }
 
   /// LD (nn), A | mem[constant16] <- A
-  void ld(const MemAddr& nn, const RegA& a) {
+  void ld(const MemAddr& nn, const RegA& a, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i I,r") % "LD" % nn % a,  //
-           {build(0b00, F, D), nn.l, nn.h});
+           {build(0b00, F, D), nn.l, nn.h}, loc);
   }
 
   /// LD A, I | A <- I
-  void ld(const RegA& a, const RegI& i) {
+  void ld(const RegA& a, const RegI& i, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % a % i,  //
-           {0xed, 0x57});
+           {0xed, 0x57}, loc);
   }
 
   /// LD I, A | I <- A
-  void ld(const RegI& i, const RegA& a) {
+  void ld(const RegI& i, const RegA& a, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % i % a,  //
-           {0xed, 0x47});
+           {0xed, 0x47}, loc);
   }
 
   /// LD A, R | A <- R
-  void ld(const RegA& a, const RegR& r) {
+  void ld(const RegA& a, const RegR& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % a % r,  //
-           {0xed, 0x5f});
+           {0xed, 0x5f}, loc);
   }
 
   /// LD R, A | R <- A
-  void ld(const RegR& r, const RegA& a) {
+  void ld(const RegR& r, const RegA& a, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % r % a,  //
-           {0xed, 0x4f});
+           {0xed, 0x4f}, loc);
   }
 
   // =========================================================================
   // 16ビット転送命令
 
   /// LD rp, nn | reg16 <- constant16
-  void ld(const Reg16& rp, uint16_t nn) {
+  void ld(const Reg16& rp, uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     MemAddr m(nn);
     append(Fmt("i r,x") % "LD" % rp % nn,  //
-           {build(0b00, rp, 0b0001), m.l, m.h});
+           {build(0b00, rp, 0b0001), m.l, m.h}, loc);
   }
-  void ld(const Reg16& rp, const std::string& label) {
+  void ld(const Reg16& rp, const std::string& label, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,s") % "LD" % rp % label,  //
-           {build(0b00, rp, 0b0001), 0x00, 0x00});
+           {build(0b00, rp, 0b0001), 0x00, 0x00}, loc);
     resolve(label, 1);
   }
 
   /// LD indexreg16, nn | indexreg16 <- constant16
-  void ld(const IndexReg16& rp, uint16_t nn) {
+  void ld(const IndexReg16& rp, uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     MemAddr m(nn);
     append(Fmt("i r,x") % "LD" % rp % nn,  //
-           {rp.m_prefix, build(0b00, HL, 0b0001), m.l, m.h});
+           {rp.m_prefix, build(0b00, HL, 0b0001), m.l, m.h}, loc);
   }
-  void ld(const IndexReg16& rp, const std::string& label) {
+  void ld(const IndexReg16& rp, const std::string& label, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,s") % "LD" % rp % label,  //
-           {rp.m_prefix, build(0b00, HL, 0b0001), 0x00, 0x00});
+           {rp.m_prefix, build(0b00, HL, 0b0001), 0x00, 0x00}, loc);
     resolve(label, 2);
   }
 
   /// LD HL, (nn) | reg16 <- mem[constant16]
-  void ld(const RegHL& hl, const MemAddr& nn) {
+  void ld(const RegHL& hl, const MemAddr& nn, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,I") % "LD" % hl % nn,  //
-           {build(0b00, hl, 0b1010), nn.l, nn.h});
+           {build(0b00, hl, 0b1010), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 1);
     }
   }
 
   /// LD rp, (nn) | reg16 <- mem[constant16]
-  void ld(const BasicReg16& rp, const MemAddr& nn) {
+  void ld(const BasicReg16& rp, const MemAddr& nn, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,I)") % "LD" % rp % nn,  //
-           {0xed, build(0b01, rp, 0b1011), nn.l, nn.h});
+           {0xed, build(0b01, rp, 0b1011), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 2);
     }
   }
 
   /// LD IX or IY, (nn) | indexreg16 <- mem[constant16]
-  void ld(const IndexReg16& rp, const MemAddr& nn) {
+  void ld(const IndexReg16& rp, const MemAddr& nn, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,I") % "LD" % rp % nn,  //
-           {rp.m_prefix, build(0b00, rp, 0b1010), nn.l, nn.h});
+           {rp.m_prefix, build(0b00, rp, 0b1010), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 2);
     }
   }
 
   /// LD (nn), HL | mem[constant16] <- reg16
-  void ld(const MemAddr& nn, const RegHL& hl) {
+  void ld(const MemAddr& nn, const RegHL& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i I,r") % "LD" % nn % hl,  //
-           {build(0b00, hl, 0b0010), nn.l, nn.h});
+           {build(0b00, hl, 0b0010), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 1);
     }
   }
 
   /// LD (nn), rp | mem[constant16] <- reg16
-  void ld(const MemAddr& nn, const BasicReg16& rp) {
+  void ld(const MemAddr& nn, const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i I,r") % "LD" % nn % rp,  //
-           {0xed, build(0b01, rp, 0b0011), nn.l, nn.h});
+           {0xed, build(0b01, rp, 0b0011), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 2);
     }
   }
 
   /// LD (nn), IX or IY | mem[constant16] <- indexreg16
-  void ld(const MemAddr& nn, const IndexReg16& rp) {
+  void ld(const MemAddr& nn, const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i I,r") % "LD" % nn % rp,  //
-           {rp.m_prefix, build(0b00, rp, 0b0010), nn.l, nn.h});
+           {rp.m_prefix, build(0b00, rp, 0b0010), nn.l, nn.h}, loc);
     if (nn.isLabel()) {
       resolve(nn.label, 2);
     }
   }
 
   /// LD SP, HL | SP <- HL
-  void ld(const RegSP& sp, const RegHL& hl) {
+  void ld(const RegSP& sp, const RegHL& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % sp % hl,  //
-           {0b11111001});
+           {0b11111001}, loc);
   }
 
   /// LD SP, IX or IY | SP <- IX or IY
-  void ld(const RegSP& sp, const IndexReg16& rp) {
+  void ld(const RegSP& sp, const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "LD" % sp % rp,  //
-           {rp.m_prefix, 0b11111001});
+           {rp.m_prefix, 0b11111001}, loc);
   }
 
   // =========================================================================
   // ブロック転送命令
 
   /// LDI | mem[DE++] <- mem[HL++]; --BC;
-  void ldi(void) {
+  void ldi(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "LDI",  //
-           {0b1110'1101, 0b1010'0000});
+           {0b1110'1101, 0b1010'0000}, loc);
   }
 
   /// LDIR | while(BC!=0) { mem[DE++] <- mem[HL++]; --BC; }
-  void ldir(void) {
+  void ldir(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "LDIR",  //
-           {0b1110'1101, 0b1011'0000});
+           {0b1110'1101, 0b1011'0000}, loc);
   }
 
   /// LDD | mem[DE--] <- mem[HL--]; --BC;
-  void ldd(void) {
+  void ldd(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "LDD",  //
-           {0b1110'1101, 0b1010'1000});
+           {0b1110'1101, 0b1010'1000}, loc);
   }
 
   /// LDDR | while(BC!=0) { mem[DE--] <- mem[HL--]; --BC; }
-  void lddr(void) {
+  void lddr(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "LDDR",  //
-           {0b1110'1101, 0b1011'1000});
+           {0b1110'1101, 0b1011'1000}, loc);
   }
 
   // =========================================================================
   // 交換命令
 
   /// EX DE, HL | DE <=> HL
-  void ex(const RegDE& de, const RegHL& hl) {
+  void ex(const RegDE& de, const RegHL& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "EX" % de % hl,  //
-           {0b1110'1011});
+           {0b1110'1011}, loc);
   }
 
   /// EX AF, AF' | AF <=> AF'
-  void ex(const RegAF& af, const RegAF& afd) {
+  void ex(const RegAF& af, const RegAF& afd, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r'") % "EX" % af % afd,  //
-           {0b0000'1000});
+           {0b0000'1000}, loc);
   }
 
   /// EXX | (BC, DE, HL) <=> (BC', DE', HL')
-  void exx(void) {
+  void exx(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "EXX",  //
-           {0b1101'1001});
+           {0b1101'1001}, loc);
   }
 
   /// EX (SP), HL | mem[SP] <=> L; mem[SP+1] <=> H;
-  void ex(const RegSPAddr& sp, const RegHL& hl) {
+  void ex(const RegSPAddr& sp, const RegHL& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "EX" % sp % hl,  //
-           {0b1110'0011});
+           {0b1110'0011}, loc);
   }
 
   /// EX (SP), IX or IY | mem[SP] <=> IXL or IYL; mem[SP+1] <=> IXH or IYH;
-  void ex(const RegSPAddr& sp, const IndexReg16& rp) {
+  void ex(const RegSPAddr& sp, const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "EX" % sp % rp,  //
-           {rp.m_prefix, 0b1110'0011});
+           {rp.m_prefix, 0b1110'0011}, loc);
   }
 
   // =========================================================================
   // スタック操作命令
 
  private:
-  void push_rp_impl(const Reg16& rp) {
+  void push_rp_impl(const Reg16& rp, const SourceLoc& loc) {
     append(Fmt("i r") % "PUSH" % rp,  //
-           {build(0b11, rp, 0b0101)});
+           {build(0b11, rp, 0b0101)}, loc);
   }
-  void pop_rp_impl(const Reg16& rp) {
+  void pop_rp_impl(const Reg16& rp, const SourceLoc& loc) {
     append(Fmt("i r") % "POP" % rp,  //
-           {build(0b11, rp, 0b0001)});
+           {build(0b11, rp, 0b0001)}, loc);
   }
 
  public:
   /// PUSH BC | mem[SP-1] <- B; mem[SP-2] <- C; SP-= 2;
-  void push(const RegBC& bc) { push_rp_impl(bc); }
+  void push(const RegBC& bc, const SourceLoc& loc = SourceLoc()) { push_rp_impl(bc, loc); }
 
   /// PUSH DE | mem[SP-1] <- D; mem[SP-2] <- E; SP-= 2;
-  void push(const RegDE& de) { push_rp_impl(de); }
+  void push(const RegDE& de, const SourceLoc& loc = SourceLoc()) { push_rp_impl(de, loc); }
 
   /// PUSH HL | mem[SP-1] <- H; mem[SP-2] <- L; SP-= 2;
-  void push(const RegHL& hl) { push_rp_impl(hl); }
+  void push(const RegHL& hl, const SourceLoc& loc = SourceLoc()) { push_rp_impl(hl, loc); }
 
   /// PUSH AF | mem[SP-1] <- A; mem[SP-2] <- F; SP-= 2;
-  void push(const RegAF& af) { push_rp_impl(af); }
+  void push(const RegAF& af, const SourceLoc& loc = SourceLoc()) { push_rp_impl(af, loc); }
 
   /// PUSH IX or IY | mem[SP-1] <- IXH or IYH; mem[SP-2] <- IXL or IYL; SP-= 2;
-  void push(const IndexReg16& rp) {
+  void push(const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "PUSH" % rp,  //
-           {rp.m_prefix, build(0b11, rp, 0b0101)});
+           {rp.m_prefix, build(0b11, rp, 0b0101)}, loc);
   }
 
   /// POP BC | B <- mem[SP]; C <- mem[SP+1]; SP+= 2;
-  void pop(const RegBC& bc) { pop_rp_impl(bc); }
+  void pop(const RegBC& bc, const SourceLoc& loc = SourceLoc()) { pop_rp_impl(bc, loc); }
 
   /// POP DE | D <- mem[SP]; E <- mem[SP+1]; SP+= 2;
-  void pop(const RegDE& de) { pop_rp_impl(de); }
+  void pop(const RegDE& de, const SourceLoc& loc = SourceLoc()) { pop_rp_impl(de, loc); }
 
   /// POP HL | H <- mem[SP]; L <- mem[SP+1]; SP+= 2;
-  void pop(const RegHL& hl) { pop_rp_impl(hl); }
+  void pop(const RegHL& hl, const SourceLoc& loc = SourceLoc()) { pop_rp_impl(hl, loc); }
 
   /// POP AF | A <- mem[SP]; F <- mem[SP+1]; SP+= 2;
-  void pop(const RegAF& af) { pop_rp_impl(af); }
+  void pop(const RegAF& af, const SourceLoc& loc = SourceLoc()) { pop_rp_impl(af, loc); }
 
   /// POP IX or IY | IXH or IYH <- mem[SP]; IXL or IYL <- mem[SP+1]; SP+= 2;
-  void pop(const IndexReg16& rp) {
+  void pop(const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "POP" % rp,  //
-           {rp.m_prefix, build(0b11, rp, 0b0001)});
+           {rp.m_prefix, build(0b11, rp, 0b0001)}, loc);
   }
 
   // =========================================================================
@@ -1369,168 +1375,168 @@ class Generator {
   // 左巡回シフト命令
 
   /// RLCA |
-  void rlca(void) {
+  void rlca(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RLCA",  //
-           {0b0000'0111});
+           {0b0000'0111}, loc);
   }
 
   /// RLA |
-  void rla(void) {
+  void rla(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RLA",  //
-           {0b0001'0111});
+           {0b0001'0111}, loc);
   }
 
   /// RLC r |
-  void rlc(const BasicReg8& r) {
+  void rlc(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RLC" % r,  //
-           {0b1100'1011, build(0b00, B, r)});
+           {0b1100'1011, build(0b00, B, r)}, loc);
   }
 
   /// RLC (HL) |
-  void rlc(const RegHLAddr& hl) {
+  void rlc(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RLC" % hl,  //
-           {0b1100'1011, 0b0000'0110});
+           {0b1100'1011, 0b0000'0110}, loc);
   }
 
   /// RLC (IX or IY + d) |
-  void rlc(const IndenexReg16AddrOffset& ireg16_offset) {
+  void rlc(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RLC" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), 0b0000'0110});
+            ireg16_offset.getOffset(), 0b0000'0110}, loc);
   }
 
   /// RL r |
-  void rl(const BasicReg8& r) {
+  void rl(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RL" % r,  //
-           {0b1100'1011, build(0b00, D, r)});
+           {0b1100'1011, build(0b00, D, r)}, loc);
   }
 
   /// RL (HL) |
-  void rl(const RegHLAddr& hl) {
+  void rl(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RL" % hl,  //
-           {0b1100'1011, build(0b00, D, F)});
+           {0b1100'1011, build(0b00, D, F)}, loc);
   }
 
   /// RL (IX or IY + d) |
-  void rl(const IndenexReg16AddrOffset& ireg16_offset) {
+  void rl(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RL" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), 0b0001'0110});
+            ireg16_offset.getOffset(), 0b0001'0110}, loc);
   }
 
   // ---------------------------------
   // 右巡回シフト命令
 
   /// RRCA |
-  void rrca(void) {
+  void rrca(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RRCA",  //
-           {0b0000'1111});
+           {0b0000'1111}, loc);
   }
 
   /// RRA |
-  void rra(void) {
+  void rra(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RRA",  //
-           {0b0001'1111});
+           {0b0001'1111}, loc);
   }
 
   /// RRC r |
-  void rrc(const BasicReg8& r) {
+  void rrc(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RRC" % r,  //
-           {0b1100'1011, build(0b00, C, r)});
+           {0b1100'1011, build(0b00, C, r)}, loc);
   }
 
   /// RRC (HL) |
-  void rrc(const RegHLAddr& hl) {
+  void rrc(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RRC" % hl,  //
-           {0b1100'1011, build(0b00, C, F)});
+           {0b1100'1011, build(0b00, C, F)}, loc);
   }
 
   /// RRC (IX or IY + d) |
-  void rrc(const IndenexReg16AddrOffset& ireg16_offset) {
+  void rrc(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RRC" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), build(0b00, C, F)});
+            ireg16_offset.getOffset(), build(0b00, C, F)}, loc);
   }
 
   /// RR r |
-  void rr(const BasicReg8& r) {
+  void rr(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RR" % r,  //
-           {0b1100'1011, build(0b00, E, r)});
+           {0b1100'1011, build(0b00, E, r)}, loc);
   }
 
   /// RR (HL) |
-  void rr(const RegHLAddr& hl) {
+  void rr(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RR" % hl,  //
-           {0b1100'1011, build(0b00, E, F)});
+           {0b1100'1011, build(0b00, E, F)}, loc);
   }
 
   /// RR (IX or IY + d) |
-  void rr(const IndenexReg16AddrOffset& ireg16_offset) {
+  void rr(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "RR" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), build(0b00, E, F)});
+            ireg16_offset.getOffset(), build(0b00, E, F)}, loc);
   }
 
   // ---------------------------------
   // 左シフト命令
 
   /// SLA r |
-  void sla(const BasicReg8& r) {
+  void sla(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SLA" % r,  //
-           {0b1100'1011, build(0b00, H, r)});
+           {0b1100'1011, build(0b00, H, r)}, loc);
   }
 
   /// SLA (HL) |
-  void sla(const RegHLAddr& hl) {
+  void sla(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SLA" % hl,  //
-           {0b1100'1011, build(0b00, H, F)});
+           {0b1100'1011, build(0b00, H, F)}, loc);
   }
 
   /// SLA (IX or IY + d) |
-  void sla(const IndenexReg16AddrOffset& ireg16_offset) {
+  void sla(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SLA" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), build(0b00, H, F)});
+            ireg16_offset.getOffset(), build(0b00, H, F)}, loc);
   }
 
   // ---------------------------------
   // 右シフト命令
 
   /// SRA r |
-  void sra(const BasicReg8& r) {
+  void sra(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRA" % r,  //
-           {0b1100'1011, build(0b00, L, r)});
+           {0b1100'1011, build(0b00, L, r)}, loc);
   }
 
   /// SRA (HL) |
-  void sra(const RegHLAddr& hl) {
+  void sra(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRA" % hl,  //
-           {0b1100'1011, build(0b00, L, F)});
+           {0b1100'1011, build(0b00, L, F)}, loc);
   }
 
   /// SRA (IX or IY + d) |
-  void sra(const IndenexReg16AddrOffset& ireg16_offset) {
+  void sra(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRA" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), build(0b00, L, F)});
+            ireg16_offset.getOffset(), build(0b00, L, F)}, loc);
   }
 
   /// SRL r |
-  void srl(const BasicReg8& r) {
+  void srl(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRL" % r,  //
-           {0b1100'1011, build(0b00, A, r)});
+           {0b1100'1011, build(0b00, A, r)}, loc);
   }
 
   /// SRL (HL) |
-  void srl(const RegHLAddr& hl) {
+  void srl(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRL" % hl,  //
-           {0b1100'1011, build(0b00, A, F)});
+           {0b1100'1011, build(0b00, A, F)}, loc);
   }
   /// SRL (IX or IY + d) |
-  void srl(const IndenexReg16AddrOffset& ireg16_offset) {
+  void srl(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "SRL" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
-            ireg16_offset.getOffset(), build(0b00, A, F)});
+            ireg16_offset.getOffset(), build(0b00, A, F)}, loc);
   }
 
   // =========================================================================
@@ -1540,358 +1546,358 @@ class Generator {
   // 加算・インクリメント命令
 
   /// ADD A, r | A <- A + reg8
-  void add(const RegA& a, const BasicReg8& r) {
+  void add(const RegA& a, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % a % r,  //
-           {build(0b10, B, r)});
+           {build(0b10, B, r)}, loc);
   }
 
   /// ADD A, n | A <- A + constant8
-  void add(const RegA& a, uint8_t n) {
+  void add(const RegA& a, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "ADD" % a % n,  //
-           {build(0b11, B, F), n});
+           {build(0b11, B, F), n}, loc);
   }
 
   /// ADD A, (HL) | A <- A + mem[HL]
-  void add(const RegA& a, const RegHLAddr& r) {
+  void add(const RegA& a, const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % a % r,  //
-           {build(0b10, B, F)});
+           {build(0b10, B, F)}, loc);
   }
 
   /// ADD A, (IX or IY + d) | A <- A + mem[IX or IY + d]
-  void add(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset) {
+  void add(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % a % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, B, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// ADC A, r | A <- A + reg8 + carry
-  void adc(const RegA& a, const BasicReg8& r) {
+  void adc(const RegA& a, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADC" % a % r,  //
-           {build(0b10, C, r)});
+           {build(0b10, C, r)}, loc);
   }
 
   /// ADC A, n | A <- A + constant8 + carry
-  void adc(const RegA& a, uint8_t n) {
+  void adc(const RegA& a, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "ADC" % a % n,  //
-           {build(0b11, C, F), n});
+           {build(0b11, C, F), n}, loc);
   }
 
   /// ADC A, (HL) | A <- A + mem[HL] + carry
-  void adc(const RegA& a, const RegHLAddr& r) {
+  void adc(const RegA& a, const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADC" % a % r,  //
-           {build(0b10, C, F)});
+           {build(0b10, C, F)}, loc);
   }
 
   /// ADC A, (IX or IY + d) | A <- A + mem[IX or IY + d] + carry
-  void adc(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset) {
+  void adc(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADC" % a % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, C, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// INC r | reg8 <- reg8 + 1
-  void inc(const BasicReg8& r) {
+  void inc(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % r,  //
-           {build(0b00, r, H)});
+           {build(0b00, r, H)}, loc);
   }
 
   /// INC (HL) | mem[HL] <- mem[HL] + 1
-  void inc(const RegHLAddr& r) {
+  void inc(const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % r,  //
-           {build(0b00, F, H)});
+           {build(0b00, F, H)}, loc);
   }
 
   /// INC (IX or IY + d) | mem[IX or IY + d] <- mem[IX or IY + d] + 1
-  void inc(const IndenexReg16AddrOffset& ireg16_offset) {
+  void inc(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b00, F, H),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   // ---------------------------------
   // 減算・デクリメント命令
 
   /// SUB A, r | A <- A - reg8
-  void sub(const RegA& a, const BasicReg8& r) {
+  void sub(const RegA& a, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SUB" % a % r,  //
-           {build(0b10, D, r)});
+           {build(0b10, D, r)}, loc);
   }
 
   /// SUB A, n | A <- A - constant8
-  void sub(const RegA& a, uint8_t n) {
+  void sub(const RegA& a, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "SUB" % a % n,  //
-           {build(0b11, D, F), n});
+           {build(0b11, D, F), n}, loc);
   }
 
   /// SUB A, (HL) | A <- A - mem[HL]
-  void sub(const RegA& a, const RegHLAddr& r) {
+  void sub(const RegA& a, const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SUB" % a % r,  //
-           {build(0b10, D, F)});
+           {build(0b10, D, F)}, loc);
   }
 
   /// SUB A, (IX or IY + d) | A <- A - mem[IX or IY + d]
-  void sub(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset) {
+  void sub(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SUB" % a % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, D, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// SBC A, r | A <- A - reg8 - carry
-  void sbc(const RegA& a, const BasicReg8& r) {
+  void sbc(const RegA& a, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SBC" % a % r,  //
-           {build(0b10, E, r)});
+           {build(0b10, E, r)}, loc);
   }
 
   /// SBC A, n | A <- A - constant8 - carry
-  void sbc(const RegA& a, uint8_t n) {
+  void sbc(const RegA& a, uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,x") % "SBC" % a % n,  //
-           {build(0b11, E, F), n});
+           {build(0b11, E, F), n}, loc);
   }
 
   /// SBC A, (HL) | A <- A - mem[HL] - carry
-  void sbc(const RegA& a, const RegHLAddr& r) {
+  void sbc(const RegA& a, const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SBC" % a % r,  //
-           {build(0b10, E, F)});
+           {build(0b10, E, F)}, loc);
   }
 
   /// SBC A, (IX or IY + d) | A <- A - mem[IX or IY + d] - carry
-  void sbc(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset) {
+  void sbc(const RegA& a, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SBC" % a % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, E, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// DEC r | reg8 <- reg8 - 1
-  void dec(const BasicReg8& r) {
+  void dec(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % r,  //
-           {build(0b00, r, L)});
+           {build(0b00, r, L)}, loc);
   }
 
   /// DEC (HL) | mem[HL] <- mem[HL] - 1
-  void dec(const RegHLAddr& r) {
+  void dec(const RegHLAddr& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % r,  //
-           {build(0b00, F, L)});
+           {build(0b00, F, L)}, loc);
   }
 
   /// DEC (IX or IY + d) | mem[IX or IY + d] <- mem[IX or IY + d] - 1
-  void dec(const IndenexReg16AddrOffset& ireg16_offset) {
+  void dec(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b00, F, L),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   // =========================================================================
   // 16ビット算術演算命令
 
   /// ADD HL, rp | HL <- HL + reg16
-  void add(const RegHL& hl, const BasicReg16& rp) {
+  void add(const RegHL& hl, const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % hl % rp,  //
-           {build(0b00, rp, 0b1001)});
+           {build(0b00, rp, 0b1001)}, loc);
   }
 
   /// ADD HL, HL | HL <- HL + HL
-  void add(const RegHL& hl, const RegHL& rp) {
+  void add(const RegHL& hl, const RegHL& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % hl % rp,  //
-           {build(0b00, rp, 0b1001)});
+           {build(0b00, rp, 0b1001)}, loc);
   }
 
   /// ADC HL, rp | HL <- HL + reg16 + carry
-  void adc(const RegHL& hl, const BasicReg16& rp) {
+  void adc(const RegHL& hl, const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADC" % hl % rp,  //
-           {0b1110'1101, build(0b01, rp, 0b1010)});
+           {0b1110'1101, build(0b01, rp, 0b1010)}, loc);
   }
 
   /// ADC HL, HL | HL <- HL + HL + carry
-  void adc(const RegHL& hl, const RegHL& rp) {
+  void adc(const RegHL& hl, const RegHL& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADC" % hl % rp,  //
-           {0b1110'1101, build(0b01, rp, 0b1010)});
+           {0b1110'1101, build(0b01, rp, 0b1010)}, loc);
   }
 
   /// ADD IX or IY, rp | IX or IY <- IX or IY + reg16
-  void add(const IndexReg16& ireg16, const BasicReg16& rp) {
+  void add(const IndexReg16& ireg16, const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "ADD" % ireg16 % rp,  //
-           {ireg16.m_prefix, build(0b00, rp, 0b1001)});
+           {ireg16.m_prefix, build(0b00, rp, 0b1001)}, loc);
   }
 
   /// INC rp | reg16 <- reg16 + 1
-  void inc(const BasicReg16& rp) {
+  void inc(const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % rp,  //
-           {build(0b00, rp, 0b0011)});
+           {build(0b00, rp, 0b0011)}, loc);
   }
 
   /// INC HL | HL <- HL + 1
-  void inc(const RegHL& rp) {
+  void inc(const RegHL& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % rp,  //
-           {build(0b00, rp, 0b0011)});
+           {build(0b00, rp, 0b0011)}, loc);
   }
 
   /// INC IX or IY | IX or IY <- IX or IY + 1
-  void inc(const IndexReg16& rp) {
+  void inc(const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "INC" % rp,  //
-           {rp.m_prefix, build(0b00, rp, 0b0011)});
+           {rp.m_prefix, build(0b00, rp, 0b0011)}, loc);
   }
 
   /// SBC HL, rp | HL <- HL - reg16 - carry
-  void sbc(const RegHL& hl, const BasicReg16& rp) {
+  void sbc(const RegHL& hl, const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SBC" % hl % rp,  //
-           {0b1110'1101, build(0b1, rp, 0b0010)});
+           {0b1110'1101, build(0b1, rp, 0b0010)}, loc);
   }
 
   /// SBC HL, HL | HL <- HL - HL - carry
-  void sbc(const RegHL& hl, const RegHL& rp) {
+  void sbc(const RegHL& hl, const RegHL& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "SBC" % hl % rp,  //
-           {0b1110'1101, build(0b01, rp, 0b0010)});
+           {0b1110'1101, build(0b01, rp, 0b0010)}, loc);
   }
 
   /// DEC rp | reg16 <- reg16 - 1
-  void dec(const BasicReg16& rp) {
+  void dec(const BasicReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % rp,  //
-           {build(0b00, rp, 0b1011)});
+           {build(0b00, rp, 0b1011)}, loc);
   }
 
   /// DEC HL | HL <- HL - 1
-  void dec(const RegHL& rp) {
+  void dec(const RegHL& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % rp,  //
-           {build(0b00, rp, 0b1011)});
+           {build(0b00, rp, 0b1011)}, loc);
   }
 
   /// DEC IX or IY |IX or IY <- IX or IY - 1
-  void dec(const IndexReg16& rp) {
+  void dec(const IndexReg16& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "DEC" % rp,  //
-           {rp.m_prefix, build(0b00, rp, 0b1011)});
+           {rp.m_prefix, build(0b00, rp, 0b1011)}, loc);
   }
 
   // =========================================================================
   // 論理演算命令
 
   /// AND r | A <- A & reg8
-  void and (const BasicReg8& r) {
+  void and (const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "AND" % r,  //
-           {build(0b10, H, r)});
+           {build(0b10, H, r)}, loc);
   }
 
   /// AND n | A <- A & constant8
-  void and (uint8_t n) {
+  void and (uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i x") % "AND" % n,  //
-           {build(0b11, H, F), n});
+           {build(0b11, H, F), n}, loc);
   }
 
   /// AND (HL) | A <- A & mem[HL]
-  void and (const RegHLAddr& hl) {
+  void and (const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "AND" % hl,  //
-           {build(0b10, H, F)});
+           {build(0b10, H, F)}, loc);
   }
 
   /// AND (IX or IY + d) | A <- A & mem[IX or IY + d]
-  void and (const IndenexReg16AddrOffset& ireg16_offset) {
+  void and (const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "AND" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, H, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// OR r | A <- A | reg8
-  void or (const BasicReg8& r) {
+  void or (const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "OR" % r,  //
-           {build(0b10, F, r)});
+           {build(0b10, F, r)}, loc);
   }
 
   /// OR n | A <- A | constant8
-  void or (uint8_t n) {
+  void or (uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i x") % "OR" % n,  //
-           {build(0b11, F, F), n});
+           {build(0b11, F, F), n}, loc);
   }
 
   /// OR (HL) | A <- A | mem[HL]
-  void or (const RegHLAddr& hl) {
+  void or (const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "OR" % hl,  //
-           {build(0b10, F, F)});
+           {build(0b10, F, F)}, loc);
   }
 
   /// OR (IX or IY + d) | A <- A | mem[IX or IY + d]
-  void or (const IndenexReg16AddrOffset& ireg16_offset) {
+  void or (const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "OR" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, F, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
 #define XZ80_XOR xor
 
   /// XOR r | A <- A ^ reg8
-  void XZ80_XOR(const BasicReg8& r) {
+  void XZ80_XOR(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "XOR" % r,  //
-           {build(0b10, L, r)});
+           {build(0b10, L, r)}, loc);
   }
 
   /// XOR n | A <- A ^ constant8
-  void XZ80_XOR(uint8_t n) {
+  void XZ80_XOR(uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i x") % "XOR" % n,  //
-           {build(0b11, L, F), n});
+           {build(0b11, L, F), n}, loc);
   }
 
   /// XOR (HL) | A <- A ^ mem[HL]
-  void XZ80_XOR(const RegHLAddr& hl) {
+  void XZ80_XOR(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "XOR" % hl,  //
-           {build(0b10, L, F)});
+           {build(0b10, L, F)}, loc);
   }
 
   /// XOR (IX or IY + d) | A <- A ^ mem[IX or IY + d]
-  void XZ80_XOR(const IndenexReg16AddrOffset& ireg16_offset) {
+  void XZ80_XOR(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "XOR" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, build(0b10, L, F),
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   /// CPL | A <- ~A
-  void cpl(void) {
+  void cpl(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CPL",  //
-           {0b0010'1111});
+           {0b0010'1111}, loc);
   }
 
   /// NEG | A <- ~A + 1
-  void neg(void) {
+  void neg(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "NEG",  //
-           {0b1110'1101, 0b0100'0100});
+           {0b1110'1101, 0b0100'0100}, loc);
   }
 
   // =========================================================================
   // ビット操作命令
 
   /// CCF | carry <- ~carry
-  void ccf(void) {
+  void ccf(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CCF",  //
-           {0b0011'1111});
+           {0b0011'1111}, loc);
   }
 
   /// SCF | carry <- 1
-  void scf(void) {
+  void scf(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "SCF",  //
-           {0b0011'0111});
+           {0b0011'0111}, loc);
   }
 
   /// BIT b, r | Z <- ~r_b
-  void bit(uint8_t b, const BasicReg8& r) {
+  void bit(uint8_t b, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "BIT %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "BIT" % b % r,  //
-           {0b1100'1011, static_cast<uint8_t>(0b0100'0000 | b << 3 | r.id)});
+           {0b1100'1011, static_cast<uint8_t>(0b0100'0000 | b << 3 | r.id)}, loc);
   }
 
   /// BIT b, (HL) | Z <- ~mem[HL]_b
-  void bit(uint8_t b, const RegHLAddr& hl) {
+  void bit(uint8_t b, const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "BIT %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "BIT" % b % hl,  //
-           {0b1100'1011, static_cast<uint8_t>(0b0100'0000 | b << 3 | 0b110)});
+           {0b1100'1011, static_cast<uint8_t>(0b0100'0000 | b << 3 | 0b110)}, loc);
   }
 
   /// BIT b, (IX or IY +d) | Z <- ~mem[IX or IY +d]_b
-  void bit(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset) {
+  void bit(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "BIT %d:out of range", b);
@@ -1900,33 +1906,33 @@ class Generator {
     append(Fmt("i d,r") % "BIT" % b % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
             ireg16_offset.getOffset(),
-            static_cast<uint8_t>(0b0100'0000 | b << 3 | 0b110)});
+            static_cast<uint8_t>(0b0100'0000 | b << 3 | 0b110)}, loc);
   }
 
   /// SET b, r | r_b <- 1
-  void set(uint8_t b, const BasicReg8& r) {
+  void set(uint8_t b, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "SET %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "SET" % b % r,  //
-           {0b1100'1011, static_cast<uint8_t>(0b1100'0000 | b << 3 | r.id)});
+           {0b1100'1011, static_cast<uint8_t>(0b1100'0000 | b << 3 | r.id)}, loc);
   }
 
   /// SET b, (HL) | mem[HL]_b <- 1
-  void set(uint8_t b, const RegHLAddr& hl) {
+  void set(uint8_t b, const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "SET %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "SET" % b % hl,  //
-           {0b1100'1011, static_cast<uint8_t>(0b1100'0000 | b << 3 | 0b110)});
+           {0b1100'1011, static_cast<uint8_t>(0b1100'0000 | b << 3 | 0b110)}, loc);
   }
 
   /// SET b, (IX or IY +d) | mem[IX or IY +d]_b <- 1
-  void set(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset) {
+  void set(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "SET %d:out of range", b);
@@ -1935,33 +1941,33 @@ class Generator {
     append(Fmt("i d,r") % "SET" % b % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
             ireg16_offset.getOffset(),
-            static_cast<uint8_t>(0b1100'0000 | b << 3 | 0b110)});
+            static_cast<uint8_t>(0b1100'0000 | b << 3 | 0b110)}, loc);
   }
 
   /// RES b, r | r_b <- 0
-  void res(uint8_t b, const BasicReg8& r) {
+  void res(uint8_t b, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "RES %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "RES" % b % r,  //
-           {0b1100'1011, static_cast<uint8_t>(0b1000'0000 | b << 3 | r.id)});
+           {0b1100'1011, static_cast<uint8_t>(0b1000'0000 | b << 3 | r.id)}, loc);
   }
 
   /// RES b, (HL) | mem[HL]_b <- 0
-  void res(uint8_t b, const RegHLAddr& hl) {
+  void res(uint8_t b, const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "RES %d:out of range", b);
       throw std::out_of_range(buf);
     }
     append(Fmt("i d,r") % "RES" % b % hl,  //
-           {0b1100'1011, static_cast<uint8_t>(0b1000'0000 | b << 3 | 0b110)});
+           {0b1100'1011, static_cast<uint8_t>(0b1000'0000 | b << 3 | 0b110)}, loc);
   }
 
   /// RES b, (IX or IY +d) | mem[IX or IY +d]_b <- 0
-  void res(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset) {
+  void res(uint8_t b, const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     if (7 < b) {
       char buf[32];
       std::sprintf(buf, "RES %d:out of range", b);
@@ -1970,92 +1976,92 @@ class Generator {
     append(Fmt("i d,r") % "RES" % b % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1100'1011,
             ireg16_offset.getOffset(),
-            static_cast<uint8_t>(0b1000'0000 | b << 3 | 0b110)});
+            static_cast<uint8_t>(0b1000'0000 | b << 3 | 0b110)}, loc);
   }
 
   // =========================================================================
   // サーチ・比較命令
 
   /// CPI | Frag <- A - mem[HL]; HL <- HL+1; BC <- BC-1;
-  void cpi(void) {
+  void cpi(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CPI",  //
-           {0b1110'1101, 0b1010'0001});
+           {0b1110'1101, 0b1010'0001}, loc);
   }
 
   /// CPIR | while BC!=0 and A!=mem[HL] { Frag <- A - mem[HL]; HL <- HL+1; BC <- BC-1; }
-  void cpir(void) {
+  void cpir(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CPIR",  //
-           {0b1110'1101, 0b1011'0001});
+           {0b1110'1101, 0b1011'0001}, loc);
   }
 
   /// CPD | Frag <- A - mem[HL]; HL <- HL-1; BC <- BC-1;
-  void cpd(void) {
+  void cpd(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CPD",  //
-           {0b1110'1101, 0b1010'1001});
+           {0b1110'1101, 0b1010'1001}, loc);
   }
 
   /// CPDR | while BC!=0 and A!=mem[HL] { Frag <- A - mem[HL]; HL <- HL-1; BC <- BC-1; }
-  void cpdr(void) {
+  void cpdr(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "CPDR",  //
-           {0b1110'1101, 0b1011'1001});
+           {0b1110'1101, 0b1011'1001}, loc);
   }
 
   /// CP r | Frag <- A - reg8
-  void cp(const BasicReg8& r) {
+  void cp(const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "CP" % r,  //
-           {build(0b10, A, r)});
+           {build(0b10, A, r)}, loc);
   }
 
   /// CP n | Frag <- A - constant8
-  void cp(uint8_t n) {
+  void cp(uint8_t n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i x") % "CP" % n,  //
-           {0b1111'1110, n});
+           {0b1111'1110, n}, loc);
   }
 
   /// CP (HL) | Frag <- A - mem[HL]
-  void cp(const RegHLAddr& hl) {
+  void cp(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "CP" % hl,  //
-           {build(0b10, A, F)});
+           {build(0b10, A, F)}, loc);
   }
 
   /// CP (IX or IY +d) | Frag <- A - mem[IX or IY +d]
-  void cp(const IndenexReg16AddrOffset& ireg16_offset) {
+  void cp(const IndenexReg16AddrOffset& ireg16_offset, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "CP" % ireg16_offset,  //
            {ireg16_offset.m_reg.m_prefix, 0b1011'1110,
-            ireg16_offset.getOffset()});
+            ireg16_offset.getOffset()}, loc);
   }
 
   // =========================================================================
   // 分岐命令
 
   /// JP nn | PC <- constant16
-  void jp(uint16_t nn) {
+  void jp(uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     MemAddr addr(nn);
     append(Fmt("i x") % "JP" % nn,  //
-           {0b1100'0011, addr.l, addr.h});
+           {0b1100'0011, addr.l, addr.h}, loc);
   }
-  void jp(const std::string& label) {
+  void jp(const std::string& label, const SourceLoc& loc = SourceLoc()) {
     MemAddr addr(label);
     append(Fmt("i s") % "JP" % label,  //
-           {0b1100'0011, addr.l, addr.h});
+           {0b1100'0011, addr.l, addr.h}, loc);
     resolve(label, 1);
   }
 
   /// JP cc,nn | PC <- constant16 if cc
-  void jp(const CondBase& cc, uint16_t nn) {
+  void jp(const CondBase& cc, uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     MemAddr addr(nn);
     append(Fmt("i c,x") % "JP" % cc % nn,  //
-           {build(0b11, cc, 0b010), addr.l, addr.h});
+           {build(0b11, cc, 0b010), addr.l, addr.h}, loc);
   }
-  void jp(const CondBase& cc, const std::string& label) {
+  void jp(const CondBase& cc, const std::string& label, const SourceLoc& loc = SourceLoc()) {
     MemAddr addr(label);
     append(Fmt("i c,s") % "JP" % cc % label,  //
-           {build(0b11, cc, 0b010), addr.l, addr.h});
+           {build(0b11, cc, 0b010), addr.l, addr.h}, loc);
     resolve(label, 1);
   }
 
   /// JR e | PC <- PC + e
-  void jr(int16_t e) {
+  void jr(int16_t e, const SourceLoc& loc = SourceLoc()) {
     if (e < -126 || 129 < e) {
       char buf[32];
       std::sprintf(buf, "JR %d:out of range", e);
@@ -2063,16 +2069,16 @@ class Generator {
     }
     const int offset = static_cast<int>(e) - 2;
     append(Fmt("i o") % "JR" % e,  //
-           {0b0001'1000, static_cast<uint8_t>(offset)});
+           {0b0001'1000, static_cast<uint8_t>(offset)}, loc);
   }
-  void jr(const std::string& label) {
+  void jr(const std::string& label, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i s") % "JR" % label,  //
-           {0b0001'1000, 0x00});
+           {0b0001'1000, 0x00}, loc);
     resolve(label, 1, true);
   }
 
   /// JR cc,e | PC <- PC + e if cc
-  void jr(const AllCond& cc, int16_t e) {
+  void jr(const AllCond& cc, int16_t e, const SourceLoc& loc = SourceLoc()) {
     if (e < -126 || 129 < e) {
       char buf[32];
       std::sprintf(buf, "JR %d:out of range", e);
@@ -2080,28 +2086,28 @@ class Generator {
     }
     const int offset = static_cast<int>(e) - 2;
     append(Fmt("i c,o") % "JR" % cc % e,  //
-           {build(0b0010'0000, cc), static_cast<uint8_t>(offset)});
+           {build(0b0010'0000, cc), static_cast<uint8_t>(offset)}, loc);
   }
-  void jr(const AllCond& cc, const std::string& label) {
+  void jr(const AllCond& cc, const std::string& label, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i c,s") % "JR" % cc % label,  //
-           {build(0b0010'0000, cc), 0x00});
+           {build(0b0010'0000, cc), 0x00}, loc);
     resolve(label, 1, true);
   }
 
   /// JP (HL) | PC <- mem[HL]
-  void jp(const RegHLAddr& hl) {
+  void jp(const RegHLAddr& hl, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "JP" % hl,  //
-           {0b1110'1001});
+           {0b1110'1001}, loc);
   }
 
   /// JP (IX or IY) | PC <- mem[IX or IY]
-  void jp(const IndenexReg16Addr& rp) {
+  void jp(const IndenexReg16Addr& rp, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r") % "JP" % rp,  //
-           {rp.m_reg.m_prefix, 0b1110'1001});
+           {rp.m_reg.m_prefix, 0b1110'1001}, loc);
   }
 
   /// DJNZ e | if B!=0 then PC <- PC + e; B <- B -1; end
-  void djnz(int16_t e) {
+  void djnz(int16_t e, const SourceLoc& loc = SourceLoc()) {
     if (e < -126 || 129 < e) {
       char buf[32];
       std::sprintf(buf, "DJNZ %d:out of range", e);
@@ -2109,69 +2115,69 @@ class Generator {
     }
     const int offset = static_cast<int>(e) - 2;
     append(Fmt("i o") % "DJNZ" % e,  //
-           {0b0001'0000, static_cast<uint8_t>(offset)});
+           {0b0001'0000, static_cast<uint8_t>(offset)}, loc);
   }
-  void djnz(const std::string& label) {
+  void djnz(const std::string& label, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i s") % "DJNZ" % label,  //
-           {0b0001'0000, 0x00});
+           {0b0001'0000, 0x00}, loc);
     resolve(label, 1, true);
   }
 
   /// CALL nn | mem[SP-1] <- PCH; mem[SP-2] <- PCL;
   ///         | SP <- SP - 2; PC <- constant16;
-  void call(uint16_t nn) {
+  void call(uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     const MemAddr ad(nn);
     append(Fmt("i x") % "CALL" % nn,  //
-           {0b1100'1101, ad.l, ad.h});
+           {0b1100'1101, ad.l, ad.h}, loc);
   }
-  void call(const std::string& label) {
+  void call(const std::string& label, const SourceLoc& loc = SourceLoc()) {
     const MemAddr ad(label);
     append(Fmt("i s") % "CALL" % label,  //
-           {0b1100'1101, ad.l, ad.h});
+           {0b1100'1101, ad.l, ad.h}, loc);
     resolve(label, 1);
   }
 
   /// CALL cc, nn | if cc then mem[SP-1] <- PCH; mem[SP-2] <- PCL;
   ///             | SP <- SP - 2; PC <- constant16; end
-  void call(const CondBase& cc, uint16_t nn) {
+  void call(const CondBase& cc, uint16_t nn, const SourceLoc& loc = SourceLoc()) {
     const MemAddr ad(nn);
     append(Fmt("i c,x") % "CALL" % cc % nn,  //
-           {build(0b11, cc, 0b100), ad.l, ad.h});
+           {build(0b11, cc, 0b100), ad.l, ad.h}, loc);
   }
-  void call(const CondBase& cc, const std::string& label) {
+  void call(const CondBase& cc, const std::string& label, const SourceLoc& loc = SourceLoc()) {
     const MemAddr ad(label);
     append(Fmt("i c,s") % "CALL" % cc % label,  //
-           {build(0b11, cc, 0b100), ad.l, ad.h});
+           {build(0b11, cc, 0b100), ad.l, ad.h}, loc);
     resolve(label, 1);
   }
 
   /// RET | PCL <- mem[SP]; PCH <- mem[SP+1]; SP <- SP+2
-  void ret(void) {
+  void ret(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RET",  //
-           {0b1100'1001});
+           {0b1100'1001}, loc);
   }
 
   /// RET cc | if cc then PCL <- mem[SP]; PCH <- mem[SP+1]; SP <- SP+2; end
-  void ret(const CondBase& cc) {
+  void ret(const CondBase& cc, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i c") % "RET" % cc,  //
-           {build(0b11, cc, 0b000)});
+           {build(0b11, cc, 0b000)}, loc);
   }
 
   /// RETI | PCL <- mem[SP]; PCH <- mem[SP+1]; SP <- SP+2; IFF1 <- IFF2
-  void reti(void) {
+  void reti(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RETI",  //
-           {0b1110'1101, 0b0100'1101});
+           {0b1110'1101, 0b0100'1101}, loc);
   }
 
   /// RETN | PCL <- mem[SP]; PCH <- mem[SP+1]; SP <- SP+2; IFF1 <- IFF2
-  void retn(void) {
+  void retn(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RETN",  //
-           {0b1110'1101, 0b0100'0101});
+           {0b1110'1101, 0b0100'0101}, loc);
   }
 
   /// RST p | mem[SP-1] <- PCH; mem[SP-2] <- PCL; SP <- SP-2; PC <- p
   ///       | Only p = 0, 8, 16, 24, 32, 40, 48, 56
-  void rst(uint16_t p) {
+  void rst(uint16_t p, const SourceLoc& loc = SourceLoc()) {
     if (p % 8 != 0 || 7 * 8 < p) {
       char buf[32];
       std::sprintf(buf, "RST 0%xh:invalid argument", p);
@@ -2179,7 +2185,7 @@ class Generator {
     }
     const uint8_t insn = 0b1100'0111 | p;
     append(Fmt("i x") % "RST" % p,  //
-           {insn});
+           {insn}, loc);
   }
 
   // =========================================================================
@@ -2189,31 +2195,31 @@ class Generator {
   // 動作・割り込み設定命令
 
   /// NOP | Do nothing.
-  void nop(void) {
+  void nop(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "NOP",  //
-           {0b0000'0000});
+           {0b0000'0000}, loc);
   }
 
   /// HALT | Halt.
-  void halt(void) {
+  void halt(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "HALT",  //
-           {0b0111'0110});
+           {0b0111'0110}, loc);
   }
 
   /// DI | Disable interrupt.
-  void di(void) {
+  void di(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "DI",  //
-           {0b1111'0011});
+           {0b1111'0011}, loc);
   }
 
   /// EI | Enable interrupt.
-  void ei(void) {
+  void ei(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "EI",  //
-           {0b1111'1011});
+           {0b1111'1011}, loc);
   }
 
   /// IM 0 or 1 or 2 | Interrupt mode 0 or 1 or 2
-  void im(uint8_t m) {
+  void im(uint8_t m, const SourceLoc& loc = SourceLoc()) {
     const uint8_t code[3] = {
         0b010'00'110,
         0b010'10'110,
@@ -2222,108 +2228,806 @@ class Generator {
     if (2 < m) {
       char buf[32];
       std::sprintf(buf, "IM %d:invalid argument", m);
+      throw std::invalid_argument(buf);
     }
     append(Fmt("i d") % "IM" % m,  //
-           {0b1110'1101, code[m]});
+           {0b1110'1101, code[m]}, loc);
   }
 
   // -------------------------------------------------------------------------
   // 入力命令
 
   /// IN A, (n) | A <- io[constant8]
-  void in(const RegA& a, const IoAddr& n) {
+  void in(const RegA& a, const IoAddr& n, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,I") % "IN" % a % n,  //
-           {0b1101'1011, n.addr});
+           {0b1101'1011, n.addr}, loc);
   }
 
   /// IN r, (C) | reg8 <- io[C]
-  void in(const BasicReg8& r, const RegCAddr& c) {
+  void in(const BasicReg8& r, const RegCAddr& c, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "IN" % r % c,  //
-           {0b1110'1101, build(0b01, r, B)});
+           {0b1110'1101, build(0b01, r, B)}, loc);
   }
 
   /// INI | mem[HL] <- io[C]; B <- B-1; HL <- HL+1;
-  void ini(void) {
+  void ini(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "INI",  //
-           {0b1110'1101, 0b1010'0010});
+           {0b1110'1101, 0b1010'0010}, loc);
   }
 
   /// INIR | while B!=0 { mem[HL] <- io[C]; B <- B-1; HL <- HL+1; }
-  void inir(void) {
+  void inir(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "INIR",  //
-           {0b1110'1101, 0b1011'0010});
+           {0b1110'1101, 0b1011'0010}, loc);
   }
 
   /// IND | mem[HL] <- io[C]; B <- B-1; HL <- HL-1;
-  void ind(void) {
+  void ind(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "IND",  //
-           {0b1110'1101, 0b1010'1010});
+           {0b1110'1101, 0b1010'1010}, loc);
   }
 
   /// INDR | while B!=0 { mem[HL] <- io[C]; B <- B-1; HL <- HL-1; }
-  void indr(void) {
+  void indr(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "INDR",  //
-           {0b1110'1101, 0b1011'1010});
+           {0b1110'1101, 0b1011'1010}, loc);
   }
 
   // -------------------------------------------------------------------------
   // 出力命令
 
   /// OUT (n), A | io[constant8] <- A
-  void out(const IoAddr& n, const RegA& a) {
+  void out(const IoAddr& n, const RegA& a, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i I,r") % "OUT" % n % a,  //
-           {0b1101'0011, n.addr});
+           {0b1101'0011, n.addr}, loc);
   }
 
   /// OUT (C), r | io[C] <- reg8
-  void out(const RegCAddr& c, const BasicReg8& r) {
+  void out(const RegCAddr& c, const BasicReg8& r, const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i r,r") % "OUT" % c % r,  //
-           {0b1110'1101, build(0b01, r, C)});
+           {0b1110'1101, build(0b01, r, C)}, loc);
   }
 
   /// OUTI | io[C] <- mem[HL]; B <- B-1; HL <- HL+1;
-  void outi(void) {
+  void outi(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "OUTI",  //
-           {0b1110'1101, 0b1010'0011});
+           {0b1110'1101, 0b1010'0011}, loc);
   }
 
   /// OTIR | while B!=0 { io[C] <- mem[HL]; B <- B-1; HL <- HL+1; }
-  void otir(void) {
+  void otir(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "OTIR",  //
-           {0b1110'1101, 0b1011'0011});
+           {0b1110'1101, 0b1011'0011}, loc);
   }
 
   /// OUTD | io[C] <- mem[HL]; B <- B-1; HL <- HL-1;
-  void outd(void) {
+  void outd(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "OUTD",  //
-           {0b1110'1101, 0b1010'1011});
+           {0b1110'1101, 0b1010'1011}, loc);
   }
 
   /// OTDR | while B!=0 { io[C] <- mem[HL]; B <- B-1; HL <- HL-1; }
-  void otdr(void) {
+  void otdr(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "OTDR",  //
-           {0b1110'1101, 0b1011'1011});
+           {0b1110'1101, 0b1011'1011}, loc);
   }
 
   // =========================================================================
   // BCD命令
 
   /// DAA | Decimal Adjust Accumulator
-  void daa(void) {
+  void daa(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "DAA",  //
-           {0b0010'0111});
+           {0b0010'0111}, loc);
   }
 
   /// RLD | BCD left shift
-  void rld(void) {
+  void rld(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RLD",  //
-           {0b1110'1101, 0b0110'1111});
+           {0b1110'1101, 0b0110'1111}, loc);
   }
 
   /// RRD | BCD right shift
-  void rrd(void) {
+  void rrd(const SourceLoc& loc = SourceLoc()) {
     append(Fmt("i") % "RRD",  //
-           {0b1110'1101, 0b0110'0111});
+           {0b1110'1101, 0b0110'0111}, loc);
   }
 };
+
+// =======================================================================
+// エミュレータ
+
+namespace Emu {
+/// フラグレジスタのビット
+enum Flag : uint8_t {
+  F_C = 0x01,   ///< Carry
+  F_N = 0x02,   ///< Add/Subtract
+  F_PV = 0x04,  ///< Parity/Overflow
+  F_X = 0x08,   ///< 未定義(結果のビット3)
+  F_H = 0x10,   ///< Half Carry
+  F_Y = 0x20,   ///< 未定義(結果のビット5)
+  F_Z = 0x40,   ///< Zero
+  F_S = 0x80,   ///< Sign
+};
+
+/// Z80 のレジスタ
+struct Regs {
+  uint8_t a, f;
+  uint16_t bc, de, hl;
+  uint16_t af2, bc2, de2, hl2;  ///< 裏レジスタ
+  uint16_t ix, iy, sp, pc;
+  uint8_t i, r;
+  uint8_t im;  ///< 割り込みモード(0..2)
+  bool iff1, iff2;
+  bool halted;  ///< HALT で停止中
+
+  uint16_t af(void) const { return static_cast<uint16_t>(a << 8 | f); }
+};
+
+class Snapshot;
+class Profile;
+class CallTrace;
+class Coverage;
+class IoTrace;
+
+/// Z80 のインタプリタ
+///
+/// 64KB のアドレス空間を 256 バイトのページに分け、ページ毎に
+/// ホストのメモリを割り当てるか、コールバックで読み書きする。
+/// 既定では全ページを内蔵の 64KB の RAM に割り当てる。
+///
+/// run() の実行中はレジスタをローカル変数に置き、命令毎の T-states を
+/// テーブルと条件成立時の加算で数える。
+///
+/// E_Translate では分岐までの命令の並び(ブロック)をデコード済みの
+/// ハンドラの列に翻訳し、開始アドレスでキャッシュする。ブロックのバイト列への
+/// 書き込みでそのブロックを捨てるので、自己書き換えにも追従する。書き換えの
+/// 多いページは翻訳せずに1命令ずつ実行する。
+/// 命令の実行はインタプリタと共通で、T-states と割り込みの受け付けの
+/// タイミングは同じ。
+class Machine {
+ public:
+  static const unsigned PageBits = 8;
+  static const unsigned PageSize = 1u << PageBits;
+  static const unsigned NumPages = 0x10000u >> PageBits;
+
+  typedef std::function<uint8_t(uint16_t addr)> ReadFunc;
+  typedef std::function<void(uint16_t addr, uint8_t value)> WriteFunc;
+
+  /// run() が戻った理由
+  enum StopReason {
+    S_Budget,   ///< 指定した T-states を実行した
+    S_Halt,     ///< HALT で停止した
+    S_Request,  ///< stop() が呼ばれた
+  };
+
+  /// 実行方式
+  enum Engine {
+    E_Interpret,  ///< 1命令ずつデコードして実行する
+    E_Translate,  ///< ブロック単位で翻訳してキャッシュする
+  };
+
+ private:
+  static const size_t MaxBlockInsns = 64;  ///< 1ブロックの最大命令数
+  static const uint8_t MaxPrefixes = 8;    ///< 翻訳する DD/FD の最大の連続数
+  static const size_t MaxDeadBlocks = 1024;  ///< run() の途中で解放する無効なブロックの数
+  static const uint32_t HotRewrites = 32;   ///< これを超えてコードを書き換えたページは翻訳しない
+
+  struct Core;
+  struct Insn;
+  friend struct HandlerTable;
+  typedef void (*Handler)(Core& c, const Insn& insn);
+
+  /// 翻訳済みの1命令
+  struct Insn {
+    Handler handler;   ///< 先頭のバイトに特化した実行関数
+    uint8_t bytes[4];  ///< プレフィックスの後のバイト列
+    uint8_t length;    ///< bytes の有効なバイト数
+    uint8_t prefixes;  ///< DD/FD の数
+    uint8_t index;     ///< 0: HL, 1: IX, 2: IY
+  };
+
+  /// 翻訳済みのブロック
+  struct Block {
+    uint16_t start;
+    uint16_t size;  ///< バイト数
+    bool valid;  ///< 書き込みで無効になったら false (次の run() で解放する)
+    std::vector<Insn> insns;
+  };
+
+  Regs m_regs;
+  uint64_t m_tstates;  ///< 累計の T-states
+  std::vector<uint8_t> m_ram;
+  uint8_t* m_read[NumPages];   ///< 読み出し先(nullptr は m_memRead)
+  uint8_t* m_write[NumPages];  ///< 書き込み先(nullptr は m_memWrite)
+  uint8_t* m_direct[NumPages];  ///< 書き込みを writeSlow() で捕まえる必要のないページの書き込み先
+  /// 内蔵の RAM のページ毎の、直前の snapshot()/restore() の時点の内容
+  /// (nullptr はその後に書き込んだページ)
+  std::shared_ptr<const uint8_t> m_base[NumPages];
+  ReadFunc m_memRead;
+  WriteFunc m_memWrite;
+  ReadFunc m_in;
+  WriteFunc m_out;
+
+  bool m_irq;        ///< 保留中の割り込み
+  uint8_t m_irqData;  ///< 割り込み応答時のデータバスの値
+  bool m_nmi;        ///< 保留中のノンマスカブル割り込み
+  bool m_eiDelay;    ///< 直前が EI で、割り込みを受け付けない
+  bool m_haltStops;  ///< HALT で run() から戻るか
+  bool m_stop;       ///< stop() が呼ばれた
+  StopReason m_reason;
+
+  Engine m_engine;
+  std::vector<std::unique_ptr<Block>> m_blocks;
+  std::vector<Block*> m_blockAt;  ///< 開始アドレスからブロック(最初の翻訳で確保する)
+  std::vector<Block*> m_pageBlocks[NumPages];  ///< ページにバイト列を含むブロック
+  std::vector<uint64_t> m_code;  ///< 有効なブロックのバイト列のアドレス(1アドレス1ビット)
+  uint32_t m_rewrites[NumPages];  ///< ページ毎のコードを書き換えた回数
+  size_t m_deadBlocks;            ///< 無効になったが未解放のブロック数
+  uint64_t m_translations;        ///< 翻訳したブロックの累計
+
+  Profile* m_profile;
+  CallTrace* m_callTrace;
+  Coverage* m_coverage;
+  IoTrace* m_ioTrace;
+
+  uint8_t readSlow(uint16_t addr);
+  void writeSlow(uint16_t addr, uint8_t value);
+  uint8_t in(uint16_t port);
+  void out(uint16_t port, uint8_t value);
+
+  /// p を含む内蔵の RAM のページ(内蔵の RAM でなければ NumPages)
+  unsigned ramPage(const uint8_t* p) const;
+  /// 翻訳済みのコードを除いた、ページ page の m_direct の値
+  uint8_t* directWrite(unsigned page) const;
+  bool isCode(uint16_t addr) const {
+    return !m_code.empty() && ((m_code[addr >> 6] >> (addr & 63)) & 1);
+  }
+  /// ページ page の m_code を有効なブロックから作り直す
+  void markCode(unsigned page);
+  /// addr をバイト列に含むブロックを捨てる
+  void invalidateCode(uint16_t addr);
+  void invalidatePage(unsigned page);
+  void purgeBlocks(void);
+  Block* translate(uint16_t addr);
+  /// Traced が true の場合は命令毎に traceInsn() を呼ぶ
+  template <bool Traced>
+  void runInterpreted(uint64_t end);
+  template <bool Traced>
+  void runTranslated(uint64_t end);
+  bool traced(void) const { return m_profile || m_coverage; }
+  void traceInsn(uint16_t pc, uint32_t tstates);
+
+ public:
+  Machine();
+  ~Machine();
+  Machine(const Machine&) = delete;
+  Machine& operator=(const Machine&) = delete;
+
+  /// レジスタを初期状態(PC=0, SP=0FFFFh, 割り込み禁止, IM 0)にし、
+  /// 保留中の割り込みと T-states を消す。メモリはそのまま
+  void reset(void);
+
+  Regs& regs(void) { return m_regs; }
+  const Regs& regs(void) const { return m_regs; }
+
+  /// リセットからの累計 T-states
+  uint64_t tstates(void) const { return m_tstates; }
+
+  /// 内蔵の 64KB の RAM
+  ///
+  /// 直接書き換えた場合は invalidate() を呼ぶ(E_Translate で実行したコードと
+  /// snapshot() で共有するページを更新する)。
+  uint8_t* ram(void) { return m_ram.data(); }
+
+  /// ページの割り当てを通して1バイト読み書きする(T-states は進めない)
+  uint8_t peek(uint16_t addr);
+  void poke(uint16_t addr, uint8_t value);
+
+  /// バイト列を addr から書き込む
+  void load(uint16_t addr, const uint8_t* data, size_t size);
+
+  /// Generator の生成結果を開始アドレスに書き込み、PC を開始アドレスにする
+  void load(const Generator& g);
+
+  /// [addr, addr + size) のページをホストのメモリ mem に割り当てる
+  ///
+  /// addr と size はページ単位に切り下げ・切り上げる。writable が false の
+  /// ページへの書き込みは書き込みコールバックに渡す(なければ捨てる)。
+  void map(uint16_t addr, size_t size, uint8_t* mem, bool writable = true);
+
+  /// [addr, addr + size) のページの読み書きをコールバックで行う
+  void unmap(uint16_t addr, size_t size);
+
+  /// 割り当てのないページの読み書きを行うコールバック
+  ///
+  /// 読み出しのコールバックが無い場合は 0FFh を読む。
+  void onMemory(ReadFunc read, WriteFunc write) {
+    m_memRead = std::move(read);
+    m_memWrite = std::move(write);
+  }
+
+  /// IN/OUT のコールバック(ポートは16ビットのアドレスバスの値)
+  ///
+  /// 呼び出し時点の tstates() は命令の先頭の値。IN のコールバックが
+  /// 無い場合は 0FFh を読む。
+  void onIo(ReadFunc in, WriteFunc out) {
+    m_in = std::move(in);
+    m_out = std::move(out);
+  }
+
+  /// 割り込みを要求する。受け付けられるまで保留する
+  /// @param data 割り込み応答時のデータバスの値(IM 0 の命令、IM 2 のベクタ下位)
+  void interrupt(uint8_t data = 0xff) {
+    m_irq = true;
+    m_irqData = data;
+  }
+
+  /// ノンマスカブル割り込みを要求する
+  void nmi(void) { m_nmi = true; }
+
+  /// HALT で run() から戻るか(既定は true)
+  ///
+  /// false の場合、HALT 中は割り込みが来るまで NOP を実行して T-states を進める。
+  void haltStops(bool enable) { m_haltStops = enable; }
+
+  /// 実行中の run() を現在の命令の後で終了させる(コールバックから呼ぶ)
+  void stop(void) { m_stop = true; }
+
+  /// budget T-states 以上になるまで命令を実行する
+  /// @return 実行した T-states
+  uint64_t run(uint64_t budget);
+
+  /// 1命令(または割り込みの受け付け)を実行する
+  /// @return 実行した T-states
+  uint64_t step(void) { return run(1); }
+
+  /// 直前の run() が戻った理由
+  StopReason reason(void) const { return m_reason; }
+
+  /// 実行方式を選ぶ(既定は E_Interpret)
+  void engine(Engine e) { m_engine = e; }
+  Engine engine(void) const { return m_engine; }
+
+  /// 翻訳済みのブロックを全て捨て、内蔵の RAM を全て書き換えたものとして扱う
+  void invalidate(void);
+
+  /// レジスタ、T-states、保留中の割り込みと内蔵の RAM の状態を保存する(run() の外で呼ぶ)
+  ///
+  /// 前回の snapshot()/restore() から書き込みのないページはその時のページを共有し、
+  /// 書き込んだページだけを複製する。
+  Snapshot snapshot(void);
+
+  /// snapshot の状態に戻す
+  ///
+  /// 内蔵の RAM は、snapshot と共有していないページだけを書き戻す。
+  /// map() で割り当てたホストのメモリとコールバックの先の状態は戻さない。
+  void restore(const Snapshot& snapshot);
+
+  /// キャッシュしている翻訳済みのブロック数
+  size_t numBlocks(void) const { return m_blocks.size() - m_deadBlocks; }
+
+  /// これまでに翻訳したブロックの数(捨てたものを含む)
+  uint64_t translations(void) const { return m_translations; }
+
+  /// 実行した命令の回数と T-states を profile に加える(nullptr で止める)
+  void profile(Profile* profile) { m_profile = profile; }
+
+  /// CALL/RST/RET と割り込みを trace に記録する(nullptr で止める)
+  void callTrace(CallTrace* trace);
+
+  /// 実行した命令の先頭アドレスを coverage に記録する(nullptr で止める)
+  void coverage(Coverage* coverage) { m_coverage = coverage; }
+
+  /// IN/OUT のアクセスを trace に記録する(nullptr で止める)
+  void ioTrace(IoTrace* trace);
+};
+
+/// Machine::snapshot() で保存した状態
+///
+/// 内蔵の RAM は Machine::PageSize 単位の読み出し専用のページで持ち、
+/// 同じ Machine から取った他のスナップショットと変更のないページを共有する。
+/// コピーはページの参照を複製するだけで、1つの状態から多数のテストを
+/// 始める場合に使う。
+class Snapshot {
+  friend class Machine;
+
+  Regs m_regs;
+  uint64_t m_tstates;
+  bool m_irq;
+  uint8_t m_irqData;
+  bool m_nmi;
+  bool m_eiDelay;
+  std::shared_ptr<const uint8_t> m_pages[Machine::NumPages];
+
+  Snapshot();
+
+ public:
+  /// save() で保存したファイルを読み込む
+  ///
+  /// RAM はファイルをメモリに割り当てたまま参照する(restore() で書き戻すページだけを読む)。
+  /// 形式の誤りは std::runtime_error を送出する
+  explicit Snapshot(const char* fn);
+
+  const Regs& regs(void) const { return m_regs; }
+  uint64_t tstates(void) const { return m_tstates; }
+
+  uint8_t peek(uint16_t addr) const {
+    return m_pages[addr >> Machine::PageBits].get()[addr & (Machine::PageSize - 1)];
+  }
+
+  /// other と共有しているページの数
+  size_t sharedPages(const Snapshot& other) const;
+
+  /// RAM をページ境界(4KB)に置いた形式で保存する
+  void save(const char* fn) const;
+};
+
+/// 同じ開始状態からのプログラムを多数の入力で実行する
+///
+/// スレッド毎に1つの Machine を持ち、インスタンス毎に開始状態に restore() し、
+/// 入力を設定して HALT か budget() まで実行する。restore() は書き込んだページだけを
+/// 書き戻すので、E_Translate の翻訳済みのブロックもインスタンスの間で再利用する。
+/// インスタンスはスレッド毎の区間に分け、区間を終えたスレッドは他のスレッドの
+/// 残りから少しずつ取って実行する。
+class Batch {
+ public:
+  /// インスタンス index の入力の設定や、実行後の結果の読み出しを行う
+  typedef std::function<void(Machine& m, size_t index)> InstanceFunc;
+
+  /// インスタンス毎の実行後の状態(レジスタ毎の配列で、添字はインスタンスの番号)
+  struct Results {
+    std::vector<uint8_t> a, f;
+    std::vector<uint16_t> bc, de, hl, ix, iy, sp, pc;
+    std::vector<uint64_t> tstates;  ///< 開始状態から実行した T-states
+    std::vector<uint8_t> reason;    ///< Machine::StopReason
+
+    size_t size(void) const { return a.size(); }
+  };
+
+ private:
+  static const size_t Chunk = 16;  ///< 1回に取るインスタンスの数
+
+  Snapshot m_start;
+  Machine::Engine m_engine;
+  uint64_t m_budget;
+  std::function<void(Machine& m)> m_setup;
+
+ public:
+  explicit Batch(const Snapshot& start)
+      : m_start(start), m_engine(Machine::E_Translate), m_budget(1000000), m_setup() {}
+
+  /// 実行方式(既定は E_Translate)
+  void engine(Machine::Engine e) { m_engine = e; }
+
+  /// 1インスタンス当たりの最大の T-states (既定は 1000000)
+  void budget(uint64_t budget) { m_budget = budget; }
+
+  /// スレッド毎の Machine を最初に1度だけ設定する(コールバックの登録など)
+  void setup(std::function<void(Machine& m)> setup) { m_setup = std::move(setup); }
+
+  /// n 個のインスタンスを実行する
+  ///
+  /// init と done は複数のスレッドから同時に呼ばれる。init か done が
+  /// 送出した例外は残りを中止して run() から送出する。
+  /// @param init 開始状態に戻した後、実行前に呼ぶ
+  /// @param done 実行後に呼ぶ(nullptr 可)
+  /// @param threads スレッド数(0 は CPU のコア数)
+  Results run(size_t n, const InstanceFunc& init, const InstanceFunc& done = nullptr,
+              unsigned threads = 0) const;
+};
+
+/// 命令の先頭アドレス毎の実行回数と T-states
+///
+/// Machine::profile() で登録すると、命令毎に配列の2つの要素を加算する。
+/// 割り込みの受け付けと、HALT で割り込みを待つ間の T-states は含まない。
+class Profile {
+  std::vector<uint64_t> m_counts;
+  std::vector<uint64_t> m_tstates;
+
+ public:
+  Profile() : m_counts(0x10000), m_tstates(0x10000) {}
+
+  void clear(void) {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    std::fill(m_tstates.begin(), m_tstates.end(), 0);
+  }
+
+  void add(uint16_t pc, uint32_t tstates) {
+    ++m_counts[pc];
+    m_tstates[pc] += tstates;
+  }
+
+  /// addr から始まる命令の実行回数
+  uint64_t count(uint16_t addr) const { return m_counts[addr]; }
+
+  /// addr から始まる命令の延べ T-states
+  uint64_t tstates(uint16_t addr) const { return m_tstates[addr]; }
+
+  /// 全命令の延べ T-states
+  uint64_t totalTStates(void) const;
+
+  /// g のラベルの範囲毎と命令毎に集計し、T-states の多い順に出力する
+  /// @param top 出力する最大の行数(ラベル、命令それぞれ)
+  void report(std::ostream& os, const Generator& g, size_t top = 20) const;
+
+  /// g の命令毎に T-states と実行回数を付けたリスティングを出力する
+  void listing(std::ostream& os, const Generator& g) const;
+};
+
+/// CALL/RST/割り込みとその RET から作る呼び出しの木とタイムライン
+///
+/// RET は、呼び出し時の SP と一致するフレームまでを閉じる。スタックを
+/// 直接操作して戻らなかったフレームもそこで閉じ、一致するフレームが
+/// 無い RET(PUSH と RET による分岐など)は無視する。
+class CallTrace {
+ public:
+  /// フレームの種類
+  enum Kind : uint8_t {
+    K_Call,  ///< CALL
+    K_Rst,   ///< RST
+    K_Int,   ///< マスカブル割り込み
+    K_Nmi,   ///< ノンマスカブル割り込み
+  };
+
+  /// 呼び出しの木のノード(呼び出し経路毎)
+  struct Node {
+    uint16_t addr;       ///< 呼び出し先
+    Kind kind;
+    size_t parent;       ///< 親のノードの番号(根は自身)
+    uint64_t calls;      ///< 呼び出し回数
+    uint64_t inclusive;  ///< 子を含む延べ T-states
+    uint64_t children;   ///< 子の inclusive の合計
+    std::map<uint32_t, size_t> childIndex;  ///< (kind << 16 | addr) から子のノード番号
+
+    /// 子を除く延べ T-states
+    uint64_t exclusive(void) const { return inclusive - children; }
+  };
+
+  /// 閉じたフレーム
+  struct Event {
+    size_t node;
+    uint64_t start;  ///< 開始時の T-states
+    uint64_t end;    ///< 終了時の T-states
+    uint32_t depth;
+  };
+
+ private:
+  struct Frame {
+    size_t node;
+    uint16_t sp;  ///< 戻りアドレスを積んだ後の SP
+    uint64_t start;
+  };
+
+  std::vector<Node> m_nodes;  ///< [0] は根(呼び出しの外)
+  std::vector<Frame> m_stack;
+  std::vector<Event> m_events;
+  size_t m_maxEvents;
+  uint64_t m_dropped;  ///< m_maxEvents を超えて捨てたイベントの数
+  uint64_t m_origin;   ///< 記録を始めた T-states
+  uint64_t m_last;     ///< 最後に記録した T-states
+
+  void close(uint64_t t);
+  std::string name(const Node& node, const std::map<uint16_t, std::string>& labels) const;
+  static std::map<uint16_t, std::string> labelNames(const Generator& g);
+
+ public:
+  /// @param maxEvents タイムラインに残すフレームの最大数
+  explicit CallTrace(size_t maxEvents = 1u << 20);
+
+  /// 記録を消し、t から記録を始める
+  void start(uint64_t t);
+
+  /// 呼び出し先 addr に入った(sp は戻りアドレスを積んだ後)
+  void enter(uint16_t addr, uint16_t sp, uint64_t t, Kind kind);
+
+  /// RET で戻った(sp は戻りアドレスを取り出した後)
+  void leave(uint16_t sp, uint64_t t);
+
+  /// 開いているフレームを全て t で閉じる(出力の前に呼ぶ)
+  void finish(uint64_t t);
+
+  const std::vector<Node>& nodes(void) const { return m_nodes; }
+  const std::vector<Event>& events(void) const { return m_events; }
+  uint64_t dropped(void) const { return m_dropped; }
+
+  /// 呼び出しの木を字下げして、inclusive/exclusive の T-states と回数を出力する
+  void tree(std::ostream& os, const Generator& g) const;
+
+  /// flamegraph.pl の collapsed-stack 形式(値は exclusive の T-states)
+  void collapsed(std::ostream& os, const Generator& g) const;
+
+  /// Chrome の trace-event 形式(JSON)
+  /// @param mhz CPU のクロック(ts, dur をマイクロ秒にする。args に T-states も入れる)
+  void chromeTrace(std::ostream& os, const Generator& g, double mhz = 3.579545) const;
+};
+
+/// 実行した命令の先頭アドレスのビットマップ(バンク毎に 64K ビット)
+///
+/// バンク切り替えのあるシステムでは、切り替えの度に bank() でページと
+/// バンクの対応を更新する。複数の実行の結果は merge() で OR を取って
+/// まとめる(ファイルを介して別プロセスの結果もまとめられる)。
+class Coverage {
+  static const size_t WordsPerBank = 0x10000 / 64;
+
+  unsigned m_banks;
+  std::vector<uint64_t> m_bits;
+  uint16_t m_pageBank[Machine::NumPages];  ///< ページ毎のバンク番号
+
+ public:
+  explicit Coverage(unsigned banks = 1);
+
+  unsigned banks(void) const { return m_banks; }
+
+  void clear(void) { std::fill(m_bits.begin(), m_bits.end(), 0); }
+
+  /// [addr, addr + size) のページで実行した命令をバンク bank に記録する
+  void bank(uint16_t addr, size_t size, unsigned bank);
+
+  void mark(uint16_t pc) {
+    const size_t w = m_pageBank[pc >> Machine::PageBits] * WordsPerBank + (pc >> 6);
+    m_bits[w] |= uint64_t(1) << (pc & 63);
+  }
+
+  bool covered(uint16_t addr, unsigned bank = 0) const {
+    return (m_bits[bank * WordsPerBank + (addr >> 6)] >> (addr & 63)) & 1;
+  }
+
+  /// バンク bank で実行したアドレスの数
+  size_t count(unsigned bank = 0) const;
+
+  /// other の結果を加える(バンク数が同じであること)
+  void merge(const Coverage& other);
+
+  /// save() で保存した結果を加える
+  void merge(const char* fn);
+
+  void save(const char* fn) const;
+
+  /// g の命令(DB/DW などのデータを除く)のうち、バンク bank で実行されなかった
+  /// 命令と、範囲内の命令が1つも実行されなかったラベルを出力する
+  /// @return 実行されなかった命令の数
+  size_t report(std::ostream& os, const Generator& g, unsigned bank = 0) const;
+};
+
+/// IN/OUT のポートアクセスの記録
+///
+/// Machine::ioTrace() で登録すると、IN/OUT と INI/OUTI/INIR/OTIR などの
+/// 1バイト毎のアクセスを固定長のリングバッファに記録し、ポート(アドレスの
+/// 下位8ビット)毎の統計を更新する。時刻はアクセスした命令の先頭の T-states
+/// (繰り返す命令は1回毎)。
+class IoTrace {
+ public:
+  /// 1回のアクセス
+  struct Access {
+    uint64_t t;     ///< T-states
+    uint16_t port;  ///< アドレスバスの16ビットの値
+    uint8_t value;
+    bool out;  ///< OUT なら true
+  };
+
+  /// ポート毎の統計
+  ///
+  /// 間隔が burstGap 以下で続くアクセスを1つのバーストとして数える。
+  struct Stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t last;         ///< 最後のアクセスの T-states
+    uint64_t minSpacing;   ///< 連続するアクセスの最小の間隔(2回未満は UINT64_MAX)
+    uint64_t bursts;       ///< バーストの数
+    uint64_t burst;        ///< 最後のバーストのアクセス数
+    uint64_t maxBurst;     ///< 最長のバーストのアクセス数
+    uint64_t frame;        ///< 最後のアクセスのフレームの番号
+    uint64_t inFrame;      ///< 最後のアクセスのフレームのアクセス数
+    uint64_t maxPerFrame;  ///< 1フレームの最大のアクセス数
+
+    uint64_t accesses(void) const { return reads + writes; }
+  };
+
+ private:
+  std::vector<Access> m_ring;
+  uint64_t m_total;  ///< 記録した総数(m_ring の次の位置は m_total % m_ring.size())
+  uint64_t m_origin;  ///< 記録を始めた T-states
+  uint64_t m_frameTStates;
+  uint32_t m_burstGap;
+  Stats m_stats[256];
+
+ public:
+  /// @param capacity リングバッファに残すアクセスの数
+  /// @param frameTStates 1フレームの T-states(既定は MSX の 228 * 262)
+  /// @param burstGap バーストとみなすアクセスの最大の間隔
+  explicit IoTrace(size_t capacity = 1u << 16, uint64_t frameTStates = 59736,
+                   uint32_t burstGap = 32);
+
+  /// 記録を消し、t から記録を始める
+  void start(uint64_t t);
+
+  void record(uint16_t port, uint8_t value, uint64_t t, bool out);
+
+  /// 記録したアクセスの総数(リングバッファから溢れたものを含む)
+  uint64_t total(void) const { return m_total; }
+
+  /// リングバッファに残っているアクセス(古い順)
+  std::vector<Access> accesses(void) const;
+
+  const Stats& stats(uint8_t port) const { return m_stats[port]; }
+
+  /// アクセスのあったポート毎に、フレーム当たりのバイト数、最小の間隔とバーストの長さを出力する
+  /// @param now 集計の終わりの T-states(通常は Machine::tstates())
+  void report(std::ostream& os, uint64_t now) const;
+};
+
+/// CP/M の .COM をホスト上で実行する
+///
+/// 0005h の BDOS の呼び出しと 0000h のウォームブートを HALT で捕まえ、
+/// コンソールの入出力はホストのストリームで、ファイルの入出力は指定した
+/// ディレクトリのファイルで行う。
+///
+/// 対応する BDOS のファンクションは 0..2, 6, 9..16, 19..23, 25, 26, 33..36。
+/// ディレクトリの検索(17, 18)は常に見つからない(0FFh)を返す。
+class Cpm {
+ public:
+  static const uint16_t Tpa = 0x0100;         ///< プログラムの開始アドレス
+  static const uint16_t BdosEntry = 0xfe00;   ///< BDOS の入口(TPA の上限)
+  static const uint16_t BootEntry = 0xff00;   ///< ウォームブートの入口
+  static const uint16_t DefaultDma = 0x0080;  ///< 既定の DMA アドレスとコマンドライン
+
+ private:
+  Machine m_machine;
+  std::istream& m_in;
+  std::ostream& m_out;
+  std::string m_dir;
+  std::vector<std::FILE*> m_files;  ///< FCB の 16, 17 バイト目の番号 - 1 で引く(閉じたものは nullptr)
+  uint16_t m_dma;
+  bool m_exited;
+  uint64_t m_bdosCalls;
+
+  void bdos(void);
+  uint8_t fileFunction(uint8_t func, uint16_t fcb);
+  std::string hostName(uint16_t fcb);
+  /// FCB のファイルを持つ m_files の要素(開いていなければ nullptr)
+  std::FILE** file(uint16_t fcb);
+  uint32_t record(uint16_t fcb);
+  void setRecord(uint16_t fcb, uint32_t rec);
+  uint8_t readRecord(std::FILE* fp, uint32_t rec);
+  uint8_t writeRecord(std::FILE* fp, uint32_t rec);
+  void parseFcb(uint16_t fcb, const std::string& arg);
+  void closeAll(void);
+
+ public:
+  /// @param in コンソール入力
+  /// @param out コンソール出力
+  explicit Cpm(std::istream& in = std::cin, std::ostream& out = std::cout);
+  ~Cpm();
+  Cpm(const Cpm&) = delete;
+  Cpm& operator=(const Cpm&) = delete;
+
+  Machine& machine(void) { return m_machine; }
+
+  /// ファイルを置くホストのディレクトリ(既定はカレントディレクトリ)
+  void directory(const std::string& dir) { m_dir = dir; }
+
+  /// .COM のイメージを 0100h に置き、ゼロページとコマンドラインを用意する
+  /// @param args コマンドラインの引数(最初の2つは 5Ch, 6Ch の FCB にも入る)
+  void load(const uint8_t* com, size_t size, const std::string& args = "");
+
+  /// Generator の生成結果を .COM として読み込む(開始アドレスは 0100h であること)
+  void load(const Generator& g, const std::string& args = "");
+
+  /// プログラムが終了するか budget T-states を実行するまで実行する
+  /// @return プログラムが終了した(ウォームブート、ファンクション 0、BDOS 外の HALT)
+  bool run(uint64_t budget = UINT64_MAX);
+
+  bool exited(void) const { return m_exited; }
+
+  /// 実行した BDOS のファンクションの回数
+  uint64_t bdosCalls(void) const { return m_bdosCalls; }
+};
+}  // namespace Emu
 }  // namespace Xz80
+
+#ifndef XZ80_SEPARATE_COMPILATION
+#include "xz80_impl.hpp"
+#endif
+
+#endif  // XZ80_HPP
@@ -0,0 +1,5311 @@
+/// @file xz80_impl.hpp
+/// xz80.hpp のうちテンプレートでない関数の実装
+///
+/// 通常は xz80.hpp の末尾から inline 関数として取り込まれる。
+/// XZ80_SEPARATE_COMPILATION を定義した場合は xz80lib.cpp からのみ
+/// 取り込まれ、静的ライブラリ libxz80.a としてコンパイルされる。
+
+#ifndef XZ80_IMPL_HPP
+#define XZ80_IMPL_HPP
+
+#include <atomic>
+#include <cctype>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define XZ80_HAS_MMAP 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "xz80.hpp"
+
+namespace Xz80 {
+// =======================================================================
+// ニーモニックフォーマッター
+
+namespace Formatter {
+XZ80_DECL Type Formatter::nextType(void) const {
+  // return static_cast<Type>(*m_p);
+  switch (*m_p) {
+    case '\0':
+      return T_End;
+    case 'i':
+      return T_Insn;
+    case 'l':
+      return T_Label;
+    case 's':
+      return T_Symbol;
+    case 'I':
+      return T_Indirect;
+    case 'r':
+      return T_Reg;
+    case 'c':
+      return T_Condition;
+    case ',':
+      return T_Comma;
+    case '\'':
+      return T_Dash;
+    case 'd':
+      return T_Dec;
+    case 'x':
+      return T_Hex;
+    case 'o':
+      return T_AddrOffset;
+    case 'b':
+      return T_Bytes;
+    case 'w':
+      return T_Words;
+    case 't':
+      return T_Text;
+    default:
+      break;
+  }
+  return T_Unknown;
+}
+
+XZ80_DECL void Formatter::reduceNoArg(void) {
+  while (true) {
+    switch (nextType()) {
+      case T_Comma:
+        ++m_p;
+        m_buffer.append(", ");
+        break;
+
+      case T_Dash:
+        ++m_p;
+        m_buffer.append("'");
+        break;
+
+      case T_Unknown:
+        ++m_p;
+        break;
+
+      default:
+        return;
+    }  // switch
+  }    // while
+}
+
+XZ80_DECL Formatter::Formatter(const char* format)
+    : m_format(format),
+      m_p(&m_format[0]),
+      m_buffer() {
+  reduceNoArg();
+}
+
+XZ80_DECL Formatter Formatter::operator%(const char* str) {
+  switch (nextType()) {
+    case T_Insn:
+      ++m_p;
+      m_buffer.append("    ").append(str).append(" ");
+      break;
+
+    case T_Label:
+      ++m_p;
+      m_buffer.append(str).append(":");
+      break;
+
+    case T_Symbol:
+      ++m_p;
+      m_buffer.append(str);
+      break;
+
+    case T_Text: {
+      ++m_p;
+      std::string s;
+      bool outside = true;
+      for (const char* p = str; *p != '\0'; ++p) {
+        if (std::isprint(*p) && *p != '\'') {
+          if (outside) {
+            s.append(", '");
+            outside = false;
+          }
+          const char b[2] = {*p, 0};
+          s.append(b);
+        } else {
+          if (!outside) {
+            s.append("'");
+            outside = true;
+          }
+          char buf[8];
+          std::sprintf(buf, ", 0%xh", (0xff & *p));
+          s.append(buf);
+        }
+      }  // for
+      if (!outside) {
+        s.append("'");
+      }
+      if (s.empty()) {
+        s = ", ''";
+      }
+      m_buffer.append(s.begin() + 2, s.end());
+
+      break;
+    }
+
+    default:
+      throw std::invalid_argument("const char*不正な組み合わせ");
+      break;
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const Reg8& r) {
+  switch (nextType()) {
+    case T_Reg:
+      ++m_p;
+      m_buffer.append(r.str);
+      break;
+    default:
+      throw std::invalid_argument("Reg8不正な組み合わせ");
+      break;
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const RegCAddr& c) {
+  switch (nextType()) {
+    case T_Reg:
+      ++m_p;
+      m_buffer.append("(").append(c.m_reg.str).append(")");
+      break;
+    default:
+      throw std::invalid_argument("Reg8不正な組み合わせ");
+      break;
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const Reg16& r) {
+  switch (nextType()) {
+    case T_Reg:
+      ++m_p;
+      m_buffer.append(r.str);
+      break;
+
+    default:
+      throw std::invalid_argument("Reg16不正な組み合わせ");
+      break;
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const BasicReg16Addr& rp) {
+  if (nextType() == T_Reg) {
+    ++m_p;
+    m_buffer.append("(").append(rp.m_reg.str).append(")");
+  } else {
+    throw std::invalid_argument("BasicReg16Addr不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const RegHLAddr& hl) {
+  if (nextType() == T_Reg) {
+    ++m_p;
+    m_buffer.append("(").append(hl.m_reg.str).append(")");
+  } else {
+    throw std::invalid_argument("RegHLAddr不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const RegSPAddr& sp) {
+  if (nextType() == T_Reg) {
+    ++m_p;
+    m_buffer.append("(").append(sp.m_reg.str).append(")");
+  } else {
+    throw std::invalid_argument("RegSPAddr不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const IndenexReg16AddrOffset& idx_offset) {
+  if (nextType() == T_Reg) {
+    ++m_p;
+    const int ofs = idx_offset.m_offset;
+    char buf[16];
+    if (ofs < 0) {
+      std::sprintf(buf, "-0%xh)", -ofs);
+    } else {
+      std::sprintf(buf, "+0%xh)", ofs);
+    }
+    m_buffer.append("(").append(idx_offset.m_reg.str).append(buf);
+  } else {
+    throw std::invalid_argument("IndenexReg16AddrOffset不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const IndenexReg16Addr& idx) {
+  if (nextType() == T_Reg) {
+    ++m_p;
+    m_buffer.append("(").append(idx.m_reg.str).append(")");
+  } else {
+    throw std::invalid_argument("IndenexReg16Addr不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const IoAddr& io) {
+  if (nextType() == T_Indirect) {
+    ++m_p;
+    char buf[8];
+    std::sprintf(buf, "(0%xh)", (0xff & io.addr));
+    m_buffer.append(buf);
+  } else {
+    throw std::invalid_argument("IoAddr不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const CondBase& cc) {
+  if (nextType() == T_Condition) {
+    ++m_p;
+    m_buffer.append(cc.str);
+  } else {
+    throw std::invalid_argument("CondBase不正な組み合わせ");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(int n) {
+  char buf[16];
+  switch (nextType()) {
+    case T_Dec:
+      ++m_p;
+      std::sprintf(buf, "%d", n);
+      m_buffer.append(buf);
+      break;
+
+    case T_Hex:
+      ++m_p;
+      std::sprintf(buf, "0%xh", n);
+      m_buffer.append(buf);
+      break;
+
+    case T_AddrOffset:
+      ++m_p;
+      std::sprintf(buf, "%+d", n);
+      m_buffer.append("$").append(buf);
+      break;
+
+    default:
+      throw std::invalid_argument("");
+      break;
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::bytes(const uint8_t* p, size_t n) {
+  if (nextType() == T_Bytes) {
+    ++m_p;
+    std::string s;
+    for (size_t i = 0; i < n; ++i) {
+      char buf[8];
+      std::sprintf(buf, ", 0%xh", 0xff & p[i]);
+      s.append(buf);
+    }
+    m_buffer.append(s.begin() + std::min<size_t>(2, s.size()), s.end());
+  } else {
+    throw std::invalid_argument("");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const std::initializer_list<uint8_t>& bytes) {
+  return this->bytes(bytes.begin(), bytes.size());
+}
+
+XZ80_DECL Formatter Formatter::operator%(const std::vector<uint8_t>& bytes) {
+  return this->bytes(bytes.data(), bytes.size());
+}
+
+XZ80_DECL Formatter Formatter::operator%(const std::initializer_list<uint16_t>& words) {
+  if (nextType() == T_Words) {
+    ++m_p;
+    std::string s;
+    for (uint16_t w : words) {
+      char buf[12];
+      std::sprintf(buf, ", 0%xh", 0xffff & w);
+      s.append(buf);
+    }
+    m_buffer.append(s.begin() + 2, s.end());
+  } else {
+    throw std::invalid_argument("");
+  }
+  reduceNoArg();
+  return *this;
+}
+
+XZ80_DECL Formatter Formatter::operator%(const MemAddr& nn) {
+  if (nextType() == T_Indirect) {
+    ++m_p;
+    if (nn.isLabel()) {
+      m_buffer.append("(").append(nn.label).append(")");
+    } else {
+      char buf[16];
+      std::sprintf(buf, "(0%xh)", nn.addr);
+      m_buffer.append(buf);
+    }
+  } else {
+    throw std::invalid_argument("");
+  }
+  reduceNoArg();
+  return *this;
+}
+}  // namespace Formatter
+
+// =======================================================================
+// 出力フォーマット
+
+namespace Output {
+/// 1バイトを大文字の16進数2文字に変換するテーブル
+struct HexTable {
+  char chars[512];
+  constexpr HexTable() : chars() {
+    const char digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 256; ++i) {
+      chars[i * 2] = digits[i >> 4];
+      chars[i * 2 + 1] = digits[i & 0x0f];
+    }
+  }
+};
+constexpr HexTable hexTable;
+
+/// 1バイトを16進数2文字で書き込み、書き込み位置を進める
+inline char* putHex(char* p, uint8_t b) {
+  std::memcpy(p, &hexTable.chars[b * 2], 2);
+  return p + 2;
+}
+
+/// 出力レコード1行分の情報
+struct Record {
+  uint8_t type;   ///< レコードタイプ
+  uint32_t addr;  ///< アドレス(拡張・カウント・開始アドレスレコードではその値)
+  size_t offset;  ///< データ先頭のオフセット
+  size_t num;     ///< データのバイト数
+  size_t pos;     ///< 出力文字列中の書き込み位置
+};
+
+/// アドレスを上位バイトから順に n バイト書き込む
+inline char* putAddr(char* p, uint32_t addr, size_t n, uint8_t& cs) {
+  for (size_t i = n; 0 < i; --i) {
+    const uint8_t b = static_cast<uint8_t>(addr >> ((i - 1) * 8));
+    cs += b;
+    p = putHex(p, b);
+  }
+  return p;
+}
+
+/// データ部を16進数で書き込む
+inline char* putData(char* p, const uint8_t* data, size_t num, uint8_t& cs) {
+  for (size_t i = 0; i < num; ++i) {
+    cs += data[i];
+    p = putHex(p, data[i]);
+  }
+  return p;
+}
+
+/// 0 から n-1 までを threads 個のスレッドに分割して処理する
+/// @param minPerThread 1スレッド当たりの最小の個数(少量の場合はスレッドを起動しない)
+template <class Func>
+void parallelFor(size_t n, unsigned threads, const Func& func, size_t minPerThread = 4096) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = static_cast<unsigned>(std::min<size_t>(threads, n / minPerThread));
+  if (threads <= 1) {
+    func(0, n);
+    return;
+  }
+  std::vector<std::thread> workers;
+  const size_t step = (n + threads - 1) / threads;
+  for (size_t begin = step; begin < n; begin += step) {
+    workers.emplace_back(func, begin, std::min(n, begin + step));
+  }
+  func(0, std::min(n, step));
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+XZ80_DECL void intelHex(std::string& out, const uint8_t* bytes, size_t size,
+                        uint32_t addr, uint8_t bpr, HexMode mode, unsigned threads) {
+  if (bpr == 0) {
+    throw std::invalid_argument("HEX bpr=0:invalid argument");
+  }
+  const uint64_t last = static_cast<uint64_t>(addr) + size;
+  if (mode == H_Auto) {
+    mode = (0x10000 < last) ? H_Linear : H_Addr16;
+  }
+  if ((mode == H_Addr16 && 0x10000 < last) ||
+      (mode == H_Segment && 0x100000 < last) || 0x100000000ull < last) {
+    char buf[64];
+    std::sprintf(buf, "HEX %08xh+%zu:out of range", addr, size);
+    throw std::out_of_range(buf);
+  }
+
+  // レコードの割り付け
+  // 拡張アドレスを使う場合はレコードが64KB境界を跨がないように分割し、
+  // 上位アドレスが変わる毎にタイプ02/04のレコードを挿入する
+  std::vector<Record> records;
+  records.reserve(size / bpr + size / 0x10000 + 2);
+  size_t pos = out.size();
+  uint32_t upper = 0;
+  for (size_t i = 0; i < size;) {
+    const uint32_t a = addr + i;
+    size_t num = std::min(size - i, static_cast<size_t>(bpr));
+    if (mode != H_Addr16) {
+      num = std::min<size_t>(num, 0x10000 - (a & 0xffff));
+      if ((a >> 16) != upper) {
+        upper = a >> 16;
+        const uint32_t value = (mode == H_Segment) ? upper << 12 : upper;
+        records.push_back(Record{static_cast<uint8_t>(mode == H_Segment ? 2 : 4),
+                                 value, 0, 2, pos});
+        pos += 1 + 2 * (4 + 2 + 1) + 2;
+      }
+    }
+    records.push_back(Record{0, a, i, num, pos});
+    pos += 1 + 2 * (4 + num + 1) + 2;
+    i += num;
+  }
+  records.push_back(Record{1, 0, 0, 0, pos});
+  pos += 1 + 2 * (4 + 1) + 2;
+
+  out.resize(pos);
+  char* const base = &out[0];
+  parallelFor(records.size(), threads, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) {
+      const Record& rec = records[r];
+      char* p = base + rec.pos;
+      uint8_t cs = 0;
+      *p++ = ':';
+      const uint8_t head[2] = {static_cast<uint8_t>(rec.num), 0};
+      p = putData(p, head, 1, cs);
+      if (rec.type == 0) {
+        p = putAddr(p, rec.addr & 0xffff, 2, cs);
+        cs += rec.type;
+        p = putHex(p, rec.type);
+        p = putData(p, bytes + rec.offset, rec.num, cs);
+      } else {
+        p = putAddr(p, 0, 2, cs);
+        cs += rec.type;
+        p = putHex(p, rec.type);
+        p = putAddr(p, rec.addr, rec.num, cs);
+      }
+      p = putHex(p, static_cast<uint8_t>(256 - cs));
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+  });
+}
+
+XZ80_DECL void motorola(std::string& out, const char* name, const uint8_t* bytes,
+                        size_t size, uint32_t addr, uint32_t start_addr, uint8_t bpr,
+                        SrecMode mode, unsigned threads) {
+  if (bpr == 0) {
+    throw std::invalid_argument("MOT bpr=0:invalid argument");
+  }
+  const uint64_t last = std::max<uint64_t>(static_cast<uint64_t>(addr) + size,
+                                           static_cast<uint64_t>(start_addr) + 1);
+  if (mode == S_Auto) {
+    mode = (last <= 0x10000) ? S_S1 : (last <= 0x1000000) ? S_S2 : S_S3;
+  }
+  // アドレス部のバイト数
+  const size_t addrLen = (mode == S_S1) ? 2 : (mode == S_S2) ? 3 : 4;
+  if (0x100000000ull < last || (addrLen < 4 && (1ull << (addrLen * 8)) < last)) {
+    char buf[64];
+    std::sprintf(buf, "MOT %08xh+%zu:out of range", addr, size);
+    throw std::out_of_range(buf);
+  }
+  if (255 < addrLen + bpr + 1) {
+    char buf[32];
+    std::sprintf(buf, "MOT bpr=%d:invalid argument", bpr);
+    throw std::invalid_argument(buf);
+  }
+
+  std::string msg(name);
+  msg += "|XZ80";
+  msg.push_back('\0');
+  if (255 < msg.size() + 3) {
+    msg.erase(252 - 1);
+    msg.push_back('\0');
+  }
+
+  // レコードの割り付け(S0, S1/S2/S3*n, S5/S6, S9/S8/S7)
+  const size_t numRow = (size + bpr - 1) / bpr;
+  std::vector<Record> records;
+  records.reserve(numRow + 3);
+  size_t pos = out.size();
+  const auto add = [&](uint8_t type, uint32_t a, size_t offset, size_t num, size_t alen) {
+    records.push_back(Record{type, a, offset, num, pos});
+    pos += 2 + 2 * (1 + alen + num + 1) + 2;
+  };
+  add('0', 0, 0, msg.size(), 2);
+  for (size_t i = 0; i < size; i += bpr) {
+    add(static_cast<uint8_t>('0' + addrLen - 1), addr + i, i,
+        std::min(size - i, static_cast<size_t>(bpr)), addrLen);
+  }
+  if (numRow <= 0xffff) {
+    add('5', numRow, 0, 0, 2);
+  } else {
+    add('6', numRow, 0, 0, 3);
+  }
+  add(static_cast<uint8_t>('0' + 11 - addrLen), start_addr, 0, 0, addrLen);
+
+  out.resize(pos);
+  char* const base = &out[0];
+  const uint8_t* const msgBytes = reinterpret_cast<const uint8_t*>(msg.data());
+  parallelFor(records.size(), threads, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) {
+      const Record& rec = records[r];
+      const size_t alen = (rec.type == '0' || rec.type == '5') ? 2
+                          : (rec.type == '6')                  ? 3
+                                                               : addrLen;
+      char* p = base + rec.pos;
+      uint8_t cs = 0;
+      *p++ = 'S';
+      *p++ = static_cast<char>(rec.type);
+      const uint8_t count = static_cast<uint8_t>(alen + rec.num + 1);
+      p = putData(p, &count, 1, cs);
+      p = putAddr(p, rec.addr, alen, cs);
+      if (rec.type == '0') {
+        p = putData(p, msgBytes, rec.num, cs);
+      } else {
+        p = putData(p, bytes + rec.offset, rec.num, cs);
+      }
+      p = putHex(p, static_cast<uint8_t>(~cs));
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+  });
+}
+
+/// CRC-32 の計算テーブル
+struct Crc32Table {
+  uint32_t values[256];
+  constexpr Crc32Table() : values() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+      }
+      values[i] = c;
+    }
+  }
+};
+constexpr Crc32Table crc32Table;
+
+XZ80_DECL uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = crc32Table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+XZ80_DECL void ipsPatch(std::vector<uint8_t>& out, const uint8_t* base, size_t baseSize,
+                        const uint8_t* target, size_t targetSize) {
+  if (0x1000000 < targetSize) {
+    char buf[48];
+    std::sprintf(buf, "IPS size=%zu:out of range", targetSize);
+    throw std::out_of_range(buf);
+  }
+  // base の範囲外は常に異なるものとして扱う
+  const auto differs = [&](size_t pos) {
+    return baseSize <= pos || base[pos] != target[pos];
+  };
+  const auto put = [&](uint32_t val, int n) {
+    for (int i = n - 1; 0 <= i; --i) {
+      out.push_back(static_cast<uint8_t>(val >> (i * 8)));
+    }
+  };
+  const size_t maxRecord = 0xffff;
+  const size_t mergeGap = 6;  // これ以下の一致区間はレコードを分けずに含める
+  const uint32_t eofMark = 0x454f46;  // "EOF" と読めるオフセットは使えない
+
+  const uint8_t header[] = {'P', 'A', 'T', 'C', 'H'};
+  out.insert(out.end(), header, header + sizeof(header));
+  size_t pos = 0;
+  while (pos < targetSize) {
+    if (!differs(pos)) {
+      ++pos;
+      continue;
+    }
+    if (pos == eofMark) {
+      --pos;
+    }
+
+    // 差分区間の終わりを探す(短い一致区間はまたぐ)
+    size_t end = pos + 1;
+    size_t same = 0;
+    for (size_t i = end; i < targetSize && end - pos < maxRecord; ++i) {
+      if (differs(i)) {
+        end = i + 1;
+        same = 0;
+      } else if (mergeGap < ++same) {
+        break;
+      }
+    }
+    end = std::min(end, pos + maxRecord);
+
+    // 同じ値が続く区間は RLE レコードにする
+    size_t run = 1;
+    while (pos + run < end && target[pos + run] == target[pos]) {
+      ++run;
+    }
+    if (8 < run) {
+      put(pos, 3);
+      put(0, 2);
+      put(run, 2);
+      out.push_back(target[pos]);
+      pos += run;
+      continue;
+    }
+    put(pos, 3);
+    put(end - pos, 2);
+    out.insert(out.end(), target + pos, target + end);
+    pos = end;
+  }
+  const uint8_t eof[] = {'E', 'O', 'F'};
+  out.insert(out.end(), eof, eof + sizeof(eof));
+  if (targetSize < baseSize) {
+    put(targetSize, 3);  // 切り詰め
+  }
+}
+
+XZ80_DECL void bpsPatch(std::vector<uint8_t>& out, const uint8_t* base, size_t baseSize,
+                        const uint8_t* target, size_t targetSize,
+                        const std::string& metadata) {
+  const size_t patchStart = out.size();
+  const auto number = [&](uint64_t n) {
+    while (true) {
+      const uint8_t x = n & 0x7f;
+      n >>= 7;
+      if (n == 0) {
+        out.push_back(0x80 | x);
+        break;
+      }
+      out.push_back(x);
+      --n;
+    }
+  };
+  const auto put32 = [&](uint32_t val) {
+    for (int i = 0; i < 4; ++i) {
+      out.push_back(static_cast<uint8_t>(val >> (i * 8)));
+    }
+  };
+  enum { SourceRead, TargetRead, SourceCopy, TargetCopy };
+  const auto action = [&](int cmd, size_t len) { number((uint64_t(len) - 1) << 2 | cmd); };
+
+  const uint8_t header[] = {'B', 'P', 'S', '1'};
+  out.insert(out.end(), header, header + sizeof(header));
+  number(baseSize);
+  number(targetSize);
+  number(metadata.size());
+  out.insert(out.end(), metadata.begin(), metadata.end());
+
+  // base を Block バイト毎に索引化する(ハッシュ表は衝突時に先勝ち)
+  const size_t Block = 16;
+  const uint32_t Prime = 0x01000193;
+  uint32_t primePow = 1;  // Prime^(Block-1)
+  for (size_t i = 1; i < Block; ++i) {
+    primePow *= Prime;
+  }
+  const auto hashAt = [&](const uint8_t* p) {
+    uint32_t h = 0;
+    for (size_t i = 0; i < Block; ++i) {
+      h = h * Prime + p[i];
+    }
+    return h;
+  };
+  size_t tableBits = 10;
+  while ((size_t(1) << tableBits) < baseSize / Block * 2) {
+    ++tableBits;
+  }
+  const auto slot = [&](uint32_t h) { return (h * 0x9e3779b1u) >> (32 - tableBits); };
+  std::vector<uint32_t> table(size_t(1) << tableBits, 0);  // 0 は空、それ以外は位置+1
+  for (size_t i = 0; i + Block <= baseSize; i += Block) {
+    uint32_t& e = table[slot(hashAt(base + i))];
+    if (e == 0) {
+      e = static_cast<uint32_t>(i + 1);
+    }
+  }
+
+  size_t literal = 0;  // TargetRead で出力していない区間の先頭
+  int64_t sourceRel = 0;
+  int64_t targetRel = 0;
+  const auto flush = [&](size_t pos) {
+    if (literal < pos) {
+      action(TargetRead, pos - literal);
+      out.insert(out.end(), target + literal, target + pos);
+    }
+  };
+  const auto matchLen = [&](const uint8_t* a, const uint8_t* b, size_t max) {
+    size_t n = 0;
+    while (n < max && a[n] == b[n]) {
+      ++n;
+    }
+    return n;
+  };
+  const auto relative = [&](int64_t to, int64_t rel) {
+    const int64_t d = to - rel;
+    number(static_cast<uint64_t>(d < 0 ? -d : d) << 1 | (d < 0));
+  };
+
+  size_t pos = 0;
+  uint32_t hash = (Block <= targetSize) ? hashAt(target) : 0;
+  while (pos < targetSize) {
+    // 同じ位置の一致(SourceRead)
+    if (pos < baseSize) {
+      const size_t len = matchLen(base + pos, target + pos,
+                                  std::min(baseSize, targetSize) - pos);
+      if (4 <= len) {
+        flush(pos);
+        action(SourceRead, len);
+        pos += len;
+        literal = pos;
+        if (pos + Block <= targetSize) {
+          hash = hashAt(target + pos);
+        }
+        continue;
+      }
+    }
+
+    // 同じ値の連続(直前の1バイトからの TargetCopy)
+    if (0 < pos) {
+      const size_t len = matchLen(target + pos - 1, target + pos, targetSize - pos);
+      if (16 <= len) {
+        flush(pos);
+        action(TargetCopy, len);
+        relative(pos - 1, targetRel);
+        targetRel = pos - 1 + len;
+        pos += len;
+        literal = pos;
+        if (pos + Block <= targetSize) {
+          hash = hashAt(target + pos);
+        }
+        continue;
+      }
+    }
+
+    // 移動したブロックの一致(SourceCopy)
+    if (pos + Block <= targetSize) {
+      const uint32_t e = table[slot(hash)];
+      if (e != 0) {
+        size_t src = e - 1;
+        size_t len = matchLen(base + src, target + pos,
+                              std::min(baseSize - src, targetSize - pos));
+        if (Block <= len) {
+          // 後方にも伸ばす
+          while (literal < pos && 0 < src && base[src - 1] == target[pos - 1]) {
+            --src;
+            --pos;
+            ++len;
+          }
+          flush(pos);
+          action(SourceCopy, len);
+          relative(src, sourceRel);
+          sourceRel = src + len;
+          pos += len;
+          literal = pos;
+          if (pos + Block <= targetSize) {
+            hash = hashAt(target + pos);
+          }
+          continue;
+        }
+      }
+      if (pos + Block < targetSize) {
+        hash = (hash - target[pos] * primePow) * Prime + target[pos + Block];
+      }
+    }
+    ++pos;
+  }
+  flush(targetSize);
+
+  put32(crc32(base, baseSize));
+  put32(crc32(target, targetSize));
+  put32(crc32(out.data() + patchStart, out.size() - patchStart));
+}
+
+XZ80_DECL void diffRanges(std::vector<DiffRange>& out, const uint8_t* a, size_t aSize,
+                          const uint8_t* b, size_t bSize) {
+  const size_t size = std::min(aSize, bSize);
+  // i 以降で最初に (a[i] == b[i]) != equal となる位置
+  const auto scan = [&](size_t i, bool equal) {
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+      const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+      const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+      unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+      if (equal) {
+        mask = ~mask & 0xffff;
+      }
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for (; i < size && (a[i] == b[i]) == equal; ++i) {
+    }
+    return i;
+  };
+
+  size_t i = 0;
+  while ((i = scan(i, true)) < size) {
+    const size_t end = scan(i, false);
+    out.push_back(DiffRange{static_cast<uint32_t>(i), static_cast<uint32_t>(end - i)});
+    i = end;
+  }
+  if (aSize != bSize) {
+    const size_t tail = std::max(aSize, bSize) - size;
+    if (!out.empty() && out.back().offset + out.back().size == size) {
+      out.back().size += static_cast<uint32_t>(tail);
+    } else {
+      out.push_back(DiffRange{static_cast<uint32_t>(size), static_cast<uint32_t>(tail)});
+    }
+  }
+}
+
+XZ80_DECL LzStats lzCompress(std::vector<uint8_t>& out, const uint8_t* data, size_t size,
+                             unsigned threads) {
+  enum { Literal, Near, Far };
+  const size_t MaxLiteral = 0x7f;
+  const size_t MinNear = 2, MaxNear = MinNear + 0x3f, NearDist = 0x100;
+  const size_t MinFar = 3, MaxFar = MinFar + 0x3f, FarDist = 0xffff;
+  const size_t MaxChain = 1024;  // 1位置当たりに調べる候補の上限
+
+  // 先頭3バイトのハッシュチェイン
+  const size_t HashBits = 16;
+  const auto hash3 = [&](size_t i) {
+    return ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 0x9e3779b1u) >> (32 - HashBits);
+  };
+  std::vector<int32_t> head(size_t(1) << HashBits, -1);
+  std::vector<int32_t> prev(size, -1);
+  for (size_t i = 0; i + 3 <= size; ++i) {
+    int32_t& h = head[hash3(i)];
+    prev[i] = h;
+    h = static_cast<int32_t>(i);
+  }
+
+  // 位置毎の最長一致(近距離・遠距離)を並列に求める
+  struct Match {
+    uint16_t nearLen, nearDist, farLen, farDist;
+  };
+  std::vector<Match> matches(size, Match{0, 0, 0, 0});
+  parallelFor(size, threads, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Match& m = matches[i];
+      const size_t maxLen = std::min(MaxFar, size - i);
+      size_t depth = 0;
+      for (int32_t j = prev[i]; 0 <= j && i - j <= FarDist && depth < MaxChain;
+           j = prev[j], ++depth) {
+        size_t len = 0;
+        while (len < maxLen && data[j + len] == data[i + len]) {
+          ++len;
+        }
+        if (i - j <= NearDist && m.nearLen < std::min(len, MaxNear)) {
+          m.nearLen = static_cast<uint16_t>(std::min(len, MaxNear));
+          m.nearDist = static_cast<uint16_t>(i - j);
+        }
+        if (m.farLen < len) {
+          m.farLen = static_cast<uint16_t>(len);
+          m.farDist = static_cast<uint16_t>(i - j);
+        }
+        if (len == maxLen) {
+          break;
+        }
+      }
+    }
+  });
+
+  // 末尾から最小の圧縮後サイズを求める
+  std::vector<uint32_t> cost(size + 1, 0);
+  std::vector<uint8_t> kind(size), length(size);
+  for (size_t i = size; i-- > 0;) {
+    uint32_t best = UINT32_MAX;
+    const auto consider = [&](uint32_t c, int k, size_t len) {
+      if (c < best) {
+        best = c;
+        kind[i] = static_cast<uint8_t>(k);
+        length[i] = static_cast<uint8_t>(len);
+      }
+    };
+    const Match& m = matches[i];
+    for (size_t len = m.farLen; MinFar <= len; --len) {
+      consider(3 + cost[i + len], Far, len);
+    }
+    for (size_t len = m.nearLen; MinNear <= len; --len) {
+      consider(2 + cost[i + len], Near, len);
+    }
+    for (size_t len = 1; len <= std::min(MaxLiteral, size - i); ++len) {
+      consider(1 + len + cost[i + len], Literal, len);
+    }
+    cost[i] = best;
+  }
+
+  // 符号化と展開時間の見積もり(T-states は Generator::lzUnpack() のもの)
+  LzStats stats{size, 0, 7 + 28};  // 先頭の LD B,0 と終端
+  const size_t start = out.size();
+  for (size_t i = 0; i < size; i += length[i]) {
+    const size_t len = length[i];
+    if (kind[i] == Literal) {
+      out.push_back(static_cast<uint8_t>(len));
+      out.insert(out.end(), data + i, data + i + len);
+      stats.tstates += 41 + 21 * len;
+    } else if (kind[i] == Near) {
+      out.push_back(static_cast<uint8_t>(0x80 | (len - MinNear)));
+      out.push_back(static_cast<uint8_t>(-matches[i].nearDist));
+      stats.tstates += 125 + 21 * len;
+    } else {
+      const uint16_t neg = static_cast<uint16_t>(-matches[i].farDist);
+      out.push_back(static_cast<uint8_t>(0xc0 | (len - MinFar)));
+      out.push_back(static_cast<uint8_t>(neg & 0xff));
+      out.push_back(static_cast<uint8_t>(neg >> 8));
+      stats.tstates += 147 + 21 * len;
+    }
+  }
+  out.push_back(0x00);
+  stats.compressed = out.size() - start;
+  return stats;
+}
+
+XZ80_DECL FILE* openFile(const char* fn, const char* mode) {
+  FILE* fp = std::fopen(fn, mode);
+  if (fp == nullptr) {
+    throw std::runtime_error(std::string(fn) + ":cannot open");
+  }
+  return fp;
+}
+
+XZ80_DECL WriteStats writeFile(const char* fn, const void* data, size_t size,
+                               bool update) {
+  const uint8_t* const bytes = static_cast<const uint8_t*>(data);
+
+  // 既存のファイルと比較して書き換えが必要な範囲を求める
+  std::vector<std::pair<size_t, size_t> > runs;  // (位置, バイト数)
+  size_t oldSize = 0;
+  bool exists = false;
+  if (update) {
+    FILE* fp = std::fopen(fn, "rb");
+    exists = (fp != nullptr);
+    if (exists) {
+      std::fclose(fp);
+    }
+  }
+  if (exists) {
+    const Input::MappedFile old(fn);
+    oldSize = old.size();
+    const size_t blockSize = 4096;
+    const size_t common = std::min(oldSize, size);
+    for (size_t pos = 0; pos < common; pos += blockSize) {
+      const size_t num = std::min(blockSize, common - pos);
+      if (std::memcmp(old.data() + pos, bytes + pos, num) == 0) {
+        continue;
+      }
+      if (!runs.empty() && runs.back().first + runs.back().second == pos) {
+        runs.back().second += num;
+      } else {
+        runs.push_back(std::make_pair(pos, num));
+      }
+    }
+    if (common < size) {
+      runs.push_back(std::make_pair(common, size - common));
+    }
+  } else {
+    runs.push_back(std::make_pair(size_t(0), size));
+  }
+
+  WriteStats stats = {0, 0};
+  for (const auto& r : runs) {
+    stats.written += r.second;
+  }
+  stats.skipped = size - stats.written;
+  if (exists && runs.empty() && oldSize == size) {
+    return stats;
+  }
+
+  const auto fail = [&]() {
+    throw std::runtime_error(std::string(fn) + ":write error");
+  };
+  if (!exists) {
+    FILE* fp = openFile(fn, "wb");
+    const size_t written = std::fwrite(data, 1, size, fp);
+    if (std::fclose(fp) != 0 || written != size) {
+      fail();
+    }
+    return stats;
+  }
+
+#ifdef XZ80_HAS_MMAP
+  const int fd = ::open(fn, O_WRONLY);
+  if (fd < 0) {
+    throw std::runtime_error(std::string(fn) + ":cannot open");
+  }
+  bool ok = true;
+  for (const auto& r : runs) {
+    for (size_t done = 0; ok && done < r.second;) {
+      const ssize_t n = ::pwrite(fd, bytes + r.first + done, r.second - done,
+                                 static_cast<off_t>(r.first + done));
+      ok = (0 < n);
+      done += ok ? n : 0;
+    }
+  }
+  if (ok && size < oldSize) {
+    ok = (::ftruncate(fd, static_cast<off_t>(size)) == 0);
+  }
+  if (::close(fd) != 0 || !ok) {
+    fail();
+  }
+#else
+  if (size < oldSize) {
+    // 切り詰めができないので全体を書き直す
+    FILE* fp = openFile(fn, "wb");
+    const size_t written = std::fwrite(data, 1, size, fp);
+    if (std::fclose(fp) != 0 || written != size) {
+      fail();
+    }
+    stats.written = size;
+    stats.skipped = 0;
+    return stats;
+  }
+  FILE* fp = openFile(fn, "r+b");
+  bool ok = true;
+  for (const auto& r : runs) {
+    ok = ok && std::fseek(fp, static_cast<long>(r.first), SEEK_SET) == 0 &&
+         std::fwrite(bytes + r.first, 1, r.second, fp) == r.second;
+  }
+  if (std::fclose(fp) != 0 || !ok) {
+    fail();
+  }
+#endif
+  return stats;
+}
+}  // namespace Output
+
+// =======================================================================
+// メモリイメージ
+
+XZ80_DECL void Image::write(uint32_t addr, const uint8_t* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  const uint64_t end = static_cast<uint64_t>(addr) + size;
+  if (0x100000000ull < end) {
+    char buf[64];
+    std::sprintf(buf, "Image %08xh+%zu:out of range", addr, size);
+    throw std::out_of_range(buf);
+  }
+
+  // 末尾への追記(ファイル読み込み時はほぼこれ)
+  if (!m_segments.empty() && m_segments.back().end() == addr) {
+    auto& bs = m_segments.back().bytes;
+    bs.insert(bs.end(), data, data + size);
+    return;
+  }
+
+  // 重なるか接する区間 [first, last) を探す
+  auto first = m_segments.begin();
+  {
+    size_t lo = 0, hi = m_segments.size();
+    while (lo < hi) {
+      const size_t mid = (lo + hi) / 2;
+      if (m_segments[mid].end() < addr) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    first += lo;
+  }
+  auto last = first;
+  while (last != m_segments.end() && last->addr <= end) {
+    ++last;
+  }
+
+  if (first == last) {
+    m_segments.insert(first, Segment{addr, std::vector<uint8_t>(data, data + size)});
+    return;
+  }
+
+  // 区間をまとめてから書き込む
+  const uint32_t start = std::min(addr, first->addr);
+  const uint64_t stop = std::max(end, (last - 1)->end());
+  std::vector<uint8_t> merged(stop - start);
+  for (auto itr = first; itr != last; ++itr) {
+    std::memcpy(&merged[itr->addr - start], itr->bytes.data(), itr->bytes.size());
+  }
+  std::memcpy(&merged[addr - start], data, size);
+  first->addr = start;
+  first->bytes.swap(merged);
+  m_segments.erase(first + 1, last);
+}
+
+XZ80_DECL bool Image::read(uint32_t addr, uint8_t& byte) const {
+  size_t lo = 0, hi = m_segments.size();
+  while (lo < hi) {
+    const size_t mid = (lo + hi) / 2;
+    if (m_segments[mid].end() <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == m_segments.size() || addr < m_segments[lo].addr) {
+    return false;
+  }
+  byte = m_segments[lo].bytes[addr - m_segments[lo].addr];
+  return true;
+}
+
+XZ80_DECL std::vector<uint8_t> Image::flatten(uint32_t& base, uint8_t fill) const {
+  if (m_segments.empty()) {
+    base = 0;
+    return std::vector<uint8_t>();
+  }
+  base = m_segments.front().addr;
+  std::vector<uint8_t> bytes(m_segments.back().end() - base, fill);
+  for (const auto& seg : m_segments) {
+    std::memcpy(&bytes[seg.addr - base], seg.bytes.data(), seg.bytes.size());
+  }
+  return bytes;
+}
+
+XZ80_DECL size_t Image::size(void) const {
+  size_t total = 0;
+  for (const auto& seg : m_segments) {
+    total += seg.bytes.size();
+  }
+  return total;
+}
+
+// =======================================================================
+// 入力フォーマット
+
+namespace Input {
+XZ80_DECL MappedFile::MappedFile(const char* fn)
+    : m_data(nullptr), m_size(0), m_buffer() {
+#ifdef XZ80_HAS_MMAP
+  const int fd = ::open(fn, O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(std::string(fn) + ":cannot open");
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error(std::string(fn) + ":cannot stat");
+  }
+  m_size = static_cast<size_t>(st.st_size);
+  if (0 < m_size) {
+    void* p = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error(std::string(fn) + ":cannot map");
+    }
+    m_data = static_cast<const uint8_t*>(p);
+  }
+  ::close(fd);
+#else
+  FILE* fp = Output::openFile(fn, "rb");
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), fp)) != 0) {
+    m_buffer.insert(m_buffer.end(), buf, buf + n);
+  }
+  std::fclose(fp);
+  m_data = m_buffer.data();
+  m_size = m_buffer.size();
+#endif
+}
+
+XZ80_DECL MappedFile::~MappedFile() {
+#ifdef XZ80_HAS_MMAP
+  if (m_data != nullptr) {
+    ::munmap(const_cast<uint8_t*>(m_data), m_size);
+  }
+#endif
+}
+
+/// 16進数1文字の値を返すテーブル(16進数以外は 0xff)
+struct HexValueTable {
+  uint8_t values[256];
+  constexpr HexValueTable() : values() {
+    for (int i = 0; i < 256; ++i) {
+      values[i] = 0xff;
+    }
+    for (int i = 0; i < 10; ++i) {
+      values['0' + i] = i;
+    }
+    for (int i = 0; i < 6; ++i) {
+      values['A' + i] = 10 + i;
+      values['a' + i] = 10 + i;
+    }
+  }
+};
+constexpr HexValueTable hexValueTable;
+
+XZ80_DECL bool decodeHex(const char* src, size_t num, uint8_t* dst) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  // 32文字ずつ16バイトに変換する
+  const __m128i c0 = _mm_set1_epi8('0' - 1);
+  const __m128i c9 = _mm_set1_epi8('9' + 1);
+  const __m128i ca = _mm_set1_epi8('a' - 1);
+  const __m128i cf = _mm_set1_epi8('f' + 1);
+  const __m128i lowerBit = _mm_set1_epi8(0x20);
+  const __m128i digitBase = _mm_set1_epi8('0');
+  const __m128i alphaBase = _mm_set1_epi8('a' - 10);
+  const __m128i lowMask = _mm_set1_epi16(0x00ff);
+  const auto nibbles = [&](__m128i c, __m128i& v) {
+    const __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, c0), _mm_cmplt_epi8(c, c9));
+    const __m128i lc = _mm_or_si128(c, lowerBit);
+    const __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lc, ca), _mm_cmplt_epi8(lc, cf));
+    v = _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(c, digitBase)),
+                     _mm_and_si128(isAlpha, _mm_sub_epi8(lc, alphaBase)));
+    return _mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) == 0xffff;
+  };
+  for (; i + 16 <= num; i += 16) {
+    __m128i v0, v1;
+    const __m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+    const __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2 + 16));
+    if (!nibbles(s0, v0) || !nibbles(s1, v1)) {
+      return false;
+    }
+    // 16ビット単位で (上位桁 << 4) | 下位桁 を作り、8ビットに詰める
+    const __m128i w0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0, lowMask), 4),
+                                    _mm_srli_epi16(v0, 8));
+    const __m128i w1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, lowMask), 4),
+                                    _mm_srli_epi16(v1, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(w0, w1));
+  }
+#endif
+  for (; i < num; ++i) {
+    const uint8_t h = hexValueTable.values[static_cast<uint8_t>(src[i * 2])];
+    const uint8_t l = hexValueTable.values[static_cast<uint8_t>(src[i * 2 + 1])];
+    if ((h | l) & 0xf0) {
+      return false;
+    }
+    dst[i] = static_cast<uint8_t>(h << 4 | l);
+  }
+  return true;
+}
+
+/// テキストを1行ずつ取り出して 16進数部分をデコードする
+///
+/// func(type, bytes, num, fail) を各行について呼び出す。
+/// type は行頭のマーカー直後の文字(S-record のみ)、
+/// fail は行番号付きで std::runtime_error を送出する関数。
+template <class Func>
+void forEachRecord(const char* text, size_t len, char mark, bool typed,
+                   const char* what, const Func& func) {
+  uint8_t bytes[1 + 255 + 4 + 1];
+  const char* p = text;
+  const char* const end = text + len;
+  size_t lineNo = 0;
+  const auto fail = [&](const char* msg) {
+    char buf[96];
+    std::sprintf(buf, "%s line %zu:%s", what, lineNo, msg);
+    throw std::runtime_error(buf);
+  };
+  while (p < end) {
+    ++lineNo;
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    const char* q = eol;
+    while (p < q && (q[-1] == '\r' || q[-1] == ' ' || q[-1] == '\t')) {
+      --q;
+    }
+    if (p == q) {  // 空行
+      p = eol + 1;
+      continue;
+    }
+    if (*p != mark) {
+      fail("invalid record mark");
+    }
+    ++p;
+    char type = 0;
+    if (typed) {
+      if (p == q) {
+        fail("missing record type");
+      }
+      type = *p++;
+    }
+    const size_t chars = q - p;
+    if (chars % 2 != 0 || chars / 2 < 2 || sizeof(bytes) < chars / 2) {
+      fail("invalid record length");
+    }
+    const size_t num = chars / 2;
+    if (!decodeHex(p, num, bytes)) {
+      fail("invalid hex digit");
+    }
+    func(type, bytes, num, fail);
+    p = eol + 1;
+  }
+}
+
+XZ80_DECL std::vector<uint8_t> lzDecompress(const uint8_t* data, size_t size) {
+  const auto fail = []() { throw std::runtime_error("LZ:broken data"); };
+  std::vector<uint8_t> out;
+  size_t p = 0;
+  while (true) {
+    if (size <= p) {
+      fail();
+    }
+    const uint8_t t = data[p++];
+    if (t == 0x00) {
+      break;
+    }
+    if (t < 0x80) {
+      if (size - p < t) {
+        fail();
+      }
+      out.insert(out.end(), data + p, data + p + t);
+      p += t;
+      continue;
+    }
+    const bool isFar = (0xc0 <= t);
+    if (size - p < (isFar ? 2u : 1u)) {
+      fail();
+    }
+    size_t dist, len;
+    if (isFar) {
+      dist = 0x10000 - (data[p] | data[p + 1] << 8);
+      len = (t & 0x3f) + 3;
+      p += 2;
+    } else {
+      dist = 0x100 - data[p];
+      len = (t & 0x3f) + 2;
+      p += 1;
+    }
+    if (out.size() < dist || dist == 0x10000) {
+      fail();
+    }
+    // 重なった一致は LDIR と同じく1バイトずつ複写する
+    for (size_t i = 0; i < len; ++i) {
+      out.push_back(out[out.size() - dist]);
+    }
+  }
+  return out;
+}
+
+XZ80_DECL void parseHex(const char* text, size_t len, Image& image) {
+  uint32_t base = 0;
+  bool eof = false;
+  const auto record = [&](char, const uint8_t* r, size_t n, const auto& fail) {
+    if (eof) {
+      fail("data after end of file record");
+    }
+    if (n != 5u + r[0]) {
+      fail("byte count mismatch");
+    }
+    uint8_t cs = 0;
+    for (size_t i = 0; i < n; ++i) {
+      cs += r[i];
+    }
+    if (cs != 0) {
+      fail("checksum error");
+    }
+    const uint8_t* data = r + 4;
+    const uint32_t offset = r[1] << 8 | r[2];
+    switch (r[3]) {
+      case 0:  // データ
+        image.write(base + offset, data, r[0]);
+        break;
+      case 1:  // 終了
+        eof = true;
+        break;
+      case 2:  // 拡張セグメントアドレス
+        if (r[0] != 2) {
+          fail("invalid extended segment address");
+        }
+        base = static_cast<uint32_t>(data[0] << 8 | data[1]) << 4;
+        break;
+      case 3:  // 開始セグメントアドレス(CS:IP)
+        if (r[0] != 4) {
+          fail("invalid start segment address");
+        }
+        image.setStart((static_cast<uint32_t>(data[0] << 8 | data[1]) << 4) +
+                       (data[2] << 8 | data[3]));
+        break;
+      case 4:  // 拡張リニアアドレス
+        if (r[0] != 2) {
+          fail("invalid extended linear address");
+        }
+        base = static_cast<uint32_t>(data[0] << 8 | data[1]) << 16;
+        break;
+      case 5:  // 開始リニアアドレス
+        if (r[0] != 4) {
+          fail("invalid start linear address");
+        }
+        image.setStart(static_cast<uint32_t>(data[0]) << 24 | data[1] << 16 |
+                       data[2] << 8 | data[3]);
+        break;
+      default:
+        fail("unknown record type");
+        break;
+    }
+  };
+  forEachRecord(text, len, ':', false, "HEX", record);
+  if (!eof) {
+    throw std::runtime_error("HEX:end of file record not found");
+  }
+}
+
+XZ80_DECL void parseMot(const char* text, size_t len, Image& image) {
+  size_t numData = 0;
+  const auto record = [&](char type, const uint8_t* r, size_t n, const auto& fail) {
+    if (n != 1u + r[0]) {
+      fail("byte count mismatch");
+    }
+    uint8_t cs = 0;
+    for (size_t i = 0; i < n; ++i) {
+      cs += r[i];
+    }
+    if (cs != 0xff) {
+      fail("checksum error");
+    }
+    // アドレス部のバイト数
+    size_t alen = 0;
+    switch (type) {
+      case '0':
+      case '1':
+      case '5':
+      case '9':
+        alen = 2;
+        break;
+      case '2':
+      case '6':
+      case '8':
+        alen = 3;
+        break;
+      case '3':
+      case '7':
+        alen = 4;
+        break;
+      default:
+        fail("unknown record type");
+        break;
+    }
+    if (r[0] < alen + 1) {
+      fail("record too short");
+    }
+    uint32_t addr = 0;
+    for (size_t i = 0; i < alen; ++i) {
+      addr = addr << 8 | r[1 + i];
+    }
+    const uint8_t* data = r + 1 + alen;
+    const size_t num = r[0] - alen - 1;
+    switch (type) {
+      case '0': {
+        const char* name = reinterpret_cast<const char*>(data);
+        image.setName(std::string(name, strnlen(name, num)));
+        break;
+      }
+      case '1':
+      case '2':
+      case '3':
+        image.write(addr, data, num);
+        ++numData;
+        break;
+      case '5':
+      case '6':
+        if (addr != (numData & (type == '5' ? 0xffff : 0xffffff))) {
+          fail("record count mismatch");
+        }
+        break;
+      default:  // '7', '8', '9'
+        image.setStart(addr);
+        break;
+    }
+  };
+  forEachRecord(text, len, 'S', true, "MOT", record);
+}
+
+XZ80_DECL void parseBsave(const uint8_t* data, size_t len, Image& image) {
+  if (len < 7 || data[0] != 0xfe) {
+    throw std::runtime_error("BSAVE:invalid header");
+  }
+  const uint16_t start = data[1] | data[2] << 8;
+  const uint16_t end = data[3] | data[4] << 8;
+  const uint16_t exec = data[5] | data[6] << 8;
+  // 空のイメージは終了アドレスを開始アドレスの1つ前にして保存する
+  const bool empty = static_cast<uint16_t>(end + 1) == start && len == 7;
+  if (!empty) {
+    if (end < start || len - 7 < static_cast<size_t>(end - start + 1)) {
+      throw std::runtime_error("BSAVE:size mismatch");
+    }
+    image.write(start, data + 7, end - start + 1);
+  }
+  image.setStart(exec);
+}
+
+XZ80_DECL Image loadHex(const char* fn) {
+  const MappedFile file(fn);
+  Image image;
+  parseHex(reinterpret_cast<const char*>(file.data()), file.size(), image);
+  return image;
+}
+
+XZ80_DECL Image loadMot(const char* fn) {
+  const MappedFile file(fn);
+  Image image;
+  parseMot(reinterpret_cast<const char*>(file.data()), file.size(), image);
+  return image;
+}
+
+XZ80_DECL Image loadBsave(const char* fn) {
+  const MappedFile file(fn);
+  Image image;
+  parseBsave(file.data(), file.size(), image);
+  return image;
+}
+}  // namespace Input
+
+// =======================================================================
+// 逆アセンブラ
+
+namespace Disasm {
+/// 命令テーブルの種類
+enum TableNo { T_Base, T_CB, T_ED, T_DD, T_FD, T_DDCB, T_FDCB, NumTables };
+
+/// 途切れた命令などを1バイトの DB として扱うエントリ
+const unsigned DataEntry = NumTables * 256;
+
+/// 命令テーブル
+///
+/// text は Formatter の書式からインデントを除いたもので、オペランドの値を
+/// '#'(8ビット), '@'(16ビット), '%'(相対), '&'(インデックスのオフセット)
+/// で表す。text が空のエントリは length バイトの DB として出力する。
+struct Table {
+  std::string text[DataEntry + 1];
+  uint8_t length[DataEntry + 1];
+  /// 先頭バイト → エントリ。プレフィックスは Prefix | 次に引くテーブル
+  uint16_t first[256];
+  static const uint16_t Prefix = 0x8000;
+  Table();
+};
+
+XZ80_DECL Table::Table() : length(), first() {
+  static const char* const r[] = {"B", "C", "D", "E", "H", "L", "(HL)", "A"};
+  static const char* const rp[] = {"BC", "DE", "HL", "SP"};
+  static const char* const rp2[] = {"BC", "DE", "HL", "AF"};
+  static const char* const cc[] = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
+  static const char* const alu[] = {"ADD A, ", "ADC A, ", "SUB A, ", "SBC A, ",
+                                    "AND ", "XOR ", "OR ", "CP "};
+  static const char* const rot[] = {"RLC ", "RRC ", "RL ", "RR ",
+                                    "SLA ", "SRA ", "SLL ", "SRL "};
+  static const char* const bit[] = {"BIT ", "RES ", "SET "};
+  static const char* const x0z7[] = {"RLCA ", "RRCA ", "RLA ", "RRA ",
+                                     "DAA ", "CPL ", "SCF ", "CCF "};
+  static const char* const bli[4][4] = {
+      {"LDI ", "CPI ", "INI ", "OUTI "},
+      {"LDD ", "CPD ", "IND ", "OUTD "},
+      {"LDIR ", "CPIR ", "INIR ", "OTIR "},
+      {"LDDR ", "CPDR ", "INDR ", "OTDR "},
+  };
+  static const int im[] = {0, 0, 1, 2, 0, 0, 1, 2};
+
+  for (int op = 0; op < 256; ++op) {
+    const int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+    const std::string ry(r[y]), rz(r[z]), ys(1, static_cast<char>('0' + y));
+
+    // 1バイト命令
+    std::string& t = text[T_Base * 256 + op];
+    if (x == 0) {
+      static const char* const x0z0[] = {"NOP ", "EX AF, AF'", "DJNZ %", "JR %"};
+      switch (z) {
+        case 0:
+          t = (y < 4) ? std::string(x0z0[y]) : std::string("JR ") + cc[y - 4] + ", %";
+          break;
+        case 1:
+          t = q ? std::string("ADD HL, ") + rp[p] : std::string("LD ") + rp[p] + ", @";
+          break;
+        case 2: {
+          static const char* const ld[] = {"LD (BC), A", "LD A, (BC)", "LD (DE), A",
+                                           "LD A, (DE)", "LD (@), HL", "LD HL, (@)",
+                                           "LD (@), A",  "LD A, (@)"};
+          t = ld[y];
+          break;
+        }
+        case 3:
+          t = std::string(q ? "DEC " : "INC ") + rp[p];
+          break;
+        case 4:
+          t = "INC " + ry;
+          break;
+        case 5:
+          t = "DEC " + ry;
+          break;
+        case 6:
+          t = "LD " + ry + ", #";
+          break;
+        default:
+          t = x0z7[y];
+          break;
+      }
+    } else if (x == 1) {
+      t = (op == 0x76) ? std::string("HALT ") : "LD " + ry + ", " + rz;
+    } else if (x == 2) {
+      t = alu[y] + rz;
+    } else {
+      switch (z) {
+        case 0:
+          t = std::string("RET ") + cc[y];
+          break;
+        case 1: {
+          static const char* const x3z1[] = {"RET ", "EXX ", "JP (HL)", "LD SP, HL"};
+          t = q ? std::string(x3z1[p]) : std::string("POP ") + rp2[p];
+          break;
+        }
+        case 2:
+          t = std::string("JP ") + cc[y] + ", @";
+          break;
+        case 3: {
+          static const char* const x3z3[] = {"JP @",        "",           "OUT (#), A", "IN A, (#)",
+                                             "EX (SP), HL", "EX DE, HL", "DI ",        "EI "};
+          t = x3z3[y];
+          break;
+        }
+        case 4:
+          t = std::string("CALL ") + cc[y] + ", @";
+          break;
+        case 5:
+          t = q ? (p == 0 ? "CALL @" : "") : std::string("PUSH ") + rp2[p];
+          break;
+        case 6:
+          t = alu[y] + std::string("#");
+          break;
+        default: {
+          char buf[16];
+          std::sprintf(buf, "RST 0%xh", y * 8);
+          t = buf;
+          break;
+        }
+      }
+    }
+
+    // CB
+    text[T_CB * 256 + op] = (x == 0) ? rot[y] + rz : bit[x - 1] + ys + ", " + rz;
+
+    // DDCB/FDCB
+    for (int i = 0; i < 2; ++i) {
+      const std::string m = (i == 0) ? "(IX&)" : "(IY&)";
+      std::string& u = text[(T_DDCB + i) * 256 + op];
+      if (x == 0) {
+        u = rot[y] + m;
+      } else {
+        u = bit[x - 1] + ys + ", " + m;
+      }
+      if (x != 1 && z != 6) {
+        u += ", " + rz;
+      }
+      length[(T_DDCB + i) * 256 + op] = 4;
+    }
+
+    // ED
+    std::string& e = text[T_ED * 256 + op];
+    if (x == 1) {
+      switch (z) {
+        case 0:
+          e = "IN " + (y == 6 ? std::string("F") : ry) + ", (C)";
+          break;
+        case 1:
+          e = "OUT (C), " + (y == 6 ? std::string("0") : ry);
+          break;
+        case 2:
+          e = std::string(q ? "ADC HL, " : "SBC HL, ") + rp[p];
+          break;
+        case 3:
+          e = q ? std::string("LD ") + rp[p] + ", (@)" : std::string("LD (@), ") + rp[p];
+          break;
+        case 4:
+          e = "NEG ";
+          break;
+        case 5:
+          e = (y == 1) ? "RETI " : "RETN ";
+          break;
+        case 6:
+          e = "IM " + std::string(1, static_cast<char>('0' + im[y]));
+          break;
+        default: {
+          static const char* const x1z7[] = {"LD I, A", "LD R, A", "LD A, I", "LD A, R",
+                                             "RRD ",    "RLD ",    "",        ""};
+          e = x1z7[y];
+          break;
+        }
+      }
+    } else if (x == 2 && z <= 3 && 4 <= y) {
+      e = bli[y - 4][z];
+    }
+  }
+
+  // DD/FD は HL を IX/IY に置き換えられる命令だけが有効
+  const auto isDelim = [](const std::string& t, size_t i) {
+    return t.size() <= i || t[i] == ' ' || t[i] == ',';
+  };
+  const auto replaceWord = [&](std::string& t, const std::string& from, const std::string& to) {
+    bool done = false;
+    for (size_t i = t.find(from); i != std::string::npos; i = t.find(from, i + 1)) {
+      if ((i == 0 || isDelim(t, i - 1)) && isDelim(t, i + from.size())) {
+        t.replace(i, from.size(), to);
+        done = true;
+      }
+    }
+    return done;
+  };
+  for (int i = 0; i < 2; ++i) {
+    const std::string xy = (i == 0) ? "IX" : "IY";
+    for (int op = 0; op < 256; ++op) {
+      std::string t = text[T_Base * 256 + op];
+      bool valid;
+      if (op == 0xe9) {
+        t = "JP (" + xy + ")";
+        valid = true;
+      } else if (op == 0xeb) {
+        valid = false;  // EX DE, HL は置き換えない
+      } else if (t.find("(HL)") != std::string::npos) {
+        t.replace(t.find("(HL)"), 4, "(" + xy + "&)");
+        valid = true;
+      } else {
+        valid = replaceWord(t, "HL", xy);
+        if (!valid) {
+          valid = replaceWord(t, "H", xy + "H") | replaceWord(t, "L", xy + "L");
+        }
+      }
+      text[(T_DD + i) * 256 + op] = valid ? t : std::string();
+      if (!valid) {
+        length[(T_DD + i) * 256 + op] = 1;
+      }
+    }
+  }
+
+  // 長さ = プレフィックスとオペコード + オペランド
+  for (unsigned n = 0; n < DataEntry; ++n) {
+    if (length[n] != 0) {
+      continue;
+    }
+    const unsigned tno = n >> 8;
+    const std::string& t = text[n];
+    if (t.empty()) {
+      length[n] = 2;  // 未定義の ED
+      continue;
+    }
+    unsigned len = (tno == T_Base) ? 1 : 2;
+    for (const char c : t) {
+      len += (c == '#' || c == '%' || c == '&') ? 1 : (c == '@') ? 2 : 0;
+    }
+    length[n] = static_cast<uint8_t>(len);
+  }
+  length[DataEntry] = 1;
+
+  for (int op = 0; op < 256; ++op) {
+    first[op] = static_cast<uint16_t>(T_Base * 256 + op);
+  }
+  first[0xcb] = Prefix | T_CB;
+  first[0xed] = Prefix | T_ED;
+  first[0xdd] = Prefix | T_DD;
+  first[0xfd] = Prefix | T_FD;
+}
+
+/// 命令テーブル(初回の使用時に作成する)
+inline const Table& table(void) {
+  static const Table t;
+  return t;
+}
+
+/// 数値を Formatter と同じ "0%xh" の形式で追加する
+inline void putHexNum(std::string& out, unsigned n) {
+  char buf[12];
+  char* p = buf + sizeof(buf);
+  *--p = 'h';
+  do {
+    *--p = "0123456789abcdef"[n & 0x0f];
+    n >>= 4;
+  } while (n != 0);
+  *--p = '0';
+  out.append(p, buf + sizeof(buf) - p);
+}
+
+/// テーブルを引いて1命令をデコードする(size は 1 以上)
+inline size_t decodeWith(const Table& t, const uint8_t* data, size_t size, uint32_t addr,
+                         Insn& insn) {
+  // 末尾の4バイト未満は0で埋めて同じ手順で引く
+  uint8_t pad[4] = {0, 0, 0, 0};
+  const uint8_t* d = data;
+  if (size < 4) {
+    std::memcpy(pad, data, size);
+    d = pad;
+  }
+  unsigned entry = t.first[d[0]];
+  if (entry & Table::Prefix) {
+    const unsigned tno = entry & 0xff;
+    entry = (tno != T_CB && tno != T_ED && d[1] == 0xcb)
+                ? (tno - T_DD + T_DDCB) * 256 + d[3]
+                : tno * 256 + d[1];
+  }
+  size_t len = t.length[entry];
+  if (size < len) {
+    entry = DataEntry;  // 途中で途切れた命令
+    len = 1;
+  }
+  insn.addr = addr;
+  insn.entry = static_cast<uint16_t>(entry);
+  insn.length = static_cast<uint8_t>(len);
+  std::memcpy(insn.bytes, d, 4);
+  for (size_t i = len; i < 4; ++i) {
+    insn.bytes[i] = 0;
+  }
+  return len;
+}
+
+XZ80_DECL size_t decode(const uint8_t* data, size_t size, uint32_t addr, Insn& insn) {
+  if (size == 0) {
+    return 0;
+  }
+  return decodeWith(table(), data, size, addr, insn);
+}
+
+/// data[begin] から end を越えるまでデコードして out の末尾に追加する
+/// @return 最後の命令の次の位置
+inline size_t decodeRange(const Table& t, std::vector<Insn>& out, const uint8_t* data,
+                          size_t size, uint32_t addr, size_t begin, size_t end) {
+  const size_t first = out.size();
+  out.resize(first + (end - begin));  // 命令数はバイト数を超えない
+  Insn* p = out.data() + first;
+  size_t pos = begin;
+  for (; pos < end; ++p) {
+    pos += decodeWith(t, data + pos, size - pos, addr + static_cast<uint32_t>(pos), *p);
+  }
+  out.resize(p - out.data());
+  return pos;
+}
+
+XZ80_DECL size_t decodeAll(std::vector<Insn>& out, const uint8_t* data, size_t size,
+                           uint32_t addr, unsigned threads) {
+  const Table& t = table();
+  const size_t first = out.size();
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const size_t minPerPart = 64 * 1024;
+  const size_t parts = std::max<size_t>(1, std::min<size_t>(threads, size / minPerPart));
+  if (parts == 1) {
+    decodeRange(t, out, data, size, addr, 0, size);
+    return out.size() - first;
+  }
+
+  // 区間毎に仮の境界からデコードする
+  const size_t step = (size + parts - 1) / parts;
+  std::vector<std::vector<Insn> > part(parts);
+  std::vector<size_t> partEnd(parts);
+  Output::parallelFor(parts, static_cast<unsigned>(parts), [&](size_t begin, size_t end) {
+    for (size_t k = begin; k < end; ++k) {
+      partEnd[k] = decodeRange(t, part[k], data, size, addr, k * step,
+                               std::min(size, (k + 1) * step));
+    }
+  }, 1);
+
+  // 前の区間の終わりから、次の区間の命令境界と一致するまでデコードし直す
+  size_t pos = 0;
+  for (size_t k = 0; k < parts; ++k) {
+    const std::vector<Insn>& v = part[k];
+    Insn insn;
+    while (true) {
+      const uint32_t a = addr + static_cast<uint32_t>(pos);
+      const auto itr = std::lower_bound(v.begin(), v.end(), a, [](const Insn& i, uint32_t x) {
+        return i.addr < x;
+      });
+      if (itr != v.end() && itr->addr == a) {
+        out.insert(out.end(), itr, v.end());
+        pos = partEnd[k];
+        break;
+      }
+      if (v.empty() || v.back().addr < a) {
+        break;  // この区間では同期しなかった
+      }
+      pos += decodeWith(t, data + pos, size - pos, a, insn);
+      out.push_back(insn);
+    }
+  }
+  if (pos < size) {
+    decodeRange(t, out, data, size, addr, pos, size);
+  }
+  return out.size() - first;
+}
+
+XZ80_DECL void format(std::string& out, const Insn& insn) {
+  const std::string& t = table().text[insn.entry];
+  if (t.empty()) {
+    out.append("    DB ");
+    for (size_t i = 0; i < insn.length; ++i) {
+      if (i != 0) {
+        out.append(", ");
+      }
+      putHexNum(out, insn.bytes[i]);
+    }
+    return;
+  }
+
+  out.append("    ");
+  size_t arg = ((insn.entry >> 8) == T_Base) ? 1 : 2;
+  for (const char c : t) {
+    switch (c) {
+      case '#':
+        putHexNum(out, insn.bytes[arg++]);
+        break;
+      case '@':
+        putHexNum(out, insn.bytes[arg] | insn.bytes[arg + 1] << 8);
+        arg += 2;
+        break;
+      case '%': {
+        char buf[8];
+        std::sprintf(buf, "$%+d", static_cast<int8_t>(insn.bytes[arg++]) + 2);
+        out.append(buf);
+        break;
+      }
+      case '&': {
+        const int d = static_cast<int8_t>(insn.bytes[arg++]);
+        out.push_back(d < 0 ? '-' : '+');
+        putHexNum(out, d < 0 ? -d : d);
+        break;
+      }
+      default:
+        out.push_back(c);
+        break;
+    }
+  }
+}
+
+XZ80_DECL std::string text(const Insn& insn) {
+  std::string s;
+  format(s, insn);
+  return s;
+}
+
+/// 1命令分の行を out の末尾に追加する
+inline void formatLine(std::string& out, const Insn& insn, bool comment) {
+  static const char digits[] = "0123456789ABCDEF";
+  static const char lower[] = "0123456789abcdef";
+  const size_t start = out.size();
+  format(out, insn);
+  if (comment) {
+    // "%-20s\t;%04Xh: " に続けてバイト列
+    const size_t width = out.size() - start;
+    if (width < 20) {
+      out.append(20 - width, ' ');
+    }
+    char buf[32];
+    char* p = buf;
+    *p++ = '\t';
+    *p++ = ';';
+    int shift = 12;
+    while (shift < 28 && (insn.addr >> (shift + 4)) != 0) {
+      shift += 4;
+    }
+    for (; 0 <= shift; shift -= 4) {
+      *p++ = digits[(insn.addr >> shift) & 0x0f];
+    }
+    *p++ = 'h';
+    *p++ = ':';
+    *p++ = ' ';
+    for (size_t i = 0; i < insn.length; ++i) {
+      *p++ = lower[insn.bytes[i] >> 4];
+      *p++ = lower[insn.bytes[i] & 0x0f];
+      *p++ = ' ';
+    }
+    out.append(buf, p);
+  }
+  out.push_back('\n');
+}
+
+XZ80_DECL void disassemble(std::string& out, const uint8_t* data, size_t size,
+                           uint32_t addr, bool comment, unsigned threads) {
+  if (threads == 1) {
+    const Table& t = table();
+    Insn insn;
+    for (size_t pos = 0; pos < size;) {
+      pos += decodeWith(t, data + pos, size - pos, addr + static_cast<uint32_t>(pos), insn);
+      formatLine(out, insn, comment);
+    }
+    return;
+  }
+
+  // デコードした命令を区間に分けて並列に文字列にする
+  std::vector<Insn> insns;
+  decodeAll(insns, data, size, addr, threads);
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const size_t parts = std::max<size_t>(1, std::min<size_t>(threads, insns.size() / 16384));
+  const size_t step = (insns.size() + parts - 1) / parts;
+  std::vector<std::string> texts(parts);
+  Output::parallelFor(parts, static_cast<unsigned>(parts), [&](size_t begin, size_t end) {
+    for (size_t k = begin; k < end; ++k) {
+      const size_t last = std::min(insns.size(), (k + 1) * step);
+      texts[k].reserve((last - k * step) * (comment ? 40 : 16));
+      for (size_t i = k * step; i < last; ++i) {
+        formatLine(texts[k], insns[i], comment);
+      }
+    }
+  }, 1);
+  for (const auto& text : texts) {
+    out.append(text);
+  }
+}
+}  // namespace Disasm
+
+// =======================================================================
+// コードジェネレータ
+
+XZ80_DECL void Mnemonic::assign(uint16_t addr, const std::string& mnemonic,
+            const std::vector<uint8_t>& bytes) {
+  m_addr = addr;
+  m_mnemonic.assign(mnemonic);
+  m_bytes.assign(bytes.begin(), bytes.end());
+  m_label.clear();
+  m_offset = 0;
+  m_rel = false;
+  m_srcId = 0;
+}
+
+XZ80_DECL void Mnemonic::resolveAddr(uint16_t addr) {
+  if (m_rel) {
+    const int e = static_cast<int>(addr) - static_cast<int>(m_addr);
+    if (e < -126 || 129 < e) {
+      char buf[64];
+      std::sprintf(buf, "Label resolve e=%d:out of range", e);
+      throw std::out_of_range(buf);
+    }
+    m_bytes[m_offset] = static_cast<uint8_t>((e - 2) & 0xff);
+  } else {
+    MemAddr ma(addr);
+    m_bytes[m_offset] = ma.l;
+    m_bytes[m_offset + 1] = ma.h;
+  }
+  m_label.clear();
+  m_offset = 0;
+}
+
+XZ80_DECL uint32_t Generator::sourceId(const SourceLoc& loc) {
+  if (!m_srcTrack) {
+    return 0;
+  }
+  const auto key = std::make_pair(loc.file, loc.line);
+  const auto itr = m_srcIdMap.find(key);
+  if (itr != m_srcIdMap.end()) {
+    return itr->second;
+  }
+
+  // 同名ファイルは同じ番号にまとめる
+  uint32_t fileNo = 0;
+  while (fileNo < m_srcFiles.size() && m_srcFiles[fileNo] != loc.file) {
+    ++fileNo;
+  }
+  if (fileNo == m_srcFiles.size()) {
+    m_srcFiles.push_back(loc.file);
+  }
+  m_srcLocs.push_back(std::make_pair(fileNo, loc.line));
+  const uint32_t id = m_srcLocs.size();
+  m_srcIdMap.insert(std::make_pair(key, id));
+  return id;
+}
+
+XZ80_DECL void Generator::append(const std::string& mnemonic, const std::vector<uint8_t>& bytes,
+            const SourceLoc& loc) {
+  if (m_mnemonicPool.empty()) {
+    m_mnemonics.emplace_back(m_curr, mnemonic, bytes);
+  } else {
+    m_mnemonics.push_back(std::move(m_mnemonicPool.back()));
+    m_mnemonicPool.pop_back();
+    m_mnemonics.back().assign(m_curr, mnemonic, bytes);
+  }
+  m_mnemonics.back().setSourceId(sourceId(loc));
+  m_curr += bytes.size();
+}
+
+XZ80_DECL void Generator::reset(uint16_t org) {
+  m_org = org;
+  m_curr = org;
+  for (auto& m : m_mnemonics) {
+    m_mnemonicPool.push_back(std::move(m));
+  }
+  m_mnemonics.clear();
+  m_sections.clear();
+  m_lzUnpack = false;
+  m_poolEntries.clear();
+  m_poolIndex.clear();
+  m_poolRequests = 0;
+  m_poolRequested = 0;
+  m_poolBase = 0;
+  while (!m_labelMap.empty()) {
+    m_labelPool.push_back(m_labelMap.extract(m_labelMap.begin()));
+  }
+}
+
+XZ80_DECL void Generator::dump() const {
+  std::printf("ORG 0%xh\n", m_org);
+  for (const auto& m : m_mnemonics) {
+    std::string s;
+    char buf[8];
+    for (const auto b : m.getBytes()) {
+      std::sprintf(buf, "%02x ", b);
+      s += buf;
+    }
+    if (m.getSourceId() != 0) {
+      const auto& sl = m_srcLocs[m.getSourceId() - 1];
+      std::sprintf(buf, "%u", static_cast<unsigned>(sl.second));
+      s.append("@").append(m_srcFiles[sl.first]).append(":").append(buf);
+    }
+    std::printf("%-20s\t;%04Xh(%+d): %s\n",  //
+                m.getMnemonic().c_str(), m.getAddr(), m.getAddr() - m_org,
+                s.c_str());
+  }
+}
+
+XZ80_DECL bool Generator::getSourceLoc(uint32_t id, std::string& file, uint_least32_t& line) const {
+  if (id == 0 || m_srcLocs.size() < id) {
+    return false;
+  }
+  const auto& sl = m_srcLocs[id - 1];
+  file = m_srcFiles[sl.first];
+  line = sl.second;
+  return true;
+}
+
+XZ80_DECL void Generator::srcmap(const char* fn) const {
+  FILE* fp = Output::openFile(fn, "wb");
+  std::fprintf(fp, "[files]\n");
+  for (size_t i = 0; i < m_srcFiles.size(); ++i) {
+    std::fprintf(fp, "%u %s\n", static_cast<unsigned>(i), m_srcFiles[i].c_str());
+  }
+  std::fprintf(fp, "[lines]\n");
+  for (size_t i = 0; i < m_srcLocs.size(); ++i) {
+    std::fprintf(fp, "%u %u %u\n", static_cast<unsigned>(i + 1),
+                 static_cast<unsigned>(m_srcLocs[i].first),
+                 static_cast<unsigned>(m_srcLocs[i].second));
+  }
+  std::fprintf(fp, "[addrs]\n");
+  for (const auto& m : m_mnemonics) {
+    if (m.getSourceId() == 0) {
+      continue;
+    }
+    std::fprintf(fp, "%04X %u %u\n", m.getAddr(),
+                 static_cast<unsigned>(m.getBytes().size()),
+                 static_cast<unsigned>(m.getSourceId()));
+  }
+  fclose(fp);
+}
+
+namespace Output {
+/// ストリームへ書き出すまでに溜めるバイト数
+const size_t RenderChunk = 64 * 1024;
+
+inline void renderFlush(std::string& out, std::ostream* os, bool force) {
+  if (os != nullptr && (force || RenderChunk <= out.size())) {
+    os->write(out.data(), out.size());
+    out.clear();
+  }
+}
+
+inline void putLE(std::string& out, uint32_t val, int n) {
+  for (int i = 0; i < n; ++i) {
+    out.push_back(static_cast<char>(val >> (i * 8)));
+  }
+}
+
+/// JSON の文字列リテラルとして追加する
+inline void putJsonString(std::string& out, const char* str, size_t len) {
+  out.push_back('"');
+  for (size_t i = 0; i < len; ++i) {
+    const unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (c < 0x20) {
+      char buf[8];
+      std::sprintf(buf, "\\u%04x", c);
+      out.append(buf);
+    } else {
+      out.push_back(c);
+    }
+  }
+  out.push_back('"');
+}
+
+/// ニーモニックの字下げを除いた文字列
+inline std::pair<const char*, size_t> trimMnemonic(const std::string& s) {
+  size_t i = 0;
+  while (i < s.size() && s[i] == ' ') {
+    ++i;
+  }
+  return std::make_pair(s.c_str() + i, s.size() - i);
+}
+}  // namespace Output
+
+XZ80_DECL void Generator::renderSymbols(std::string& out, std::ostream* os) const {
+  std::vector<std::pair<uint16_t, const std::string*> > syms;
+  syms.reserve(m_labelMap.size());
+  for (const auto& kv : m_labelMap) {
+    syms.push_back(std::make_pair(kv.second, &kv.first));
+  }
+  std::stable_sort(syms.begin(), syms.end(),
+                   [](const std::pair<uint16_t, const std::string*>& a,
+                      const std::pair<uint16_t, const std::string*>& b) {
+                     return a.first < b.first;
+                   });
+
+  size_t next = 0;  // 次にアドレスが変わるラベルの番号
+  char buf[32];
+  for (size_t i = 0; i < syms.size(); ++i) {
+    if (next <= i) {
+      next = i + 1;
+      while (next < syms.size() && syms[next].first == syms[i].first) {
+        ++next;
+      }
+    }
+    const unsigned end = (next < syms.size()) ? syms[next].first : m_curr;
+    std::sprintf(buf, "%04X %u ", syms[i].first, end - syms[i].first);
+    out.append(buf).append(*syms[i].second).push_back('\n');
+    Output::renderFlush(out, os, false);
+  }
+}
+
+XZ80_DECL void Generator::renderSections(std::string& out, std::ostream* os) const {
+  std::vector<std::pair<std::string, size_t> > secs;
+  if (m_sections.empty() || m_sections.front().second != 0) {
+    secs.push_back(std::make_pair(std::string("CODE"), size_t(0)));
+  }
+  secs.insert(secs.end(), m_sections.begin(), m_sections.end());
+
+  char buf[48];
+  for (size_t i = 0; i < secs.size(); ++i) {
+    const size_t first = secs[i].second;
+    const size_t last = (i + 1 < secs.size()) ? secs[i + 1].second : m_mnemonics.size();
+    const unsigned start = (first < m_mnemonics.size()) ? m_mnemonics[first].getAddr() : m_curr;
+    const unsigned end = (last < m_mnemonics.size()) ? m_mnemonics[last].getAddr() : m_curr;
+    size_t count = 0;
+    for (size_t j = first; j < last; ++j) {
+      count += !m_mnemonics[j].getBytes().empty();
+    }
+    std::sprintf(buf, "%04X %u %u ", start, end - start, static_cast<unsigned>(count));
+    out.append(buf).append(secs[i].first).push_back('\n');
+  }
+  Output::renderFlush(out, os, false);
+}
+
+XZ80_DECL void Generator::renderListing(std::string& out, std::ostream* os,
+                                        Output::ListingFormat format) const {
+  if (format == Output::L_Binary) {
+    out.append("XZL2");
+    Output::putLE(out, m_org, 2);
+    Output::putLE(out, static_cast<uint32_t>(m_mnemonics.size()), 4);
+    for (const auto& m : m_mnemonics) {
+      const auto& bs = m.getBytes();
+      const auto text = Output::trimMnemonic(m.getMnemonic());
+      Output::putLE(out, m.getAddr(), 2);
+      Output::putLE(out, static_cast<uint32_t>(bs.size()), 4);
+      out.append(bs.begin(), bs.end());
+      Output::putLE(out, static_cast<uint32_t>(text.second), 4);
+      out.append(text.first, text.second);
+      Output::putLE(out, m.getSourceId(), 4);
+      Output::renderFlush(out, os, false);
+    }
+    Output::putLE(out, static_cast<uint32_t>(m_srcFiles.size()), 4);
+    for (const auto& f : m_srcFiles) {
+      Output::putLE(out, static_cast<uint32_t>(f.size()), 2);
+      out.append(f);
+    }
+    Output::putLE(out, static_cast<uint32_t>(m_srcLocs.size()), 4);
+    for (const auto& sl : m_srcLocs) {
+      Output::putLE(out, sl.first, 4);
+      Output::putLE(out, static_cast<uint32_t>(sl.second), 4);
+    }
+    Output::renderFlush(out, os, false);
+    return;
+  }
+
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "{\"org\":%u,\"size\":%u,\"lines\":[", m_org,
+                static_cast<unsigned>(m_curr - m_org));
+  out.append(buf);
+  bool first = true;
+  for (const auto& m : m_mnemonics) {
+    std::sprintf(buf, "%s\n{\"addr\":%u,\"bytes\":\"", first ? "" : ",", m.getAddr());
+    out.append(buf);
+    first = false;
+    for (const auto b : m.getBytes()) {
+      std::sprintf(buf, "%02x", b);
+      out.append(buf);
+    }
+    out.append("\",\"text\":");
+    const auto text = Output::trimMnemonic(m.getMnemonic());
+    Output::putJsonString(out, text.first, text.second);
+    if (m.getSourceId() != 0) {
+      const auto& sl = m_srcLocs[m.getSourceId() - 1];
+      std::sprintf(buf, ":%u", static_cast<unsigned>(sl.second));
+      const std::string src = m_srcFiles[sl.first] + buf;
+      out.append(",\"src\":");
+      Output::putJsonString(out, src.data(), src.size());
+    }
+    out.push_back('}');
+    Output::renderFlush(out, os, false);
+  }
+  out.append("\n]}\n");
+  Output::renderFlush(out, os, false);
+}
+
+XZ80_DECL void Generator::symbolMap(std::ostream& os) const {
+  std::string out;
+  renderSymbols(out, &os);
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL Output::WriteStats Generator::symbolMap(const char* fn) const {
+  std::string out;
+  renderSymbols(out, nullptr);
+  return Output::writeFile(fn, out.data(), out.size(), m_updateFiles);
+}
+
+XZ80_DECL void Generator::sectionMap(std::ostream& os) const {
+  std::string out;
+  renderSections(out, &os);
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL Output::WriteStats Generator::sectionMap(const char* fn) const {
+  std::string out;
+  renderSections(out, nullptr);
+  return Output::writeFile(fn, out.data(), out.size(), m_updateFiles);
+}
+
+XZ80_DECL void Generator::listing(std::ostream& os, Output::ListingFormat format) const {
+  std::string out;
+  renderListing(out, &os, format);
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL Output::WriteStats Generator::listing(const char* fn,
+                                                Output::ListingFormat format) const {
+  std::string out;
+  renderListing(out, nullptr, format);
+  return Output::writeFile(fn, out.data(), out.size(), m_updateFiles);
+}
+
+XZ80_DECL std::vector<uint8_t> Generator::getBytes(void) const {
+  const size_t size = m_curr - m_org;
+  std::vector<uint8_t> bytes;
+  bytes.reserve(size);
+  for (const auto& m : m_mnemonics) {
+    const auto& bs = m.getBytes();
+    bytes.insert(bytes.end(), bs.begin(), bs.end());
+  }
+  return bytes;
+}
+
+XZ80_DECL Output::WriteStats Generator::save(const char* fn) const {
+  const std::vector<uint8_t> bytes = getBytes();
+  return Output::writeFile(fn, bytes.data(), bytes.size(), m_updateFiles);
+}
+
+XZ80_DECL Output::WriteStats Generator::bsave(const char* fn, uint16_t start_addr) const {
+  std::vector<uint8_t> bytes;
+  bytes.reserve(7 + (m_curr - m_org));
+  const auto wb = [&](uint8_t val)  // WriteByte
+  { bytes.push_back(val); };
+  const auto ww = [&](uint16_t val)  // WriteWord
+  {
+    wb(val & 0xff);
+    wb((val >> 8) & 0xff);
+  };
+
+  // ヘッダの出力
+  wb(0xfe);
+  ww(this->m_org);
+  ww(this->m_curr - 1);
+  ww(start_addr);
+
+  // バイナリデータ本体の出力
+  for (const auto& m : m_mnemonics) {
+    const auto& bs = m.getBytes();
+    bytes.insert(bytes.end(), bs.begin(), bs.end());
+  }
+
+  return Output::writeFile(fn, bytes.data(), bytes.size(), m_updateFiles);
+}
+
+XZ80_DECL Output::WriteStats Generator::patch(const char* fn, const char* base_fn,
+                                              Output::PatchFormat format) const {
+  const std::vector<uint8_t> bytes = getBytes();
+  const Input::MappedFile base(base_fn);
+  std::vector<uint8_t> out;
+  if (format == Output::P_IPS) {
+    Output::ipsPatch(out, base.data(), base.size(), bytes.data(), bytes.size());
+  } else {
+    Output::bpsPatch(out, base.data(), base.size(), bytes.data(), bytes.size());
+  }
+  return Output::writeFile(fn, out.data(), out.size(), m_updateFiles);
+}
+
+XZ80_DECL size_t Generator::diff(std::ostream& os, const uint8_t* base, size_t size,
+                                 const Generator* base_gen) const {
+  const std::vector<uint8_t> bytes = getBytes();
+  std::vector<Output::DiffRange> ranges;
+  Output::diffRanges(ranges, base, size, bytes.data(), bytes.size());
+  if (ranges.empty()) {
+    return 0;
+  }
+
+  // バイト列を持つ命令と、その先頭の org からのオフセット
+  typedef std::vector<std::pair<uint32_t, const Mnemonic*> > Code;
+  const auto codeOf = [](const Generator& g, Code& code) {
+    for (const auto& m : g.m_mnemonics) {
+      if (!m.getBytes().empty()) {
+        code.emplace_back(static_cast<uint16_t>(m.getAddr() - g.m_org), &m);
+      }
+    }
+  };
+  // offset を含む命令の番号(なければ code.size())
+  const auto find = [](const Code& code, uint32_t offset) {
+    auto itr = std::upper_bound(code.begin(), code.end(), offset,
+                                [](uint32_t o, const Code::value_type& c) { return o < c.first; });
+    if (itr == code.begin()) {
+      return code.size();
+    }
+    --itr;
+    const bool inside = offset < itr->first + itr->second->getBytes().size();
+    return inside ? static_cast<size_t>(itr - code.begin()) : code.size();
+  };
+  // offset より後ろで終わる最初の命令
+  const auto after = [](const Code& code, uint32_t offset) {
+    return std::partition_point(code.begin(), code.end(), [&](const Code::value_type& c) {
+      return c.first + c.second->getBytes().size() <= offset;
+    });
+  };
+  Code code, baseCode;
+  codeOf(*this, code);
+  if (base_gen != nullptr) {
+    codeOf(*base_gen, baseCode);
+  }
+
+  std::vector<std::pair<uint16_t, const std::string*> > labels;
+  for (const auto& l : m_labelMap) {
+    labels.emplace_back(l.second, &l.first);
+  }
+  std::stable_sort(labels.begin(), labels.end(),
+                   [](const std::pair<uint16_t, const std::string*>& a,
+                      const std::pair<uint16_t, const std::string*>& b) { return a.first < b.first; });
+
+  std::string out;
+  char buf[64];
+  const auto line = [&](char mark, const char* text, const uint8_t* p, size_t n) {
+    std::sprintf(buf, "  %c ", mark);
+    out.append(buf);
+    const size_t start = out.size();
+    out.append(text);
+    out.append(std::max<size_t>(out.size() - start, 24) - (out.size() - start), ' ');
+    out.append(" ;");
+    for (size_t i = 0; i < n; ++i) {
+      std::sprintf(buf, " %02x", p[i]);
+      out.append(buf);
+    }
+    out.push_back('\n');
+  };
+
+  size_t groups = 0;
+  for (size_t r = 0; r < ranges.size(); ++groups) {
+    uint32_t begin = ranges[r].offset;
+    uint32_t end = begin + ranges[r].size;
+    ++r;
+    // 生成側の命令の境界まで広げ、重なる区間をまとめる
+    const size_t first = find(code, begin);
+    if (first < code.size()) {
+      begin = code[first].first;
+    }
+    for (bool grown = true; grown;) {
+      grown = false;
+      const size_t last = find(code, end - 1);
+      if (last < code.size()) {
+        const uint32_t e =
+            code[last].first + static_cast<uint32_t>(code[last].second->getBytes().size());
+        grown = end < e;
+        end = std::max(end, e);
+      }
+      for (; r < ranges.size() && ranges[r].offset < end; ++r, grown = true) {
+        end = std::max(end, ranges[r].offset + ranges[r].size);
+      }
+    }
+
+    // 見出し: アドレスと直前のラベルからのオフセット
+    const uint16_t addr = static_cast<uint16_t>(m_org + begin);
+    std::sprintf(buf, "%04Xh", addr);
+    out.append(buf);
+    auto label = std::upper_bound(
+        labels.begin(), labels.end(), addr,
+        [](uint16_t a, const std::pair<uint16_t, const std::string*>& l) { return a < l.first; });
+    if (label != labels.begin()) {
+      --label;
+      out.append(" ").append(*label->second);
+      if (label->first != addr) {
+        std::sprintf(buf, "+%u", static_cast<unsigned>(addr - label->first));
+        out.append(buf);
+      }
+    }
+    out.push_back('\n');
+
+    // 基準側
+    const size_t numOut = out.size();
+    if (base_gen != nullptr) {
+      for (auto c = after(baseCode, begin); c != baseCode.end() && c->first < end; ++c) {
+        const auto& bs = c->second->getBytes();
+        line('-', Output::trimMnemonic(c->second->getMnemonic()).first, bs.data(), bs.size());
+      }
+    } else {
+      for (size_t p = begin; p < end && p < size;) {
+        Disasm::Insn insn;
+        const size_t n = Disasm::decode(base + p, size - p, m_org + p, insn);
+        const std::string text = Disasm::text(insn);
+        line('-', Output::trimMnemonic(text).first, base + p, n);
+        p += n;
+      }
+    }
+    if (numOut == out.size()) {
+      out.append("  - (none)\n");
+    }
+
+    // 生成側
+    if (bytes.size() <= begin) {
+      out.append("  + (none)\n");
+    }
+    for (auto c = after(code, begin); c != code.end() && c->first < end; ++c) {
+      const auto& bs = c->second->getBytes();
+      line('+', Output::trimMnemonic(c->second->getMnemonic()).first, bs.data(), bs.size());
+    }
+    Output::renderFlush(out, &os, false);
+  }
+  Output::renderFlush(out, &os, true);
+  return groups;
+}
+
+XZ80_DECL size_t Generator::diff(std::ostream& os, const char* base_fn) const {
+  const Input::MappedFile base(base_fn);
+  return diff(os, base.data(), base.size());
+}
+
+XZ80_DECL Output::LzStats Generator::dbz(const uint8_t* data, size_t size, unsigned threads,
+                                         const SourceLoc& loc) {
+  std::vector<uint8_t> packed;
+  const Output::LzStats stats = Output::lzCompress(packed, data, size, threads);
+  dbLines(packed.data(), packed.size(), loc);
+  return stats;
+}
+
+XZ80_DECL void Generator::dbLines(const uint8_t* data, size_t size, const SourceLoc& loc) {
+  const size_t perLine = 16;
+  std::vector<uint8_t> line;
+  for (size_t i = 0; i < size; i += perLine) {
+    line.assign(data + i, data + std::min(size, i + perLine));
+    db(line, loc);
+  }
+}
+
+XZ80_DECL std::string Generator::poolLabel(size_t index) const {
+  return "POOL." + std::to_string(m_poolBase + index);
+}
+
+XZ80_DECL std::string Generator::dbp(const uint8_t* data, size_t size) {
+  ++m_poolRequests;
+  m_poolRequested += size;
+  const auto ret = m_poolIndex.insert(
+      std::make_pair(std::vector<uint8_t>(data, data + size), m_poolEntries.size()));
+  if (ret.second) {
+    m_poolEntries.push_back(&ret.first->first);
+  }
+  return poolLabel(ret.first->second);
+}
+
+XZ80_DECL Generator::PoolStats Generator::pool(const SourceLoc& loc) {
+  const size_t n = m_poolEntries.size();
+  const auto& entries = m_poolEntries;
+
+  // 逆順の辞書順に並べると、末尾が一致するデータは隣り合う
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return std::lexicographical_compare(entries[a]->rbegin(), entries[a]->rend(),
+                                        entries[b]->rbegin(), entries[b]->rend());
+  });
+
+  // 次のデータの末尾に含まれるなら、その併合先に併合する
+  std::vector<size_t> host(n);
+  for (size_t k = n; k-- > 0;) {
+    const size_t i = order[k];
+    host[i] = i;
+    if (k + 1 < n) {
+      const auto& a = *entries[i];
+      const auto& b = *entries[order[k + 1]];
+      if (a.size() <= b.size() && std::equal(a.rbegin(), a.rend(), b.rbegin())) {
+        host[i] = host[order[k + 1]];
+      }
+    }
+  }
+
+  // 併合先毎に (位置, 登録番号) を集める
+  std::vector<std::vector<std::pair<size_t, size_t> > > labels(n);
+  for (size_t i = 0; i < n; ++i) {
+    const size_t h = host[i];
+    labels[h].push_back(std::make_pair(entries[h]->size() - entries[i]->size(), i));
+  }
+
+  PoolStats stats{m_poolRequests, n, m_poolRequested, 0};
+  for (size_t h = 0; h < n; ++h) {
+    if (host[h] != h) {
+      continue;
+    }
+    const auto& bytes = *entries[h];
+    auto& ls = labels[h];
+    std::sort(ls.begin(), ls.end());
+    size_t pos = 0;
+    for (const auto& pl : ls) {
+      dbLines(bytes.data() + pos, pl.first - pos, loc);
+      pos = pl.first;
+      l(poolLabel(pl.second).c_str(), loc);
+    }
+    dbLines(bytes.data() + pos, bytes.size() - pos, loc);
+    stats.emittedBytes += bytes.size();
+  }
+
+  m_poolBase += n;
+  m_poolEntries.clear();
+  m_poolIndex.clear();
+  m_poolRequests = 0;
+  m_poolRequested = 0;
+  return stats;
+}
+
+XZ80_DECL void Generator::lzUnpack(const char* label, const SourceLoc& loc) {
+  if (m_lzUnpack) {
+    return;
+  }
+  m_lzUnpack = true;
+
+  // T-states は Output::lzCompress() の見積もりと合わせること。
+  // LDIR の後は BC=0 なので、B の再設定は遠距離の一致の後だけで良い
+  const std::string top(label);
+  const std::string loop = top + ".loop";
+  const std::string match = top + ".match";
+  const std::string far = top + ".far";
+  l(label, loc);
+  ld(B, 0, loc);             //  7
+  l(loop.c_str(), loc);      //
+  ld(A, HL(), loc);          //  7 トークン
+  inc(HL, loc);              //  6
+  or (A, loc);               //  4
+  ret(Z, loc);               //  5/11 終端
+  jp(M, match, loc);         // 10
+  ld(C, A, loc);             //  4 リテラル
+  ldir(loc);                 // 21n-5
+  jp(loop, loc);             // 10 → 41+21n
+  l(match.c_str(), loc);     //    (ここまで 32)
+  cp(0xc0, loc);             //  7
+  jr(NC, far, loc);          //  7/12
+  and (0x3f, loc);           //  7 近距離の一致
+  add(A, 2, loc);            //  7
+  ld(C, A, loc);             //  4
+  ld(A, HL(), loc);          //  7
+  inc(HL, loc);              //  6
+  push(HL, loc);             // 11
+  ld(L, A, loc);             //  4
+  ld(H, 0xff, loc);          //  7
+  add(HL, DE, loc);          // 11
+  ldir(loc);                 // 21n-5
+  pop(HL, loc);              // 10
+  jp(loop, loc);             // 10 → 125+21n
+  l(far.c_str(), loc);       //
+  and (0x3f, loc);           //  7 遠距離の一致
+  add(A, 3, loc);            //  7
+  ld(C, A, loc);             //  4
+  ld(B, HL(), loc);          //  7
+  inc(HL, loc);              //  6
+  ld(A, HL(), loc);          //  7
+  inc(HL, loc);              //  6
+  push(HL, loc);             // 11
+  ld(H, A, loc);             //  4
+  ld(L, B, loc);             //  4
+  ld(B, 0, loc);             //  7
+  add(HL, DE, loc);          // 11
+  ldir(loc);                 // 21n-5
+  pop(HL, loc);              // 10
+  jp(loop, loc);             // 10 → 147+21n
+}
+
+XZ80_DECL Output::WriteStats Generator::hex(const char* fn, const uint8_t bpr) const {
+  const std::string s = toHex(bpr);
+  return Output::writeFile(fn, s.data(), s.size(), m_updateFiles);
+}
+
+XZ80_DECL void Generator::hex(std::ostream& os, const uint8_t bpr) const {
+  const std::string s = toHex(bpr);
+  os.write(s.data(), s.size());
+}
+
+XZ80_DECL std::string Generator::toHex(const uint8_t bpr) const {
+  const std::vector<uint8_t> bytes = getBytes();
+  std::string s;
+  Output::intelHex(s, bytes.data(), bytes.size(), m_org, bpr);
+  return s;
+}
+
+XZ80_DECL Output::WriteStats Generator::mot(const char* fn, uint16_t start_addr, const uint8_t bpr) const {
+  const std::string s = toMot(fn, start_addr, bpr);
+  return Output::writeFile(fn, s.data(), s.size(), m_updateFiles);
+}
+
+XZ80_DECL void Generator::mot(std::ostream& os, const char* name, uint16_t start_addr,
+                              const uint8_t bpr) const {
+  const std::string s = toMot(name, start_addr, bpr);
+  os.write(s.data(), s.size());
+}
+
+XZ80_DECL std::string Generator::toMot(const char* name, uint16_t start_addr,
+                                       const uint8_t bpr) const {
+  const std::vector<uint8_t> bytes = getBytes();
+  std::string s;
+  Output::motorola(s, name, bytes.data(), bytes.size(), m_org, start_addr, bpr);
+  return s;
+}
+
+XZ80_DECL bool Generator::resolve(bool verbose) {
+  int numError = 0;
+  if (verbose) {
+    std::printf(";\x1b[1;36mLabel address resolve..\x1b[0m\n");
+  }
+  for (auto& m : m_mnemonics) {
+    if (m.getLabel().empty()) {
+      continue;
+    }
+
+    const auto itr = this->m_labelMap.find(m.getLabel());
+    if (itr == m_labelMap.end()) {
+      // 解決不能なラベルだった
+      if (verbose) {
+        std::printf(
+            ";0%04xh: %-20s\t;\x1b[1;31mLabel '%s' is not resolved.\x1b[0m\n",  //
+            m.getAddr(), m.getMnemonic().c_str(), m.getLabel().c_str());
+      }
+      ++numError;
+      continue;
+    }
+
+    // アドレスを埋め込む
+    if (verbose) {
+      std::printf(
+          ";0%04xh: %-20s\t;\x1b[1;32mLabel '%s' = 0%04xh\x1b[0m\n",  //
+          m.getAddr(), m.getMnemonic().c_str(), m.getLabel().c_str(),
+          itr->second);
+    }
+    m.resolveAddr(itr->second);
+  }  // for
+
+  if (verbose) {
+    if (numError != 0) {
+      std::printf(";\x1b[1;36m%d unresolved mnemonic(s) found.\x1b[0m\n",
+                  numError);
+    } else {
+      std::printf(";\x1b[1;36mAll mnemonic labels resolved.\x1b[0m\n");
+    }
+  }
+  return numError == 0;
+}
+
+// =======================================================================
+// エミュレータ
+
+// 命令の実行は、インタプリタと翻訳済みブロックの各ハンドラにインライン展開する
+#if defined(__GNUC__) && defined(__OPTIMIZE__)
+#define XZ80_EMU_INLINE inline __attribute__((always_inline))
+#else
+#define XZ80_EMU_INLINE inline
+#endif
+
+namespace Emu {
+/// フラグ、T-states、命令長の表
+struct Tables {
+  uint8_t sz53[256];      ///< 結果に対する S, Z, Y, X
+  uint8_t sz53p[256];     ///< 結果に対する S, Z, Y, X, P
+  uint8_t cycles[256];    ///< プレフィックス無しの命令(条件不成立時)
+  uint8_t cyclesCB[256];  ///< CB 命令(プレフィックスを含む)
+  uint8_t cyclesED[256];  ///< ED 命令(プレフィックスを含む)
+  uint8_t length[256];    ///< プレフィックス無しの命令のバイト数(CB, ED は 0)
+  uint8_t lengthXY[256];  ///< DD/FD の後のバイト数(変位を含む)
+  bool branch[256];       ///< PC を書き換える命令(ブロックの終わり)
+
+  constexpr Tables()
+      : sz53(), sz53p(), cycles(), cyclesCB(), cyclesED(), length(), lengthXY(), branch() {
+    // 00h..3Fh, C0h..FFh の T-states (40h..BFh は規則的なので計算する)
+    const uint8_t low[64] = {
+        4, 10, 7, 6, 4, 4, 7, 4, 4, 11, 7, 6, 4, 4, 7, 4,         //
+        8, 10, 7, 6, 4, 4, 7, 4, 12, 11, 7, 6, 4, 4, 7, 4,        //
+        7, 10, 16, 6, 4, 4, 7, 4, 7, 11, 16, 6, 4, 4, 7, 4,       //
+        7, 10, 13, 6, 11, 11, 10, 4, 7, 11, 13, 6, 4, 4, 7, 4,    //
+    };
+    const uint8_t high[64] = {
+        5, 10, 10, 10, 10, 11, 7, 11, 5, 10, 10, 0, 10, 17, 7, 11,  //
+        5, 10, 10, 11, 10, 11, 7, 11, 5, 4, 10, 11, 10, 0, 7, 11,   //
+        5, 10, 10, 19, 10, 11, 7, 11, 5, 4, 10, 4, 10, 0, 7, 11,    //
+        5, 10, 10, 4, 10, 11, 7, 11, 5, 6, 10, 4, 10, 0, 7, 11,     //
+    };
+    for (int i = 0; i < 256; ++i) {
+      uint8_t f = i & (F_S | F_Y | F_X);
+      if (i == 0) {
+        f |= F_Z;
+      }
+      int p = i ^ (i >> 4);
+      p ^= p >> 2;
+      p ^= p >> 1;
+      sz53[i] = f;
+      sz53p[i] = f | ((p & 1) ? 0 : F_PV);
+
+      const int x = i >> 6, y = (i >> 3) & 7, z = i & 7;
+      bool mem = false;  // (HL) を使う
+      if (x == 0) {
+        cycles[i] = low[i];
+        length[i] = (z == 1 && !(y & 1)) ? 3 : (z == 2 && 4 <= y) ? 3 : (z == 0 && 2 <= y) ? 2 : (z == 6) ? 2 : 1;
+        mem = (i == 0x34 || i == 0x35 || i == 0x36);
+        branch[i] = (i == 0x10 || (z == 0 && 3 <= y));
+      } else if (x == 3) {
+        cycles[i] = high[i - 0xc0];
+        length[i] = (i == 0xcb || i == 0xdd || i == 0xed || i == 0xfd) ? 0
+                    : (z == 2 || z == 4 || i == 0xc3 || i == 0xcd)     ? 3
+                    : (z == 6 || i == 0xd3 || i == 0xdb)               ? 2
+                                                                       : 1;
+        branch[i] = (z == 0 || z == 2 || z == 4 || z == 7 || i == 0xc3 || i == 0xc9 ||
+                     i == 0xcd || i == 0xe9);
+      } else {
+        cycles[i] = (i != 0x76 && (z == 6 || (x == 1 && y == 6))) ? 7 : 4;
+        length[i] = 1;
+        mem = (i != 0x76 && (z == 6 || (x == 1 && y == 6)));
+        branch[i] = (i == 0x76);
+      }
+      lengthXY[i] = static_cast<uint8_t>(length[i] + (mem ? 1 : 0));
+
+      cyclesCB[i] = (z != 6) ? 8 : (x == 1) ? 12 : 15;
+
+      uint8_t ed = 8;
+      if (x == 1) {
+        const uint8_t byZ[8] = {12, 12, 15, 20, 8, 14, 8, 9};
+        ed = (z == 7 && (y == 4 || y == 5)) ? 18 : (z == 7 && 6 <= y) ? 8 : byZ[z];
+      } else if (x == 2 && z <= 3 && 4 <= y) {
+        ed = 16;
+      }
+      cyclesED[i] = ed;
+    }
+  }
+};
+constexpr Tables emuTables;
+
+/// run() の実行中のレジスタと、1命令の実行
+///
+/// インタプリタではローカル変数として置くので、レジスタはホストの
+/// レジスタに割り当てられる。
+struct Machine::Core {
+  Machine& m;
+  const Tables& tb;
+  uint8_t a, f;
+  uint16_t bc, de, hl, ix, iy, sp, pc;
+  uint8_t r;
+  uint8_t rHigh;  ///< LD R,A で書き換わる R のビット7
+  bool iff1, iff2, halted, eiDelay;
+  uint64_t t;
+  uint64_t t0;          ///< 実行中の命令の先頭の T-states
+  int index;            ///< 0: HL, 1: IX, 2: IY (hl と入れ替えて実行する)
+  const uint8_t* code;  ///< 翻訳済みの命令のバイト列(nullptr ならメモリから読む)
+  CallTrace* calls;     ///< 呼び出しの記録(nullptr なら記録しない)
+
+  explicit Core(Machine& machine)
+      : m(machine),
+        tb(emuTables),
+        a(m.m_regs.a),
+        f(m.m_regs.f),
+        bc(m.m_regs.bc),
+        de(m.m_regs.de),
+        hl(m.m_regs.hl),
+        ix(m.m_regs.ix),
+        iy(m.m_regs.iy),
+        sp(m.m_regs.sp),
+        pc(m.m_regs.pc),
+        r(m.m_regs.r),
+        rHigh(m.m_regs.r & 0x80),
+        iff1(m.m_regs.iff1),
+        iff2(m.m_regs.iff2),
+        halted(m.m_regs.halted),
+        eiDelay(m.m_eiDelay),
+        t(m.m_tstates),
+        t0(m.m_tstates),
+        index(0),
+        code(nullptr),
+        calls(m.m_callTrace) {}
+
+  /// レジスタを Machine に書き戻す
+  void save(void) {
+    Regs& g = m.m_regs;
+    g.a = a;
+    g.f = f;
+    g.bc = bc;
+    g.de = de;
+    g.hl = hl;
+    g.ix = ix;
+    g.iy = iy;
+    g.sp = sp;
+    g.pc = pc;
+    g.r = static_cast<uint8_t>(rHigh | (r & 0x7f));
+    g.iff1 = iff1;
+    g.iff2 = iff2;
+    g.halted = halted;
+    m.m_eiDelay = eiDelay;
+    m.m_tstates = t;
+  }
+
+  uint8_t rd(uint16_t addr) {
+    const uint8_t* p = m.m_read[addr >> PageBits];
+    if (p) {
+      return p[addr & (PageSize - 1)];
+    }
+    m.m_tstates = t0;
+    return m.readSlow(addr);
+  }
+  void wr(uint16_t addr, uint8_t v) {
+    uint8_t* p = m.m_direct[addr >> PageBits];
+    if (p) {
+      p[addr & (PageSize - 1)] = v;
+    } else {
+      m.m_tstates = t0;
+      m.writeSlow(addr, v);
+    }
+  }
+  uint16_t rd16(uint16_t addr) {
+    return static_cast<uint16_t>(rd(addr) | rd(static_cast<uint16_t>(addr + 1)) << 8);
+  }
+  void wr16(uint16_t addr, uint16_t v) {
+    wr(addr, static_cast<uint8_t>(v));
+    wr(static_cast<uint16_t>(addr + 1), static_cast<uint8_t>(v >> 8));
+  }
+  uint8_t fetch(void) {
+    if (code) {
+      ++pc;
+      return *code++;
+    }
+    return rd(pc++);
+  }
+  uint16_t fetch16(void) {
+    const uint8_t l = fetch();
+    return static_cast<uint16_t>(fetch() << 8 | l);
+  }
+  void push(uint16_t v) {
+    sp -= 2;
+    wr16(sp, v);
+  }
+  uint16_t pop(void) {
+    const uint16_t v = rd16(sp);
+    sp += 2;
+    return v;
+  }
+  uint8_t ioIn(uint16_t port) {
+    m.m_tstates = t0;
+    return m.in(port);
+  }
+  void ioOut(uint16_t port, uint8_t v) {
+    m.m_tstates = t0;
+    m.out(port, v);
+  }
+
+  // レジスタ番号(B, C, D, E, H, L, -, A)による読み書き
+  uint8_t getR(int i) const {
+    switch (i) {
+      case 0: return static_cast<uint8_t>(bc >> 8);
+      case 1: return static_cast<uint8_t>(bc);
+      case 2: return static_cast<uint8_t>(de >> 8);
+      case 3: return static_cast<uint8_t>(de);
+      case 4: return static_cast<uint8_t>(hl >> 8);
+      case 5: return static_cast<uint8_t>(hl);
+      default: return a;
+    }
+  }
+  void setR(int i, uint8_t v) {
+    switch (i) {
+      case 0: bc = static_cast<uint16_t>((bc & 0x00ff) | v << 8); break;
+      case 1: bc = static_cast<uint16_t>((bc & 0xff00) | v); break;
+      case 2: de = static_cast<uint16_t>((de & 0x00ff) | v << 8); break;
+      case 3: de = static_cast<uint16_t>((de & 0xff00) | v); break;
+      case 4: hl = static_cast<uint16_t>((hl & 0x00ff) | v << 8); break;
+      case 5: hl = static_cast<uint16_t>((hl & 0xff00) | v); break;
+      default: a = v; break;
+    }
+  }
+  // IX/IY と入れ替え中の本来の HL
+  uint16_t& realHL(void) { return (index == 1) ? ix : iy; }
+  // H, L を IXH/IXL ではなく本来の H, L として扱う読み書き((IX+d) と組む命令)
+  uint8_t getRealR(int i) {
+    if (index && (i == 4 || i == 5)) {
+      return static_cast<uint8_t>((i == 4) ? realHL() >> 8 : realHL());
+    }
+    return getR(i);
+  }
+  void setRealR(int i, uint8_t v) {
+    if (index && (i == 4 || i == 5)) {
+      uint16_t& h = realHL();
+      h = static_cast<uint16_t>((i == 4) ? ((h & 0x00ff) | v << 8) : ((h & 0xff00) | v));
+    } else {
+      setR(i, v);
+    }
+  }
+  // レジスタペア番号(BC, DE, HL, SP)による読み書き
+  uint16_t getRP(int i) const {
+    switch (i) {
+      case 0: return bc;
+      case 1: return de;
+      case 2: return hl;
+      default: return sp;
+    }
+  }
+  void setRP(int i, uint16_t v) {
+    switch (i) {
+      case 0: bc = v; break;
+      case 1: de = v; break;
+      case 2: hl = v; break;
+      default: sp = v; break;
+    }
+  }
+  // 条件番号(NZ, Z, NC, C, PO, PE, P, M)の判定
+  bool cond(int i) const {
+    uint8_t mask;
+    switch (i >> 1) {
+      case 0: mask = F_Z; break;
+      case 1: mask = F_C; break;
+      case 2: mask = F_PV; break;
+      default: mask = F_S; break;
+    }
+    const bool set = (f & mask) != 0;
+    return (i & 1) ? set : !set;
+  }
+  // (HL) または (IX+d) のアドレス
+  uint16_t addrHL(void) {
+    if (!index) {
+      return hl;
+    }
+    t += 8;
+    return static_cast<uint16_t>(hl + static_cast<int8_t>(fetch()));
+  }
+
+  // 演算とフラグ
+  void add8(uint8_t v, int c) {
+    const unsigned res = a + v + c;
+    f = tb.sz53[res & 0xff] | ((res >> 8) & F_C) | ((a ^ v ^ res) & F_H) |
+        (((a ^ ~v) & (a ^ res) & 0x80) >> 5);
+    a = static_cast<uint8_t>(res);
+  }
+  uint8_t sub8(uint8_t v, int c) {
+    const unsigned res = a - v - c;
+    f = tb.sz53[res & 0xff] | F_N | ((res >> 8) & F_C) | ((a ^ v ^ res) & F_H) |
+        (((a ^ v) & (a ^ res) & 0x80) >> 5);
+    return static_cast<uint8_t>(res);
+  }
+  void alu(int op, uint8_t v) {
+    switch (op) {
+      case 0: add8(v, 0); break;
+      case 1: add8(v, f & F_C); break;
+      case 2: a = sub8(v, 0); break;
+      case 3: a = sub8(v, f & F_C); break;
+      case 4: a &= v; f = tb.sz53p[a] | F_H; break;
+      case 5: a ^= v; f = tb.sz53p[a]; break;
+      case 6: a |= v; f = tb.sz53p[a]; break;
+      default:  // CP の X, Y はオペランドから
+        sub8(v, 0);
+        f = (f & ~(F_X | F_Y)) | (v & (F_X | F_Y));
+        break;
+    }
+  }
+  uint8_t inc8(uint8_t v) {
+    ++v;
+    f = (f & F_C) | tb.sz53[v] | ((v & 0x0f) ? 0 : F_H) | ((v == 0x80) ? F_PV : 0);
+    return v;
+  }
+  uint8_t dec8(uint8_t v) {
+    f = (f & F_C) | F_N | ((v & 0x0f) ? 0 : F_H);
+    --v;
+    f |= tb.sz53[v] | ((v == 0x7f) ? F_PV : 0);
+    return v;
+  }
+  uint16_t add16(uint16_t x, uint16_t v) {
+    const unsigned res = x + v;
+    f = (f & (F_S | F_Z | F_PV)) | ((res >> 16) & F_C) | (((x ^ v ^ res) >> 8) & F_H) |
+        ((res >> 8) & (F_X | F_Y));
+    return static_cast<uint16_t>(res);
+  }
+  void adc16(uint16_t v) {
+    const unsigned res = hl + v + (f & F_C);
+    f = ((res >> 16) & F_C) | (((hl ^ v ^ res) >> 8) & F_H) | ((res >> 8) & (F_S | F_X | F_Y)) |
+        ((res & 0xffff) ? 0 : F_Z) | (((hl ^ ~v) & (hl ^ res) & 0x8000) >> 13);
+    hl = static_cast<uint16_t>(res);
+  }
+  void sbc16(uint16_t v) {
+    const unsigned res = hl - v - (f & F_C);
+    f = F_N | ((res >> 16) & F_C) | (((hl ^ v ^ res) >> 8) & F_H) |
+        ((res >> 8) & (F_S | F_X | F_Y)) | ((res & 0xffff) ? 0 : F_Z) |
+        (((hl ^ v) & (hl ^ res) & 0x8000) >> 13);
+    hl = static_cast<uint16_t>(res);
+  }
+  // CB 命令のローテート・シフト(RLC, RRC, RL, RR, SLA, SRA, SLL, SRL)
+  uint8_t rot(int op, uint8_t v) {
+    uint8_t c;
+    switch (op) {
+      case 0: c = v >> 7; v = static_cast<uint8_t>(v << 1 | c); break;
+      case 1: c = v & 1; v = static_cast<uint8_t>(v >> 1 | c << 7); break;
+      case 2: c = v >> 7; v = static_cast<uint8_t>(v << 1 | (f & F_C)); break;
+      case 3: c = v & 1; v = static_cast<uint8_t>(v >> 1 | (f & F_C) << 7); break;
+      case 4: c = v >> 7; v = static_cast<uint8_t>(v << 1); break;
+      case 5: c = v & 1; v = static_cast<uint8_t>((v & 0x80) | v >> 1); break;
+      case 6: c = v >> 7; v = static_cast<uint8_t>(v << 1 | 1); break;
+      default: c = v & 1; v = static_cast<uint8_t>(v >> 1); break;
+    }
+    f = tb.sz53p[v] | c;
+    return v;
+  }
+  // BIT b, v (xy は X, Y フラグの元になる値)
+  void bit(int b, uint8_t v, uint8_t xy) {
+    const uint8_t mask = v & (1 << b);
+    f = (f & F_C) | F_H | (xy & (F_X | F_Y)) | (mask ? (mask & F_S) : (F_Z | F_PV));
+  }
+
+  /// 保留中の割り込みを受け付ける
+  /// @return 受け付けた
+  XZ80_EMU_INLINE bool interrupt(void) {
+    if (m.m_nmi) {
+      m.m_nmi = false;
+      halted = false;
+      iff1 = false;
+      ++r;
+      push(pc);
+      pc = 0x0066;
+      if (calls) {
+        calls->enter(pc, sp, t, CallTrace::K_Nmi);
+      }
+      t += 11;
+      return true;
+    }
+    if (m.m_irq && iff1 && !eiDelay) {
+      m.m_irq = false;
+      halted = false;
+      iff1 = iff2 = false;
+      ++r;
+      push(pc);
+      const uint64_t start = t;
+      switch (m.m_regs.im) {
+        case 2:
+          pc = rd16(static_cast<uint16_t>(m.m_regs.i << 8 | m.m_irqData));
+          t += 19;
+          break;
+        case 1:
+          pc = 0x0038;
+          t += 13;
+          break;
+        default:  // IM 0 はデータバスの RST 命令のみ扱う
+          pc = ((m.m_irqData & 0xc7) == 0xc7) ? (m.m_irqData & 0x38) : 0x0038;
+          t += 13;
+          break;
+      }
+      if (calls) {
+        calls->enter(pc, sp, start, CallTrace::K_Int);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  /// 命令の前に割り込みの受け付けと HALT 中の処理を行う
+  /// @return 命令を実行できる(false ならループの判定からやり直す)
+  XZ80_EMU_INLINE bool ready(uint64_t end) {
+    if (interrupt()) {
+      return false;
+    }
+    eiDelay = false;
+    if (!halted) {
+      return true;
+    }
+    if (!m.m_haltStops) {
+      // 割り込みが来るまで NOP を実行する
+      const uint64_t n = (end - t) / 4 + ((end - t) % 4 != 0);
+      t += n * 4;
+      r = static_cast<uint8_t>(r + n);
+    }
+    return false;
+  }
+
+  /// 受け付ける割り込みが保留中か
+  bool interruptible(void) const { return m.m_nmi || (m.m_irq && iff1 && !eiDelay); }
+
+  /// run() のループを続けるか(HALT で戻る場合も割り込みは受け付ける)
+  bool running(uint64_t end) const {
+    return t < end && !m.m_stop && (!halted || !m.m_haltStops || interruptible());
+  }
+
+  /// 割り込みの受け付けか、run() の終了で翻訳済みの命令の並びを中断するか
+  bool pending(uint64_t end) const {
+    return end <= t || m.m_stop || halted || interruptible();
+  }
+
+  /// メモリから1命令を読んで実行する
+  XZ80_EMU_INLINE void step(void) {
+    t0 = t;
+    ++r;
+    uint8_t op = fetch();
+    index = 0;
+    while (op == 0xdd || op == 0xfd) {
+      t += 4;
+      index = (op == 0xdd) ? 1 : 2;
+      ++r;
+      op = fetch();
+    }
+    exec(op);
+  }
+
+  /// 翻訳済みの1命令を実行する(Op は定数として展開される)
+  template <int Op>
+  static void handler(Core& c, const Insn& insn) {
+    c.pc = static_cast<uint16_t>(c.pc + insn.prefixes + 1);
+    c.r = static_cast<uint8_t>(c.r + insn.prefixes + 1);
+    c.t += insn.prefixes * 4;
+    c.index = insn.index;
+    c.code = insn.bytes + 1;
+    c.exec(Op);
+    c.code = nullptr;
+  }
+
+  /// プレフィックスの後の1命令を実行する
+  XZ80_EMU_INLINE void exec(uint8_t op) {
+    if (op == 0xed) {
+      index = 0;  // DD/FD は ED 命令に作用しない
+    } else if (index) {
+      std::swap(hl, realHL());
+    }
+    t += tb.cycles[op];
+
+    switch (op >> 6) {
+      case 1:  // LD r, r' / HALT
+        if (op == 0x76) {
+          halted = true;
+        } else if ((op & 7) == 6) {
+          const uint16_t ad = addrHL();
+          setRealR((op >> 3) & 7, rd(ad));
+        } else if (((op >> 3) & 7) == 6) {
+          const uint16_t ad = addrHL();
+          wr(ad, getRealR(op & 7));
+        } else {
+          setR((op >> 3) & 7, getR(op & 7));
+        }
+        break;
+
+      case 2:  // ALU A, r
+        alu((op >> 3) & 7, ((op & 7) == 6) ? rd(addrHL()) : getR(op & 7));
+        break;
+
+      case 0:
+        switch (op) {
+          case 0x00: break;  // NOP
+          case 0x01: case 0x11: case 0x21: case 0x31: setRP(op >> 4, fetch16()); break;
+          case 0x02: wr(bc, a); break;
+          case 0x12: wr(de, a); break;
+          case 0x0a: a = rd(bc); break;
+          case 0x1a: a = rd(de); break;
+          case 0x03: case 0x13: case 0x23: case 0x33:
+            setRP(op >> 4, static_cast<uint16_t>(getRP(op >> 4) + 1));
+            break;
+          case 0x0b: case 0x1b: case 0x2b: case 0x3b:
+            setRP(op >> 4, static_cast<uint16_t>(getRP(op >> 4) - 1));
+            break;
+          case 0x34: {
+            const uint16_t ad = addrHL();
+            wr(ad, inc8(rd(ad)));
+            break;
+          }
+          case 0x35: {
+            const uint16_t ad = addrHL();
+            wr(ad, dec8(rd(ad)));
+            break;
+          }
+          case 0x36: {
+            const uint16_t ad = addrHL();
+            if (index) {
+              t -= 3;  // LD (IX+d), n は 19 T-states
+            }
+            wr(ad, fetch());
+            break;
+          }
+          case 0x07: {  // RLCA
+            a = static_cast<uint8_t>(a << 1 | a >> 7);
+            f = (f & (F_S | F_Z | F_PV)) | (a & (F_X | F_Y | F_C));
+            break;
+          }
+          case 0x0f: {  // RRCA
+            const uint8_t c = a & 1;
+            a = static_cast<uint8_t>(a >> 1 | c << 7);
+            f = (f & (F_S | F_Z | F_PV)) | (a & (F_X | F_Y)) | c;
+            break;
+          }
+          case 0x17: {  // RLA
+            const uint8_t c = a >> 7;
+            a = static_cast<uint8_t>(a << 1 | (f & F_C));
+            f = (f & (F_S | F_Z | F_PV)) | (a & (F_X | F_Y)) | c;
+            break;
+          }
+          case 0x1f: {  // RRA
+            const uint8_t c = a & 1;
+            a = static_cast<uint8_t>(a >> 1 | (f & F_C) << 7);
+            f = (f & (F_S | F_Z | F_PV)) | (a & (F_X | F_Y)) | c;
+            break;
+          }
+          case 0x08: {  // EX AF, AF'
+            const uint16_t af = static_cast<uint16_t>(a << 8 | f);
+            a = static_cast<uint8_t>(m.m_regs.af2 >> 8);
+            f = static_cast<uint8_t>(m.m_regs.af2);
+            m.m_regs.af2 = af;
+            break;
+          }
+          case 0x09: case 0x19: case 0x29: case 0x39: hl = add16(hl, getRP(op >> 4)); break;
+          case 0x10: {  // DJNZ
+            const int8_t e = static_cast<int8_t>(fetch());
+            bc -= 0x100;
+            if (bc >> 8) {
+              pc = static_cast<uint16_t>(pc + e);
+              t += 5;
+            }
+            break;
+          }
+          case 0x18: {
+            const int8_t e = static_cast<int8_t>(fetch());
+            pc = static_cast<uint16_t>(pc + e);
+            break;
+          }
+          case 0x20: case 0x28: case 0x30: case 0x38: {
+            const int8_t e = static_cast<int8_t>(fetch());
+            if (cond((op >> 3) & 3)) {
+              pc = static_cast<uint16_t>(pc + e);
+              t += 5;
+            }
+            break;
+          }
+          case 0x22: wr16(fetch16(), hl); break;
+          case 0x2a: hl = rd16(fetch16()); break;
+          case 0x32: wr(fetch16(), a); break;
+          case 0x3a: a = rd(fetch16()); break;
+          case 0x27: {  // DAA
+            uint8_t diff = 0;
+            uint8_t c = f & F_C;
+            if ((f & F_H) || 9 < (a & 0x0f)) {
+              diff = 0x06;
+            }
+            if (c || 0x99 < a) {
+              diff |= 0x60;
+              c = F_C;
+            }
+            const bool h = (f & F_N) ? ((f & F_H) && (a & 0x0f) < 6) : (9 < (a & 0x0f));
+            a = static_cast<uint8_t>((f & F_N) ? a - diff : a + diff);
+            f = tb.sz53p[a] | (f & F_N) | c | (h ? F_H : 0);
+            break;
+          }
+          case 0x2f:  // CPL
+            a = static_cast<uint8_t>(~a);
+            f = (f & (F_S | F_Z | F_PV | F_C)) | F_H | F_N | (a & (F_X | F_Y));
+            break;
+          case 0x37:  // SCF
+            f = (f & (F_S | F_Z | F_PV)) | F_C | (a & (F_X | F_Y));
+            break;
+          case 0x3f:  // CCF
+            f = (f & (F_S | F_Z | F_PV)) | ((f & F_C) ? F_H : F_C) | (a & (F_X | F_Y));
+            break;
+          default: {
+            const int y = (op >> 3) & 7;
+            switch (op & 7) {
+              case 4: setR(y, inc8(getR(y))); break;
+              case 5: setR(y, dec8(getR(y))); break;
+              default: setR(y, fetch()); break;  // LD r, n
+            }
+            break;
+          }
+        }
+        break;
+
+      default:
+        switch (op) {
+          case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+          case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+            if (cond((op >> 3) & 7)) {
+              pc = pop();
+              t += 6;
+              if (calls) {
+                calls->leave(sp, t);
+              }
+            }
+            break;
+          case 0xc1: case 0xd1: case 0xe1: setRP((op >> 4) & 3, pop()); break;
+          case 0xf1: {
+            const uint16_t v = pop();
+            a = static_cast<uint8_t>(v >> 8);
+            f = static_cast<uint8_t>(v);
+            break;
+          }
+          case 0xc2: case 0xca: case 0xd2: case 0xda:
+          case 0xe2: case 0xea: case 0xf2: case 0xfa: {
+            const uint16_t nn = fetch16();
+            if (cond((op >> 3) & 7)) {
+              pc = nn;
+            }
+            break;
+          }
+          case 0xc3: pc = fetch16(); break;
+          case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+          case 0xe4: case 0xec: case 0xf4: case 0xfc: {
+            const uint16_t nn = fetch16();
+            if (cond((op >> 3) & 7)) {
+              push(pc);
+              pc = nn;
+              t += 7;
+              if (calls) {
+                calls->enter(pc, sp, t0, CallTrace::K_Call);
+              }
+            }
+            break;
+          }
+          case 0xc5: case 0xd5: case 0xe5: push(getRP((op >> 4) & 3)); break;
+          case 0xf5: push(static_cast<uint16_t>(a << 8 | f)); break;
+          case 0xc6: case 0xce: case 0xd6: case 0xde:
+          case 0xe6: case 0xee: case 0xf6: case 0xfe:
+            alu((op >> 3) & 7, fetch());
+            break;
+          case 0xc7: case 0xcf: case 0xd7: case 0xdf:
+          case 0xe7: case 0xef: case 0xf7: case 0xff:
+            push(pc);
+            pc = op & 0x38;
+            if (calls) {
+              calls->enter(pc, sp, t0, CallTrace::K_Rst);
+            }
+            break;
+          case 0xc9:
+            pc = pop();
+            if (calls) {
+              calls->leave(sp, t);
+            }
+            break;
+          case 0xcd: {
+            const uint16_t nn = fetch16();
+            push(pc);
+            pc = nn;
+            if (calls) {
+              calls->enter(pc, sp, t0, CallTrace::K_Call);
+            }
+            break;
+          }
+          case 0xd3: {
+            const uint8_t n = fetch();
+            ioOut(static_cast<uint16_t>(a << 8 | n), a);
+            break;
+          }
+          case 0xdb: {
+            const uint8_t n = fetch();
+            a = ioIn(static_cast<uint16_t>(a << 8 | n));
+            break;
+          }
+          case 0xd9: {  // EXX (DD/FD は作用しない)
+            uint16_t& h = index ? realHL() : hl;
+            std::swap(bc, m.m_regs.bc2);
+            std::swap(de, m.m_regs.de2);
+            std::swap(h, m.m_regs.hl2);
+            break;
+          }
+          case 0xe3: {
+            const uint16_t v = rd16(sp);
+            wr16(sp, hl);
+            hl = v;
+            break;
+          }
+          case 0xe9: pc = hl; break;
+          case 0xeb: std::swap(de, index ? realHL() : hl); break;  // DD/FD は作用しない
+          case 0xf3: iff1 = iff2 = false; break;
+          case 0xf9: sp = hl; break;
+          case 0xfb:
+            iff1 = iff2 = true;
+            eiDelay = true;
+            break;
+          case 0xcb: execCB(); break;
+          case 0xed: execED(); break;
+        }
+        break;
+    }
+
+    if (index) {
+      std::swap(hl, realHL());
+    }
+  }
+
+  /// CB 命令(DD CB d op を含む)
+  XZ80_EMU_INLINE void execCB(void) {
+    if (index) {
+      // DD CB d op: 結果は (IX+d) と、r が (HL) 以外ならレジスタにも入る
+      const uint16_t ad = static_cast<uint16_t>(hl + static_cast<int8_t>(fetch()));
+      const uint8_t op2 = fetch();
+      const int x = op2 >> 6, y = (op2 >> 3) & 7, z = op2 & 7;
+      uint8_t v = rd(ad);
+      if (x == 1) {
+        bit(y, v, static_cast<uint8_t>(ad >> 8));
+        t += 16;
+        return;
+      }
+      t += 19;
+      v = (x == 0) ? rot(y, v) : (x == 2) ? (v & ~(1 << y)) : (v | 1 << y);
+      wr(ad, v);
+      if (z != 6) {
+        setRealR(z, v);
+      }
+      return;
+    }
+    ++r;
+    const uint8_t op2 = fetch();
+    const int x = op2 >> 6, y = (op2 >> 3) & 7, z = op2 & 7;
+    t += tb.cyclesCB[op2];
+    uint8_t v = (z == 6) ? rd(hl) : getR(z);
+    if (x == 1) {
+      // BIT n, (HL) の X, Y は内部レジスタ WZ の上位による。H で近似する
+      bit(y, v, (z == 6) ? static_cast<uint8_t>(hl >> 8) : v);
+      return;
+    }
+    v = (x == 0) ? rot(y, v) : (x == 2) ? (v & ~(1 << y)) : (v | 1 << y);
+    if (z == 6) {
+      wr(hl, v);
+    } else {
+      setR(z, v);
+    }
+  }
+
+  /// ED 命令
+  XZ80_EMU_INLINE void execED(void) {
+    ++r;
+    const uint8_t op2 = fetch();
+    const int x = op2 >> 6, y = (op2 >> 3) & 7, z = op2 & 7;
+    t += tb.cyclesED[op2];
+    if (x == 1) {
+      switch (z) {
+        case 0: {  // IN r, (C) (r=6 はフラグのみ)
+          const uint8_t v = ioIn(bc);
+          f = (f & F_C) | tb.sz53p[v];
+          if (y != 6) {
+            setR(y, v);
+          }
+          break;
+        }
+        case 1: ioOut(bc, (y == 6) ? 0 : getR(y)); break;
+        case 2: (y & 1) ? adc16(getRP(y >> 1)) : sbc16(getRP(y >> 1)); break;
+        case 3: {
+          const uint16_t nn = fetch16();
+          if (y & 1) {
+            setRP(y >> 1, rd16(nn));
+          } else {
+            wr16(nn, getRP(y >> 1));
+          }
+          break;
+        }
+        case 4: {  // NEG
+          const uint8_t v = a;
+          a = 0;
+          a = sub8(v, 0);
+          break;
+        }
+        case 5:  // RETN/RETI
+          pc = pop();
+          iff1 = iff2;
+          if (calls) {
+            calls->leave(sp, t);
+          }
+          break;
+        case 6: {
+          const uint8_t modes[4] = {0, 0, 1, 2};
+          m.m_regs.im = modes[y & 3];
+          break;
+        }
+        default:
+          switch (y) {
+            case 0: m.m_regs.i = a; break;
+            case 1:
+              r = a;
+              rHigh = a & 0x80;
+              break;
+            case 2:
+            case 3:
+              a = (y == 2) ? m.m_regs.i : static_cast<uint8_t>(rHigh | (r & 0x7f));
+              f = (f & F_C) | tb.sz53[a] | (iff2 ? F_PV : 0);
+              break;
+            case 4: {  // RRD
+              const uint8_t v = rd(hl);
+              wr(hl, static_cast<uint8_t>(a << 4 | v >> 4));
+              a = (a & 0xf0) | (v & 0x0f);
+              f = (f & F_C) | tb.sz53p[a];
+              break;
+            }
+            case 5: {  // RLD
+              const uint8_t v = rd(hl);
+              wr(hl, static_cast<uint8_t>(v << 4 | (a & 0x0f)));
+              a = (a & 0xf0) | v >> 4;
+              f = (f & F_C) | tb.sz53p[a];
+              break;
+            }
+            default: break;
+          }
+          break;
+      }
+      return;
+    }
+    if (x != 2 || 3 < z || y < 4) {
+      return;  // 未定義の ED 命令は NOP
+    }
+
+    // ブロック転送・サーチ・入出力
+    const uint16_t step = (y & 1) ? 0xffff : 0x0001;
+    const bool repeat = 6 <= y;
+    switch (z) {
+      case 0: {  // LDI/LDD/LDIR/LDDR
+        const uint8_t v = rd(hl);
+        wr(de, v);
+        hl += step;
+        de += step;
+        --bc;
+        const uint8_t n = static_cast<uint8_t>(v + a);
+        f = (f & (F_S | F_Z | F_C)) | (bc ? F_PV : 0) | (n & F_X) | ((n << 4) & F_Y);
+        if (repeat && bc) {
+          pc -= 2;
+          t += 5;
+        }
+        break;
+      }
+      case 1: {  // CPI/CPD/CPIR/CPDR
+        const uint8_t v = rd(hl);
+        const uint8_t res = static_cast<uint8_t>(a - v);
+        const uint8_t h = (a ^ v ^ res) & F_H;
+        hl += step;
+        --bc;
+        const uint8_t n = static_cast<uint8_t>(res - (h ? 1 : 0));
+        f = (f & F_C) | F_N | (tb.sz53[res] & (F_S | F_Z)) | h | (bc ? F_PV : 0) | (n & F_X) |
+            ((n << 4) & F_Y);
+        if (repeat && bc && res) {
+          pc -= 2;
+          t += 5;
+        }
+        break;
+      }
+      default: {  // INI/IND/INIR/INDR, OUTI/OUTD/OTIR/OTDR
+        uint8_t v;
+        unsigned k;
+        if (z == 2) {
+          v = ioIn(bc);
+          wr(hl, v);
+          k = v + static_cast<uint8_t>(bc + step);
+          bc -= 0x100;
+        } else {
+          v = rd(hl);
+          bc -= 0x100;
+          ioOut(bc, v);
+          k = v + static_cast<uint8_t>(hl + step);
+        }
+        hl += step;
+        const uint8_t b = static_cast<uint8_t>(bc >> 8);
+        f = tb.sz53[b] | ((v & 0x80) ? F_N : 0) | ((0xff < k) ? (F_H | F_C) : 0) |
+            (tb.sz53p[(k & 7) ^ b] & F_PV);
+        if (repeat && b) {
+          pc -= 2;
+          t += 5;
+        }
+        break;
+      }
+    }
+  }
+};
+
+/// 翻訳済みの命令のハンドラを、命令の先頭(プレフィックスの後)のバイトで引く表
+struct HandlerTable {
+  Machine::Handler handlers[256];
+
+  template <size_t... I>
+  constexpr explicit HandlerTable(std::index_sequence<I...>)
+      : handlers{&Machine::Core::handler<I>...} {}
+};
+constexpr HandlerTable emuHandlers{std::make_index_sequence<256>()};
+
+XZ80_DECL Machine::Machine()
+    : m_regs(),
+      m_tstates(0),
+      m_ram(0x10000),
+      m_read(),
+      m_write(),
+      m_direct(),
+      m_base(),
+      m_memRead(),
+      m_memWrite(),
+      m_in(),
+      m_out(),
+      m_irq(false),
+      m_irqData(0xff),
+      m_nmi(false),
+      m_eiDelay(false),
+      m_haltStops(true),
+      m_stop(false),
+      m_reason(S_Budget),
+      m_engine(E_Interpret),
+      m_blocks(),
+      m_blockAt(),
+      m_pageBlocks(),
+      m_code(),
+      m_rewrites(),
+      m_deadBlocks(0),
+      m_translations(0),
+      m_profile(nullptr),
+      m_callTrace(nullptr),
+      m_coverage(nullptr),
+      m_ioTrace(nullptr) {
+  map(0x0000, 0x10000, m_ram.data());
+  reset();
+}
+
+XZ80_DECL Machine::~Machine() {}
+
+XZ80_DECL void Machine::reset(void) {
+  m_regs = Regs();
+  m_regs.a = 0xff;
+  m_regs.f = 0xff;
+  m_regs.sp = 0xffff;
+  m_tstates = 0;
+  m_irq = false;
+  m_nmi = false;
+  m_eiDelay = false;
+  m_reason = S_Budget;
+}
+
+XZ80_DECL uint8_t Machine::readSlow(uint16_t addr) {
+  return m_memRead ? m_memRead(addr) : 0xff;
+}
+
+XZ80_DECL void Machine::writeSlow(uint16_t addr, uint8_t value) {
+  const unsigned page = addr >> PageBits;
+  if (uint8_t* p = m_write[page]) {
+    // 翻訳済みのコードを含むページか、スナップショットと共有するページへの書き込み
+    const unsigned rp = ramPage(p);
+    if (rp < NumPages) {
+      m_base[rp].reset();
+    }
+    if (isCode(addr)) {
+      if (m_rewrites[page] <= HotRewrites) {
+        ++m_rewrites[page];
+      }
+      invalidateCode(addr);
+    } else if (m_pageBlocks[page].empty()) {
+      m_direct[page] = directWrite(page);
+    }
+    p[addr & (PageSize - 1)] = value;
+  } else if (m_memWrite) {
+    m_memWrite(addr, value);
+  }
+}
+
+XZ80_DECL uint8_t Machine::in(uint16_t port) {
+  const uint8_t v = m_in ? m_in(port) : 0xff;
+  if (m_ioTrace) {
+    m_ioTrace->record(port, v, m_tstates, false);
+  }
+  return v;
+}
+
+XZ80_DECL void Machine::out(uint16_t port, uint8_t value) {
+  if (m_ioTrace) {
+    m_ioTrace->record(port, value, m_tstates, true);
+  }
+  if (m_out) {
+    m_out(port, value);
+  }
+}
+
+XZ80_DECL uint8_t Machine::peek(uint16_t addr) {
+  const uint8_t* p = m_read[addr >> PageBits];
+  return p ? p[addr & (PageSize - 1)] : readSlow(addr);
+}
+
+XZ80_DECL void Machine::poke(uint16_t addr, uint8_t value) {
+  uint8_t* p = m_direct[addr >> PageBits];
+  if (p) {
+    p[addr & (PageSize - 1)] = value;
+  } else {
+    writeSlow(addr, value);
+  }
+}
+
+XZ80_DECL void Machine::load(uint16_t addr, const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    poke(static_cast<uint16_t>(addr + i), data[i]);
+  }
+}
+
+XZ80_DECL void Machine::load(const Generator& g) {
+  const std::vector<uint8_t> bytes = g.getBytes();
+  load(g.getOrg(), bytes.data(), bytes.size());
+  m_regs.pc = g.getOrg();
+}
+
+XZ80_DECL void Machine::map(uint16_t addr, size_t size, uint8_t* mem, bool writable) {
+  const size_t first = addr >> PageBits;
+  const size_t last = std::min<size_t>(NumPages, (addr + size + PageSize - 1) >> PageBits);
+  for (size_t i = first; i < last; ++i) {
+    invalidatePage(static_cast<unsigned>(i));
+    uint8_t* p = mem + (i - first) * PageSize;
+    m_read[i] = p;
+    m_write[i] = writable ? p : nullptr;
+    m_direct[i] = directWrite(static_cast<unsigned>(i));
+  }
+}
+
+XZ80_DECL void Machine::unmap(uint16_t addr, size_t size) {
+  const size_t first = addr >> PageBits;
+  const size_t last = std::min<size_t>(NumPages, (addr + size + PageSize - 1) >> PageBits);
+  for (size_t i = first; i < last; ++i) {
+    invalidatePage(static_cast<unsigned>(i));
+    m_read[i] = nullptr;
+    m_write[i] = nullptr;
+    m_direct[i] = nullptr;
+  }
+}
+
+XZ80_DECL unsigned Machine::ramPage(const uint8_t* p) const {
+  const uintptr_t offset = reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(m_ram.data());
+  return offset < m_ram.size() ? static_cast<unsigned>(offset >> PageBits) : NumPages;
+}
+
+XZ80_DECL uint8_t* Machine::directWrite(unsigned page) const {
+  uint8_t* p = m_write[page];
+  const unsigned rp = ramPage(p);
+  return (rp < NumPages && m_base[rp]) ? nullptr : p;
+}
+
+XZ80_DECL void Machine::invalidate(void) {
+  for (unsigned i = 0; i < NumPages; ++i) {
+    m_base[i].reset();
+    m_rewrites[i] = 0;
+    invalidatePage(i);
+  }
+}
+
+XZ80_DECL void Machine::markCode(unsigned page) {
+  if (m_code.empty()) {
+    return;
+  }
+  const unsigned words = PageSize / 64;
+  std::fill_n(&m_code[page * words], words, 0);
+  for (const Block* b : m_pageBlocks[page]) {
+    if (!b->valid) {
+      continue;
+    }
+    for (unsigned i = 0; i < b->size; ++i) {
+      const uint16_t a = static_cast<uint16_t>(b->start + i);
+      if ((a >> PageBits) == page) {
+        m_code[a >> 6] |= uint64_t(1) << (a & 63);
+      }
+    }
+  }
+}
+
+XZ80_DECL void Machine::invalidateCode(uint16_t addr) {
+  const unsigned page = addr >> PageBits;
+  std::vector<Block*>& list = m_pageBlocks[page];
+  for (Block* b : list) {
+    if (b->valid && static_cast<uint16_t>(addr - b->start) < b->size) {
+      b->valid = false;
+      m_blockAt[b->start] = nullptr;
+      ++m_deadBlocks;
+    }
+  }
+  // 他のページに掛かるブロックのビットは、そのページへの次の書き込みで消える
+  list.erase(std::remove_if(list.begin(), list.end(), [](const Block* b) { return !b->valid; }),
+             list.end());
+  markCode(page);
+  if (list.empty()) {
+    m_direct[page] = directWrite(page);
+  }
+}
+
+XZ80_DECL void Machine::invalidatePage(unsigned page) {
+  for (Block* b : m_pageBlocks[page]) {
+    if (b->valid) {
+      b->valid = false;
+      m_blockAt[b->start] = nullptr;
+      ++m_deadBlocks;
+    }
+  }
+  m_pageBlocks[page].clear();
+  markCode(page);
+  m_direct[page] = directWrite(page);
+}
+
+XZ80_DECL void Machine::purgeBlocks(void) {
+  for (auto& list : m_pageBlocks) {
+    list.erase(std::remove_if(list.begin(), list.end(), [](const Block* b) { return !b->valid; }),
+               list.end());
+  }
+  m_blocks.erase(std::remove_if(m_blocks.begin(), m_blocks.end(),
+                                [](const std::unique_ptr<Block>& b) { return !b->valid; }),
+                 m_blocks.end());
+  m_deadBlocks = 0;
+}
+
+XZ80_DECL Snapshot Machine::snapshot(void) {
+  Snapshot s;
+  s.m_regs = m_regs;
+  s.m_tstates = m_tstates;
+  s.m_irq = m_irq;
+  s.m_irqData = m_irqData;
+  s.m_nmi = m_nmi;
+  s.m_eiDelay = m_eiDelay;
+  for (unsigned i = 0; i < NumPages; ++i) {
+    if (!m_base[i]) {
+      std::shared_ptr<uint8_t> page(new uint8_t[PageSize], std::default_delete<uint8_t[]>());
+      std::memcpy(page.get(), &m_ram[i * PageSize], PageSize);
+      m_base[i] = std::move(page);
+    }
+    s.m_pages[i] = m_base[i];
+  }
+  // 共有したページへの次の書き込みを writeSlow() で捕まえる
+  for (unsigned i = 0; i < NumPages; ++i) {
+    if (!directWrite(i)) {
+      m_direct[i] = nullptr;
+    }
+  }
+  return s;
+}
+
+XZ80_DECL void Machine::restore(const Snapshot& snapshot) {
+  bool changed[NumPages];
+  for (unsigned i = 0; i < NumPages; ++i) {
+    changed[i] = m_base[i] != snapshot.m_pages[i];
+  }
+  // 書き戻しで値の変わる翻訳済みのコードのバイトを含むブロックだけを捨てる
+  for (unsigned i = 0; i < NumPages; ++i) {
+    if (m_pageBlocks[i].empty() || NumPages <= ramPage(m_read[i])) {
+      continue;
+    }
+    const size_t offset = m_read[i] - m_ram.data();
+    for (unsigned j = 0; j < PageSize && offset + j < m_ram.size(); ++j) {
+      const size_t r = offset + j;
+      const uint16_t addr = static_cast<uint16_t>(i << PageBits | j);
+      if (changed[r >> PageBits] && isCode(addr) &&
+          m_ram[r] != snapshot.m_pages[r >> PageBits].get()[r & (PageSize - 1)]) {
+        invalidateCode(addr);
+      }
+    }
+  }
+  for (unsigned i = 0; i < NumPages; ++i) {
+    if (changed[i]) {
+      std::memcpy(&m_ram[i * PageSize], snapshot.m_pages[i].get(), PageSize);
+      m_base[i] = snapshot.m_pages[i];
+    }
+  }
+  for (unsigned i = 0; i < NumPages; ++i) {
+    if (!directWrite(i)) {
+      m_direct[i] = nullptr;
+    }
+  }
+  m_regs = snapshot.m_regs;
+  m_tstates = snapshot.m_tstates;
+  m_irq = snapshot.m_irq;
+  m_irqData = snapshot.m_irqData;
+  m_nmi = snapshot.m_nmi;
+  m_eiDelay = snapshot.m_eiDelay;
+  m_reason = S_Budget;
+}
+
+XZ80_DECL Machine::Block* Machine::translate(uint16_t addr) {
+  const Tables& tb = emuTables;
+  // ホストのメモリに割り当てた、書き換えの多くないページからのみ読む(コールバックは呼ばない)
+  const auto translatable = [&](uint16_t a) {
+    return m_read[a >> PageBits] && m_rewrites[a >> PageBits] <= HotRewrites;
+  };
+  if (!translatable(addr)) {
+    return nullptr;
+  }
+  std::unique_ptr<Block> block(new Block());
+  block->start = addr;
+  block->valid = true;
+
+  const auto byte = [&](uint16_t a, uint8_t& v) {
+    const uint8_t* p = translatable(a) ? m_read[a >> PageBits] : nullptr;
+    if (p) {
+      v = p[a & (PageSize - 1)];
+    }
+    return p != nullptr;
+  };
+
+  uint16_t pc = addr;
+  size_t size = 0;
+  while (block->insns.size() < MaxBlockInsns) {
+    Insn insn = Insn();
+    uint16_t p = pc;
+    uint8_t op = 0;
+    bool ok = byte(p, op);
+    while (ok && (op == 0xdd || op == 0xfd) && insn.prefixes < MaxPrefixes) {
+      insn.index = (op == 0xdd) ? 1 : 2;
+      ++insn.prefixes;
+      ok = byte(++p, op);
+    }
+    if (!ok || op == 0xdd || op == 0xfd) {
+      break;  // 読めないか、プレフィックスが長すぎる
+    }
+    if (op == 0xed) {
+      insn.index = 0;
+    }
+
+    uint8_t op2 = 0;
+    if (op == 0xcb) {
+      insn.length = insn.index ? 3 : 2;
+    } else if (op == 0xed) {
+      ok = byte(static_cast<uint16_t>(p + 1), op2);
+      insn.length = ((op2 & 0xc7) == 0x43) ? 4 : 2;
+    } else {
+      insn.length = insn.index ? tb.lengthXY[op] : tb.length[op];
+    }
+    for (unsigned i = 0; ok && i < insn.length; ++i) {
+      ok = byte(static_cast<uint16_t>(p + i), insn.bytes[i]);
+    }
+    if (!ok) {
+      break;
+    }
+    insn.handler = emuHandlers.handlers[op];
+    block->insns.push_back(insn);
+    size += insn.prefixes + insn.length;
+    pc = static_cast<uint16_t>(p + insn.length);
+
+    // PC を書き換える命令でブロックを終える
+    const bool edBranch = (op2 & 0xc7) == 0x45 || ((op2 & 0xf4) == 0xb0);
+    if (tb.branch[op] || (op == 0xed && edBranch)) {
+      break;
+    }
+  }
+  if (block->insns.empty()) {
+    return nullptr;
+  }
+
+  if (m_blockAt.empty()) {
+    m_blockAt.resize(0x10000);
+    m_code.resize(0x10000 / 64);
+  }
+  Block* b = block.get();
+  b->size = static_cast<uint16_t>(size);
+  m_blocks.push_back(std::move(block));
+  m_blockAt[addr] = b;
+  ++m_translations;
+  // 命令のバイト列への書き込みで無効化する
+  for (size_t i = 0; i < size; ++i) {
+    const uint16_t a = static_cast<uint16_t>(addr + i);
+    const unsigned page = a >> PageBits;
+    m_code[a >> 6] |= uint64_t(1) << (a & 63);
+    if (m_pageBlocks[page].empty() || m_pageBlocks[page].back() != b) {
+      m_pageBlocks[page].push_back(b);
+      m_direct[page] = nullptr;
+    }
+  }
+  return b;
+}
+
+XZ80_DECL uint64_t Machine::run(uint64_t budget) {
+  if (m_deadBlocks) {
+    purgeBlocks();
+  }
+  const uint64_t start = m_tstates;
+  const uint64_t end = (UINT64_MAX - start < budget) ? UINT64_MAX : start + budget;
+  m_stop = false;
+  const bool trace = traced();
+  if (m_engine == E_Translate) {
+    trace ? runTranslated<true>(end) : runTranslated<false>(end);
+  } else {
+    trace ? runInterpreted<true>(end) : runInterpreted<false>(end);
+  }
+  m_reason = m_stop ? S_Request : (m_regs.halted && m_haltStops) ? S_Halt : S_Budget;
+  return m_tstates - start;
+}
+
+XZ80_DECL void Machine::callTrace(CallTrace* trace) {
+  m_callTrace = trace;
+  if (trace) {
+    trace->start(m_tstates);
+  }
+}
+
+XZ80_DECL void Machine::ioTrace(IoTrace* trace) {
+  m_ioTrace = trace;
+  if (trace) {
+    trace->start(m_tstates);
+  }
+}
+
+XZ80_DECL void Machine::traceInsn(uint16_t pc, uint32_t tstates) {
+  if (m_profile) {
+    m_profile->add(pc, tstates);
+  }
+  if (m_coverage) {
+    m_coverage->mark(pc);
+  }
+}
+
+template <bool Traced>
+void Machine::runInterpreted(uint64_t end) {
+  Core c(*this);
+  while (c.running(end)) {
+    if (c.ready(end)) {
+      const uint16_t pc = c.pc;
+      c.step();
+      if (Traced) {
+        traceInsn(pc, static_cast<uint32_t>(c.t - c.t0));
+      }
+    }
+  }
+  c.save();
+}
+
+template <bool Traced>
+void Machine::runTranslated(uint64_t end) {
+  Core c(*this);
+  while (c.running(end)) {
+    if (!c.ready(end)) {
+      continue;
+    }
+    if (MaxDeadBlocks < m_deadBlocks) {
+      purgeBlocks();  // 実行中のブロックが無い間に解放する
+    }
+    Block* b = m_blockAt.empty() ? nullptr : m_blockAt[c.pc];
+    if (!b && !(b = translate(c.pc))) {
+      const uint16_t pc = c.pc;
+      c.step();  // ホストのメモリに無いコードは翻訳しない
+      if (Traced) {
+        traceInsn(pc, static_cast<uint32_t>(c.t - c.t0));
+      }
+      continue;
+    }
+    // 命令の間の割り込みと終了の判定はインタプリタと同じ
+    const Insn* insn = b->insns.data();
+    const Insn* const last = insn + b->insns.size();
+    for (;;) {
+      const uint16_t pc = c.pc;
+      c.t0 = c.t;
+      insn->handler(c, *insn);
+      if (Traced) {
+        traceInsn(pc, static_cast<uint32_t>(c.t - c.t0));
+      }
+      if (++insn == last || !b->valid || c.pending(end)) {
+        break;
+      }
+      c.eiDelay = false;
+    }
+  }
+  c.save();
+}
+
+// ファイル形式: "XZ80SNP1", レジスタと割り込みの状態(リトルエンディアン),
+// SnapshotRamOffset から 64KB の RAM
+const size_t SnapshotRamOffset = 0x1000;
+
+XZ80_DECL Snapshot::Snapshot()
+    : m_regs(), m_tstates(0), m_irq(false), m_irqData(0xff), m_nmi(false), m_eiDelay(false) {}
+
+XZ80_DECL Snapshot::Snapshot(const char* fn) : Snapshot() {
+  const auto file = std::make_shared<Input::MappedFile>(fn);
+  const uint8_t* p = file->data();
+  if (file->size() != SnapshotRamOffset + 0x10000 || std::memcmp(p, "XZ80SNP1", 8) != 0) {
+    throw std::runtime_error(std::string(fn) + ":not a snapshot file");
+  }
+  p += 8;
+  const auto get = [&p](int n) {
+    uint64_t v = 0;
+    for (int i = n - 1; 0 <= i; --i) {
+      v = v << 8 | p[i];
+    }
+    p += n;
+    return v;
+  };
+  Regs& r = m_regs;
+  r.a = static_cast<uint8_t>(get(1));
+  r.f = static_cast<uint8_t>(get(1));
+  uint16_t* const words[] = {&r.bc, &r.de, &r.hl, &r.af2, &r.bc2, &r.de2,
+                             &r.hl2, &r.ix, &r.iy, &r.sp, &r.pc};
+  for (uint16_t* w : words) {
+    *w = static_cast<uint16_t>(get(2));
+  }
+  r.i = static_cast<uint8_t>(get(1));
+  r.r = static_cast<uint8_t>(get(1));
+  r.im = static_cast<uint8_t>(get(1));
+  r.iff1 = get(1) != 0;
+  r.iff2 = get(1) != 0;
+  r.halted = get(1) != 0;
+  m_tstates = get(8);
+  m_irq = get(1) != 0;
+  m_irqData = static_cast<uint8_t>(get(1));
+  m_nmi = get(1) != 0;
+  m_eiDelay = get(1) != 0;
+  // 各ページはファイルの割り当てを共有して参照する
+  for (unsigned i = 0; i < Machine::NumPages; ++i) {
+    m_pages[i] = std::shared_ptr<const uint8_t>(
+        file, file->data() + SnapshotRamOffset + i * Machine::PageSize);
+  }
+}
+
+XZ80_DECL size_t Snapshot::sharedPages(const Snapshot& other) const {
+  size_t n = 0;
+  for (unsigned i = 0; i < Machine::NumPages; ++i) {
+    n += m_pages[i] == other.m_pages[i];
+  }
+  return n;
+}
+
+XZ80_DECL void Snapshot::save(const char* fn) const {
+  std::string out("XZ80SNP1");
+  const Regs& r = m_regs;
+  Output::putLE(out, r.a, 1);
+  Output::putLE(out, r.f, 1);
+  for (const uint16_t w : {r.bc, r.de, r.hl, r.af2, r.bc2, r.de2, r.hl2, r.ix, r.iy, r.sp, r.pc}) {
+    Output::putLE(out, w, 2);
+  }
+  Output::putLE(out, r.i, 1);
+  Output::putLE(out, r.r, 1);
+  Output::putLE(out, r.im, 1);
+  Output::putLE(out, r.iff1, 1);
+  Output::putLE(out, r.iff2, 1);
+  Output::putLE(out, r.halted, 1);
+  Output::putLE(out, static_cast<uint32_t>(m_tstates), 4);
+  Output::putLE(out, static_cast<uint32_t>(m_tstates >> 32), 4);
+  Output::putLE(out, m_irq, 1);
+  Output::putLE(out, m_irqData, 1);
+  Output::putLE(out, m_nmi, 1);
+  Output::putLE(out, m_eiDelay, 1);
+  out.resize(SnapshotRamOffset);
+  for (const auto& page : m_pages) {
+    out.append(reinterpret_cast<const char*>(page.get()), Machine::PageSize);
+  }
+  Output::writeFile(fn, out.data(), out.size(), false);
+}
+
+XZ80_DECL Batch::Results Batch::run(size_t n, const InstanceFunc& init, const InstanceFunc& done,
+                                   unsigned threads) const {
+  Results r;
+  for (auto* v : {&r.a, &r.f, &r.reason}) {
+    v->resize(n);
+  }
+  for (auto* v : {&r.bc, &r.de, &r.hl, &r.ix, &r.iy, &r.sp, &r.pc}) {
+    v->resize(n);
+  }
+  r.tstates.resize(n);
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, (n + Chunk - 1) / Chunk)));
+
+  // スレッド毎の区間 [next, end)。他のスレッドも next から Chunk 個ずつ取る
+  struct alignas(64) Range {
+    std::atomic<size_t> next;
+    size_t end;
+  };
+  std::unique_ptr<Range[]> ranges(new Range[threads]);
+  for (unsigned w = 0; w < threads; ++w) {
+    ranges[w].next = n * w / threads;
+    ranges[w].end = n * (w + 1) / threads;
+  }
+  std::atomic<bool> abort{false};
+  std::exception_ptr error;
+  std::mutex errorLock;
+
+  const auto worker = [&](unsigned self) {
+    try {
+      Machine m;
+      m.engine(m_engine);
+      if (m_setup) {
+        m_setup(m);
+      }
+      for (unsigned k = 0; k < threads && !abort; ) {
+        Range& range = ranges[(self + k) % threads];
+        const size_t begin = range.next.fetch_add(Chunk);
+        if (range.end <= begin) {
+          ++k;  // この区間は終わったので次のスレッドの区間から取る
+          continue;
+        }
+        for (size_t i = begin; i < std::min(begin + Chunk, range.end); ++i) {
+          m.restore(m_start);
+          init(m, i);
+          r.tstates[i] = m.run(m_budget);
+          const Regs& regs = m.regs();
+          r.a[i] = regs.a;
+          r.f[i] = regs.f;
+          r.bc[i] = regs.bc;
+          r.de[i] = regs.de;
+          r.hl[i] = regs.hl;
+          r.ix[i] = regs.ix;
+          r.iy[i] = regs.iy;
+          r.sp[i] = regs.sp;
+          r.pc[i] = regs.pc;
+          r.reason[i] = static_cast<uint8_t>(m.reason());
+          if (done) {
+            done(m, i);
+          }
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorLock);
+      if (!error) {
+        error = std::current_exception();
+      }
+      abort = true;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned w = 1; w < threads; ++w) {
+    workers.emplace_back(worker, w);
+  }
+  worker(0);
+  for (auto& w : workers) {
+    w.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return r;
+}
+
+XZ80_DECL uint64_t Profile::totalTStates(void) const {
+  uint64_t total = 0;
+  for (const uint64_t t : m_tstates) {
+    total += t;
+  }
+  return total;
+}
+
+XZ80_DECL void Profile::report(std::ostream& os, const Generator& g, size_t top) const {
+  struct Row {
+    uint64_t tstates;
+    uint64_t count;
+    uint16_t addr;
+    const std::string* name;
+  };
+  const auto byTStates = [](const Row& a, const Row& b) {
+    return a.tstates != b.tstates ? b.tstates < a.tstates : a.addr < b.addr;
+  };
+  const uint64_t total = totalTStates();
+  uint64_t insns = 0;
+  for (const uint64_t n : m_counts) {
+    insns += n;
+  }
+
+  // ラベルの範囲 [ラベル, 次のラベル) 毎(最初のラベルより前は "(other)")
+  std::vector<std::pair<uint16_t, const std::string*> > labels;
+  for (const auto& l : g.getLabels()) {
+    labels.emplace_back(l.second, &l.first);
+  }
+  std::stable_sort(labels.begin(), labels.end(),
+                   [](const std::pair<uint16_t, const std::string*>& a,
+                      const std::pair<uint16_t, const std::string*>& b) { return a.first < b.first; });
+  static const std::string other("(other)");
+  std::vector<Row> ranges;
+  Row outside{0, 0, 0, &other};
+  for (uint32_t addr = 0; addr < 0x10000; ++addr) {
+    if (!m_counts[addr]) {
+      continue;
+    }
+    auto itr = std::upper_bound(labels.begin(), labels.end(), addr,
+                                [](uint32_t a, const std::pair<uint16_t, const std::string*>& l) {
+                                  return a < l.first;
+                                });
+    Row* row = &outside;
+    if (itr != labels.begin()) {
+      // 同じアドレスのラベルは最初のものにまとめる
+      const uint16_t start = (--itr)->first;
+      while (itr != labels.begin() && (itr - 1)->first == start) {
+        --itr;
+      }
+      if (ranges.empty() || ranges.back().addr != start) {
+        ranges.push_back(Row{0, 0, start, itr->second});
+      }
+      row = &ranges.back();
+    }
+    row->tstates += m_tstates[addr];
+    row->count += m_counts[addr];
+  }
+  if (outside.count) {
+    ranges.push_back(outside);
+  }
+  std::sort(ranges.begin(), ranges.end(), byTStates);
+
+  std::vector<Row> insnRows;
+  for (const auto& m : g.getMnemonics()) {
+    if (!m.getBytes().empty() && m_counts[m.getAddr()]) {
+      insnRows.push_back(Row{m_tstates[m.getAddr()], m_counts[m.getAddr()], m.getAddr(),
+                             &m.getMnemonic()});
+    }
+  }
+  std::sort(insnRows.begin(), insnRows.end(), byTStates);
+
+  char buf[128];
+  const auto percent = [&](uint64_t t) { return total ? 100.0 * t / total : 0.0; };
+  std::sprintf(buf, "; T-states: %llu, instructions: %llu\n", static_cast<unsigned long long>(total),
+               static_cast<unsigned long long>(insns));
+  os << buf << ";\n";
+  std::sprintf(buf, "; %12s %7s %12s  %s\n", "T-states", "%", "count", "label");
+  os << buf;
+  for (size_t i = 0; i < std::min(top, ranges.size()); ++i) {
+    const Row& r = ranges[i];
+    std::sprintf(buf, "  %12llu %6.1f%% %12llu  ", static_cast<unsigned long long>(r.tstates),
+                 percent(r.tstates), static_cast<unsigned long long>(r.count));
+    os << buf << *r.name << '\n';
+  }
+  os << ";\n";
+  std::sprintf(buf, "; %12s %7s %12s  %-6s %s\n", "T-states", "%", "count", "addr", "instruction");
+  os << buf;
+  for (size_t i = 0; i < std::min(top, insnRows.size()); ++i) {
+    const Row& r = insnRows[i];
+    auto text = Output::trimMnemonic(*r.name);
+    while (text.second && text.first[text.second - 1] == ' ') {
+      --text.second;
+    }
+    std::sprintf(buf, "  %12llu %6.1f%% %12llu  %04Xh  ", static_cast<unsigned long long>(r.tstates),
+                 percent(r.tstates), static_cast<unsigned long long>(r.count), r.addr);
+    os << buf;
+    os.write(text.first, static_cast<std::streamsize>(text.second));
+    os << '\n';
+  }
+}
+
+XZ80_DECL void Profile::listing(std::ostream& os, const Generator& g) const {
+  std::string out;
+  char buf[64];
+  std::sprintf(buf, "; %12s %12s  %s\n", "T-states", "count", "addr");
+  out.append(buf);
+  for (const auto& m : g.getMnemonics()) {
+    if (m.getBytes().empty()) {
+      std::sprintf(buf, "  %12s %12s  %04Xh  ", "", "", m.getAddr());
+    } else {
+      std::sprintf(buf, "  %12llu %12llu  %04Xh  ",
+                   static_cast<unsigned long long>(m_tstates[m.getAddr()]),
+                   static_cast<unsigned long long>(m_counts[m.getAddr()]), m.getAddr());
+    }
+    out.append(buf);
+    out.append(m.getMnemonic());
+    out.push_back('\n');
+    Output::renderFlush(out, &os, false);
+  }
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL CallTrace::CallTrace(size_t maxEvents)
+    : m_nodes(), m_stack(), m_events(), m_maxEvents(maxEvents), m_dropped(0), m_origin(0),
+      m_last(0) {
+  start(0);
+}
+
+XZ80_DECL void CallTrace::start(uint64_t t) {
+  m_nodes.assign(1, Node{0, K_Call, 0, 0, 0, 0, {}});
+  m_stack.clear();
+  m_events.clear();
+  m_dropped = 0;
+  m_origin = t;
+  m_last = t;
+}
+
+XZ80_DECL void CallTrace::enter(uint16_t addr, uint16_t sp, uint64_t t, Kind kind) {
+  const size_t parent = m_stack.empty() ? 0 : m_stack.back().node;
+  const uint32_t key = static_cast<uint32_t>(kind) << 16 | addr;
+  const auto itr = m_nodes[parent].childIndex.find(key);
+  size_t node;
+  if (itr != m_nodes[parent].childIndex.end()) {
+    node = itr->second;
+  } else {
+    node = m_nodes.size();
+    m_nodes[parent].childIndex.emplace(key, node);
+    m_nodes.push_back(Node{addr, kind, parent, 0, 0, 0, {}});
+  }
+  ++m_nodes[node].calls;
+  m_stack.push_back(Frame{node, sp, t});
+  m_last = t;
+}
+
+XZ80_DECL void CallTrace::leave(uint16_t sp, uint64_t t) {
+  const uint16_t entry = static_cast<uint16_t>(sp - 2);
+  for (size_t i = m_stack.size(); i-- > 0;) {
+    if (m_stack[i].sp == entry) {
+      while (i < m_stack.size()) {
+        close(t);
+      }
+      break;
+    }
+  }
+  m_last = t;
+}
+
+XZ80_DECL void CallTrace::close(uint64_t t) {
+  const Frame f = m_stack.back();
+  m_stack.pop_back();
+  Node& n = m_nodes[f.node];
+  const uint64_t d = t - f.start;
+  n.inclusive += d;
+  m_nodes[n.parent].children += d;
+  if (m_events.size() < m_maxEvents) {
+    m_events.push_back(Event{f.node, f.start, t, static_cast<uint32_t>(m_stack.size())});
+  } else {
+    ++m_dropped;
+  }
+}
+
+XZ80_DECL void CallTrace::finish(uint64_t t) {
+  while (!m_stack.empty()) {
+    close(t);
+  }
+  m_last = std::max(m_last, t);
+  m_nodes[0].inclusive = m_last - m_origin;
+}
+
+XZ80_DECL std::map<uint16_t, std::string> CallTrace::labelNames(const Generator& g) {
+  std::map<uint16_t, std::string> names;
+  for (const auto& l : g.getLabels()) {
+    names.emplace(l.second, l.first);
+  }
+  return names;
+}
+
+XZ80_DECL std::string CallTrace::name(const Node& node,
+                                      const std::map<uint16_t, std::string>& labels) const {
+  if (&node == &m_nodes[0]) {
+    return "(root)";
+  }
+  std::string s = (node.kind == K_Int) ? "int:" : (node.kind == K_Nmi) ? "nmi:" : "";
+  const auto itr = labels.find(node.addr);
+  if (itr != labels.end()) {
+    return s + itr->second;
+  }
+  char buf[8];
+  std::sprintf(buf, "%04Xh", node.addr);
+  return s + buf;
+}
+
+XZ80_DECL void CallTrace::tree(std::ostream& os, const Generator& g) const {
+  const std::map<uint16_t, std::string> labels = labelNames(g);
+  std::string out;
+  char buf[64];
+  std::sprintf(buf, "; %12s %12s %10s  %s\n", "inclusive", "exclusive", "calls", "frame");
+  out.append(buf);
+  // 子は inclusive の多い順
+  const std::function<void(size_t, int)> visit = [&](size_t i, int depth) {
+    const Node& n = m_nodes[i];
+    std::sprintf(buf, "  %12llu %12llu %10llu  ", static_cast<unsigned long long>(n.inclusive),
+                 static_cast<unsigned long long>(n.exclusive()),
+                 static_cast<unsigned long long>(n.calls));
+    out.append(buf);
+    out.append(depth * 2, ' ');
+    out.append(name(n, labels));
+    out.push_back('\n');
+    Output::renderFlush(out, &os, false);
+    std::vector<size_t> children;
+    for (const auto& c : n.childIndex) {
+      children.push_back(c.second);
+    }
+    std::stable_sort(children.begin(), children.end(), [&](size_t a, size_t b) {
+      return m_nodes[b].inclusive < m_nodes[a].inclusive;
+    });
+    for (const size_t c : children) {
+      visit(c, depth + 1);
+    }
+  };
+  visit(0, 0);
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL void CallTrace::collapsed(std::ostream& os, const Generator& g) const {
+  const std::map<uint16_t, std::string> labels = labelNames(g);
+  std::string out;
+  const std::function<void(size_t, const std::string&)> visit = [&](size_t i,
+                                                                    const std::string& parent) {
+    const Node& n = m_nodes[i];
+    const std::string path = parent.empty() ? name(n, labels) : parent + ";" + name(n, labels);
+    if (n.exclusive()) {
+      out.append(path);
+      out.push_back(' ');
+      out.append(std::to_string(n.exclusive()));
+      out.push_back('\n');
+      Output::renderFlush(out, &os, false);
+    }
+    for (const auto& c : n.childIndex) {
+      visit(c.second, path);
+    }
+  };
+  visit(0, "");
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL void CallTrace::chromeTrace(std::ostream& os, const Generator& g, double mhz) const {
+  const std::map<uint16_t, std::string> labels = labelNames(g);
+  std::vector<std::string> names(m_nodes.size());
+  for (size_t i = 0; i < m_nodes.size(); ++i) {
+    names[i] = name(m_nodes[i], labels);
+  }
+  std::string out("{\"traceEvents\":[\n");
+  char buf[160];
+  for (size_t i = 0; i < m_events.size(); ++i) {
+    const Event& e = m_events[i];
+    out.append("{\"name\":");
+    Output::putJsonString(out, names[e.node].c_str(), names[e.node].size());
+    std::sprintf(buf,
+                 ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"args\":{\"start\":%llu,\"tstates\":%llu,\"depth\":%u}}%s\n",
+                 (e.start - m_origin) / mhz, (e.end - e.start) / mhz,
+                 static_cast<unsigned long long>(e.start),
+                 static_cast<unsigned long long>(e.end - e.start), e.depth,
+                 (i + 1 < m_events.size()) ? "," : "");
+    out.append(buf);
+    Output::renderFlush(out, &os, false);
+  }
+  out.append("],\"displayTimeUnit\":\"ns\"}\n");
+  Output::renderFlush(out, &os, true);
+}
+
+XZ80_DECL Coverage::Coverage(unsigned banks)
+    : m_banks(banks ? banks : 1), m_bits(m_banks * WordsPerBank), m_pageBank() {}
+
+XZ80_DECL void Coverage::bank(uint16_t addr, size_t size, unsigned bank) {
+  if (m_banks <= bank) {
+    throw std::out_of_range("Coverage:bank out of range");
+  }
+  const size_t first = addr >> Machine::PageBits;
+  const size_t last = std::min<size_t>(
+      Machine::NumPages, (addr + size + Machine::PageSize - 1) >> Machine::PageBits);
+  for (size_t i = first; i < last; ++i) {
+    m_pageBank[i] = static_cast<uint16_t>(bank);
+  }
+}
+
+XZ80_DECL size_t Coverage::count(unsigned bank) const {
+  size_t n = 0;
+  for (size_t i = 0; i < WordsPerBank; ++i) {
+    n += __builtin_popcountll(m_bits[bank * WordsPerBank + i]);
+  }
+  return n;
+}
+
+XZ80_DECL void Coverage::merge(const Coverage& other) {
+  if (other.m_banks != m_banks) {
+    throw std::invalid_argument("Coverage:number of banks mismatch");
+  }
+  for (size_t i = 0; i < m_bits.size(); ++i) {
+    m_bits[i] |= other.m_bits[i];
+  }
+}
+
+// ファイル形式: "XZ80COV1", バンク数(4バイト), ビットマップ(リトルエンディアンの8バイト単位)
+XZ80_DECL void Coverage::save(const char* fn) const {
+  std::string out("XZ80COV1");
+  Output::putLE(out, m_banks, 4);
+  for (const uint64_t w : m_bits) {
+    Output::putLE(out, static_cast<uint32_t>(w), 4);
+    Output::putLE(out, static_cast<uint32_t>(w >> 32), 4);
+  }
+  Output::writeFile(fn, out.data(), out.size(), false);
+}
+
+XZ80_DECL void Coverage::merge(const char* fn) {
+  const Input::MappedFile in(fn);
+  const uint8_t* p = in.data();
+  if (in.size() < 12 || std::memcmp(p, "XZ80COV1", 8) != 0) {
+    throw std::runtime_error(std::string(fn) + ":not a coverage file");
+  }
+  const uint32_t banks = p[8] | p[9] << 8 | p[10] << 16 | static_cast<uint32_t>(p[11]) << 24;
+  if (banks != m_banks || in.size() != 12 + m_bits.size() * 8) {
+    throw std::runtime_error(std::string(fn) + ":number of banks mismatch");
+  }
+  p += 12;
+  for (size_t i = 0; i < m_bits.size(); ++i, p += 8) {
+    uint64_t w = 0;
+    for (int j = 7; 0 <= j; --j) {
+      w = w << 8 | p[j];
+    }
+    m_bits[i] |= w;
+  }
+}
+
+XZ80_DECL size_t Coverage::report(std::ostream& os, const Generator& g, unsigned bank) const {
+  // 命令とその直前のラベル
+  struct Line {
+    const Mnemonic* m;
+    const std::string* label;
+  };
+  std::vector<std::pair<uint16_t, const std::string*> > labels;
+  for (const auto& l : g.getLabels()) {
+    labels.emplace_back(l.second, &l.first);
+  }
+  std::stable_sort(labels.begin(), labels.end(),
+                   [](const std::pair<uint16_t, const std::string*>& a,
+                      const std::pair<uint16_t, const std::string*>& b) { return a.first < b.first; });
+  std::vector<Line> lines;
+  size_t next = 0;
+  const std::string* label = nullptr;
+  for (const auto& m : g.getMnemonics()) {
+    const auto text = Output::trimMnemonic(m.getMnemonic());
+    if (m.getBytes().empty() || (3 <= text.second && (std::strncmp(text.first, "DB ", 3) == 0 ||
+                                                      std::strncmp(text.first, "DW ", 3) == 0))) {
+      continue;
+    }
+    while (next < labels.size() && labels[next].first <= m.getAddr()) {
+      label = labels[next++].second;
+    }
+    lines.push_back(Line{&m, label});
+  }
+
+  std::string out;
+  char buf[64];
+  size_t uncovered = 0;
+  std::vector<const std::string*> deadLabels;
+  for (size_t i = 0; i < lines.size();) {
+    // 同じラベルの命令をまとめて判定する
+    size_t j = i;
+    bool any = false;
+    for (; j < lines.size() && lines[j].label == lines[i].label; ++j) {
+      any = any || covered(lines[j].m->getAddr(), bank);
+    }
+    if (!any && lines[i].label) {
+      deadLabels.push_back(lines[i].label);
+    }
+    for (; i < j; ++i) {
+      if (!covered(lines[i].m->getAddr(), bank)) {
+        ++uncovered;
+      }
+    }
+  }
+  std::sprintf(buf, "; covered %u/%u instructions (%.1f%%)\n",
+               static_cast<unsigned>(lines.size() - uncovered), static_cast<unsigned>(lines.size()),
+               lines.empty() ? 100.0 : 100.0 * (lines.size() - uncovered) / lines.size());
+  out.append(buf);
+  out.append("; labels never reached:\n");
+  for (const std::string* l : deadLabels) {
+    out.append("  ");
+    out.append(*l);
+    out.push_back('\n');
+  }
+  out.append("; instructions never executed:\n");
+  for (const Line& l : lines) {
+    const uint16_t addr = l.m->getAddr();
+    if (covered(addr, bank)) {
+      continue;
+    }
+    std::sprintf(buf, "  %04Xh  ", addr);
+    out.append(buf);
+    auto text = Output::trimMnemonic(l.m->getMnemonic());
+    while (0 < text.second && text.first[text.second - 1] == ' ') {
+      --text.second;
+    }
+    out.append(text.first, text.second);
+    if (l.label) {
+      out.append("\t; ");
+      out.append(*l.label);
+      std::sprintf(buf, "+%u", static_cast<unsigned>(addr - g.getLabels().at(*l.label)));
+      out.append(buf);
+    }
+    out.push_back('\n');
+    Output::renderFlush(out, &os, false);
+  }
+  Output::renderFlush(out, &os, true);
+  return uncovered;
+}
+
+XZ80_DECL IoTrace::IoTrace(size_t capacity, uint64_t frameTStates, uint32_t burstGap)
+    : m_ring(std::max<size_t>(1, capacity)),
+      m_total(0),
+      m_origin(0),
+      m_frameTStates(std::max<uint64_t>(1, frameTStates)),
+      m_burstGap(burstGap),
+      m_stats() {
+  start(0);
+}
+
+XZ80_DECL void IoTrace::start(uint64_t t) {
+  m_total = 0;
+  m_origin = t;
+  for (Stats& s : m_stats) {
+    s = Stats();
+    s.minSpacing = UINT64_MAX;
+  }
+}
+
+XZ80_DECL void IoTrace::record(uint16_t port, uint8_t value, uint64_t t, bool out) {
+  m_ring[m_total++ % m_ring.size()] = Access{t, port, value, out};
+
+  Stats& s = m_stats[port & 0xff];
+  const uint64_t frame = (t - m_origin) / m_frameTStates;
+  if (s.accesses() == 0) {
+    s.bursts = 1;
+    s.burst = 1;
+    s.frame = frame;
+    s.inFrame = 1;
+  } else {
+    const uint64_t spacing = t - s.last;
+    s.minSpacing = std::min(s.minSpacing, spacing);
+    if (spacing <= m_burstGap) {
+      ++s.burst;
+    } else {
+      ++s.bursts;
+      s.burst = 1;
+    }
+    if (frame == s.frame) {
+      ++s.inFrame;
+    } else {
+      s.frame = frame;
+      s.inFrame = 1;
+    }
+  }
+  s.maxBurst = std::max(s.maxBurst, s.burst);
+  s.maxPerFrame = std::max(s.maxPerFrame, s.inFrame);
+  s.last = t;
+  ++(out ? s.writes : s.reads);
+}
+
+XZ80_DECL std::vector<IoTrace::Access> IoTrace::accesses(void) const {
+  std::vector<Access> v;
+  const size_t n = static_cast<size_t>(std::min<uint64_t>(m_total, m_ring.size()));
+  v.reserve(n);
+  for (uint64_t i = m_total - n; i < m_total; ++i) {
+    v.push_back(m_ring[i % m_ring.size()]);
+  }
+  return v;
+}
+
+XZ80_DECL void IoTrace::report(std::ostream& os, uint64_t now) const {
+  const double frames = static_cast<double>(now - m_origin) / m_frameTStates;
+  char buf[160];
+  std::sprintf(buf, "; T-states: %llu (%.2f frames of %llu), accesses: %llu\n",
+               static_cast<unsigned long long>(now - m_origin), frames,
+               static_cast<unsigned long long>(m_frameTStates),
+               static_cast<unsigned long long>(m_total));
+  os << buf << ";\n";
+  std::sprintf(buf, "; %-4s %10s %10s %11s %9s %11s %9s %9s %9s\n", "port", "in", "out",
+               "bytes/frame", "max/frame", "min spacing", "bursts", "max burst", "avg burst");
+  os << buf;
+  for (unsigned port = 0; port < 256; ++port) {
+    const Stats& s = m_stats[port];
+    if (s.accesses() == 0) {
+      continue;
+    }
+    char spacing[24] = "-";
+    if (s.minSpacing != UINT64_MAX) {
+      std::sprintf(spacing, "%llu", static_cast<unsigned long long>(s.minSpacing));
+    }
+    std::sprintf(buf, "  %02Xh  %10llu %10llu %11.1f %9llu %11s %9llu %9llu %9.1f\n", port,
+                 static_cast<unsigned long long>(s.reads), static_cast<unsigned long long>(s.writes),
+                 0 < frames ? s.accesses() / frames : 0.0,
+                 static_cast<unsigned long long>(s.maxPerFrame), spacing,
+                 static_cast<unsigned long long>(s.bursts),
+                 static_cast<unsigned long long>(s.maxBurst),
+                 static_cast<double>(s.accesses()) / s.bursts);
+    os << buf;
+  }
+}
+
+XZ80_DECL Cpm::Cpm(std::istream& in, std::ostream& out)
+    : m_machine(), m_in(in), m_out(out), m_dir("."), m_files(), m_dma(DefaultDma), m_exited(false),
+      m_bdosCalls(0) {}
+
+XZ80_DECL Cpm::~Cpm() { closeAll(); }
+
+XZ80_DECL void Cpm::closeAll(void) {
+  for (std::FILE* fp : m_files) {
+    if (fp) {
+      std::fclose(fp);
+    }
+  }
+  m_files.clear();
+}
+
+XZ80_DECL void Cpm::load(const uint8_t* com, size_t size, const std::string& args) {
+  if (BdosEntry - Tpa < size) {
+    throw std::length_error("too large .COM image");
+  }
+  closeAll();
+  m_machine.reset();
+  m_dma = DefaultDma;
+  m_exited = false;
+  m_bdosCalls = 0;
+
+  // ゼロページ: JP ウォームブート, IOBYTE, ドライブ, JP BDOS
+  uint8_t* ram = m_machine.ram();
+  std::memset(ram, 0, Tpa);
+  m_machine.invalidate();  // 前のプログラムの翻訳済みのブロックを捨てる
+  const uint8_t page0[] = {0xc3, 0x00, BootEntry >> 8, 0x00, 0x00, 0xc3, 0x00, BdosEntry >> 8};
+  m_machine.load(0x0000, page0, sizeof(page0));
+  const uint8_t bdos[] = {0x76, 0xc9};  // HALT; RET
+  m_machine.load(BdosEntry, bdos, sizeof(bdos));
+  m_machine.poke(BootEntry, 0x76);  // HALT
+
+  // コマンドライン(大文字にし、先頭に空白を置く)と FCB
+  std::string tail;
+  for (const char c : args) {
+    tail += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+  }
+  std::vector<std::string> words;
+  std::istringstream ss(tail);
+  for (std::string w; ss >> w;) {
+    words.push_back(w);
+  }
+  if (!tail.empty()) {
+    tail.insert(0, " ");
+  }
+  tail.resize(std::min<size_t>(tail.size(), 0x7e));
+  m_machine.poke(DefaultDma, static_cast<uint8_t>(tail.size()));
+  m_machine.load(DefaultDma + 1, reinterpret_cast<const uint8_t*>(tail.data()), tail.size());
+  parseFcb(0x005c, words.size() < 1 ? "" : words[0]);
+  parseFcb(0x006c, words.size() < 2 ? "" : words[1]);
+
+  m_machine.load(Tpa, com, size);
+  Regs& r = m_machine.regs();
+  r.pc = Tpa;
+  r.sp = static_cast<uint16_t>(BdosEntry - 2);  // RET で 0000h に戻る
+  m_machine.poke(r.sp, 0x00);
+  m_machine.poke(static_cast<uint16_t>(r.sp + 1), 0x00);
+}
+
+XZ80_DECL void Cpm::load(const Generator& g, const std::string& args) {
+  if (g.getOrg() != Tpa) {
+    throw std::invalid_argument("CP/M program must start at 0100h");
+  }
+  const std::vector<uint8_t> bytes = g.getBytes();
+  load(bytes.data(), bytes.size(), args);
+}
+
+XZ80_DECL void Cpm::parseFcb(uint16_t fcb, const std::string& arg) {
+  uint8_t buf[16];
+  std::memset(buf, ' ', sizeof(buf));
+  buf[0] = 0;
+  std::memset(buf + 12, 0, 4);
+  size_t pos = 0;
+  if (2 <= arg.size() && arg[1] == ':') {
+    buf[0] = static_cast<uint8_t>(arg[0] - 'A' + 1);
+    pos = 2;
+  }
+  // 名前(8文字)と拡張子(3文字)。'*' は残りを '?' で埋める
+  for (int part = 0; part < 2; ++part) {
+    const int first = part ? 9 : 1, len = part ? 3 : 8;
+    for (int i = 0; pos < arg.size() && arg[pos] != '.'; ++pos) {
+      if (arg[pos] == '*') {
+        for (; i < len; ++i) {
+          buf[first + i] = '?';
+        }
+      } else if (i < len) {
+        buf[first + i++] = static_cast<uint8_t>(arg[pos]);
+      }
+    }
+    if (pos < arg.size()) {
+      ++pos;  // '.'
+    }
+  }
+  m_machine.load(fcb, buf, sizeof(buf));
+}
+
+XZ80_DECL bool Cpm::run(uint64_t budget) {
+  const uint64_t start = m_machine.tstates();
+  const uint64_t end = (UINT64_MAX - start < budget) ? UINT64_MAX : start + budget;
+  m_machine.haltStops(true);
+  while (!m_exited) {
+    const uint64_t now = m_machine.tstates();
+    if (end <= now) {
+      return false;
+    }
+    m_machine.run(end - now);
+    if (m_machine.reason() != Machine::S_Halt) {
+      return false;
+    }
+    Regs& r = m_machine.regs();
+    if (r.pc != BdosEntry + 1) {
+      m_exited = true;  // ウォームブートか、プログラム中の HALT
+      break;
+    }
+    r.halted = false;
+    bdos();  // 続く RET で呼び出し元に戻る
+  }
+  m_out.flush();
+  closeAll();
+  return true;
+}
+
+XZ80_DECL void Cpm::bdos(void) {
+  Regs& r = m_machine.regs();
+  const uint8_t func = static_cast<uint8_t>(r.bc);
+  const uint8_t e = static_cast<uint8_t>(r.de);
+  uint16_t result = 0;
+  ++m_bdosCalls;
+
+  const auto getc = [&]() -> uint8_t {
+    const int c = m_in.get();
+    return (c == EOF) ? 0x1a : static_cast<uint8_t>(c);
+  };
+  const auto available = [&]() { return 0 < m_in.rdbuf()->in_avail(); };
+
+  switch (func) {
+    case 0:  // システムリセット
+      m_exited = true;
+      break;
+    case 1:  // コンソール入力(エコーする)
+      result = getc();
+      m_out.put(static_cast<char>(result));
+      break;
+    case 2:  // コンソール出力
+      m_out.put(static_cast<char>(e));
+      break;
+    case 6:  // 直接コンソール入出力
+      if (e == 0xff) {
+        result = available() ? getc() : 0;
+      } else if (e == 0xfe) {
+        result = available() ? 0xff : 0;
+      } else if (e == 0xfd) {
+        result = getc();
+      } else {
+        m_out.put(static_cast<char>(e));
+      }
+      break;
+    case 9:  // '$' で終わる文字列の出力
+      for (uint16_t a = r.de; m_machine.peek(a) != '$'; ++a) {
+        m_out.put(static_cast<char>(m_machine.peek(a)));
+      }
+      break;
+    case 10: {  // 行入力(DE: 最大文字数, 文字数, 文字列)
+      const uint8_t max = m_machine.peek(r.de);
+      uint8_t n = 0;
+      for (int c; n < max && (c = m_in.get()) != EOF && c != '\n';) {
+        if (c != '\r') {
+          m_machine.poke(static_cast<uint16_t>(r.de + 2 + n++), static_cast<uint8_t>(c));
+        }
+      }
+      m_machine.poke(static_cast<uint16_t>(r.de + 1), n);
+      break;
+    }
+    case 11:  // コンソールの状態
+      result = available() ? 0xff : 0;
+      break;
+    case 12:  // バージョン(CP/M 2.2)
+      result = 0x0022;
+      break;
+    case 13:  // ディスクのリセット
+      m_dma = DefaultDma;
+      break;
+    case 14:  // ドライブの選択
+    case 25:  // 現在のドライブ(常に A:)
+      break;
+    case 26:  // DMA アドレスの設定
+      m_dma = r.de;
+      break;
+    default:
+      result = fileFunction(func, r.de);
+      break;
+  }
+
+  // 8ビットの結果は A と L、16ビットの結果は HL と BA に返す
+  r.hl = result;
+  r.a = static_cast<uint8_t>(result);
+  r.bc = static_cast<uint16_t>((result & 0xff00) | (r.bc & 0x00ff));
+}
+
+XZ80_DECL std::string Cpm::hostName(uint16_t fcb) {
+  std::string name, ext;
+  for (int i = 1; i < 12; ++i) {
+    const char c = static_cast<char>(m_machine.peek(static_cast<uint16_t>(fcb + i)) & 0x7f);
+    if (c != ' ') {
+      (i < 9 ? name : ext) += c;
+    }
+  }
+  return m_dir + "/" + name + (ext.empty() ? "" : "." + ext);
+}
+
+XZ80_DECL std::FILE** Cpm::file(uint16_t fcb) {
+  Machine& m = m_machine;
+  const size_t id = m.peek(static_cast<uint16_t>(fcb + 16)) |
+                    m.peek(static_cast<uint16_t>(fcb + 17)) << 8;
+  return (0 < id && id <= m_files.size() && m_files[id - 1]) ? &m_files[id - 1] : nullptr;
+}
+
+XZ80_DECL uint32_t Cpm::record(uint16_t fcb) {
+  Machine& m = m_machine;
+  const uint32_t ex = m.peek(static_cast<uint16_t>(fcb + 12)) & 0x1f;
+  const uint32_t s2 = m.peek(static_cast<uint16_t>(fcb + 14)) & 0x3f;
+  const uint32_t cr = m.peek(static_cast<uint16_t>(fcb + 32)) & 0x7f;
+  return (s2 * 32 + ex) * 128 + cr;
+}
+
+XZ80_DECL void Cpm::setRecord(uint16_t fcb, uint32_t rec) {
+  m_machine.poke(static_cast<uint16_t>(fcb + 32), rec & 0x7f);
+  m_machine.poke(static_cast<uint16_t>(fcb + 12), (rec >> 7) & 0x1f);
+  m_machine.poke(static_cast<uint16_t>(fcb + 14), (rec >> 12) & 0x3f);
+}
+
+XZ80_DECL uint8_t Cpm::readRecord(std::FILE* fp, uint32_t rec) {
+  uint8_t buf[128];
+  size_t n = 0;
+  if (std::fseek(fp, static_cast<long>(rec) * 128, SEEK_SET) == 0) {
+    n = std::fread(buf, 1, sizeof(buf), fp);
+  }
+  if (n == 0) {
+    return 1;  // ファイルの終わり
+  }
+  std::memset(buf + n, 0x1a, sizeof(buf) - n);
+  m_machine.load(m_dma, buf, sizeof(buf));
+  return 0;
+}
+
+XZ80_DECL uint8_t Cpm::writeRecord(std::FILE* fp, uint32_t rec) {
+  uint8_t buf[128];
+  for (size_t i = 0; i < sizeof(buf); ++i) {
+    buf[i] = m_machine.peek(static_cast<uint16_t>(m_dma + i));
+  }
+  if (std::fseek(fp, static_cast<long>(rec) * 128, SEEK_SET) != 0 ||
+      std::fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+    return 2;  // ディスクが一杯
+  }
+  return 0;
+}
+
+XZ80_DECL uint8_t Cpm::fileFunction(uint8_t func, uint16_t fcb) {
+  const auto attach = [&](std::FILE* fp) -> uint8_t {
+    if (!fp) {
+      return 0xff;
+    }
+    // 閉じたファイルの番号を再利用する
+    const auto slot = std::find(m_files.begin(), m_files.end(), nullptr);
+    const size_t id = (slot - m_files.begin()) + 1;
+    if (slot == m_files.end()) {
+      m_files.push_back(fp);
+    } else {
+      *slot = fp;
+    }
+    m_machine.poke(static_cast<uint16_t>(fcb + 16), static_cast<uint8_t>(id));
+    m_machine.poke(static_cast<uint16_t>(fcb + 17), static_cast<uint8_t>(id >> 8));
+    setRecord(fcb, 0);
+    // RC: 最初のエクステントのレコード数
+    std::fseek(fp, 0, SEEK_END);
+    const long records = (std::ftell(fp) + 127) / 128;
+    m_machine.poke(static_cast<uint16_t>(fcb + 15), static_cast<uint8_t>(std::min(records, 128L)));
+    return 0;
+  };
+  const auto randomRecord = [&]() {
+    return static_cast<uint32_t>(m_machine.peek(static_cast<uint16_t>(fcb + 33)) |
+                                 m_machine.peek(static_cast<uint16_t>(fcb + 34)) << 8 |
+                                 (m_machine.peek(static_cast<uint16_t>(fcb + 35)) & 0x03) << 16);
+  };
+  const auto setRandomRecord = [&](uint32_t rec) {
+    m_machine.poke(static_cast<uint16_t>(fcb + 33), static_cast<uint8_t>(rec));
+    m_machine.poke(static_cast<uint16_t>(fcb + 34), static_cast<uint8_t>(rec >> 8));
+    m_machine.poke(static_cast<uint16_t>(fcb + 35), static_cast<uint8_t>(rec >> 16));
+  };
+
+  const std::string name = hostName(fcb);
+  std::FILE** slot = file(fcb);
+  std::FILE* fp = slot ? *slot : nullptr;
+  switch (func) {
+    case 15: {  // オープン
+      std::FILE* f = std::fopen(name.c_str(), "r+b");
+      return attach(f ? f : std::fopen(name.c_str(), "rb"));
+    }
+    case 16:  // クローズ
+      if (!fp) {
+        return 0xff;
+      }
+      std::fclose(fp);
+      *slot = nullptr;
+      m_machine.poke(static_cast<uint16_t>(fcb + 16), 0);
+      m_machine.poke(static_cast<uint16_t>(fcb + 17), 0);
+      return 0;
+    case 19:  // 削除
+      return (std::remove(name.c_str()) == 0) ? 0 : 0xff;
+    case 20: {  // 順次読み出し
+      if (!fp) {
+        return 9;  // 不正な FCB
+      }
+      const uint32_t rec = record(fcb);
+      const uint8_t rc = readRecord(fp, rec);
+      if (rc == 0) {
+        setRecord(fcb, rec + 1);
+      }
+      return rc;
+    }
+    case 21: {  // 順次書き込み
+      if (!fp) {
+        return 9;
+      }
+      const uint32_t rec = record(fcb);
+      const uint8_t rc = writeRecord(fp, rec);
+      if (rc == 0) {
+        setRecord(fcb, rec + 1);
+      }
+      return rc;
+    }
+    case 22:  // 作成
+      return attach(std::fopen(name.c_str(), "w+b"));
+    case 23:  // 名前の変更(新しい名前は FCB+16)
+      return (std::rename(name.c_str(), hostName(static_cast<uint16_t>(fcb + 16)).c_str()) == 0)
+                 ? 0
+                 : 0xff;
+    case 33:  // ランダム読み出し
+    case 34: {  // ランダム書き込み
+      if (!fp) {
+        return 9;
+      }
+      const uint32_t rec = randomRecord();
+      setRecord(fcb, rec);
+      return (func == 33) ? readRecord(fp, rec) : writeRecord(fp, rec);
+    }
+    case 35: {  // ファイルサイズ
+      std::FILE* f = fp ? fp : std::fopen(name.c_str(), "rb");
+      if (!f) {
+        return 0xff;
+      }
+      std::fseek(f, 0, SEEK_END);
+      setRandomRecord(static_cast<uint32_t>((std::ftell(f) + 127) / 128));
+      if (!fp) {
+        std::fclose(f);
+      }
+      return 0;
+    }
+    case 36:  // ランダムレコードの設定
+      setRandomRecord(record(fcb));
+      return 0;
+    default:  // ディレクトリの検索(17, 18)と未対応のファンクション
+      return 0xff;
+  }
+}
+}  // namespace Emu
+}  // namespace Xz80
+
+#endif  // XZ80_IMPL_HPP
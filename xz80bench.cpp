@@ -0,0 +1,358 @@
+// 命令の生成・ラベル解決・出力・エミュレータのスループットを計測するベンチマーク
+//
+// ./xz80bench                      結果を表形式で表示する
+// ./xz80bench --json > base.json   結果を JSON で出力する
+// ./xz80bench --baseline base.json 基準の結果と比較し、劣化していれば終了コード 1
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <sstream>
+
+#include "xz80.hpp"
+
+// -----------------------------------------------------------------------
+// メモリ確保回数の計測
+
+namespace {
+std::atomic<uint64_t> g_allocs{0};
+}  // namespace
+
+// malloc/free による置き換えを new/delete の不一致と誤検出するため
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+// -----------------------------------------------------------------------
+// 計測対象
+
+constexpr size_t NumInstructions = 1000000;  ///< 命令生成の命令数
+constexpr size_t NumLabels = 100000;         ///< ラベル解決のラベル数
+constexpr size_t DataSize = 1 << 20;         ///< db の総バイト数
+constexpr size_t ImageSize = 1 << 20;        ///< HEX/S-record 出力のイメージサイズ
+constexpr uint64_t EmuTStates = 100000000;  ///< エミュレータで実行する T-states
+constexpr size_t BatchInstances = 10000;     ///< バッチ実行のインスタンス数
+constexpr int Repeat = 3;                    ///< 計測の繰り返し回数(最良値を採る)
+
+/// 1回の計測結果
+struct Result {
+  std::string name;
+  uint64_t items;   ///< 処理した命令・ラベル・行・T-states の数
+  uint64_t bytes;   ///< 生成したバイト数(emulate, translate, profile は実行した T-states)
+  double seconds;   ///< 最良の所要時間
+  uint64_t allocs;  ///< 1回当たりのメモリ確保回数
+  long peakRssKB;   ///< 計測後のプロセスの最大常駐メモリ
+
+  double itemsPerSec(void) const { return seconds > 0 ? items / seconds : 0; }
+  double bytesPerSec(void) const { return seconds > 0 ? bytes / seconds : 0; }
+  double allocsPerItem(void) const { return items ? double(allocs) / items : 0; }
+};
+
+class Bench : public Xz80::Generator {
+ public:
+  /// 様々な形式の命令を混ぜて n 命令生成する
+  /// 64KB に収まるように一定数ごとに reset() する
+  uint64_t encode(size_t n) {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (i % 16384 == 0) {
+        bytes += getBytes().size();
+        reset();
+      }
+      const uint8_t v = static_cast<uint8_t>(i);
+      switch (i % 16) {
+        case 0: ld(A, v); break;
+        case 1: ld(B, C); break;
+        case 2: ld(HL, static_cast<uint16_t>(i)); break;
+        case 3: add(A, IX(static_cast<int8_t>(v))); break;
+        case 4: inc(HL); break;
+        case 5: XZ80_XOR(A); break;
+        case 6: ld(mem(static_cast<uint16_t>(i)), A); break;
+        case 7: bit(v & 7, IY(static_cast<int8_t>(v))); break;
+        case 8: push(BC); break;
+        case 9: jr(NZ, -2); break;
+        case 10: call(Z, static_cast<uint16_t>(i)); break;
+        case 11: out(io(v), A); break;
+        case 12: rlc(HL()); break;
+        case 13: ldir(); break;
+        case 14: sbc(HL, DE); break;
+        default: ret(); break;
+      }
+    }
+    return bytes + getBytes().size();
+  }
+
+  /// 前方参照する JP とラベルの組を n 個生成して解決する
+  uint64_t labels(size_t n) {
+    uint64_t bytes = 0;
+    char name[16];
+    for (size_t i = 0; i < n; ++i) {
+      std::sprintf(name, "L%u", static_cast<unsigned>(i));
+      if (i % 10000 == 0) {
+        // 直前の JP の参照先を定義してから解決する
+        l(name);
+        bytes += flush();
+        reset();
+      }
+      l(name);
+      std::sprintf(name, "L%u", static_cast<unsigned>(i + 1));
+      jp(Z, name);
+    }
+    l(name);
+    return bytes + flush();
+  }
+
+  /// エミュレータで実行する、転送・演算・分岐を混ぜた無限ループ
+  void emuLoop(void) {
+    reset();
+    ld(SP, 0);
+    l("OUTER");
+    ld(HL, 0x4000);
+    ld(DE, 0x5000);
+    ld(BC, 0x40);
+    ldir();
+    ld(B, 0);
+    ld(IX, 0x6000);
+    l("INNER");
+    ld(A, mem(0x4000));
+    add(A, B);
+    ld(IX(0), A);
+    XZ80_XOR(C);
+    rlc(IX(1));
+    push(BC);
+    pop(DE);
+    inc(HL);
+    djnz("INNER");
+    call("SUB");
+    jp("OUTER");
+    l("SUB");
+    sbc(HL, DE);
+    ret(NC);
+    ret();
+    resolve();
+  }
+
+  /// 16バイトの db を size バイト分生成する
+  uint64_t data(size_t size) {
+    uint64_t bytes = 0;
+    std::vector<uint8_t> line(16);
+    for (size_t i = 0; i < size; i += line.size()) {
+      if (i % 0xc000 == 0) {
+        bytes += getBytes().size();
+        reset();
+      }
+      for (size_t j = 0; j < line.size(); ++j) {
+        line[j] = static_cast<uint8_t>(i + j);
+      }
+      db(line);
+    }
+    return bytes + getBytes().size();
+  }
+
+ private:
+  uint64_t flush(void) {
+    if (!resolve()) {
+      throw std::runtime_error("unresolved label");
+    }
+    return getBytes().size();
+  }
+};
+
+long peakRssKB(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+/// func を Repeat 回実行し、最良の所要時間を記録する
+/// @param func 生成したバイト数を返す
+Result measure(const char* name, uint64_t items, const std::function<uint64_t()>& func) {
+  Result r{name, items, 0, 0, 0, 0};
+  for (int i = 0; i < Repeat; ++i) {
+    const uint64_t allocs = g_allocs.load();
+    const auto start = std::chrono::steady_clock::now();
+    r.bytes = func();
+    const double sec =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.allocs = g_allocs.load() - allocs;
+    if (i == 0 || sec < r.seconds) {
+      r.seconds = sec;
+    }
+  }
+  r.peakRssKB = peakRssKB();
+  return r;
+}
+
+std::vector<Result> run(void) {
+  std::vector<Result> results;
+  Bench g;
+  results.push_back(measure("encode", NumInstructions, [&]() { return g.encode(NumInstructions); }));
+  results.push_back(measure("labels", NumLabels, [&]() { return g.labels(NumLabels); }));
+  results.push_back(measure("db", DataSize / 16, [&]() { return g.data(DataSize); }));
+
+  Xz80::Emu::Machine m;
+  g.emuLoop();
+  m.load(g);
+  results.push_back(measure("emulate", EmuTStates, [&]() {
+    m.reset();
+    m.regs().pc = g.getOrg();
+    return m.run(EmuTStates);
+  }));
+  m.engine(Xz80::Emu::Machine::E_Translate);
+  results.push_back(measure("translate", EmuTStates, [&]() {
+    m.reset();
+    m.regs().pc = g.getOrg();
+    return m.run(EmuTStates);
+  }));
+  Xz80::Emu::Profile prof;
+  m.profile(&prof);
+  results.push_back(measure("profile", EmuTStates, [&]() {
+    m.reset();
+    m.regs().pc = g.getOrg();
+    return m.run(EmuTStates);
+  }));
+  m.profile(nullptr);
+  // 開始状態から戻して短く実行するインスタンスを全コアで実行する
+  m.reset();
+  m.regs().pc = g.getOrg();
+  Xz80::Emu::Batch batch(m.snapshot());
+  batch.budget(EmuTStates / BatchInstances);
+  results.push_back(measure("batch", EmuTStates, [&]() {
+    const auto r = batch.run(BatchInstances, [](Xz80::Emu::Machine&, size_t) {});
+    uint64_t total = 0;
+    for (const uint64_t t : r.tstates) {
+      total += t;
+    }
+    return total;
+  }));
+
+  std::vector<uint8_t> image(ImageSize);
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+  }
+  std::string text;
+  results.push_back(measure("hex", ImageSize / 32, [&]() {
+    text.clear();
+    Xz80::Output::intelHex(text, image.data(), image.size(), 0, 32);
+    return static_cast<uint64_t>(text.size());
+  }));
+  results.push_back(measure("mot", ImageSize / 32, [&]() {
+    text.clear();
+    Xz80::Output::motorola(text, "BENCH", image.data(), image.size(), 0, 0, 32);
+    return static_cast<uint64_t>(text.size());
+  }));
+  return results;
+}
+
+void printTable(const std::vector<Result>& results) {
+  std::printf("%-10s %12s %14s %14s %12s %12s\n", "name", "ms", "items/s", "bytes/s", "allocs/item",
+              "peakRSS(KB)");
+  for (const auto& r : results) {
+    std::printf("%-10s %12.2f %14.0f %14.0f %12.3f %12ld\n", r.name.c_str(), r.seconds * 1000,
+                r.itemsPerSec(), r.bytesPerSec(), r.allocsPerItem(), r.peakRssKB);
+  }
+}
+
+void printJson(const std::vector<Result>& results) {
+  std::printf("{\"benchmarks\":[\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    std::printf(
+        "{\"name\":\"%s\",\"items\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+        "\"itemsPerSec\":%.0f,\"bytesPerSec\":%.0f,\"allocsPerItem\":%.4f,\"peakRssKB\":%ld}%s\n",
+        r.name.c_str(), static_cast<unsigned long long>(r.items),
+        static_cast<unsigned long long>(r.bytes), r.seconds, r.itemsPerSec(), r.bytesPerSec(),
+        r.allocsPerItem(), r.peakRssKB, (i + 1 < results.size()) ? "," : "");
+  }
+  std::printf("]}\n");
+}
+
+/// printJson() の出力から name の key の値を得る
+/// @return 見つからない場合は負の値
+double jsonValue(const std::string& json, const std::string& name, const char* key) {
+  const size_t pos = json.find("\"name\":\"" + name + "\"");
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  const size_t end = json.find('}', pos);
+  const size_t k = json.find(std::string("\"") + key + "\":", pos);
+  if (k == std::string::npos || end < k) {
+    return -1;
+  }
+  return std::strtod(json.c_str() + k + std::strlen(key) + 3, nullptr);
+}
+
+/// 基準の結果と比較する
+/// 処理速度が tolerance を超えて低下したか、確保回数が増えた場合は劣化とみなす
+/// @return 劣化した項目の数
+int compare(const std::vector<Result>& results, const char* fn, double tolerance) {
+  std::ifstream ifs(fn);
+  if (!ifs) {
+    throw std::runtime_error(std::string("cannot open ") + fn);
+  }
+  std::stringstream ss;
+  ss << ifs.rdbuf();
+  const std::string json = ss.str();
+
+  int regressions = 0;
+  std::printf("%-10s %14s %10s %14s %14s\n", "name", "items/s", "vs base", "allocs/item", "base");
+  for (const auto& r : results) {
+    const double speed = jsonValue(json, r.name, "itemsPerSec");
+    const double allocs = jsonValue(json, r.name, "allocsPerItem");
+    if (speed < 0 || allocs < 0) {
+      std::printf("%-10s %14.0f %10s\n", r.name.c_str(), r.itemsPerSec(), "(new)");
+      continue;
+    }
+    const double ratio = speed > 0 ? r.itemsPerSec() / speed : 1.0;
+    const bool slow = ratio < 1.0 - tolerance;
+    const bool alloc = allocs + 0.0001 < r.allocsPerItem();
+    std::printf("%-10s %14.0f %9.1f%% %14.4f %14.4f%s\n", r.name.c_str(), r.itemsPerSec(),
+                (ratio - 1.0) * 100, r.allocsPerItem(), allocs,
+                (slow || alloc) ? "  REGRESSION" : "");
+    regressions += (slow || alloc) ? 1 : 0;
+  }
+  return regressions;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool json = false;
+  const char* baseline = nullptr;
+  double tolerance = 0.10;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+      tolerance = std::atof(argv[++i]);
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--json] [--baseline file.json [--tolerance 0.10]]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const std::vector<Result> results = run();
+  if (json) {
+    printJson(results);
+  } else if (!baseline) {
+    printTable(results);
+  }
+  if (baseline) {
+    return compare(results, baseline, tolerance) ? 1 : 0;
+  }
+  return 0;
+}
@@ -0,0 +1,548 @@
+// Generator の命令をランダムに生成し、逆アセンブラで独立にデコードした結果と
+// 長さ・アドレス・オペランドが一致するかを調べるファザー
+//
+// ./xz80fuzz [--seconds N] [--cases N] [--seed N] [--threads N]
+// 不一致が見つかった場合は命令列を最小化して表示し、終了コード 1 で終了する。
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "xz80.hpp"
+
+namespace {
+/// ランダムに生成する1命令
+///
+/// kind が命令の種類、a, b, nn がオペランドの選択に使う値。
+struct Op {
+  uint8_t kind;
+  uint8_t a;
+  uint8_t b;
+  uint16_t nn;
+};
+
+constexpr uint8_t NumKinds = 59;  ///< Fuzz::emit() が扱う命令の種類の数
+constexpr size_t MaxOps = 24;     ///< 1ケースの最大命令数(JR が届く範囲に収める)
+constexpr int NumLabels = 8;      ///< ラベル参照に使うラベルの数
+
+/// xorshift64*
+class Random {
+  uint64_t m_state;
+
+ public:
+  explicit Random(uint64_t seed) : m_state(seed * 0x9e3779b97f4a7c15ull | 1) {}
+  uint64_t next(void) {
+    m_state ^= m_state >> 12;
+    m_state ^= m_state << 25;
+    m_state ^= m_state >> 27;
+    return m_state * 0x2545f4914f6cdd1dull;
+  }
+};
+
+class Fuzz : public Xz80::Generator {
+  bool m_defined[NumLabels];
+  /// 解決前のラベル参照(命令番号, ラベル番号, オペランドの位置)
+  /// resolve() で Mnemonic のラベル情報が消えるため記録しておく
+  struct Ref {
+    size_t index;
+    int label;
+    size_t offset;
+  };
+  std::vector<Ref> m_refs;
+
+ public:
+  /// ops を生成し、デコード結果と照合する
+  /// @return 不一致の内容(一致した場合は空文字列)
+  std::string check(const std::vector<Op>& ops) {
+    reset();
+    std::fill(m_defined, m_defined + NumLabels, false);
+    try {
+      for (const auto& op : ops) {
+        emit(op);
+      }
+      for (int k = 0; k < NumLabels; ++k) {
+        if (!m_defined[k]) {
+          l(labelName(k));
+        }
+      }
+      m_refs.clear();
+      const auto& ms = getMnemonics();
+      for (size_t i = 0; i < ms.size(); ++i) {
+        if (!ms[i].getLabel().empty()) {
+          m_refs.push_back(Ref{i, ms[i].getLabel()[1] - '0', ms[i].getOffset()});
+        }
+      }
+      if (!resolve()) {
+        return "unresolved label";
+      }
+    } catch (const std::exception& e) {
+      return std::string("exception: ") + e.what();
+    }
+    return verify();
+  }
+
+ private:
+  static const char* labelName(int k) {
+    static const char* const names[NumLabels] = {"L0", "L1", "L2", "L3", "L4", "L5", "L6", "L7"};
+    return names[k];
+  }
+
+  /// 生成した命令をデコードして照合する
+  std::string verify(void) const {
+    const std::vector<uint8_t> bytes = getBytes();
+    uint32_t addr = getOrg();
+    size_t pos = 0;
+    auto ref = m_refs.begin();
+    const auto& ms = getMnemonics();
+    for (size_t i = 0; i < ms.size(); ++i) {
+      const Xz80::Mnemonic& m = ms[i];
+      char buf[128];
+      const std::vector<uint8_t>& mb = m.getBytes();
+      if (m.getAddr() != (addr & 0xffff)) {
+        std::sprintf(buf, "%s: address 0%04xh, expected 0%04xh", m.getMnemonic().c_str(),
+                     m.getAddr(), addr & 0xffff);
+        return buf;
+      }
+      if (mb.empty()) {
+        continue;  // ラベル
+      }
+      if (bytes.size() < pos + mb.size() || !std::equal(mb.begin(), mb.end(), &bytes[pos])) {
+        return m.getMnemonic() + ": bytes differ from getBytes()";
+      }
+      const size_t head = m.getMnemonic().find_first_not_of(' ');
+      if (m.getMnemonic().compare(head, 3, "DB ") == 0 ||
+          m.getMnemonic().compare(head, 3, "DW ") == 0) {
+        // データはデコードせず、位置とバイト列だけを確認する
+        addr += mb.size();
+        pos += mb.size();
+        continue;
+      }
+      Xz80::Disasm::Insn insn;
+      const size_t len = Xz80::Disasm::decode(&bytes[pos], bytes.size() - pos, addr, insn);
+      std::string text = Xz80::Disasm::text(insn);
+      std::string expected = m.getMnemonic();
+      text.erase(0, text.find_first_not_of(' '));
+      expected.erase(0, expected.find_first_not_of(' '));
+      if (len != mb.size()) {
+        std::sprintf(buf, ": length %u, decoded as %u (", static_cast<unsigned>(mb.size()),
+                     static_cast<unsigned>(len));
+        return expected + buf + text + ")";
+      }
+      if (ref != m_refs.end() && ref->index == i) {
+        // ラベル参照はオペランドの値を解決したアドレスと照合する
+        const char* label = labelName(ref->label);
+        const size_t lpos = expected.find(label);
+        const auto itr = getLabels().find(label);
+        const size_t off = ref->offset;
+        ++ref;
+        const bool rel = mb.size() == 2 && (mb[0] == 0x10 || (mb[0] & 0xe7) == 0x20 || mb[0] == 0x18);
+        const uint16_t target =
+            rel ? static_cast<uint16_t>(addr + 2 + static_cast<int8_t>(mb[off]))
+                : static_cast<uint16_t>(mb[off] | mb[off + 1] << 8);
+        if (lpos == std::string::npos || itr == getLabels().end() || itr->second != target) {
+          std::sprintf(buf, ": operand 0%04xh does not point to the label", target);
+          return expected + buf;
+        }
+        expected.erase(lpos);
+        text.erase(std::min(text.size(), lpos));
+      }
+      if (text != expected) {
+        return "\"" + m.getMnemonic() + "\" decoded as \"" + text + "\"";
+      }
+      addr += mb.size();
+      pos += mb.size();
+    }
+    if (pos != bytes.size()) {
+      return "getBytes() has extra bytes";
+    }
+    return std::string();
+  }
+
+  /// op の命令を生成する
+  void emit(const Op& op) {
+    const Xz80::BasicReg8* const r8[] = {&B, &C, &D, &E, &H, &L, &A};
+    const Xz80::IndexReg16* const idx[] = {&IX, &IY};
+    const Xz80::BasicReg16* const rp[] = {&BC, &DE, &SP};
+    const Xz80::CondBase* const cc[] = {&NZ, &Z, &NC, &Cy, &PO, &PE, &P, &M};
+    const Xz80::AllCond* const jrcc[] = {&NZ, &Z, &NC, &Cy};
+    const uint8_t a = op.a, b = op.b, n = static_cast<uint8_t>(op.nn);
+    const uint16_t nn = op.nn;
+    const int8_t d = static_cast<int8_t>(b);
+    const auto& r = *r8[a % 7];
+    const auto& s = *r8[b % 7];
+    const auto& x = *idx[a & 1];
+    const auto& p = *rp[b % 3];
+    const int k = b % NumLabels;
+
+    switch (op.kind) {
+      case 0: ld(r, *r8[(a / 7) % 7]); break;
+      case 1: ld(r, b); break;
+      case 2: ld(r, HL()); break;
+      case 3: ld(*r8[(a >> 1) % 7], x(d)); break;
+      case 4: ld(HL(), r); break;
+      case 5: ld(x(d), *r8[(a >> 1) % 7]); break;
+      case 6: ld(HL(), b); break;
+      case 7: ld(x(d), n); break;
+      case 8: ld(A, mem(nn)); break;
+      case 9: ld(mem(nn), A); break;
+      case 10: (a & 1) ? ld(A, DE()) : ld(A, BC()); break;
+      case 11: (a & 1) ? ld(DE(), A) : ld(BC(), A); break;
+      case 12:
+        switch (a % 4) {
+          case 0: ld(A, I); break;
+          case 1: ld(I, A); break;
+          case 2: ld(A, R); break;
+          default: ld(R, A); break;
+        }
+        break;
+      case 13: ld(p, nn); break;
+      case 14: ld(HL, nn); break;
+      case 15: ld(x, nn); break;
+      case 16: ld(p, mem(nn)); break;
+      case 17: ld(mem(nn), p); break;
+      case 18: ld(HL, mem(nn)); break;
+      case 19: ld(mem(nn), HL); break;
+      case 20: ld(x, mem(nn)); break;
+      case 21: ld(mem(nn), x); break;
+      case 22: (b & 1) ? ld(SP, x) : ld(SP, HL); break;
+      case 23:
+        switch (b % 5) {
+          case 0: (a & 2) ? pop(BC) : push(BC); break;
+          case 1: (a & 2) ? pop(DE) : push(DE); break;
+          case 2: (a & 2) ? pop(HL) : push(HL); break;
+          case 3: (a & 2) ? pop(AF) : push(AF); break;
+          default: (a & 2) ? pop(x) : push(x); break;
+        }
+        break;
+      case 24:
+        switch (b % 5) {
+          case 0: ex(DE, HL); break;
+          case 1: ex(AF, AF); break;
+          case 2: exx(); break;
+          case 3: ex(SP(), HL); break;
+          default: ex(SP(), x); break;
+        }
+        break;
+      case 25:
+        switch (a % 16) {
+          case 0: ldi(); break;
+          case 1: ldir(); break;
+          case 2: ldd(); break;
+          case 3: lddr(); break;
+          case 4: cpi(); break;
+          case 5: cpir(); break;
+          case 6: cpd(); break;
+          case 7: cpdr(); break;
+          case 8: ini(); break;
+          case 9: inir(); break;
+          case 10: ind(); break;
+          case 11: indr(); break;
+          case 12: outi(); break;
+          case 13: otir(); break;
+          case 14: outd(); break;
+          default: otdr(); break;
+        }
+        break;
+      case 26:
+      case 27:
+      case 28:
+      case 29: alu(op.kind, a % 8, s, b, x(d)); break;
+      case 30: (b & 1) ? dec(r) : inc(r); break;
+      case 31: (b & 1) ? dec(HL()) : inc(HL()); break;
+      case 32: (a & 2) ? dec(x(d)) : inc(x(d)); break;
+      case 33:
+      case 34:
+      case 35: rot(op.kind, a % 7, s, (*idx[(a >> 3) & 1])(d)); break;
+      case 36:
+      case 37:
+      case 38: bits(op.kind, a % 3, (a >> 2) & 7, s, (*idx[(a >> 5) & 1])(d)); break;
+      case 39:
+        switch (a % 3) {
+          case 0: add(HL, p); break;
+          case 1: adc(HL, p); break;
+          default: sbc(HL, p); break;
+        }
+        break;
+      case 40:
+        switch (a % 3) {
+          case 0: add(HL, HL); break;
+          case 1: adc(HL, HL); break;
+          default: sbc(HL, HL); break;
+        }
+        break;
+      case 41: add(x, p); break;
+      case 42:
+        switch (b % 6) {
+          case 0: (a & 2) ? dec(BC) : inc(BC); break;
+          case 1: (a & 2) ? dec(DE) : inc(DE); break;
+          case 2: (a & 2) ? dec(SP) : inc(SP); break;
+          case 3: (a & 2) ? dec(HL) : inc(HL); break;
+          default: (a & 2) ? dec(x) : inc(x); break;
+        }
+        break;
+      case 43:
+        switch (a % 18) {
+          case 0: daa(); break;
+          case 1: cpl(); break;
+          case 2: neg(); break;
+          case 3: ccf(); break;
+          case 4: scf(); break;
+          case 5: nop(); break;
+          case 6: halt(); break;
+          case 7: di(); break;
+          case 8: ei(); break;
+          case 9: rlca(); break;
+          case 10: rla(); break;
+          case 11: rrca(); break;
+          case 12: rra(); break;
+          case 13: rld(); break;
+          case 14: rrd(); break;
+          case 15: ret(); break;
+          case 16: reti(); break;
+          default: retn(); break;
+        }
+        break;
+      case 44: im(a % 3); break;
+      case 45: rst((a & 7) * 8); break;
+      case 46: (a & 1) ? call(nn) : jp(nn); break;
+      case 47: (b & 1) ? call(*cc[a % 8], nn) : jp(*cc[a % 8], nn); break;
+      case 48: ret(*cc[a % 8]); break;
+      case 49:
+        switch (a % 3) {
+          case 0: jp(HL()); break;
+          case 1: jp(IX()); break;
+          default: jp(IY()); break;
+        }
+        break;
+      case 50: (a & 1) ? djnz(b - 126) : jr(b - 126); break;
+      case 51: jr(*jrcc[a % 4], b - 126); break;
+      case 52: (a & 1) ? out(io(b), A) : in(A, io(b)); break;
+      case 53: (a & 1) ? out(C(), s) : in(s, C()); break;
+      case 54:
+        if (!m_defined[k]) {
+          m_defined[k] = true;
+          l(labelName(k));
+        }
+        break;
+      case 55:
+        switch (a % 5) {
+          case 0: jp(labelName(k)); break;
+          case 1: call(labelName(k)); break;
+          case 2: jp(*cc[(a >> 3) % 8], labelName(k)); break;
+          case 3: ld(HL, labelName(k)); break;
+          default: ld(A, mem(labelName(k))); break;
+        }
+        break;
+      case 56:
+        switch (a % 6) {
+          case 0: jr(labelName(k)); break;
+          case 1: djnz(labelName(k)); break;
+          default: jr(*jrcc[a % 6 - 2], labelName(k)); break;
+        }
+        break;
+      case 57: db(b); break;
+      default: dw(nn); break;
+    }
+  }
+
+  /// 8ビット算術・論理演算
+  void alu(uint8_t kind, uint8_t op, const Xz80::BasicReg8& r, uint8_t n,
+           const Xz80::IndenexReg16AddrOffset& x) {
+#define XZ80FUZZ_ALU(f)          \
+  switch (kind) {                \
+    case 26: f(r); break;        \
+    case 27: f(n); break;        \
+    case 28: f(HL()); break;     \
+    default: f(x); break;        \
+  }
+#define XZ80FUZZ_ALU_A(f)        \
+  switch (kind) {                \
+    case 26: f(A, r); break;     \
+    case 27: f(A, n); break;     \
+    case 28: f(A, HL()); break;  \
+    default: f(A, x); break;     \
+  }
+    switch (op) {
+      case 0: XZ80FUZZ_ALU_A(add); break;
+      case 1: XZ80FUZZ_ALU_A(adc); break;
+      case 2: XZ80FUZZ_ALU_A(sub); break;
+      case 3: XZ80FUZZ_ALU_A(sbc); break;
+      case 4: XZ80FUZZ_ALU(and); break;
+      case 5: XZ80FUZZ_ALU(or); break;
+      case 6: XZ80FUZZ_ALU(XZ80_XOR); break;
+      default: XZ80FUZZ_ALU(cp); break;
+    }
+#undef XZ80FUZZ_ALU_A
+#undef XZ80FUZZ_ALU
+  }
+
+  /// ローテート・シフト
+  void rot(uint8_t kind, uint8_t op, const Xz80::BasicReg8& r,
+           const Xz80::IndenexReg16AddrOffset& x) {
+#define XZ80FUZZ_ROT(f)          \
+  switch (kind) {                \
+    case 33: f(r); break;        \
+    case 34: f(HL()); break;     \
+    default: f(x); break;        \
+  }
+    switch (op) {
+      case 0: XZ80FUZZ_ROT(rlc); break;
+      case 1: XZ80FUZZ_ROT(rl); break;
+      case 2: XZ80FUZZ_ROT(rrc); break;
+      case 3: XZ80FUZZ_ROT(rr); break;
+      case 4: XZ80FUZZ_ROT(sla); break;
+      case 5: XZ80FUZZ_ROT(sra); break;
+      default: XZ80FUZZ_ROT(srl); break;
+    }
+#undef XZ80FUZZ_ROT
+  }
+
+  /// ビット操作
+  void bits(uint8_t kind, uint8_t op, uint8_t bit_, const Xz80::BasicReg8& r,
+            const Xz80::IndenexReg16AddrOffset& x) {
+#define XZ80FUZZ_BIT(f)             \
+  switch (kind) {                   \
+    case 36: f(bit_, r); break;     \
+    case 37: f(bit_, HL()); break;  \
+    default: f(bit_, x); break;     \
+  }
+    switch (op) {
+      case 0: XZ80FUZZ_BIT(bit); break;
+      case 1: XZ80FUZZ_BIT(set); break;
+      default: XZ80FUZZ_BIT(res); break;
+    }
+#undef XZ80FUZZ_BIT
+  }
+};
+
+std::vector<Op> randomCase(Random& rnd) {
+  std::vector<Op> ops(1 + rnd.next() % MaxOps);
+  for (auto& op : ops) {
+    const uint64_t v = rnd.next();
+    op.kind = static_cast<uint8_t>((v >> 40) % NumKinds);
+    op.a = static_cast<uint8_t>(v);
+    op.b = static_cast<uint8_t>(v >> 8);
+    op.nn = static_cast<uint16_t>(v >> 16);
+  }
+  return ops;
+}
+
+/// 不一致が再現する最小の命令列に縮める
+///
+/// 命令の塊を取り除いても再現するなら取り除き、塊を半分ずつ小さくしていく。
+/// 最後に各命令のオペランドを 0 に寄せる。
+std::vector<Op> shrink(Fuzz& fuzz, std::vector<Op> ops) {
+  for (size_t chunk = ops.size() / 2; 0 < chunk; chunk /= 2) {
+    for (size_t i = 0; i + chunk <= ops.size();) {
+      std::vector<Op> t(ops);
+      t.erase(t.begin() + i, t.begin() + i + chunk);
+      if (!t.empty() && !fuzz.check(t).empty()) {
+        ops.swap(t);
+      } else {
+        i += chunk;
+      }
+    }
+  }
+  for (auto& op : ops) {
+    for (int field = 0; field < 3; ++field) {
+      const Op save = op;
+      switch (field) {
+        case 0: op.a = 0; break;
+        case 1: op.b = 0; break;
+        default: op.nn = 0; break;
+      }
+      if (fuzz.check(ops).empty()) {
+        op = save;
+      }
+    }
+  }
+  return ops;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  double seconds = 10;
+  uint64_t maxCases = 0;
+  uint64_t seed = static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+  unsigned threads = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--seconds") == 0) {
+      seconds = std::atof(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "--cases") == 0) {
+      maxCases = std::strtoull(argv[i + 1], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--seed") == 0) {
+      seed = std::strtoull(argv[i + 1], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--threads") == 0) {
+      threads = static_cast<unsigned>(std::atoi(argv[i + 1]));
+    }
+  }
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::printf("seed %llu, %u thread(s)\n", static_cast<unsigned long long>(seed), threads);
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                    std::chrono::duration<double>(seconds));
+  std::atomic<uint64_t> cases{0};
+  std::atomic<bool> stop{false};
+  std::mutex mutex;
+  std::vector<Op> failure;
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      Fuzz fuzz;
+      Random rnd(seed + t);
+      while (!stop.load(std::memory_order_relaxed)) {
+        // 時刻の確認と件数の集計は一定数ごとに行う
+        for (int i = 0; i < 256; ++i) {
+          std::vector<Op> ops = randomCase(rnd);
+          if (!fuzz.check(ops).empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stop.exchange(true)) {
+              failure.swap(ops);
+            }
+            return;
+          }
+        }
+        const uint64_t done = cases.fetch_add(256) + 256;
+        if ((maxCases && maxCases <= done) || deadline <= std::chrono::steady_clock::now()) {
+          stop = true;
+        }
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  const double sec =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%llu cases in %.1f s (%.0f cases/min)\n",
+              static_cast<unsigned long long>(cases.load()), sec, cases.load() / sec * 60);
+
+  if (failure.empty()) {
+    std::printf("OK\n");
+    return 0;
+  }
+
+  Fuzz fuzz;
+  const std::vector<Op> minimal = shrink(fuzz, failure);
+  std::printf("NG: %s\n", fuzz.check(minimal).c_str());
+  std::printf("minimal reproducer (%u of %u ops):\n", static_cast<unsigned>(minimal.size()),
+              static_cast<unsigned>(failure.size()));
+  fuzz.check(minimal);
+  size_t i = 0;
+  for (const auto& m : fuzz.getMnemonics()) {
+    std::printf("  %-24s ;", m.getMnemonic().c_str());
+    for (const auto b : m.getBytes()) {
+      std::printf(" %02x", b);
+    }
+    std::printf("\n");
+  }
+  for (const auto& op : minimal) {
+    std::printf("  op[%u] kind=%u a=%u b=%u nn=0x%04x\n", static_cast<unsigned>(i++), op.kind, op.a,
+                op.b, op.nn);
+  }
+  return 1;
+}
@@ -0,0 +1,12 @@
+// libxz80.a 用の翻訳単位
+//
+// xz80_impl.hpp の関数を非 inline でコンパイルする。
+// 利用側は XZ80_SEPARATE_COMPILATION を定義して xz80.hpp を取り込み、
+// libxz80.a とリンクする。
+
+#ifndef XZ80_SEPARATE_COMPILATION
+#define XZ80_SEPARATE_COMPILATION
+#endif
+
+#include "xz80.hpp"
+#include "xz80_impl.hpp"
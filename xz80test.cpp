@@ -0,0 +1,1147 @@
+// Generator の全命令を全てのオペランドの組み合わせで生成し、
+// バイト列とニーモニックを参照表(xz80test.inc)と照合するテスト
+//
+// 参照表の更新: ./xz80test --update > xz80test.inc
+// (更新後は git diff で差分がエンコードの意図した変更だけであることを確認する)
+#include <chrono>
+#include <functional>
+#include <sstream>
+
+#include "xz80.hpp"
+
+namespace {
+const char* const reference[] = {
+#include "xz80test.inc"
+};
+
+/// 参照表に載せない、ラベルを含むニーモニックの判定に使うラベル名
+const char* const labelNames[] = {"FAR", "NEAR", "LZ_UNPACK", "POOL."};
+
+class Enumerator : public Xz80::Generator {
+ public:
+  Enumerator() : Xz80::Generator(0x0100) {}
+
+  /// 全命令を生成する
+  void all(void) {
+    const Xz80::BasicReg8* const r8[] = {&B, &C, &D, &E, &H, &L, &A};
+    const Xz80::IndexReg16* const idx[] = {&IX, &IY};
+    const Xz80::BasicReg16* const rp[] = {&BC, &DE, &SP};  // HL は別の型
+    const Xz80::AllCond* const jrcc[] = {&NZ, &Z, &NC, &Cy};
+    const Xz80::CondBase* const cc[] = {&NZ, &Z, &NC, &Cy, &PO, &PE, &P, &M};
+    const uint8_t n8[] = {0x00, 0x7f, 0x80, 0xff};
+    const uint16_t n16[] = {0x0000, 0x1234, 0xffff};
+    const int8_t ds[] = {-128, -1, 0, 127};
+    const int16_t es[] = {-126, 0, 2, 129};
+
+    // 8ビット転送
+    for (const auto r : r8) {
+      for (const auto s : r8) {
+        ld(*r, *s);
+      }
+      for (const auto n : n8) {
+        ld(*r, n);
+      }
+      ld(*r, HL());
+      ld(HL(), *r);
+      for (const auto x : idx) {
+        for (const auto d : ds) {
+          ld(*r, (*x)(d));
+          ld((*x)(d), *r);
+        }
+      }
+    }
+    for (const auto n : n8) {
+      ld(HL(), n);
+      for (const auto x : idx) {
+        for (const auto d : ds) {
+          ld((*x)(d), n);
+        }
+      }
+    }
+    ld(A, BC());
+    ld(A, DE());
+    ld(BC(), A);
+    ld(DE(), A);
+    for (const auto nn : n16) {
+      ld(A, mem(nn));
+      ld(mem(nn), A);
+    }
+    ld(A, mem("FAR"));
+    ld(mem("FAR"), A);
+    ld(A, I);
+    ld(I, A);
+    ld(A, R);
+    ld(R, A);
+
+    // 16ビット転送
+    for (const auto nn : n16) {
+      for (const auto p : rp) {
+        ld(*p, nn);
+        ld(*p, mem(nn));
+        ld(mem(nn), *p);
+      }
+      ld(HL, nn);
+      ld(HL, mem(nn));
+      ld(mem(nn), HL);
+      for (const auto x : idx) {
+        ld(*x, nn);
+        ld(*x, mem(nn));
+        ld(mem(nn), *x);
+      }
+    }
+    for (const auto p : rp) {
+      ld(*p, "FAR");
+      ld(*p, mem("FAR"));
+      ld(mem("FAR"), *p);
+    }
+    ld(HL, "FAR");
+    ld(HL, mem("FAR"));
+    ld(mem("FAR"), HL);
+    for (const auto x : idx) {
+      ld(*x, "FAR");
+      ld(*x, mem("FAR"));
+      ld(mem("FAR"), *x);
+      ld(SP, *x);
+      push(*x);
+      pop(*x);
+      ex(SP(), *x);
+    }
+    ld(SP, HL);
+    push(BC);
+    push(DE);
+    push(HL);
+    push(AF);
+    pop(BC);
+    pop(DE);
+    pop(HL);
+    pop(AF);
+
+    // 交換・ブロック転送・ブロックサーチ
+    ex(DE, HL);
+    ex(AF, AF);
+    exx();
+    ex(SP(), HL);
+    ldi();
+    ldir();
+    ldd();
+    lddr();
+    cpi();
+    cpir();
+    cpd();
+    cpdr();
+
+    // 8ビット算術・論理演算
+    typedef std::function<void(const Xz80::BasicReg8&)> R8Op;
+    typedef std::function<void(uint8_t)> N8Op;
+    typedef std::function<void(const Xz80::RegHLAddr&)> HLOp;
+    typedef std::function<void(const Xz80::IndenexReg16AddrOffset&)> IdxOp;
+    const auto alu = [&](const R8Op& r, const N8Op& n, const HLOp& hl, const IdxOp& x) {
+      for (const auto s : r8) {
+        r(*s);
+      }
+      if (n) {
+        for (const auto v : n8) {
+          n(v);
+        }
+      }
+      hl(HL());
+      for (const auto i : idx) {
+        for (const auto d : ds) {
+          x((*i)(d));
+        }
+      }
+    };
+#define XZ80TEST_ALU_A(op)                                                    \
+  alu([&](const Xz80::BasicReg8& r) { op(A, r); }, [&](uint8_t n) { op(A, n); }, \
+      [&](const Xz80::RegHLAddr& r) { op(A, r); },                            \
+      [&](const Xz80::IndenexReg16AddrOffset& r) { op(A, r); })
+#define XZ80TEST_ALU(op, n_op)                                                      \
+  alu([&](const Xz80::BasicReg8& r) { op(r); }, n_op, [&](const Xz80::RegHLAddr& r) { op(r); }, \
+      [&](const Xz80::IndenexReg16AddrOffset& r) { op(r); })
+    XZ80TEST_ALU_A(add);
+    XZ80TEST_ALU_A(adc);
+    XZ80TEST_ALU_A(sub);
+    XZ80TEST_ALU_A(sbc);
+    XZ80TEST_ALU(and, [&](uint8_t n) { and(n); });
+    XZ80TEST_ALU(or, [&](uint8_t n) { or(n); });
+    XZ80TEST_ALU(XZ80_XOR, [&](uint8_t n) { XZ80_XOR(n); });
+    XZ80TEST_ALU(cp, [&](uint8_t n) { cp(n); });
+    XZ80TEST_ALU(inc, N8Op());
+    XZ80TEST_ALU(dec, N8Op());
+
+    // ローテート・シフト
+    XZ80TEST_ALU(rlc, N8Op());
+    XZ80TEST_ALU(rl, N8Op());
+    XZ80TEST_ALU(rrc, N8Op());
+    XZ80TEST_ALU(rr, N8Op());
+    XZ80TEST_ALU(sla, N8Op());
+    XZ80TEST_ALU(sra, N8Op());
+    XZ80TEST_ALU(srl, N8Op());
+    rlca();
+    rla();
+    rrca();
+    rra();
+    rld();
+    rrd();
+
+    // ビット操作
+#undef XZ80TEST_ALU
+#undef XZ80TEST_ALU_A
+    for (uint8_t b = 0; b < 8; ++b) {
+      for (const auto r : r8) {
+        bit(b, *r);
+        set(b, *r);
+        res(b, *r);
+      }
+      bit(b, HL());
+      set(b, HL());
+      res(b, HL());
+      for (const auto x : idx) {
+        for (const auto d : ds) {
+          bit(b, (*x)(d));
+          set(b, (*x)(d));
+          res(b, (*x)(d));
+        }
+      }
+    }
+
+    // 16ビット算術演算
+    for (const auto p : rp) {
+      add(HL, *p);
+      adc(HL, *p);
+      sbc(HL, *p);
+      inc(*p);
+      dec(*p);
+      for (const auto x : idx) {
+        add(*x, *p);
+      }
+    }
+    add(HL, HL);
+    adc(HL, HL);
+    sbc(HL, HL);
+    inc(HL);
+    dec(HL);
+    for (const auto x : idx) {
+      inc(*x);
+      dec(*x);
+    }
+
+    // 汎用・CPU制御
+    daa();
+    cpl();
+    neg();
+    ccf();
+    scf();
+    nop();
+    halt();
+    di();
+    ei();
+    for (uint8_t m = 0; m < 3; ++m) {
+      im(m);
+    }
+
+    // ジャンプ・コール・リターン
+    for (const auto nn : n16) {
+      jp(nn);
+      call(nn);
+      for (const auto c : cc) {
+        jp(*c, nn);
+        call(*c, nn);
+      }
+    }
+    jp("FAR");
+    call("FAR");
+    for (const auto c : cc) {
+      jp(*c, "FAR");
+      call(*c, "FAR");
+      ret(*c);
+    }
+    jp(HL());
+    jp(IX());
+    jp(IY());
+    l("NEAR");
+    for (const auto e : es) {
+      jr(e);
+      djnz(e);
+      for (const auto c : jrcc) {
+        jr(*c, e);
+      }
+    }
+    jr("NEAR");
+    djnz("NEAR");
+    for (const auto c : jrcc) {
+      jr(*c, "NEAR");
+    }
+    ret();
+    reti();
+    retn();
+    for (uint16_t p = 0; p < 0x40; p += 8) {
+      rst(p);
+    }
+
+    // 入出力
+    for (const auto n : n8) {
+      in(A, io(n));
+      out(io(n), A);
+    }
+    for (const auto r : r8) {
+      in(*r, C());
+      out(C(), *r);
+    }
+    ini();
+    inir();
+    ind();
+    indr();
+    outi();
+    otir();
+    outd();
+    otdr();
+
+    // 疑似命令
+    db(static_cast<uint8_t>(0x00));
+    db({0x01, 0x80, 0xff});
+    db("A'b\n");
+    db(std::vector<uint8_t>{0x12, 0x34});
+    dw(0x1234);
+    dw({0x0000, 0xffff});
+    dw("FAR");
+    dw({"FAR", "NEAR"});
+    dw(dbp("POOLED"));
+    dw(dbp("ED"));
+    dw(dbp({0x00}));
+    pool();
+    lzUnpack();
+    dbz(std::vector<uint8_t>{1, 2, 3, 1, 2, 3, 1, 2, 3, 0, 0, 0, 0, 0, 0, 0, 0});
+    l("FAR");
+  }
+
+  /// 不正なオペランドで例外が送出されるか
+  int errors(void) {
+    int fail = 0;
+    const auto expect = [&](const char* what, const std::function<void()>& f) {
+      try {
+        f();
+      } catch (const std::exception&) {
+        return;
+      }
+      std::printf("NG: %s did not throw\n", what);
+      ++fail;
+    };
+    expect("bit(8, B)", [&]() { bit(8, B); });
+    expect("set(8, HL())", [&]() { set(8, HL()); });
+    expect("res(8, IX(0))", [&]() { res(8, IX(0)); });
+    expect("rst(9)", [&]() { rst(9); });
+    expect("rst(0x40)", [&]() { rst(0x40); });
+    expect("im(3)", [&]() { im(3); });
+    expect("jr(130)", [&]() { jr(130); });
+    expect("jr(-127)", [&]() { jr(-127); });
+    expect("jr(NZ, 130)", [&]() { jr(NZ, 130); });
+    expect("djnz(-127)", [&]() { djnz(-127); });
+
+    // 範囲外の相対ジャンプと未定義ラベル
+    reset();
+    l("TOP");
+    for (int i = 0; i < 200; ++i) {
+      nop();
+    }
+    jr("TOP");
+    expect("resolve() of out of range JR", [&]() { resolve(); });
+    reset();
+    jp("UNDEFINED");
+    if (resolve()) {
+      std::printf("NG: resolve() succeeded with an undefined label\n");
+      ++fail;
+    }
+    return fail;
+  }
+};
+
+/// 生成結果のバイナリ形式の命令リストから "バイト列|ニーモニック" の並びを得る
+std::vector<std::string> entries(const Xz80::Generator& g) {
+  std::ostringstream os;
+  g.listing(os, Xz80::Output::L_Binary);
+  const std::string bin = os.str();
+  if (bin.compare(0, 4, "XZL2") != 0) {
+    return std::vector<std::string>();
+  }
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(bin.data()) + 6;
+  const auto get = [&](int n) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; ++i) {
+      v |= static_cast<uint32_t>(*p++) << (i * 8);
+    }
+    return v;
+  };
+  std::vector<std::string> out;
+  const uint32_t count = get(4);
+  for (uint32_t i = 0; i < count; ++i) {
+    get(2);  // アドレス
+    std::string s;
+    for (uint32_t n = get(4); n != 0; --n) {
+      char buf[4];
+      std::sprintf(buf, "%02x", *p++);
+      s += buf;
+    }
+    s += '|';
+    const uint32_t len = get(4);
+    s.append(reinterpret_cast<const char*>(p), len);
+    p += len;
+    get(4);  // ソース位置ID
+    out.push_back(s);
+  }
+  return out;
+}
+
+/// 逆アセンブラの結果が生成時のニーモニックと一致するか
+int crossCheck(const std::vector<std::string>& es) {
+  int fail = 0;
+  for (const auto& e : es) {
+    const size_t bar = e.find('|');
+    const std::string text = e.substr(bar + 1);
+    if (bar == 0 || text.compare(0, 3, "DB ") == 0 || text.compare(0, 3, "DW ") == 0) {
+      continue;
+    }
+    bool labeled = false;
+    for (const char* l : labelNames) {
+      labeled = labeled || text.find(l) != std::string::npos;
+    }
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < bar; i += 2) {
+      bytes.push_back(static_cast<uint8_t>(std::stoi(e.substr(i, 2), nullptr, 16)));
+    }
+    Xz80::Disasm::Insn insn;
+    const size_t len = Xz80::Disasm::decode(bytes.data(), bytes.size(), 0, insn);
+    std::string d = Xz80::Disasm::text(insn);
+    d.erase(0, d.find_first_not_of(' '));
+    if (len != bytes.size() || (!labeled && d != text)) {
+      std::printf("NG: disassembler: %s -> %s\n", e.c_str(), d.c_str());
+      ++fail;
+    }
+  }
+  return fail;
+}
+/// エミュレータのテスト用プログラム
+class Program : public Xz80::Generator {
+ public:
+  /// DJNZ のループと LDIR、HALT までの T-states を数える
+  void loop(void) {
+    ld(B, 10);
+    ld(HL, 0);
+    ld(DE, 3);
+    l("LOOP");
+    add(HL, DE);
+    djnz("LOOP");
+    ld(HL, "SRC");
+    ld(DE, 0x8000);
+    ld(BC, 5);
+    ldir();
+    halt();
+    l("SRC");
+    db(std::vector<uint8_t>{1, 2, 3, 4, 5});
+  }
+
+  /// フラグ、インデックスレジスタ、サブルーチン、入出力
+  void misc(void) {
+    ld(A, 0x15);
+    add(A, 0x27);
+    daa();
+    ld(IX, 0x8000);
+    ld(IX(1), 0x5a);
+    inc(IX(1));
+    ld(C, IX(1));
+    set(7, IX(1));
+    call("SUB");
+    out(io(0x10), A);
+    in(A, io(0x20));
+    im(1);
+    ei();
+    halt();
+    l("SUB");
+    ret();
+  }
+
+  /// 実行中のブロック内の命令のオペランドを書き換える
+  void selfModify(void) {
+    XZ80_XOR(A);
+    ld(E, 3);
+    l("LOOP");
+    l("INSN");
+    add(A, 1);
+    ld(HL, "INSN");
+    inc(HL);
+    inc(HL());
+    dec(E);
+    jr(NZ, "LOOP");
+    halt();
+  }
+
+  void bdos(uint8_t func) {
+    ld(C, func);
+    call(0x0005);
+  }
+
+  /// CP/M のコンソールとファイルの BDOS ファンクションを呼ぶ
+  void cpm(void) {
+    ld(DE, "MSG");
+    bdos(9);
+    // 引数のファイルを作り、2レコード書いて閉じる
+    ld(DE, 0x005c);
+    bdos(22);
+    ld(HL, 0x0080);
+    ld(HL(), static_cast<uint8_t>('X'));
+    ld(DE, 0x005c);
+    bdos(21);
+    ld(HL, 0x0080);
+    ld(HL(), static_cast<uint8_t>('Y'));
+    ld(DE, 0x005c);
+    bdos(21);
+    ld(DE, 0x005c);
+    bdos(16);
+    // 開き直して読み、読めた先頭の文字と EOF の結果を出力する
+    ld(DE, 0x005c);
+    bdos(15);
+    ld(DE, 0x005c);
+    bdos(20);
+    ld(DE, 0x005c);
+    bdos(20);
+    ld(A, mem(0x0080));
+    ld(E, A);
+    bdos(2);
+    ld(DE, 0x005c);
+    bdos(20);
+    add(A, static_cast<uint8_t>('0'));
+    ld(E, A);
+    bdos(2);
+    ret();
+    l("MSG");
+    db("Hello$");
+  }
+
+  /// 開いて閉じることを繰り返し、最後に開いたファイルの番号を出力する
+  void cpmReopen(void) {
+    for (const uint8_t func : {22, 16, 15, 16, 15, 16, 15}) {
+      ld(DE, 0x005c);
+      bdos(func);
+    }
+    ld(A, mem(0x005c + 16));
+    add(A, static_cast<uint8_t>('0'));
+    ld(E, A);
+    bdos(2);
+    ret();
+  }
+
+  /// ゼロページに文字を出力するサブルーチンを置いて呼ぶ
+  void cpmStub(void) {
+    ld(HL, "STUB");
+    ld(DE, 0x0040);
+    ld(BC, 8);
+    ldir();
+    call(0x0040);
+    ret();
+    l("STUB");
+    db(std::vector<uint8_t>{0x1e, 'A', 0x0e, 0x02, 0xcd, 0x05, 0x00, 0xc9});
+  }
+
+  /// 前のプログラムが置いたサブルーチンを呼ぶ
+  void cpmCallStub(void) {
+    call(0x0040);
+    ret();
+  }
+
+  /// 入れ子の CALL と RST
+  void calls(void) {
+    ld(SP, 0);
+    call("FUNC_A");
+    call("FUNC_A");
+    rst(0x38);
+    halt();
+    l("FUNC_A");
+    call("FUNC_B");
+    nop();
+    ret();
+    l("FUNC_B");
+    ld(B, 3);
+    l("WAIT");
+    djnz("WAIT");
+    ret();
+  }
+
+  /// ループの直後の変数を書き換え続ける
+  void dataLoop(void) {
+    ld(HL, "VAR");
+    l("LOOP");
+    inc(HL());
+    jr("LOOP");
+    l("VAR");
+    db(std::vector<uint8_t>{0});
+  }
+
+  /// ループ中の命令のオペランドを書き換え続ける
+  void rewriteLoop(void) {
+    ld(HL, "INSN");
+    inc(HL);
+    l("LOOP");
+    l("INSN");
+    ld(A, 1);
+    inc(HL());
+    jr("LOOP");
+  }
+
+  /// 255 バイトを超える DB とその後の命令
+  void largeData(size_t size = 20000) {
+    db(std::vector<uint8_t>(size, 0x5a));
+    nop();
+  }
+
+  /// 実行されない長い名前のラベル
+  void longLabel(void) {
+    halt();
+    l(std::string(80, 'L').c_str());
+    nop();
+  }
+
+  /// A の値で分岐先が変わる
+  void branch(void) {
+    cp(2);
+    jr(Z, "SKIP");
+    inc(A);
+    halt();
+    l("SKIP");
+    dec(A);
+    halt();
+  }
+
+  /// ブロック転送と単発の OUT/IN
+  void ports(void) {
+    ld(HL, "DATA");
+    ld(BC, 0x0498);
+    otir();
+    ld(A, 0x12);
+    out(io(0x99), A);
+    out(io(0x99), A);
+    in(A, io(0x98));
+    halt();
+    l("DATA");
+    db(std::vector<uint8_t>{0x11, 0x22, 0x33, 0x44});
+  }
+
+  /// 割り込みを受けながら転送・演算・分岐を繰り返す
+  void busy(void) {
+    ld(SP, 0);
+    im(1);
+    ei();
+    l("OUTER");
+    ld(HL, 0x4000);
+    ld(DE, 0x5000);
+    ld(BC, 0x21);
+    ldir();
+    ld(B, 0x30);
+    ld(IX, 0x6000);
+    l("INNER");
+    ld(A, IX(3));
+    add(A, B);
+    ld(IX(0), A);
+    rlc(IX(1));
+    daa();
+    push(AF);
+    pop(DE);
+    ex(AF, AF);
+    exx();
+    inc(HL);
+    exx();
+    djnz("INNER");
+    call("SUB");
+    jp("OUTER");
+    l("SUB");
+    sbc(HL, DE);
+    ret(NC);
+    ret();
+  }
+};
+
+/// 実行結果のレジスタと T-states を確かめる
+int emulate(Xz80::Emu::Machine::Engine engine) {
+  int fail = 0;
+  const auto check = [&](const char* name, uint32_t expected, uint32_t actual) {
+    if (expected != actual) {
+      std::printf("NG: emulator %s: expected %04Xh but %04Xh\n", name, expected, actual);
+      ++fail;
+    }
+  };
+
+  {
+    Program p;
+    p.loop();
+    p.resolve();
+    Xz80::Emu::Machine m;
+    Xz80::Emu::Profile prof;
+    m.engine(engine);
+    m.profile(&prof);
+    m.load(p);
+    const uint64_t t = m.run(100000);
+    check("loop reason", Xz80::Emu::Machine::S_Halt, m.reason());
+    // 7+10+10 + 11*10 + 13*9+8 + 10+10+10 + 21*4+16 + 4
+    check("loop T-states", 396, static_cast<uint32_t>(t));
+    check("loop HL", 0x0117 + 5, m.regs().hl);
+    check("loop DE", 0x8005, m.regs().de);
+    check("loop BC", 0, m.regs().bc);
+    check("ldir", 0x05, m.peek(0x8004));
+
+    // LOOP から次のラベルまでの範囲が最も多く、全体は run() の結果と一致する
+    std::ostringstream os;
+    prof.report(os, p);
+    check("profile total", static_cast<uint32_t>(t), static_cast<uint32_t>(prof.totalTStates()));
+    check("profile DJNZ", 13 * 9 + 8, static_cast<uint32_t>(prof.tstates(0x0109)));
+    check("profile count", 10, static_cast<uint32_t>(prof.count(0x0109)));
+    if (os.str().find("           369   93.2%           29  LOOP\n") == std::string::npos) {
+      std::printf("NG: profile report\n%s", os.str().c_str());
+      ++fail;
+    }
+  }
+  {
+    Program p;
+    p.misc();
+    p.resolve();
+    Xz80::Emu::Machine m;
+    m.engine(engine);
+    m.load(p);
+    std::vector<uint32_t> ports;
+    m.onIo([&](uint16_t port) { ports.push_back(port); return static_cast<uint8_t>(0x99); },
+           [&](uint16_t port, uint8_t v) {
+             ports.push_back(port);
+             ports.push_back(v);
+             ports.push_back(static_cast<uint32_t>(m.tstates()));
+           });
+    const uint64_t t = m.run(100000);
+    // 7+7+4 + 14+19+23+19+23 + 17+10 + 11+11 + 8+4+4
+    check("misc T-states", 181, static_cast<uint32_t>(t));
+    check("misc A", 0x99, m.regs().a);
+    check("misc C", 0x5b, m.regs().bc & 0xff);
+    check("misc (IX+1)", 0xdb, m.peek(0x8001));
+    check("misc ports", 4, static_cast<uint32_t>(ports.size()));
+    if (ports.size() == 4) {
+      check("misc OUT port", 0x4210, ports[0]);
+      check("misc OUT value", 0x42, ports[1]);
+      check("misc OUT T-states", 7 + 7 + 4 + 14 + 19 + 23 + 19 + 23 + 17 + 10, ports[2]);
+      check("misc IN port", 0x4220, ports[3]);
+    }
+
+    // HALT 中に割り込みを受け付け、IM 1 で 38h へ
+    m.interrupt();
+    check("interrupt T-states", 13, static_cast<uint32_t>(m.step()));
+    check("interrupt PC", 0x0038, m.regs().pc);
+    check("interrupt IFF1", 0, m.regs().iff1);
+    check("interrupt return", static_cast<uint32_t>(p.getOrg() + p.getBytes().size() - 1),
+          m.peek(m.regs().sp) | m.peek(static_cast<uint16_t>(m.regs().sp + 1)) << 8);
+  }
+  {
+    Program p;
+    p.calls();
+    p.resolve();
+    Xz80::Emu::Machine m;
+    Xz80::Emu::CallTrace trace;
+    m.engine(engine);
+    m.callTrace(&trace);
+    m.poke(0x0038, 0xc9);  // RET
+    m.load(p);
+    m.run(100000);
+    trace.finish(m.tstates());
+    std::ostringstream os;
+    trace.collapsed(os, p);
+    // FUNC_B: 17+7+13*2+8+10, FUNC_A: 17+68+4+10, RST 38h: 11+10
+    const char* expected =
+        "(root) 14\n(root);FUNC_A 62\n(root);FUNC_A;FUNC_B 136\n(root);0038h 21\n";
+    if (os.str() != expected || trace.events().size() != 5) {
+      std::printf("NG: call trace\n%s", os.str().c_str());
+      ++fail;
+    }
+  }
+  {
+    Program p;
+    p.ports();
+    p.resolve();
+    Xz80::Emu::Machine m;
+    Xz80::Emu::IoTrace trace(4, 100);
+    m.engine(engine);
+    m.load(p);
+    m.ioTrace(&trace);
+    m.run(100000);
+    // OTIR は 20 から 21 毎、OUT は 106 と 117、IN は 128
+    const Xz80::Emu::IoTrace::Stats& vdp = trace.stats(0x98);
+    check("I/O 98h out", 4, static_cast<uint32_t>(vdp.writes));
+    check("I/O 98h in", 1, static_cast<uint32_t>(vdp.reads));
+    check("I/O 98h spacing", 21, static_cast<uint32_t>(vdp.minSpacing));
+    check("I/O 98h bursts", 2, static_cast<uint32_t>(vdp.bursts));
+    check("I/O 98h max burst", 4, static_cast<uint32_t>(vdp.maxBurst));
+    check("I/O 98h max/frame", 4, static_cast<uint32_t>(vdp.maxPerFrame));
+    check("I/O 99h spacing", 11, static_cast<uint32_t>(trace.stats(0x99).minSpacing));
+    check("I/O total", 7, static_cast<uint32_t>(trace.total()));
+    const auto ring = trace.accesses();
+    check("I/O ring", 4, static_cast<uint32_t>(ring.size()));
+    if (ring.size() == 4) {
+      check("I/O ring port", 0x0098, ring[0].port);
+      check("I/O ring value", 0x44, ring[0].value);
+      check("I/O ring T-states", 83, static_cast<uint32_t>(ring[0].t));
+      check("I/O ring in", 0, ring[3].out);
+    }
+    std::ostringstream os;
+    trace.report(os, m.tstates());
+    // 143 T-states (1.43 フレーム) に5バイト
+    const char* expected =
+        "  98h           1          4         3.5         4          21         2         4       2.5\n";
+    if (os.str().find(expected) == std::string::npos) {
+      std::printf("NG: I/O report\n%s", os.str().c_str());
+      ++fail;
+    }
+  }
+  {
+    // 分岐の片側ずつを実行し、ファイルを介して結果をまとめる
+    Program p;
+    p.branch();
+    p.resolve();
+    Xz80::Emu::Coverage cov[2];
+    for (int i = 0; i < 2; ++i) {
+      Xz80::Emu::Machine m;
+      m.engine(engine);
+      m.coverage(&cov[i]);
+      m.load(p);
+      m.regs().a = static_cast<uint8_t>(i * 2);
+      m.run(100000);
+    }
+    std::ostringstream os;
+    check("coverage uncovered", 2, static_cast<uint32_t>(cov[0].report(os, p)));
+    const std::string expected =
+        "; covered 4/6 instructions (66.7%)\n"
+        "; labels never reached:\n"
+        "  SKIP\n"
+        "; instructions never executed:\n"
+        "  0106h  DEC A\t; SKIP+0\n"
+        "  0107h  HALT\t; SKIP+1\n";
+    if (os.str() != expected) {
+      std::printf("NG: coverage report\n%s", os.str().c_str());
+      ++fail;
+    }
+    cov[1].save("/tmp/xz80test.cov");
+    cov[0].merge("/tmp/xz80test.cov");
+    std::remove("/tmp/xz80test.cov");
+    std::ostringstream merged;
+    check("coverage merged", 0, static_cast<uint32_t>(cov[0].report(merged, p)));
+    check("coverage count", 6, static_cast<uint32_t>(cov[0].count()));
+  }
+  {
+    Program p;
+    p.longLabel();
+    p.resolve();
+    Xz80::Emu::Coverage cov;
+    Xz80::Emu::Machine m;
+    m.engine(engine);
+    m.coverage(&cov);
+    m.load(p);
+    m.run(100000);
+    std::ostringstream os;
+    cov.report(os, p);
+    if (os.str().find("  0101h  NOP\t; " + std::string(80, 'L') + "+0\n") == std::string::npos) {
+      std::printf("NG: coverage report of a long label\n%s", os.str().c_str());
+      ++fail;
+    }
+  }
+  {
+    Program p;
+    p.selfModify();
+    p.resolve();
+    Xz80::Emu::Machine m;
+    m.engine(engine);
+    m.load(p);
+    m.run(100);
+    m.run(UINT64_MAX);  // 累計に加えても溢れない
+    check("self-modifying code", 1 + 2 + 3, m.regs().a);
+    check("self-modifying reason", Xz80::Emu::Machine::S_Halt, m.reason());
+  }
+  return fail;
+}
+
+/// 同じ状態から繰り返し実行し、書き込んだページだけを複製しているか
+int snapshot(Xz80::Emu::Machine::Engine engine) {
+  int fail = 0;
+  Program p;
+  p.selfModify();
+  p.resolve();
+  Xz80::Emu::Machine m;
+  m.engine(engine);
+  m.load(p);
+  const Xz80::Emu::Snapshot start = m.snapshot();
+  for (int i = 0; i < 3; ++i) {
+    m.restore(start);
+    m.run(100000);
+    if (m.regs().a != 1 + 2 + 3 || m.tstates() == 0) {
+      std::printf("NG: snapshot run %d: A=%02Xh\n", i, m.regs().a);
+      ++fail;
+    }
+  }
+  // 書き換えたのはコードのページだけ
+  const Xz80::Emu::Snapshot done = m.snapshot();
+  if (done.sharedPages(start) != Xz80::Emu::Machine::NumPages - 1) {
+    std::printf("NG: snapshot shared %u pages\n", static_cast<unsigned>(done.sharedPages(start)));
+    ++fail;
+  }
+  done.save("/tmp/xz80test.snp");
+  const Xz80::Emu::Snapshot loaded("/tmp/xz80test.snp");
+  std::remove("/tmp/xz80test.snp");
+  m.restore(start);
+  m.restore(loaded);
+  if (m.regs().a != done.regs().a || m.regs().pc != done.regs().pc ||
+      m.tstates() != done.tstates() || m.peek(p.getOrg() + 3) != done.peek(p.getOrg() + 3) ||
+      !m.regs().halted) {
+    std::printf("NG: snapshot file\n");
+    ++fail;
+  }
+  return fail;
+}
+
+/// 入力毎に分岐が変わるプログラムを複数のスレッドで実行する
+int batch(Xz80::Emu::Machine::Engine engine) {
+  Program p;
+  p.branch();
+  p.resolve();
+  Xz80::Emu::Machine m;
+  m.load(p);
+  Xz80::Emu::Batch batch(m.snapshot());
+  batch.engine(engine);
+  const size_t n = 1000;
+  std::vector<uint8_t> out(n);
+  const auto r = batch.run(
+      n, [](Xz80::Emu::Machine& m, size_t i) { m.regs().a = static_cast<uint8_t>(i); },
+      [&out](Xz80::Emu::Machine& m, size_t i) { out[i] = m.regs().a; }, 4);
+  int fail = 0;
+  for (size_t i = 0; i < n && r.size() == n; ++i) {
+    const uint8_t a = static_cast<uint8_t>(i);
+    // 7+7+4+4 または 7+12+4+4
+    const uint8_t expected = (a == 2) ? 1 : static_cast<uint8_t>(a + 1);
+    if (r.a[i] != expected || out[i] != expected || r.tstates[i] != ((a == 2) ? 27u : 22u) ||
+        r.reason[i] != Xz80::Emu::Machine::S_Halt) {
+      std::printf("NG: batch %u: A=%02Xh T-states %u\n", static_cast<unsigned>(i), r.a[i],
+                  static_cast<unsigned>(r.tstates[i]));
+      ++fail;
+      break;
+    }
+  }
+  return fail + (r.size() != n);
+}
+
+/// BDOS の代わりに標準入出力とファイルで CP/M のプログラムを実行する
+int cpm(void) {
+  Program p;
+  p.cpm();
+  p.resolve();
+  std::istringstream in;
+  std::ostringstream out;
+  Xz80::Emu::Cpm cpm(in, out);
+  cpm.directory("/tmp");
+  cpm.load(p, "xz80test.dat");
+  const bool exited = cpm.run(1000000);
+  std::remove("/tmp/XZ80TEST.DAT");
+  if (!exited || out.str() != "HelloY1" || cpm.bdosCalls() != 11) {
+    std::printf("NG: CP/M: \"%s\"\n", out.str().c_str());
+    return 1;
+  }
+
+  // 閉じたファイルの番号は再利用する
+  Program reopen;
+  reopen.cpmReopen();
+  reopen.resolve();
+  out.str("");
+  cpm.load(reopen, "xz80test.dat");
+  cpm.run(1000000);
+  std::remove("/tmp/XZ80TEST.DAT");
+  if (out.str() != "1") {
+    std::printf("NG: CP/M reopen: \"%s\"\n", out.str().c_str());
+    return 1;
+  }
+
+  // 翻訳済みのブロックは次のプログラムに残らない
+  Program stub, callStub;
+  stub.cpmStub();
+  stub.resolve();
+  callStub.cpmCallStub();
+  callStub.resolve();
+  cpm.machine().engine(Xz80::Emu::Machine::E_Translate);
+  out.str("");
+  cpm.load(stub);
+  cpm.run(100000);
+  cpm.load(callStub);
+  cpm.run(100000);
+  if (out.str() != "A") {
+    std::printf("NG: CP/M reload: \"%s\"\n", out.str().c_str());
+    return 1;
+  }
+  return 0;
+}
+
+/// コードの隣のデータやコード自身を書き換え続けても翻訳が増え続けないか
+int rewrites(void) {
+  int fail = 0;
+  for (int n = 0; n < 2; ++n) {
+    Program p;
+    n ? p.rewriteLoop() : p.dataLoop();
+    p.resolve();
+    Xz80::Emu::Machine m[2];
+    for (int i = 0; i < 2; ++i) {
+      m[i].engine(i ? Xz80::Emu::Machine::E_Translate : Xz80::Emu::Machine::E_Interpret);
+      m[i].load(p);
+      m[i].run(200000);
+    }
+    // データの書き込みはブロックを捨てず、書き換えの多いページは翻訳をやめる
+    const uint64_t limit = n ? 40 : 2;
+    if (limit < m[1].translations() || m[0].regs().a != m[1].regs().a ||
+        m[0].tstates() != m[1].tstates() ||
+        std::memcmp(m[0].ram(), m[1].ram(), 0x10000) != 0) {
+      std::printf("NG: rewrite loop %d: %llu translations\n", n,
+                  static_cast<unsigned long long>(m[1].translations()));
+      ++fail;
+    }
+  }
+  return fail;
+}
+
+/// インタプリタと翻訳の実行結果が、割り込みのタイミングを含めて一致するか
+int compareEngines(void) {
+  Program p;
+  p.busy();
+  p.resolve();
+  Xz80::Emu::Machine m[2];
+  const uint8_t isr[] = {0xfb, 0xed, 0x4d};  // EI; RETI
+  for (int i = 0; i < 2; ++i) {
+    m[i].engine(i ? Xz80::Emu::Machine::E_Translate : Xz80::Emu::Machine::E_Interpret);
+    m[i].load(p);
+    m[i].load(0x0038, isr, sizeof(isr));
+    for (int n = 0; n < 500; ++n) {
+      m[i].run(997 + n % 13);
+      m[i].interrupt();
+      if (n % 50 == 0) {
+        m[i].nmi();
+      }
+    }
+  }
+  const Xz80::Emu::Regs& a = m[0].regs();
+  const Xz80::Emu::Regs& b = m[1].regs();
+  if (m[0].tstates() != m[1].tstates() || a.af() != b.af() || a.bc != b.bc || a.de != b.de ||
+      a.hl != b.hl || a.ix != b.ix || a.sp != b.sp || a.pc != b.pc || a.r != b.r ||
+      std::memcmp(m[0].ram(), m[1].ram(), 0x10000) != 0 || m[1].translations() == 0) {
+    std::printf("NG: emulator engines differ: T-states %llu/%llu PC %04Xh/%04Xh\n",
+                static_cast<unsigned long long>(m[0].tstates()),
+                static_cast<unsigned long long>(m[1].tstates()), a.pc, b.pc);
+    return 1;
+  }
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const auto start = std::chrono::steady_clock::now();
+  Enumerator g;
+  g.all();
+  if (!g.resolve()) {
+    std::printf("NG: unresolved labels\n");
+    return 1;
+  }
+  const std::vector<std::string> es = entries(g);
+
+  if (argc == 2 && std::strcmp(argv[1], "--update") == 0) {
+    std::printf("// xz80test の参照表(./xz80test --update で生成)\n");
+    for (const auto& e : es) {
+      std::printf("\"%s\",\n", e.c_str());
+    }
+    return 0;
+  }
+
+  int fail = 0;
+  const size_t numRef = sizeof(reference) / sizeof(reference[0]);
+  for (size_t i = 0; i < std::max(numRef, es.size()); ++i) {
+    const char* expected = (i < numRef) ? reference[i] : "(none)";
+    const char* actual = (i < es.size()) ? es[i].c_str() : "(none)";
+    if (std::strcmp(expected, actual) != 0) {
+      if (fail < 20) {
+        std::printf("NG: #%u expected \"%s\" but \"%s\"\n", static_cast<unsigned>(i), expected,
+                    actual);
+      }
+      ++fail;
+    }
+  }
+  fail += crossCheck(es);
+
+  // 255 バイトを超える DB
+  Program large;
+  large.largeData();
+  large.resolve();
+  const std::vector<std::string> les = entries(large);
+  std::ostringstream json;
+  large.reset(0xc000);
+  large.largeData(16000);
+  large.resolve();
+  large.listing(json, Xz80::Output::L_Json);
+  if (json.str().compare(0, 35, "{\"org\":49152,\"size\":16001,\"lines\":[") != 0) {
+    std::printf("NG: JSON listing of a large DB\n%.40s\n", json.str().c_str());
+    ++fail;
+  }
+  std::string hexBytes;
+  for (int i = 0; i < 20000; ++i) {
+    hexBytes += "5a";
+  }
+  if (les.size() != 2 || les[0].compare(0, hexBytes.size() + 1, hexBytes + "|") != 0 ||
+      les[0].size() < 100000 || les[1].compare(0, 6, "00|NOP") != 0) {
+    std::printf("NG: binary listing of a large DB\n");
+    ++fail;
+  }
+
+  // 出力形式の往復
+  const std::vector<uint8_t> bytes = g.getBytes();
+  Xz80::Image hex, mot;
+  const std::string h = g.toHex(), m = g.toMot("xz80test");
+  Xz80::Input::parseHex(h.data(), h.size(), hex);
+  Xz80::Input::parseMot(m.data(), m.size(), mot);
+  uint32_t base = 0;
+  if (hex.flatten(base) != bytes || base != 0x0100 || mot.flatten(base) != bytes) {
+    std::printf("NG: HEX/S-record round trip\n");
+    ++fail;
+  }
+  g.bsave("/tmp/xz80test.bin", 0x0100);
+  const Xz80::Image bin = Xz80::Input::loadBsave("/tmp/xz80test.bin");
+  Program none;
+  none.resolve();
+  none.bsave("/tmp/xz80test.bin");
+  const Xz80::Image noBin = Xz80::Input::loadBsave("/tmp/xz80test.bin");
+  std::remove("/tmp/xz80test.bin");
+  if (bin.flatten(base) != bytes || base != 0x0100 || bin.getStart() != 0x0100 || !noBin.empty()) {
+    std::printf("NG: BSAVE round trip\n");
+    ++fail;
+  }
+
+  // 命令単位の差分
+  std::vector<uint8_t> changed(bytes);
+  changed[1] ^= 0x01;
+  changed.resize(changed.size() - 1);
+  std::ostringstream ds;
+  if (g.diff(ds, bytes.data(), bytes.size()) != 0 ||
+      g.diff(ds, changed.data(), changed.size()) != 2 ||
+      ds.str().compare(0, 17, "0101h\n  - LD B, B") != 0) {
+    std::printf("NG: diff\n%s", ds.str().c_str());
+    ++fail;
+  }
+
+  fail += g.errors();
+  fail += emulate(Xz80::Emu::Machine::E_Interpret);
+  fail += emulate(Xz80::Emu::Machine::E_Translate);
+  fail += snapshot(Xz80::Emu::Machine::E_Interpret);
+  fail += snapshot(Xz80::Emu::Machine::E_Translate);
+  fail += batch(Xz80::Emu::Machine::E_Interpret);
+  fail += batch(Xz80::Emu::Machine::E_Translate);
+  fail += rewrites();
+  fail += compareEngines();
+  fail += cpm();
+
+  const double ms =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%s: %u instructions, %d failure(s), %.1f ms\n", fail ? "NG" : "OK",
+              static_cast<unsigned>(es.size()), fail, ms);
+  return fail ? 1 : 0;
+}